@@ -52,6 +52,7 @@ extern "C" {
 #define OP_1NEGATE     0x4f
 #define OP_1           0x51
 #define OP_16          0x60
+#define OP_RETURN      0x6a
 #define OP_DUP         0x76
 #define OP_EQUAL       0x87
 #define OP_EQUALVERIFY 0x88
@@ -32,112 +32,137 @@
 
 // base58 and base58check encoding: https://en.bitcoin.it/wiki/Base58Check_encoding
 
-// returns the number of characters written to str including NULL terminator, or total strLen needed if str is NULL
-size_t BRBase58Encode(char *str, size_t strLen, const uint8_t *data, size_t dataLen)
+#define BASE58_LIMB        656356768 // 58^5, the largest power of 58 that fits in 32bits with room for carries
+#define BASE58_LIMB_DIGITS 5
+
+// big numbers are converted between bases a 32bit limb at a time with 64bit multiplies, instead of a byte at a time
+// limbs must have room for (dataLen - leading zeroes)*28/100 + 1 base 58^5 limbs, log(256)/log(58^5) rounded up
+inline static size_t _BRBase58Encode(char *str, size_t strLen, const uint8_t *data, size_t dataLen, uint32_t *limbs)
 {
     static const char chars[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
-    size_t i, j, len, zcount = 0;
-    
-    assert(data != NULL);
-    while (zcount < dataLen && data && data[zcount] == 0) zcount++; // count leading zeroes
-
-    uint8_t buf[(dataLen - zcount)*138/100 + 1]; // log(256)/log(58), rounded up
+    size_t i, j, n, len, zcount = 0, limbCount = 0;
+    uint64_t carry = 0;
+    uint32_t t;
+    char *p;
     
-    memset(buf, 0, sizeof(buf));
+    while (zcount < dataLen && data[zcount] == 0) zcount++; // count leading zeroes
     
-    for (i = zcount; data && i < dataLen; i++) {
-        uint32_t carry = data[i];
+    // the first chunk is shorter so the rest are whole 32bit big-endian words
+    for (i = zcount, n = (dataLen - zcount) % 4; i < dataLen; i += n, n = 4) {
+        if (n == 0) n = 4;
+        
+        for (j = 0, carry = 0; j < n; j++) carry = (carry << 8) | data[i + j];
         
-        for (j = sizeof(buf); j > 0; j--) {
-            carry += (uint32_t)buf[j - 1] << 8;
-            buf[j - 1] = carry % 58;
-            carry /= 58;
+        for (j = 0; j < limbCount; j++) {
+            carry += (uint64_t)limbs[j] << (n*8);
+            limbs[j] = carry % BASE58_LIMB;
+            carry /= BASE58_LIMB;
         }
         
-        var_clean(&carry);
+        while (carry > 0) limbs[limbCount++] = carry % BASE58_LIMB, carry /= BASE58_LIMB;
     }
     
-    i = 0;
-    while (i < sizeof(buf) && buf[i] == 0) i++; // skip leading zeroes
-    len = (zcount + sizeof(buf) - i) + 1;
-
+    len = zcount + 1;
+    if (limbCount > 0) len += (limbCount - 1)*BASE58_LIMB_DIGITS;
+    for (t = (limbCount > 0) ? limbs[limbCount - 1] : 0; t > 0; t /= 58) len++;
+    
     if (str && len <= strLen) {
-        while (zcount-- > 0) *(str++) = chars[0];
-        while (i < sizeof(buf)) *(str++) = chars[buf[i++]];
-        *str = '\0';
+        memset(str, chars[0], zcount);
+        p = &str[len - 1];
+        *p = '\0';
+        
+        for (j = 0; j < limbCount; j++) { // the most significant limb is written without leading zeroes
+            for (i = 0, t = limbs[j]; i < BASE58_LIMB_DIGITS && (j + 1 < limbCount || t > 0); i++, t /= 58) {
+                *(--p) = chars[t % 58];
+            }
+        }
     }
     
-    mem_clean(buf, sizeof(buf));
+    var_clean(&carry);
+    var_clean(&t);
+    mem_clean(limbs, limbCount*sizeof(*limbs));
     return (! str || len <= strLen) ? len : 0;
 }
 
+// returns the number of characters written to str including NULL terminator, or total strLen needed if str is NULL
+size_t BRBase58Encode(char *str, size_t strLen, const uint8_t *data, size_t dataLen)
+{
+    size_t zcount = 0;
+    
+    assert(data != NULL);
+    if (! data) return 0;
+    
+    if (dataLen == 25) { // fixed length path for the payload of a base58check encoded address
+        uint32_t limbs[25*28/100 + 1];
+        
+        return _BRBase58Encode(str, strLen, data, 25, limbs);
+    }
+    
+    while (zcount < dataLen && data[zcount] == 0) zcount++;
+    
+    uint32_t limbs[(dataLen - zcount)*28/100 + 1];
+    
+    return _BRBase58Encode(str, strLen, data, dataLen, limbs);
+}
+
 // returns the number of bytes written to data, or total dataLen needed if data is NULL
 size_t BRBase58Decode(uint8_t *data, size_t dataLen, const char *str)
 {
-    size_t i = 0, j, len, zcount = 0;
+    static const int8_t digits[128] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1,  0,  1,  2,  3,  4,  5,  6,  7,  8, -1, -1, -1, -1, -1, -1,
+        -1,  9, 10, 11, 12, 13, 14, 15, 16, -1, 17, 18, 19, 20, 21, -1,
+        22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, -1, -1, -1, -1, -1,
+        -1, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, -1, 44, 45, 46,
+        47, 48, 49, 50, 51, 52, 53, 54, 55, 56, 57, -1, -1, -1, -1, -1
+    };
+    const uint8_t *s = (const uint8_t *)str;
+    size_t i, j, k, len, count = 0, zcount = 0, limbCount = 0;
+    uint64_t carry = 0, mul;
+    uint32_t t;
     
     assert(str != NULL);
-    while (str && *str == '1') str++, zcount++; // count leading zeroes
+    if (! str) return 0;
+    while (s[zcount] == '1') zcount++; // count leading zeroes
+    s += zcount;
+    while (s[count] < 128 && digits[s[count]] >= 0) count++; // decoding stops at the first invalid base58 digit
     
-    uint8_t buf[(str) ? strlen(str)*733/1000 + 1 : 0]; // log(58)/log(256), rounded up
+    uint32_t limbs[count/BASE58_LIMB_DIGITS + 1]; // log(58^5)/log(2^32) rounded up
     
-    memset(buf, 0, sizeof(buf));
-    
-    while (str && *str) {
-        uint32_t carry = *(const uint8_t *)(str++);
-        
-        switch (carry) {
-            case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
-                carry -= '1';
-                break;
-                
-            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H':
-                carry += 9 - 'A';
-                break;
-                
-            case 'J': case 'K': case 'L': case 'M': case 'N':
-                carry += 17 - 'J';
-                break;
-                
-            case 'P': case 'Q': case 'R': case 'S': case 'T': case 'U': case 'V': case 'W': case 'X': case 'Y':
-            case 'Z':
-                carry += 22 - 'P';
-                break;
-                
-            case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
-            case 'k':
-                carry += 33 - 'a';
-                break;
-                
-            case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't': case 'u': case 'v':
-            case 'w': case 'x': case 'y': case 'z':
-                carry += 44 - 'm';
-                break;
-                
-            default:
-                carry = UINT32_MAX;
-        }
+    // the first group of digits is shorter so the rest are whole base 58^5 limbs
+    for (i = 0, k = count % BASE58_LIMB_DIGITS; i < count; i += k, k = BASE58_LIMB_DIGITS) {
+        if (k == 0) k = BASE58_LIMB_DIGITS;
         
-        if (carry >= 58) break; // invalid base58 digit
+        for (j = 0, carry = 0, mul = 1; j < k; j++) carry = carry*58 + digits[s[i + j]], mul *= 58;
         
-        for (j = sizeof(buf); j > 0; j--) {
-            carry += (uint32_t)buf[j - 1]*58;
-            buf[j - 1] = carry & 0xff;
-            carry >>= 8;
+        for (j = 0; j < limbCount; j++) {
+            carry += limbs[j]*mul;
+            limbs[j] = (uint32_t)carry;
+            carry >>= 32;
         }
         
-        var_clean(&carry);
+        while (carry > 0) limbs[limbCount++] = (uint32_t)carry, carry >>= 32;
     }
     
-    while (i < sizeof(buf) && buf[i] == 0) i++; // skip leading zeroes
-    len = zcount + sizeof(buf) - i;
+    len = zcount;
+    if (limbCount > 0) len += (limbCount - 1)*sizeof(*limbs);
+    for (t = (limbCount > 0) ? limbs[limbCount - 1] : 0; t > 0; t >>= 8) len++;
 
     if (data && len <= dataLen) {
-        if (zcount > 0) memset(data, 0, zcount);
-        memcpy(&data[zcount], &buf[i], sizeof(buf) - i);
+        memset(data, 0, zcount);
+        
+        for (i = len, j = 0; j < limbCount; j++) { // the most significant limb is written without leading zeroes
+            for (k = 0, t = limbs[j]; k < sizeof(*limbs) && (j + 1 < limbCount || t > 0); k++, t >>= 8) {
+                data[--i] = t & 0xff;
+            }
+        }
     }
 
-    mem_clean(buf, sizeof(buf));
+    var_clean(&carry);
+    var_clean(&t);
+    mem_clean(limbs, limbCount*sizeof(*limbs));
     return (! data || len <= dataLen) ? len : 0;
 }
 
@@ -183,3 +208,24 @@ size_t BRBase58CheckDecode(uint8_t *data, size_t dataLen, const char *str)
     if (buf != _buf) free(buf);
     return (! data || len <= dataLen) ? len : 0;
 }
+
+// encodes count payloads of dataLen bytes each, stored consecutively in data, writing each NULL terminated string to
+// strs at intervals of strLen bytes, e.g. strs = addrs[0].s and strLen = sizeof(BRAddress) for an array of addresses
+// returns the number of strings written, stopping at the first one that doesn't fit in strLen
+size_t BRBase58CheckEncodeBatch(char *strs, size_t strLen, const uint8_t *data, size_t dataLen, size_t count)
+{
+    uint8_t buf[dataLen + 256/8];
+    size_t i;
+    
+    assert(strs != NULL || count == 0);
+    assert(data != NULL || dataLen == 0 || count == 0);
+    
+    for (i = 0; i < count; i++) {
+        memcpy(buf, &data[i*dataLen], dataLen);
+        BRSHA256_2(&buf[dataLen], buf, dataLen);
+        if (BRBase58Encode(&strs[i*strLen], strLen, buf, dataLen + 4) == 0) break;
+    }
+    
+    mem_clean(buf, sizeof(buf));
+    return i;
+}
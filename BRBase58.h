@@ -47,6 +47,11 @@ size_t BRBase58CheckEncode(char *str, size_t strLen, const uint8_t *data, size_t
 // returns the number of bytes written to data, or total dataLen needed if data is NULL
 size_t BRBase58CheckDecode(uint8_t *data, size_t dataLen, const char *str);
 
+// encodes count payloads of dataLen bytes each, stored consecutively in data, writing each NULL terminated string to
+// strs at intervals of strLen bytes, e.g. strs = addrs[0].s and strLen = sizeof(BRAddress) for an array of addresses
+// returns the number of strings written, stopping at the first one that doesn't fit in strLen
+size_t BRBase58CheckEncodeBatch(char *strs, size_t strLen, const uint8_t *data, size_t dataLen, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
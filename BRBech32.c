@@ -34,20 +34,47 @@
 
 // bech32 address format: https://github.com/bitcoin/bips/blob/master/bip-0173.mediawiki
 
-#define polymod(x) ((((x) & 0x1ffffff) << 5) ^ (-(((x) >> 25) & 1) & 0x3b6a57b2) ^\
-                    (-(((x) >> 26) & 1) & 0x26508e6d) ^ (-(((x) >> 27) & 1) & 0x1ea119fa) ^\
-                    (-(((x) >> 28) & 1) & 0x3d4233dd) ^ (-(((x) >> 29) & 1) & 0x2a1462b3))
+// generator terms for each value of the top 5 bits of the checksum, so a step costs one table lookup
+static const uint32_t _BRBech32Gen[32] = {
+    0x00000000, 0x3b6a57b2, 0x26508e6d, 0x1d3ad9df, 0x1ea119fa, 0x25cb4e48, 0x38f19797, 0x039bc025,
+    0x3d4233dd, 0x0628646f, 0x1b12bdb0, 0x2078ea02, 0x23e32a27, 0x18897d95, 0x05b3a44a, 0x3ed9f3f8,
+    0x2a1462b3, 0x117e3501, 0x0c44ecde, 0x372ebb6c, 0x34b57b49, 0x0fdf2cfb, 0x12e5f524, 0x298fa296,
+    0x1756516e, 0x2c3c06dc, 0x3106df03, 0x0a6c88b1, 0x09f74894, 0x329d1f26, 0x2fa7c6f9, 0x14cd914b
+};
 
+// bech32 digit values of upper and lower case characters, or -1 if invalid
+static const int8_t _BRBech32Digits[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    15, -1, 10, 17, 21, 20, 26, 30,  7,  5, -1, -1, -1, -1, -1, -1,
+    -1, 29, -1, 24, 13, 25,  9,  8, 23, -1, 18, 22, 31, 27, 19, -1,
+     1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1,
+    -1, 29, -1, 24, 13, 25,  9,  8, 23, -1, 18, 22, 31, 27, 19, -1,
+     1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1
+};
+
+#define polymod(x) ((((x) & 0x1ffffff) << 5) ^ _BRBech32Gen[(x) >> 25])
+
+// returns the checksum state after the expanded human readable part hrp of length hrpLen
+static uint32_t _BRBech32HRPChecksum(const char *hrp, size_t hrpLen)
+{
+    uint32_t chk = 1;
+    size_t i;
+    
+    for (i = 0; i < hrpLen; i++) chk = polymod(chk) ^ (tolower(hrp[i]) >> 5);
+    chk = polymod(chk);
+    for (i = 0; i < hrpLen; i++) chk = polymod(chk) ^ (hrp[i] & 0x1f);
+    return chk;
+}
+
+// if hrp is not NULL, addr must have that human readable part and hrpChk must be its _BRBech32HRPChecksum()
 // returns the number of bytes written to data42 (maximum of 42)
-size_t BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr)
+static size_t _BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr, const char *hrp, uint32_t hrpChk)
 {
     size_t i, j, bufLen, addrLen, sep;
     uint32_t x, chk = 1;
     uint8_t c, ver = 0xff, buf[52], upper = 0, lower = 0;
-
-    assert(hrp84 != NULL);
-    assert(data42 != NULL);
-    assert(addr != NULL);
     
     for (i = 0; addr && addr[i]; i++) {
         if (addr[i] < 33 || addr[i] > 126) return 0;
@@ -58,24 +85,19 @@ size_t BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr)
     addrLen = sep = i;
     while (sep > 0 && addr[sep] != '1') sep--;
     if (addrLen < 8 || addrLen > 90 || sep < 1 || sep + 2 + 6 > addrLen || (upper && lower)) return 0;
-    for (i = 0; i < sep; i++) chk = polymod(chk) ^ (tolower(addr[i]) >> 5);
-    chk = polymod(chk);
-    for (i = 0; i < sep; i++) chk = polymod(chk) ^ (addr[i] & 0x1f);
+
+    if (hrp) {
+        for (i = 0; i < sep && hrp[i] == tolower(addr[i]); i++);
+        if (i < sep || hrp[i] != '\0') return 0;
+        chk = hrpChk;
+    }
+    else chk = _BRBech32HRPChecksum(addr, sep);
+    
     memset(buf, 0, sizeof(buf));
 
     for (i = sep + 1, j = -1; i < addrLen; i++, j++) {
-        switch (tolower(addr[i])) {
-            case 'q': c = 0;  break; case 'p': c = 1;  break; case 'z': c = 2;  break; case 'r': c = 3;  break;
-            case 'y': c = 4;  break; case '9': c = 5;  break; case 'x': c = 6;  break; case '8': c = 7;  break;
-            case 'g': c = 8;  break; case 'f': c = 9;  break; case '2': c = 10; break; case 't': c = 11; break;
-            case 'v': c = 12; break; case 'd': c = 13; break; case 'w': c = 14; break; case '0': c = 15; break;
-            case 's': c = 16; break; case '3': c = 17; break; case 'j': c = 18; break; case 'n': c = 19; break;
-            case '5': c = 20; break; case '4': c = 21; break; case 'k': c = 22; break; case 'h': c = 23; break;
-            case 'c': c = 24; break; case 'e': c = 25; break; case '6': c = 26; break; case 'm': c = 27; break;
-            case 'u': c = 28; break; case 'a': c = 29; break; case '7': c = 30; break; case 'l': c = 31; break;
-            default: return 0; // invalid bech32 digit
-        }
-        
+        if (_BRBech32Digits[(uint8_t)addr[i]] < 0) return 0; // invalid bech32 digit
+        c = _BRBech32Digits[(uint8_t)addr[i]];
         chk = polymod(chk) ^ c;
         if (j == -1) ver = c;
         if (j == -1 || i + 6 >= addrLen) continue;
@@ -96,28 +118,26 @@ size_t BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr)
     return 2 + bufLen;
 }
 
-// data must contain a valid BIP141 witness program
+// returns the number of bytes written to data42 (maximum of 42)
+size_t BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr)
+{
+    assert(hrp84 != NULL);
+    assert(data42 != NULL);
+    assert(addr != NULL);
+    return _BRBech32Decode(hrp84, data42, addr, NULL, 0);
+}
+
+// hrpChk must be the _BRBech32HRPChecksum() of hrp, which must already be validated
 // returns the number of bytes written to addr91 (maximum of 91)
-size_t BRBech32Encode(char *addr91, const char *hrp, const uint8_t data[])
+static size_t _BRBech32Encode(char *addr91, const char *hrp, size_t hrpLen, uint32_t hrpChk, const uint8_t data[])
 {
     static const char chars[] = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
     char addr[91];
-    uint32_t x, chk = 1;
+    uint32_t x, chk = hrpChk;
     uint8_t ver, a, b = 0, c = 0;
-    size_t i, j, len;
+    size_t i = hrpLen, j, len;
 
-    assert(addr91 != NULL);
-    assert(hrp != NULL);
-    assert(data != NULL);
-    
-    for (i = 0; hrp && hrp[i]; i++) {
-        if (i > 83 || hrp[i] < 33 || hrp[i] > 126 || isupper(hrp[i])) return 0;
-        chk = polymod(chk) ^ (hrp[i] >> 5);
-        addr[i] = hrp[i];
-    }
-    
-    chk = polymod(chk);
-    for (j = 0; j < i; j++) chk = polymod(chk) ^ (hrp[j] & 0x1f);
+    memcpy(addr, hrp, hrpLen);
     addr[i++] = '1';
     if (i < 1 || data == NULL || (data[0] > OP_0 && data[0] < OP_1)) return 0;
     ver = (data[0] >= OP_1) ? data[0] + 1 - OP_1 : 0;
@@ -143,3 +163,78 @@ size_t BRBech32Encode(char *addr91, const char *hrp, const uint8_t data[])
     return i;
 }
 
+// true if hrp is a valid lowercase human readable part
+static int _BRBech32HRPIsValid(const char *hrp)
+{
+    for (size_t i = 0; hrp && hrp[i]; i++) {
+        if (i > 83 || hrp[i] < 33 || hrp[i] > 126 || isupper(hrp[i])) return 0;
+    }
+    
+    return (hrp != NULL);
+}
+
+// data must contain a valid BIP141 witness program
+// returns the number of bytes written to addr91 (maximum of 91)
+size_t BRBech32Encode(char *addr91, const char *hrp, const uint8_t data[])
+{
+    size_t hrpLen = (hrp) ? strlen(hrp) : 0;
+    
+    assert(addr91 != NULL);
+    assert(hrp != NULL);
+    assert(data != NULL);
+    if (! _BRBech32HRPIsValid(hrp)) return 0;
+    return _BRBech32Encode(addr91, hrp, hrpLen, _BRBech32HRPChecksum(hrp, hrpLen), data);
+}
+
+// encodes count witness programs stored dataLen bytes apart in data, writing each address to addrs at intervals of
+// addrLen bytes (e.g. addrs = addrs[0].s and addrLen = sizeof(BRAddress)), the hrp checksum is only computed once
+// an address that fails to encode or doesn't fit in addrLen is written as an empty string
+// returns the number of addresses successfully encoded
+size_t BRBech32EncodeBatch(char *addrs, size_t addrLen, const char *hrp, const uint8_t *data, size_t dataLen,
+                           size_t count)
+{
+    size_t i, n = 0, hrpLen = (hrp) ? strlen(hrp) : 0;
+    uint32_t hrpChk = _BRBech32HRPChecksum(hrp, hrpLen);
+    int valid = _BRBech32HRPIsValid(hrp);
+    char addr[91];
+    
+    assert(addrs != NULL || count == 0);
+    assert(hrp != NULL);
+    assert(data != NULL || count == 0);
+    
+    for (i = 0; i < count && addrLen > 0; i++) {
+        size_t len = (valid) ? _BRBech32Encode(addr, hrp, hrpLen, hrpChk, &data[i*dataLen]) : 0;
+        
+        if (len > 0 && len <= addrLen) memcpy(&addrs[i*addrLen], addr, len), n++;
+        else addrs[i*addrLen] = '\0';
+    }
+    
+    return n;
+}
+
+// decodes count addresses stored addrLen bytes apart in addrs, that must all have the human readable part hrp, writing
+// each witness program to data at intervals of dataLen bytes, the hrp checksum is only computed once
+// a witness program that fails to decode or doesn't fit in dataLen is written with zero length
+// returns the number of addresses successfully decoded
+size_t BRBech32DecodeBatch(uint8_t *data, size_t dataLen, const char *hrp, const char *addrs, size_t addrLen,
+                           size_t count)
+{
+    size_t i, n = 0, hrpLen = (hrp) ? strlen(hrp) : 0;
+    uint32_t hrpChk = _BRBech32HRPChecksum(hrp, hrpLen);
+    int valid = _BRBech32HRPIsValid(hrp);
+    uint8_t d[42];
+    char h[84];
+    
+    assert(data != NULL || count == 0);
+    assert(hrp != NULL);
+    assert(addrs != NULL || count == 0);
+    
+    for (i = 0; i < count && dataLen > 0; i++) {
+        size_t len = (valid) ? _BRBech32Decode(h, d, &addrs[i*addrLen], hrp, hrpChk) : 0;
+        
+        if (len > 0 && len <= dataLen) memcpy(&data[i*dataLen], d, len), n++;
+        else memset(&data[i*dataLen], 0, (dataLen < 2) ? dataLen : 2);
+    }
+    
+    return n;
+}
@@ -42,6 +42,20 @@ size_t BRBech32Decode(char *hrp84, uint8_t *data42, const char *addr);
 // returns the number of bytes written to addr91 (maximum of 91)
 size_t BRBech32Encode(char *addr91, const char *hrp, const uint8_t data[]);
 
+// encodes count witness programs stored dataLen bytes apart in data, writing each address to addrs at intervals of
+// addrLen bytes (e.g. addrs = addrs[0].s and addrLen = sizeof(BRAddress)), the hrp checksum is only computed once
+// an address that fails to encode or doesn't fit in addrLen is written as an empty string
+// returns the number of addresses successfully encoded
+size_t BRBech32EncodeBatch(char *addrs, size_t addrLen, const char *hrp, const uint8_t *data, size_t dataLen,
+                           size_t count);
+
+// decodes count addresses stored addrLen bytes apart in addrs, that must all have the human readable part hrp, writing
+// each witness program to data at intervals of dataLen bytes, the hrp checksum is only computed once
+// a witness program that fails to decode or doesn't fit in dataLen is written with zero length
+// returns the number of addresses successfully decoded
+size_t BRBech32DecodeBatch(uint8_t *data, size_t dataLen, const char *hrp, const char *addrs, size_t addrLen,
+                           size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,570 @@
+//
+//  BRBlockCache.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRBlockCache.h"
+#include "BRCrypto.h"
+#include "BRArray.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#define BLOCK_CACHE_MAGIC       0x43425242 // "BRBC"
+#define BLOCK_CACHE_VERSION     1
+#define BLOCK_CACHE_FILE_HEADER 8                 // magic and version
+#define BLOCK_CACHE_COMPACT_MIN (4 * 1024 * 1024) // caches smaller than this aren't worth compacting
+
+// record layout: type[1], payloadLen[4], payload[payloadLen], checksum[4]
+// filter payload: filterId[4], count[4], elements[count*20] (sorted)
+// block payload: height[4], filterId[4], blockLen[4], block[blockLen], txCount[4], { txLen[4], tx[txLen] }...
+#define REC_HEADER       5
+#define REC_CHECK        4
+#define REC_TYPE_FILTER  'F'
+#define REC_TYPE_BLOCK   'B'
+#define BLOCK_FILTER_ID  4
+#define BLOCK_LEN        8
+#define BLOCK_DATA       12
+
+typedef struct {
+    uint64_t offset; // file offset of the block record, or 0 if no block is cached at the height
+    uint32_t len; // record length, including header and checksum
+} BRBlockCacheEntry;
+
+typedef struct {
+    uint32_t id;
+    UInt160 *elements; // sorted
+    size_t count;
+} BRBlockCacheFilter;
+
+struct BRBlockCacheStruct {
+    int fd;
+    uint64_t fileLen, deadLen; // deadLen is the space taken up by replaced block records
+    uint32_t firstHeight;
+    BRBlockCacheEntry *entries; // entries for consecutive heights starting at firstHeight
+    size_t count; // number of entries with a cached block
+    BRBlockCacheFilter *filters; // in order of id, the last is the current filter
+    int filterWritten; // true if the current filter has been written to the file
+    uint8_t *rec; // the last block record read, kept so its transactions can be read without reading it again
+    size_t recLen;
+    uint32_t recHeight;
+};
+
+inline static int _UInt160Compare(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(UInt160));
+}
+
+// writes the checksum of the record rec, excluding its trailing checksum field, to checksum
+static void _BRBlockCacheChecksum(uint8_t *rec, size_t recLen, uint8_t *checksum)
+{
+    uint8_t md[32];
+
+    BRSHA256(md, rec, recLen - REC_CHECK);
+    memcpy(checksum, md, REC_CHECK);
+}
+
+// reads the record at offset into a newly allocated buffer and verifies it, returns NULL if it's invalid
+static uint8_t *_BRBlockCacheReadRecord(BRBlockCache *cache, uint64_t offset, size_t *recLen)
+{
+    uint8_t hdr[REC_HEADER], check[REC_CHECK], *rec = NULL;
+    size_t len = 0;
+
+    if (offset + REC_HEADER <= cache->fileLen && pread(cache->fd, hdr, sizeof(hdr), offset) == sizeof(hdr)) {
+        len = REC_HEADER + UInt32GetLE(&hdr[1]) + REC_CHECK;
+        if (offset + len <= cache->fileLen) rec = malloc(len);
+    }
+
+    if (rec && pread(cache->fd, rec, len, offset) != len) {
+        free(rec);
+        rec = NULL;
+    }
+
+    if (rec) _BRBlockCacheChecksum(rec, len, check);
+
+    if (rec && memcmp(check, &rec[len - REC_CHECK], REC_CHECK) != 0) {
+        free(rec);
+        rec = NULL;
+    }
+
+    if (recLen) *recLen = (rec) ? len : 0;
+    return rec;
+}
+
+// appends a record with the given type and payload, returns its offset, or 0 on error
+static uint64_t _BRBlockCacheAppend(BRBlockCache *cache, uint8_t *rec, size_t recLen)
+{
+    uint64_t offset = cache->fileLen;
+
+    _BRBlockCacheChecksum(rec, recLen, &rec[recLen - REC_CHECK]);
+    if (pwrite(cache->fd, rec, recLen, offset) != recLen) return 0;
+    cache->fileLen += recLen;
+    return offset;
+}
+
+static BRBlockCacheFilter *_BRBlockCacheFilter(BRBlockCache *cache, uint32_t filterId)
+{
+    size_t lo = 0, hi = array_count(cache->filters), mid;
+
+    while (lo < hi) { // filters are in order of id
+        mid = (lo + hi)/2;
+        if (cache->filters[mid].id == filterId) return &cache->filters[mid];
+        if (cache->filters[mid].id < filterId) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return NULL;
+}
+
+static int _BRBlockCacheWriteFilter(BRBlockCache *cache, const BRBlockCacheFilter *filter)
+{
+    size_t len = REC_HEADER + 8 + filter->count*sizeof(UInt160) + REC_CHECK;
+    uint8_t *rec = malloc(len);
+    int r;
+
+    assert(rec != NULL);
+    rec[0] = REC_TYPE_FILTER;
+    UInt32SetLE(&rec[1], (uint32_t)(len - REC_HEADER - REC_CHECK));
+    UInt32SetLE(&rec[REC_HEADER], filter->id);
+    UInt32SetLE(&rec[REC_HEADER + 4], (uint32_t)filter->count);
+    if (filter->count > 0) memcpy(&rec[REC_HEADER + 8], filter->elements, filter->count*sizeof(UInt160));
+    r = (_BRBlockCacheAppend(cache, rec, len) != 0);
+    free(rec);
+    return r;
+}
+
+// returns the entry for height, adding entries as needed if add is true, or NULL if there isn't one
+static BRBlockCacheEntry *_BRBlockCacheEntry(BRBlockCache *cache, uint32_t height, int add)
+{
+    BRBlockCacheEntry empty = { 0, 0 };
+    size_t n = array_count(cache->entries);
+
+    if (n == 0 && add) cache->firstHeight = height;
+
+    if (height < cache->firstHeight) {
+        if (! add) return NULL;
+        for (n = cache->firstHeight - height; n > 0; n--) array_insert(cache->entries, 0, empty);
+        cache->firstHeight = height;
+    }
+
+    if (height - cache->firstHeight >= array_count(cache->entries)) {
+        if (! add) return NULL;
+        while (height - cache->firstHeight >= array_count(cache->entries)) array_add(cache->entries, empty);
+    }
+
+    return &cache->entries[height - cache->firstHeight];
+}
+
+// rewrites the cache at path with only the current block records and the filters they use, and switches to it
+static int _BRBlockCacheCompact(BRBlockCache *cache, const char *path)
+{
+    char tmpPath[strlen(path) + 5];
+    uint8_t buf[BLOCK_CACHE_FILE_HEADER], *rec;
+    size_t i, j, recLen;
+    uint32_t filterId;
+    BRBlockCache tmp = *cache;
+    int r = 1, used[array_count(cache->filters) + 1];
+    uint64_t *offsets = malloc(array_count(cache->entries)*sizeof(*offsets) + 1);
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    tmp.fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    tmp.fileLen = BLOCK_CACHE_FILE_HEADER;
+    UInt32SetLE(buf, BLOCK_CACHE_MAGIC);
+    UInt32SetLE(&buf[sizeof(uint32_t)], BLOCK_CACHE_VERSION);
+    if (tmp.fd < 0 || pwrite(tmp.fd, buf, sizeof(buf), 0) != sizeof(buf)) r = 0;
+    assert(offsets != NULL);
+    memset(used, 0, sizeof(used));
+
+    for (i = 0; r && i < array_count(cache->entries); i++) { // find the filters still in use
+        if (cache->entries[i].offset == 0 || pread(cache->fd, buf, sizeof(buf),
+                                                   cache->entries[i].offset + REC_HEADER) != sizeof(buf)) continue;
+        filterId = UInt32GetLE(&buf[BLOCK_FILTER_ID]);
+
+        for (j = 0; j < array_count(cache->filters); j++) {
+            if (cache->filters[j].id == filterId) used[j] = 1;
+        }
+    }
+
+    if (array_count(cache->filters) > 0) used[array_count(cache->filters) - 1] = 1; // always keep the current filter
+
+    for (i = 0; r && i < array_count(cache->filters); i++) {
+        if (used[i] && ! _BRBlockCacheWriteFilter(&tmp, &cache->filters[i])) r = 0;
+    }
+
+    for (i = 0; r && i < array_count(cache->entries); i++) {
+        offsets[i] = 0;
+        if (cache->entries[i].offset == 0) continue;
+        rec = _BRBlockCacheReadRecord(cache, cache->entries[i].offset, &recLen);
+        if (! rec) continue; // drop corrupt records
+        if (pwrite(tmp.fd, rec, recLen, tmp.fileLen) != recLen) r = 0;
+        offsets[i] = tmp.fileLen;
+        tmp.fileLen += recLen;
+        free(rec);
+    }
+
+    if (r && (fsync(tmp.fd) != 0 || rename(tmpPath, path) != 0)) r = 0;
+
+    if (r) {
+        close(cache->fd);
+        cache->fd = tmp.fd;
+        cache->fileLen = tmp.fileLen;
+        cache->deadLen = 0;
+
+        for (i = 0; i < array_count(cache->entries); i++) {
+            if (cache->entries[i].offset != 0 && offsets[i] == 0) cache->count--;
+            cache->entries[i].offset = offsets[i];
+        }
+
+        for (i = array_count(cache->filters); i > 0; i--) { // unused filters are gone from the file
+            if (used[i - 1]) continue;
+            free(cache->filters[i - 1].elements);
+            array_rm(cache->filters, i - 1);
+        }
+
+        cache->filterWritten = 1;
+    }
+    else {
+        if (tmp.fd >= 0) close(tmp.fd);
+        unlink(tmpPath);
+    }
+
+    free(offsets);
+    return r;
+}
+
+// opens the block cache at path, creating it if needed, and compacts it if much of it is taken up by replaced blocks
+// returns a block cache that must be closed by calling BRBlockCacheClose(), or NULL on error (errno is set)
+BRBlockCache *BRBlockCacheOpen(const char *path)
+{
+    BRBlockCache *cache = calloc(1, sizeof(*cache));
+    uint8_t buf[REC_HEADER + 8], *rec;
+    BRBlockCacheFilter filter;
+    BRBlockCacheEntry *entry;
+    uint64_t offset = BLOCK_CACHE_FILE_HEADER, recLen;
+    struct stat st;
+    int r = 1;
+
+    assert(cache != NULL);
+    assert(path != NULL);
+    array_new(cache->entries, 1000);
+    array_new(cache->filters, 10);
+    cache->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (cache->fd < 0 || fstat(cache->fd, &st) != 0) r = 0;
+
+    if (r && st.st_size < BLOCK_CACHE_FILE_HEADER) { // new cache
+        UInt32SetLE(buf, BLOCK_CACHE_MAGIC);
+        UInt32SetLE(&buf[sizeof(uint32_t)], BLOCK_CACHE_VERSION);
+
+        if (pwrite(cache->fd, buf, BLOCK_CACHE_FILE_HEADER, 0) != BLOCK_CACHE_FILE_HEADER ||
+            ftruncate(cache->fd, BLOCK_CACHE_FILE_HEADER) != 0) r = 0;
+        st.st_size = BLOCK_CACHE_FILE_HEADER;
+    }
+    else if (r && (pread(cache->fd, buf, BLOCK_CACHE_FILE_HEADER, 0) != BLOCK_CACHE_FILE_HEADER ||
+                   UInt32GetLE(buf) != BLOCK_CACHE_MAGIC ||
+                   UInt32GetLE(&buf[sizeof(uint32_t)]) != BLOCK_CACHE_VERSION)) {
+        errno = EINVAL;
+        r = 0;
+    }
+
+    cache->fileLen = (r) ? (uint64_t)st.st_size : 0;
+
+    // index the records, stopping at the first one that's incomplete, block records are only checksummed when read,
+    // except for the last one, which is the one most likely to have been torn by a crash
+    while (r && offset + sizeof(buf) <= cache->fileLen && pread(cache->fd, buf, sizeof(buf), offset) == sizeof(buf)) {
+        recLen = REC_HEADER + (uint64_t)UInt32GetLE(&buf[1]) + REC_CHECK;
+        if (offset + recLen > cache->fileLen) break;
+
+        if (buf[0] == REC_TYPE_FILTER) {
+            rec = _BRBlockCacheReadRecord(cache, offset, NULL);
+            if (! rec) break;
+            filter.id = UInt32GetLE(&rec[REC_HEADER]);
+            filter.count = UInt32GetLE(&rec[REC_HEADER + 4]);
+
+            if (REC_HEADER + 8 + filter.count*sizeof(UInt160) + REC_CHECK != recLen ||
+                (array_count(cache->filters) > 0 && filter.id <= cache->filters[array_count(cache->filters) - 1].id)) {
+                free(rec);
+                break;
+            }
+
+            filter.elements = malloc(filter.count*sizeof(UInt160) + 1);
+            assert(filter.elements != NULL);
+            memcpy(filter.elements, &rec[REC_HEADER + 8], filter.count*sizeof(UInt160));
+            array_add(cache->filters, filter);
+            free(rec);
+        }
+        else if (buf[0] == REC_TYPE_BLOCK) {
+            if (offset + recLen == cache->fileLen) {
+                rec = _BRBlockCacheReadRecord(cache, offset, NULL);
+                if (! rec) break;
+                free(rec);
+            }
+
+            entry = _BRBlockCacheEntry(cache, UInt32GetLE(&buf[REC_HEADER]), 1);
+
+            if (entry->offset != 0) cache->deadLen += entry->len;
+            else cache->count++;
+            entry->offset = offset;
+            entry->len = (uint32_t)recLen;
+        }
+        else break;
+
+        offset += recLen;
+    }
+
+    if (r && offset < cache->fileLen) { // drop the records after the first invalid one
+        if (ftruncate(cache->fd, offset) != 0) r = 0;
+        cache->fileLen = offset;
+    }
+
+    cache->filterWritten = 1;
+
+    if (r && cache->fileLen > BLOCK_CACHE_COMPACT_MIN && cache->deadLen > cache->fileLen/2) {
+        _BRBlockCacheCompact(cache, path); // if compacting fails, the cache is still usable as it is
+    }
+
+    if (! r) {
+        int err = errno;
+
+        BRBlockCacheClose(cache);
+        cache = NULL;
+        errno = err;
+    }
+
+    return cache;
+}
+
+// number of heights with a cached block
+size_t BRBlockCacheCount(BRBlockCache *cache)
+{
+    assert(cache != NULL);
+    return cache->count;
+}
+
+// makes filter the current filter, unless it's the same as the current one, and takes ownership of its elements
+static void _BRBlockCacheSetFilter(BRBlockCache *cache, UInt160 *elements, size_t count)
+{
+    size_t n = array_count(cache->filters);
+    BRBlockCacheFilter *last = (n > 0) ? &cache->filters[n - 1] : NULL;
+
+    if (last && last->count == count && memcmp(last->elements, elements, count*sizeof(UInt160)) == 0) {
+        free(elements);
+    }
+    else if (last && ! cache->filterWritten) { // no blocks were added with the current filter, so just replace it
+        free(last->elements);
+        last->elements = elements;
+        last->count = count;
+    }
+    else {
+        array_add(cache->filters, ((BRBlockCacheFilter) { (last) ? last->id + 1 : 1, elements, count }));
+        cache->filterWritten = 0;
+    }
+}
+
+// sets the filter elements that blocks added from now on were matched against (elements are copied)
+void BRBlockCacheSetFilter(BRBlockCache *cache, const UInt160 elements[], size_t elementsCount)
+{
+    UInt160 *e = malloc(elementsCount*sizeof(*e) + 1);
+    size_t i, count = 0;
+
+    assert(cache != NULL);
+    assert(elements != NULL || elementsCount == 0);
+    assert(e != NULL);
+    if (elementsCount > 0) memcpy(e, elements, elementsCount*sizeof(*e));
+    qsort(e, elementsCount, sizeof(*e), _UInt160Compare);
+
+    for (i = 0; i < elementsCount; i++) { // remove duplicates
+        if (count == 0 || ! UInt160Eq(e[i], e[count - 1])) e[count++] = e[i];
+    }
+
+    _BRBlockCacheSetFilter(cache, e, count);
+}
+
+// adds elements to the filter that blocks added from now on were matched against
+void BRBlockCacheAddFilterElements(BRBlockCache *cache, const UInt160 elements[], size_t elementsCount)
+{
+    size_t n, count;
+    UInt160 *all;
+
+    assert(cache != NULL);
+    assert(elements != NULL || elementsCount == 0);
+    n = array_count(cache->filters);
+    count = (n > 0) ? cache->filters[n - 1].count : 0;
+    all = malloc((count + elementsCount)*sizeof(*all) + 1);
+    assert(all != NULL);
+    if (count > 0) memcpy(all, cache->filters[n - 1].elements, count*sizeof(*all));
+    if (elementsCount > 0) memcpy(&all[count], elements, elementsCount*sizeof(*all));
+    BRBlockCacheSetFilter(cache, all, count + elementsCount);
+    free(all);
+}
+
+// caches block at block->height, replacing any block cached at that height, along with the wallet transactions it
+// matched, in the order they appear in the block, and tags it with the current filter, returns true on success
+int BRBlockCacheAdd(BRBlockCache *cache, const BRMerkleBlock *block, BRTransaction *transactions[], size_t txCount)
+{
+    size_t i, off, n = array_count(cache->filters), blockLen = BRMerkleBlockSerialize(block, NULL, 0),
+           len = REC_HEADER + BLOCK_DATA + blockLen + 4 + REC_CHECK;
+    uint8_t *rec;
+    uint64_t offset;
+    BRBlockCacheEntry *entry;
+
+    assert(cache != NULL);
+    assert(block != NULL);
+    assert(block->height != BLOCK_UNKNOWN_HEIGHT);
+    assert(transactions != NULL || txCount == 0);
+    if (n > 0 && ! cache->filterWritten && ! _BRBlockCacheWriteFilter(cache, &cache->filters[n - 1])) return 0;
+    cache->filterWritten = 1;
+    for (i = 0; i < txCount; i++) len += 4 + BRTransactionSerialize(transactions[i], NULL, 0);
+    rec = malloc(len);
+    assert(rec != NULL);
+    rec[0] = REC_TYPE_BLOCK;
+    UInt32SetLE(&rec[1], (uint32_t)(len - REC_HEADER - REC_CHECK));
+    UInt32SetLE(&rec[REC_HEADER], block->height);
+    UInt32SetLE(&rec[REC_HEADER + BLOCK_FILTER_ID], (n > 0) ? cache->filters[n - 1].id : 0);
+    UInt32SetLE(&rec[REC_HEADER + BLOCK_LEN], (uint32_t)blockLen);
+    off = REC_HEADER + BLOCK_DATA;
+    off += BRMerkleBlockSerialize(block, &rec[off], blockLen);
+    UInt32SetLE(&rec[off], (uint32_t)txCount);
+    off += 4;
+
+    for (i = 0; i < txCount; i++) {
+        n = BRTransactionSerialize(transactions[i], &rec[off + 4], len - REC_CHECK - off - 4);
+        UInt32SetLE(&rec[off], (uint32_t)n);
+        off += 4 + n;
+    }
+
+    offset = (off + REC_CHECK == len) ? _BRBlockCacheAppend(cache, rec, len) : 0;
+    free(rec);
+    if (offset == 0) return 0;
+    if (cache->recHeight == block->height && cache->rec) free(cache->rec), cache->rec = NULL;
+    entry = _BRBlockCacheEntry(cache, block->height, 1);
+
+    if (entry->offset != 0) cache->deadLen += entry->len;
+    else cache->count++;
+    entry->offset = offset;
+    entry->len = (uint32_t)len;
+    return 1;
+}
+
+// reads and keeps the block record at height, returns NULL if there isn't a valid one
+static const uint8_t *_BRBlockCacheBlockRecord(BRBlockCache *cache, uint32_t height)
+{
+    BRBlockCacheEntry *entry = _BRBlockCacheEntry(cache, height, 0);
+
+    if (cache->rec && cache->recHeight == height) return cache->rec;
+    if (cache->rec) free(cache->rec);
+    cache->rec = (entry && entry->offset != 0) ? _BRBlockCacheReadRecord(cache, entry->offset, &cache->recLen) : NULL;
+    cache->recHeight = height;
+
+    if (cache->rec && (cache->rec[0] != REC_TYPE_BLOCK || UInt32GetLE(&cache->rec[REC_HEADER]) != height ||
+                       REC_HEADER + BLOCK_DATA + UInt32GetLE(&cache->rec[REC_HEADER + BLOCK_LEN]) + 4 + REC_CHECK >
+                       cache->recLen)) {
+        free(cache->rec);
+        cache->rec = NULL;
+    }
+
+    return cache->rec;
+}
+
+// returns the block cached at height, which must be freed by calling BRMerkleBlockFree(), or NULL if there isn't one,
+// and sets *filterId to the id of the filter it was tagged with (0 if none), and *txCount to the number of
+// transactions cached with it
+BRMerkleBlock *BRBlockCacheBlockAtHeight(BRBlockCache *cache, uint32_t height, uint32_t *filterId, size_t *txCount)
+{
+    const uint8_t *rec;
+    BRMerkleBlock *block = NULL;
+    size_t blockLen;
+
+    assert(cache != NULL);
+    rec = _BRBlockCacheBlockRecord(cache, height);
+
+    if (rec) {
+        blockLen = UInt32GetLE(&rec[REC_HEADER + BLOCK_LEN]);
+        block = BRMerkleBlockParse(&rec[REC_HEADER + BLOCK_DATA], blockLen);
+    }
+
+    if (block) block->height = height;
+    if (filterId) *filterId = (block) ? UInt32GetLE(&rec[REC_HEADER + BLOCK_FILTER_ID]) : 0;
+    if (txCount) *txCount = (block) ? UInt32GetLE(&rec[REC_HEADER + BLOCK_DATA + blockLen]) : 0;
+    return block;
+}
+
+// writes the transactions cached with the block at height to transactions, up to txCount, and returns the number
+// written, each must be freed by calling BRTransactionFree() unless it's handed off to a wallet
+size_t BRBlockCacheTransactions(BRBlockCache *cache, uint32_t height, BRTransaction *transactions[], size_t txCount)
+{
+    const uint8_t *rec;
+    size_t i = 0, n, len, off;
+
+    assert(cache != NULL);
+    assert(transactions != NULL || txCount == 0);
+    rec = _BRBlockCacheBlockRecord(cache, height);
+    if (! rec) return 0;
+    off = REC_HEADER + BLOCK_DATA + UInt32GetLE(&rec[REC_HEADER + BLOCK_LEN]);
+    n = UInt32GetLE(&rec[off]);
+    off += 4;
+
+    while (i < n && i < txCount && off + 4 <= cache->recLen - REC_CHECK) {
+        len = UInt32GetLE(&rec[off]);
+        off += 4;
+        if (off + len > cache->recLen - REC_CHECK) break;
+        transactions[i] = BRTransactionParse(&rec[off], len);
+        if (! transactions[i]) break;
+        off += len;
+        i++;
+    }
+
+    return i;
+}
+
+// true if the filter with the given id included every one of elements
+int BRBlockCacheFilterCovers(BRBlockCache *cache, uint32_t filterId, const UInt160 elements[], size_t elementsCount)
+{
+    BRBlockCacheFilter *filter;
+    size_t i;
+
+    assert(cache != NULL);
+    assert(elements != NULL || elementsCount == 0);
+    filter = (filterId != 0) ? _BRBlockCacheFilter(cache, filterId) : NULL;
+    if (! filter) return 0;
+
+    for (i = 0; i < elementsCount; i++) {
+        if (! bsearch(&elements[i], filter->elements, filter->count, sizeof(UInt160), _UInt160Compare)) break;
+    }
+
+    return (i == elementsCount);
+}
+
+// closes the cache and frees memory allocated for it
+void BRBlockCacheClose(BRBlockCache *cache)
+{
+    assert(cache != NULL);
+    if (cache->fd >= 0) close(cache->fd);
+    for (size_t i = 0; i < array_count(cache->filters); i++) free(cache->filters[i].elements);
+    array_free(cache->filters);
+    array_free(cache->entries);
+    if (cache->rec) free(cache->rec);
+    free(cache);
+}
@@ -0,0 +1,83 @@
+//
+//  BRBlockCache.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRBlockCache_h
+#define BRBlockCache_h
+
+#include "BRMerkleBlock.h"
+#include "BRTransaction.h"
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// an append-only file of filtered blocks (merkleblocks, or headers) along with the wallet transactions they matched,
+// indexed by height, so a rescan can replay blocks from disk instead of downloading them again
+// each block is tagged with the bloom filter elements (wallet address hash160s) it was matched against, so a replay
+// can tell if a block could be missing transactions for addresses the wallet has added since
+// the latest block added at a height replaces any earlier one, and the space they used is reclaimed when the cache is
+// reopened, each record has a checksum, so records torn by a crash are ignored
+// NOTE: a block cache is not thread-safe, callers must serialize access (BRPeerManager does so with its own lock)
+
+typedef struct BRBlockCacheStruct BRBlockCache;
+
+// opens the block cache at path, creating it if needed, and compacts it if much of it is taken up by replaced blocks
+// returns a block cache that must be closed by calling BRBlockCacheClose(), or NULL on error (errno is set)
+BRBlockCache *BRBlockCacheOpen(const char *path);
+
+// number of heights with a cached block
+size_t BRBlockCacheCount(BRBlockCache *cache);
+
+// sets the filter elements that blocks added from now on were matched against (elements are copied)
+void BRBlockCacheSetFilter(BRBlockCache *cache, const UInt160 elements[], size_t elementsCount);
+
+// adds elements to the filter that blocks added from now on were matched against
+void BRBlockCacheAddFilterElements(BRBlockCache *cache, const UInt160 elements[], size_t elementsCount);
+
+// caches block at block->height, replacing any block cached at that height, along with the wallet transactions it
+// matched, in the order they appear in the block, and tags it with the current filter, returns true on success
+int BRBlockCacheAdd(BRBlockCache *cache, const BRMerkleBlock *block, BRTransaction *transactions[], size_t txCount);
+
+// returns the block cached at height, which must be freed by calling BRMerkleBlockFree(), or NULL if there isn't one,
+// and sets *filterId to the id of the filter it was tagged with (0 if none), and *txCount to the number of
+// transactions cached with it
+BRMerkleBlock *BRBlockCacheBlockAtHeight(BRBlockCache *cache, uint32_t height, uint32_t *filterId, size_t *txCount);
+
+// writes the transactions cached with the block at height to transactions, up to txCount, and returns the number
+// written, each must be freed by calling BRTransactionFree() unless it's handed off to a wallet
+size_t BRBlockCacheTransactions(BRBlockCache *cache, uint32_t height, BRTransaction *transactions[], size_t txCount);
+
+// true if the filter with the given id included every one of elements
+int BRBlockCacheFilterCovers(BRBlockCache *cache, uint32_t filterId, const UInt160 elements[], size_t elementsCount);
+
+// closes the cache and frees memory allocated for it
+void BRBlockCacheClose(BRBlockCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRBlockCache_h
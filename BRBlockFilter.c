@@ -0,0 +1,180 @@
+//
+//  BRBlockFilter.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "BRBlockFilter.h"
+#include "BRCrypto.h"
+#include "BRAddress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct {
+    const uint8_t *buf;
+    size_t bufLen, off; // off is the offset of the next byte to buffer
+    uint64_t bits; // buffered bits, most significant bit first
+    int count; // number of buffered bits
+} BRBitReader;
+
+static int _BRUInt64Compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+// returns the upper 64 bits of the 128 bit product of a and b
+static uint64_t _BRMulHigh64(uint64_t a, uint64_t b)
+{
+    uint64_t aLo = (uint32_t)a, aHi = a >> 32, bLo = (uint32_t)b, bHi = b >> 32,
+             mid1 = aHi*bLo, mid2 = aLo*bHi, carry = (((aLo*bLo) >> 32) + (uint32_t)mid1 + (uint32_t)mid2) >> 32;
+
+    return aHi*bHi + (mid1 >> 32) + (mid2 >> 32) + carry;
+}
+
+// hashes each script into the range [0, n*BLOCK_FILTER_M), keyed with the first 16 bytes of blockHash, and sorts them
+static void _BRBlockFilterHashScripts(uint64_t values[], UInt256 blockHash, const uint8_t *scripts[],
+                                      const size_t scriptLens[], size_t scriptsCount, uint64_t n)
+{
+    for (size_t i = 0; i < scriptsCount; i++) {
+        values[i] = _BRMulHigh64(BRSip64(blockHash.u8, scripts[i], scriptLens[i]), n*BLOCK_FILTER_M);
+    }
+
+    qsort(values, scriptsCount, sizeof(*values), _BRUInt64Compare);
+}
+
+static void _BRBitsWrite(uint8_t *buf, size_t bufLen, size_t *bitOff, uint64_t value, int bitCount)
+{
+    for (int i = bitCount - 1; i >= 0; i--, (*bitOff)++) {
+        if (buf && *bitOff/8 < bufLen && ((value >> i) & 1)) buf[*bitOff/8] |= 0x80 >> (*bitOff % 8);
+    }
+}
+
+// reads bitCount bits (at most 57), returns false if there aren't enough bits left
+static int _BRBitsRead(BRBitReader *reader, int bitCount, uint64_t *value)
+{
+    while (reader->count <= 56 && reader->off < reader->bufLen) { // buffer as many whole bytes as will fit
+        reader->bits |= (uint64_t)reader->buf[reader->off++] << (56 - reader->count);
+        reader->count += 8;
+    }
+
+    if (reader->count < bitCount) return 0;
+    *value = (bitCount > 0) ? reader->bits >> (64 - bitCount) : 0;
+    reader->bits = (bitCount < 64) ? reader->bits << bitCount : 0;
+    reader->count -= bitCount;
+    return 1;
+}
+
+// reads a Golomb-Rice coded value, returns false if the filter ends first
+static int _BRGolombRiceRead(BRBitReader *reader, uint64_t *value)
+{
+    uint64_t q = 0, bit = 1;
+
+    while (bit == 1) { // quotient is unary coded as q one bits followed by a zero bit
+        if (! _BRBitsRead(reader, 1, &bit)) return 0;
+        if (bit == 1) q++;
+    }
+
+    if (! _BRBitsRead(reader, BLOCK_FILTER_P, value)) return 0;
+    *value |= q << BLOCK_FILTER_P;
+    return 1;
+}
+
+// writes the basic filter for the block with blockHash containing the given scripts to filter, scripts must be unique
+// returns number of bytes written, or total filterLen needed if filter is NULL
+size_t BRBlockFilterBuild(uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount)
+{
+    uint64_t *values = malloc((scriptsCount > 0 ? scriptsCount : 1)*sizeof(*values)), prev = 0, delta;
+    size_t i, len, off = BRVarIntSet(filter, filterLen, scriptsCount), bitOff = 0;
+    uint8_t *gcs = (filter && off <= filterLen) ? &filter[off] : NULL;
+    size_t gcsLen = (gcs) ? filterLen - off : 0;
+
+    assert(values != NULL);
+    assert(scripts != NULL || scriptsCount == 0);
+    assert(scriptLens != NULL || scriptsCount == 0);
+    if (gcs) memset(gcs, 0, gcsLen);
+    _BRBlockFilterHashScripts(values, blockHash, scripts, scriptLens, scriptsCount, scriptsCount);
+
+    for (i = 0; i < scriptsCount; i++) {
+        delta = values[i] - prev;
+        prev = values[i];
+        for (uint64_t q = delta >> BLOCK_FILTER_P; q > 0; q--) _BRBitsWrite(gcs, gcsLen, &bitOff, 1, 1);
+        _BRBitsWrite(gcs, gcsLen, &bitOff, 0, 1);
+        _BRBitsWrite(gcs, gcsLen, &bitOff, delta, BLOCK_FILTER_P);
+    }
+
+    free(values);
+    len = BRVarIntSize(scriptsCount) + (bitOff + 7)/8;
+    return (! filter || len <= filterLen) ? len : 0;
+}
+
+// true if any of the given scripts are in the basic filter for the block with blockHash
+// (a match may be a false positive with a probability of 1/BLOCK_FILTER_M for each script)
+int BRBlockFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount)
+{
+    size_t i, j = 0, off = 0;
+    uint64_t n = BRVarInt(filter, filterLen, &off), value = 0, delta;
+    uint64_t _values[(scriptsCount <= 0x1000/sizeof(uint64_t)) ? scriptsCount : 0],
+             *values = (scriptsCount <= 0x1000/sizeof(uint64_t)) ? _values : malloc(scriptsCount*sizeof(*values));
+    BRBitReader reader = { filter, filterLen, off, 0, 0 };
+    int r = 0;
+
+    assert(filter != NULL || filterLen == 0);
+    assert(scripts != NULL || scriptsCount == 0);
+    assert(values != NULL);
+
+    if (off > 0 && n > 0 && scriptsCount > 0) {
+        _BRBlockFilterHashScripts(values, blockHash, scripts, scriptLens, scriptsCount, n);
+
+        // walk the sorted filter values and the sorted script values together, stopping at the first value in both
+        for (i = 0; ! r && i < n && j < scriptsCount && _BRGolombRiceRead(&reader, &delta); i++) {
+            value += delta;
+            while (j < scriptsCount && values[j] < value) j++;
+            if (j < scriptsCount && values[j] == value) r = 1;
+        }
+    }
+
+    if (values != _values) free(values);
+    return r;
+}
+
+// returns the hash of a serialized filter, as committed to by filter headers
+UInt256 BRBlockFilterHash(const uint8_t *filter, size_t filterLen)
+{
+    UInt256 md;
+
+    assert(filter != NULL || filterLen == 0);
+    BRSHA256_2(&md, filter, filterLen);
+    return md;
+}
+
+// returns the filter header for a block, given the hash of its filter and the filter header of the previous block
+UInt256 BRBlockFilterHeader(UInt256 filterHash, UInt256 prevHeader)
+{
+    UInt256 md, data[] = { filterHash, prevHeader };
+
+    BRSHA256_2(&md, data, sizeof(data));
+    return md;
+}
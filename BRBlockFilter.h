@@ -0,0 +1,64 @@
+//
+//  BRBlockFilter.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef BRBlockFilter_h
+#define BRBlockFilter_h
+
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// BIP158 compact block filters: https://github.com/bitcoin/bips/blob/master/bip-0158.mediawiki
+// a basic filter is a Golomb-coded set of the output scripts, and the scripts of outputs spent, in a block, serialized
+// as the varint number of items followed by the Golomb-Rice coded deltas of the sorted item hashes
+
+#define BLOCK_FILTER_BASIC 0x00   // basic filter type
+#define BLOCK_FILTER_P     19     // Golomb-Rice coding parameter for basic filters
+#define BLOCK_FILTER_M     784931 // inverse false positive rate for basic filters
+
+// writes the basic filter for the block with blockHash containing the given scripts to filter, scripts must be unique
+// returns number of bytes written, or total filterLen needed if filter is NULL
+size_t BRBlockFilterBuild(uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount);
+
+// true if any of the given scripts are in the basic filter for the block with blockHash
+// (a match may be a false positive with a probability of 1/BLOCK_FILTER_M for each script)
+int BRBlockFilterMatchAny(const uint8_t *filter, size_t filterLen, UInt256 blockHash, const uint8_t *scripts[],
+                          const size_t scriptLens[], size_t scriptsCount);
+
+// returns the hash of a serialized filter, as committed to by filter headers
+UInt256 BRBlockFilterHash(const uint8_t *filter, size_t filterLen);
+
+// returns the filter header for a block, given the hash of its filter and the filter header of the previous block
+UInt256 BRBlockFilterHeader(UInt256 filterHash, UInt256 prevHeader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRBlockFilter_h
@@ -33,10 +33,17 @@
 
 #define BLOOM_MAX_HASH_FUNCS 50
 
-inline static uint32_t _BRBloomFilterHash(const BRBloomFilter *filter, const uint8_t *data, size_t dataLen,
-                                          uint32_t hashNum)
+// writes the filter bit index of data for each of the filter's hash functions to idx, returns number of indexes
+inline static uint32_t _BRBloomFilterHash(const BRBloomFilter *filter, uint32_t idx[], const uint8_t *data,
+                                          size_t dataLen)
 {
-    return BRMurmur3_32(data, dataLen, hashNum*0xfba4c795 + filter->tweak) % (filter->length*8);
+    uint32_t i, seeds[BLOOM_MAX_HASH_FUNCS] = { 0 }, count = filter->hashFuncs;
+    
+    if (count > BLOOM_MAX_HASH_FUNCS) count = BLOOM_MAX_HASH_FUNCS;
+    for (i = 0; i < count; i++) seeds[i] = i*0xfba4c795 + filter->tweak;
+    BRMurmur3_32Multi(idx, seeds, count, data, dataLen);
+    for (i = 0; i < count; i++) idx[i] %= filter->length*8;
+    return count;
 }
 
 // returns a newly allocated bloom filter struct that must be freed by calling BRBloomFilterFree()
@@ -124,33 +131,70 @@ size_t BRBloomFilterSerialize(const BRBloomFilter *filter, uint8_t *buf, size_t
 // true if data is matched by filter
 int BRBloomFilterContainsData(const BRBloomFilter *filter, const uint8_t *data, size_t dataLen)
 {
-    uint32_t i, idx;
+    uint32_t i, count, idx[BLOOM_MAX_HASH_FUNCS];
     
     assert(filter != NULL);
     assert(data != NULL || dataLen == 0);
+    if (! data) return 0;
+    count = _BRBloomFilterHash(filter, idx, data, dataLen);
     
-    for (i = 0; data && i < filter->hashFuncs; i++) {
-        idx = _BRBloomFilterHash(filter, data, dataLen, i);
-        if (! (filter->filter[idx >> 3] & (1 << (7 & idx)))) return 0;
+    for (i = 0; i < count; i++) {
+        if (! (filter->filter[idx[i] >> 3] & (1 << (7 & idx[i])))) return 0;
     }
     
-    return (data) ? 1 : 0;
+    return 1;
 }
 
 // add data to filter
 void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen)
 {
-    uint32_t i, idx;
+    uint32_t i, count, idx[BLOOM_MAX_HASH_FUNCS];
     
     assert(filter != NULL);
     assert(data != NULL || dataLen == 0);
+    if (! data) return;
+    count = _BRBloomFilterHash(filter, idx, data, dataLen);
+    for (i = 0; i < count; i++) filter->filter[idx[i] >> 3] |= (1 << (7 & idx[i]));
+    filter->elemCount++;
+}
+
+// adds elemCount elements of elemLen bytes each, stored consecutively in elems, to filter, skipping any element that is
+// already matched so elemCount isn't inflated by duplicates (each element is hashed only once)
+// returns the number of elements added
+size_t BRBloomFilterInsertElements(BRBloomFilter *filter, const uint8_t *elems, size_t elemLen, size_t elemCount)
+{
+    uint32_t i, count, idx[BLOOM_MAX_HASH_FUNCS];
+    size_t j, added = 0;
+    int match;
+    
+    assert(filter != NULL);
+    assert(elems != NULL || elemCount == 0);
     
-    for (i = 0; data && i < filter->hashFuncs; i++) {
-        idx = _BRBloomFilterHash(filter, data, dataLen, i);
-        filter->filter[idx >> 3] |= (1 << (7 & idx));
+    for (j = 0; elems && j < elemCount; j++) {
+        count = _BRBloomFilterHash(filter, idx, &elems[j*elemLen], elemLen);
+        
+        for (i = 0, match = 1; match && i < count; i++) {
+            if (! (filter->filter[idx[i] >> 3] & (1 << (7 & idx[i])))) match = 0;
+        }
+        
+        if (match) continue;
+        for (i = 0; i < count; i++) filter->filter[idx[i] >> 3] |= (1 << (7 & idx[i]));
+        filter->elemCount++;
+        added++;
     }
     
-    if (data) filter->elemCount++;
+    return added;
+}
+
+// returns the expected false positive rate of filter with the number of elements it holds, which grows as elements
+// are added past the count the filter was sized for
+double BRBloomFilterFalsePositiveRate(const BRBloomFilter *filter)
+{
+    assert(filter != NULL);
+    if (filter->length == 0 || filter->hashFuncs == 0) return 1.0;
+
+    // (1 - e^(-k*n/m))^k for k hash functions, n elements, and m bits
+    return pow(1.0 - exp(-(double)filter->hashFuncs*filter->elemCount/(filter->length*8.0)), filter->hashFuncs);
 }
 
 // frees memory allocated for filter
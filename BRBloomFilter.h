@@ -72,6 +72,15 @@ int BRBloomFilterContainsData(const BRBloomFilter *filter, const uint8_t *data,
 // add data to filter
 void BRBloomFilterInsertData(BRBloomFilter *filter, const uint8_t *data, size_t dataLen);
 
+// adds elemCount elements of elemLen bytes each, stored consecutively in elems, to filter, skipping any element that is
+// already matched so elemCount isn't inflated by duplicates (each element is hashed only once)
+// returns the number of elements added
+size_t BRBloomFilterInsertElements(BRBloomFilter *filter, const uint8_t *elems, size_t elemLen, size_t elemCount);
+
+// returns the expected false positive rate of filter with the number of elements it holds, which grows as elements
+// are added past the count the filter was sized for
+double BRBloomFilterFalsePositiveRate(const BRBloomFilter *filter);
+
 // frees memory allocated for filter
 void BRBloomFilterFree(BRBloomFilter *filter);
 
@@ -597,6 +597,45 @@ uint32_t BRMurmur3_32(const void *data, size_t dataLen, uint32_t seed)
     return h;
 }
 
+#define MURMUR3_LANES 8
+
+// writes murmurHash3 (x86_32) of data for each of seedCount seeds to md, reading and mixing each data block only once
+void BRMurmur3_32Multi(uint32_t md[], const uint32_t seeds[], size_t seedCount, const void *data, size_t dataLen)
+{
+    const uint8_t *d = data;
+    uint32_t h[MURMUR3_LANES], k = 0, t = 0;
+    size_t i, j, n, count = dataLen/4;
+    
+    assert(md != NULL || seedCount == 0);
+    assert(seeds != NULL || seedCount == 0);
+    assert(data != NULL || dataLen == 0);
+    
+    // the block mixing step doesn't depend on the seed, so each block is mixed once and folded into a fixed width group
+    // of independent hash states, a loop compilers can turn into vector instructions
+    for (n = 0; n < seedCount; n += MURMUR3_LANES) {
+        memset(h, 0, sizeof(h));
+        for (j = 0; j < MURMUR3_LANES && n + j < seedCount; j++) h[j] = seeds[n + j];
+        
+        for (i = 0; i < count*4; i += 4) {
+            k = (((uint32_t)d[i + 3] << 24) | ((uint32_t)d[i + 2] << 16) |
+                 ((uint32_t)d[i + 1] <<  8) | ((uint32_t)d[i]))*C1;
+            k = rol32(k, 15)*C2;
+            for (j = 0; j < MURMUR3_LANES; j++) h[j] ^= k, h[j] = rol32(h[j], 13)*5 + 0xe6546b64;
+        }
+        
+        t = 0;
+        
+        switch (dataLen & 3) {
+            case 3: t ^= d[i + 2] << 16; // fall through
+            case 2: t ^= d[i + 1] << 8;  // fall through
+            case 1: t ^= d[i], t *= C1, t = rol32(t, 15)*C2;
+        }
+        
+        for (j = 0; j < MURMUR3_LANES; j++) h[j] ^= t, h[j] ^= dataLen, fmix32(h[j]);
+        for (j = 0; j < MURMUR3_LANES && n + j < seedCount; j++) md[n + j] = h[j];
+    }
+}
+
 #define sipround(a, b, c, d) a += b, b = rol64(b, 13) ^ a, a = rol64(a, 32), c += d, d = rol64(d, 16) ^ c,\
                              a += d, d = rol64(d, 21) ^ a, c += b, b = rol64(b, 17) ^ c, c = rol64(c, 32)
 
@@ -66,6 +66,9 @@ void BRMD5(void *md16, const void *data, size_t dataLen);
 // murmurHash3 (x86_32): https://code.google.com/p/smhasher/ - for non cryptographic use only
 uint32_t BRMurmur3_32(const void *data, size_t dataLen, uint32_t seed);
 
+// writes murmurHash3 (x86_32) of data for each of seedCount seeds to md, reading and mixing each data block only once
+void BRMurmur3_32Multi(uint32_t md[], const uint32_t seeds[], size_t seedCount, const void *data, size_t dataLen);
+
 // sipHash-64: https://131002.net/siphash
 uint64_t BRSip64(const void *key16, const void *data, size_t dataLen);
     
@@ -0,0 +1,353 @@
+//
+//  BRHeaderStore.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRHeaderStore.h"
+#include "BRCrypto.h"
+#include "BRSet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <assert.h>
+
+#define HEADER_STORE_MAGIC       0x53485242 // "BRHS"
+#define HEADER_STORE_VERSION     1
+#define HEADER_STORE_FILE_HEADER 8          // magic and version
+#define HEADER_STORE_MIN_RECORDS 4096       // minimum number of records to map at once
+#define HEADER_STORE_RECORD_SIZE 152
+
+// record layout: blockHash[32], header[80], height[4], chainWork[32], checksum[4]
+#define REC_HASH   0
+#define REC_HEADER 32
+#define REC_HEIGHT 112
+#define REC_WORK   116
+#define REC_CHECK  148
+
+struct BRHeaderStoreStruct {
+    int fd;
+    uint8_t *map;
+    size_t mapLen, count;
+    uint32_t firstHeight;
+    BRSet *index; // pointers to the blockHash of each mapped record
+};
+
+// returns a hash value for a mapped record suitable for use in a hashtable
+inline static size_t _BRHeaderRecordHash(const void *rec)
+{
+    return (size_t)UInt32GetLE(rec);
+}
+
+// true if rec and otherRec have equal blockHash values
+inline static int _BRHeaderRecordEq(const void *rec, const void *otherRec)
+{
+    return (rec == otherRec || memcmp(rec, otherRec, sizeof(UInt256)) == 0);
+}
+
+inline static const uint8_t *_BRHeaderStoreRecord(const BRHeaderStore *store, size_t idx)
+{
+    return &store->map[HEADER_STORE_FILE_HEADER + idx*HEADER_STORE_RECORD_SIZE];
+}
+
+// adds the proof-of-work of the given compact difficulty target to the little-endian 256bit integer work
+// the work of a block is 2^256/(target + 1), which is computed here as 2^(256 - 8*(size - 3))/mantissa
+static void _BRHeaderStoreAddWork(UInt256 *work, uint32_t target)
+{
+    uint32_t size = target >> 24, mantissa = target & 0x007fffff, shift, q[9];
+    uint64_t r = 0, carry = 0;
+    int i;
+
+    if (mantissa == 0 || size < 3 || size > 34) return;
+    shift = 256 - 8*(size - 3);
+
+    for (i = 8; i >= 0; i--) { // long division of 2^shift by mantissa, 32bits at a time
+        r = (r << 32) | ((i == shift/32) ? (1u << (shift % 32)) : 0);
+        q[i] = (uint32_t)(r/mantissa);
+        r %= mantissa;
+    }
+
+    for (i = 0; i < 8; i++) {
+        carry += (uint64_t)UInt32GetLE(&work->u8[i*4]) + q[i];
+        UInt32SetLE(&work->u8[i*4], (uint32_t)carry);
+        carry >>= 32;
+    }
+}
+
+// true if the record checksum is correct, and the record follows the one before it
+static int _BRHeaderStoreRecordIsValid(const BRHeaderStore *store, size_t idx)
+{
+    const uint8_t *rec = _BRHeaderStoreRecord(store, idx),
+                  *prev = (idx > 0) ? _BRHeaderStoreRecord(store, idx - 1) : NULL;
+    uint8_t md[32];
+
+    BRSHA256(md, rec, REC_CHECK);
+    if (memcmp(md, &rec[REC_CHECK], sizeof(uint32_t)) != 0) return 0;
+    if (prev && UInt32GetLE(&rec[REC_HEIGHT]) != UInt32GetLE(&prev[REC_HEIGHT]) + 1) return 0;
+    if (prev && memcmp(&rec[REC_HEADER + sizeof(uint32_t)], &prev[REC_HASH], sizeof(UInt256)) != 0) return 0;
+    return 1;
+}
+
+// maps enough of the file to hold recCount records, and rebuilds the index if the mapping moved
+static int _BRHeaderStoreMap(BRHeaderStore *store, size_t recCount)
+{
+    size_t len = HEADER_STORE_FILE_HEADER + recCount*HEADER_STORE_RECORD_SIZE;
+    void *map;
+
+    if (store->map && len <= store->mapLen) return 1;
+    if (recCount < HEADER_STORE_MIN_RECORDS) recCount = HEADER_STORE_MIN_RECORDS;
+    if (store->map && recCount < (store->mapLen/HEADER_STORE_RECORD_SIZE)*2) { // grow geometrically
+        recCount = (store->mapLen/HEADER_STORE_RECORD_SIZE)*2;
+    }
+
+    len = HEADER_STORE_FILE_HEADER + recCount*HEADER_STORE_RECORD_SIZE;
+
+    // mapping past the end of the file is fine, records are only read after they've been written
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) return 0;
+    if (store->map) munmap(store->map, store->mapLen);
+    store->map = map;
+    store->mapLen = len;
+    BRSetClear(store->index);
+
+    for (size_t i = 0; i < store->count; i++) {
+        BRSetAdd(store->index, (void *)_BRHeaderStoreRecord(store, i));
+    }
+
+    return 1;
+}
+
+// opens the header store at path, creating it if needed, and discards any incomplete or corrupt records at the tail
+// returns a header store that must be closed by calling BRHeaderStoreClose(), or NULL on error (errno is set)
+BRHeaderStore *BRHeaderStoreOpen(const char *path)
+{
+    BRHeaderStore *store = calloc(1, sizeof(*store));
+    uint8_t buf[HEADER_STORE_FILE_HEADER];
+    struct stat st;
+    size_t count;
+    int r = 1;
+
+    assert(store != NULL);
+    assert(path != NULL);
+    store->fd = open(path, O_RDWR | O_CREAT, 0600);
+    store->firstHeight = BLOCK_UNKNOWN_HEIGHT;
+    if (store->fd < 0 || fstat(store->fd, &st) != 0) r = 0;
+
+    if (r && st.st_size < sizeof(buf)) { // new store
+        UInt32SetLE(buf, HEADER_STORE_MAGIC);
+        UInt32SetLE(&buf[sizeof(uint32_t)], HEADER_STORE_VERSION);
+        if (pwrite(store->fd, buf, sizeof(buf), 0) != sizeof(buf) || ftruncate(store->fd, sizeof(buf)) != 0) r = 0;
+        st.st_size = sizeof(buf);
+    }
+    else if (r && (pread(store->fd, buf, sizeof(buf), 0) != sizeof(buf) || UInt32GetLE(buf) != HEADER_STORE_MAGIC ||
+                   UInt32GetLE(&buf[sizeof(uint32_t)]) != HEADER_STORE_VERSION)) {
+        errno = EINVAL;
+        r = 0;
+    }
+
+    count = (r) ? (st.st_size - sizeof(buf))/HEADER_STORE_RECORD_SIZE : 0;
+    store->index = BRSetNew(_BRHeaderRecordHash, _BRHeaderRecordEq, count + 100);
+    if (r && ! _BRHeaderStoreMap(store, count)) r = 0;
+
+    if (r) { // drop any records at the tail that were torn by a crash or don't connect to the chain
+        while (count > 0 && ! _BRHeaderStoreRecordIsValid(store, count - 1)) count--;
+        store->count = count;
+
+        if (st.st_size != HEADER_STORE_FILE_HEADER + count*HEADER_STORE_RECORD_SIZE &&
+            ftruncate(store->fd, HEADER_STORE_FILE_HEADER + count*HEADER_STORE_RECORD_SIZE) != 0) r = 0;
+    }
+
+    if (r && count > 0) {
+        store->firstHeight = UInt32GetLE(&_BRHeaderStoreRecord(store, 0)[REC_HEIGHT]);
+
+        for (size_t i = 0; i < count; i++) {
+            BRSetAdd(store->index, (void *)_BRHeaderStoreRecord(store, i));
+        }
+    }
+
+    if (! r) {
+        int err = errno;
+
+        BRHeaderStoreClose(store);
+        store = NULL;
+        errno = err;
+    }
+
+    return store;
+}
+
+// number of headers in the store
+size_t BRHeaderStoreCount(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return store->count;
+}
+
+// height of the first header in the store, or BLOCK_UNKNOWN_HEIGHT if the store is empty
+uint32_t BRHeaderStoreFirstHeight(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return store->firstHeight;
+}
+
+// height of the last header in the store, or BLOCK_UNKNOWN_HEIGHT if the store is empty
+uint32_t BRHeaderStoreLastHeight(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return (store->count > 0) ? store->firstHeight + (uint32_t)store->count - 1 : BLOCK_UNKNOWN_HEIGHT;
+}
+
+// populates the header fields and height of block with the stored header at the given height (hashes and flags are
+// left untouched), returns true if the store has a header at that height
+int BRHeaderStoreHeaderAtHeight(BRHeaderStore *store, uint32_t height, BRMerkleBlock *block)
+{
+    const uint8_t *rec;
+    size_t off = REC_HEADER;
+
+    assert(store != NULL);
+    assert(block != NULL);
+    if (store->count == 0 || height < store->firstHeight || height - store->firstHeight >= store->count) return 0;
+    rec = _BRHeaderStoreRecord(store, height - store->firstHeight);
+    block->blockHash = UInt256Get(&rec[REC_HASH]);
+    block->version = UInt32GetLE(&rec[off]);
+    off += sizeof(uint32_t);
+    block->prevBlock = UInt256Get(&rec[off]);
+    off += sizeof(UInt256);
+    block->merkleRoot = UInt256Get(&rec[off]);
+    off += sizeof(UInt256);
+    block->timestamp = UInt32GetLE(&rec[off]);
+    off += sizeof(uint32_t);
+    block->target = UInt32GetLE(&rec[off]);
+    off += sizeof(uint32_t);
+    block->nonce = UInt32GetLE(&rec[off]);
+    block->height = UInt32GetLE(&rec[REC_HEIGHT]);
+    return 1;
+}
+
+// returns the height of the stored header with the given blockHash, or BLOCK_UNKNOWN_HEIGHT if it isn't in the store
+uint32_t BRHeaderStoreHeightForHash(BRHeaderStore *store, UInt256 blockHash)
+{
+    const uint8_t *rec;
+
+    assert(store != NULL);
+    rec = BRSetGet(store->index, &blockHash);
+    return (rec) ? UInt32GetLE(&rec[REC_HEIGHT]) : BLOCK_UNKNOWN_HEIGHT;
+}
+
+// returns the cumulative proof-of-work of the stored chain up to and including height, as a little-endian 256bit
+// integer, counting from the first header in the store, or UINT256_ZERO if there's no header at that height
+UInt256 BRHeaderStoreChainWork(BRHeaderStore *store, uint32_t height)
+{
+    assert(store != NULL);
+    if (store->count == 0 || height < store->firstHeight || height - store->firstHeight >= store->count) {
+        return UINT256_ZERO;
+    }
+
+    return UInt256Get(&_BRHeaderStoreRecord(store, height - store->firstHeight)[REC_WORK]);
+}
+
+// appends the header of block to the store
+// unless the store is empty, block->height must follow the last stored height and block->prevBlock must be its hash
+// returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block)
+{
+    const uint8_t *last;
+    uint8_t rec[HEADER_STORE_RECORD_SIZE], md[32];
+    BRMerkleBlock header;
+    UInt256 work = UINT256_ZERO;
+    off_t off;
+
+    assert(store != NULL);
+    assert(block != NULL);
+    assert(block->height != BLOCK_UNKNOWN_HEIGHT);
+    last = (store->count > 0) ? _BRHeaderStoreRecord(store, store->count - 1) : NULL;
+
+    if (last) {
+        if (block->height != UInt32GetLE(&last[REC_HEIGHT]) + 1) return 0;
+        if (! UInt256Eq(block->prevBlock, UInt256Get(&last[REC_HASH]))) return 0;
+        work = UInt256Get(&last[REC_WORK]);
+    }
+
+    if (! _BRHeaderStoreMap(store, store->count + 1)) return 0;
+    header = *block;
+    header.totalTx = 0; // serialize only the 80 byte header
+    UInt256Set(&rec[REC_HASH], block->blockHash);
+    BRMerkleBlockSerialize(&header, &rec[REC_HEADER], REC_HEIGHT - REC_HEADER);
+    UInt32SetLE(&rec[REC_HEIGHT], block->height);
+    _BRHeaderStoreAddWork(&work, block->target);
+    UInt256Set(&rec[REC_WORK], work);
+    BRSHA256(md, rec, REC_CHECK);
+    memcpy(&rec[REC_CHECK], md, sizeof(uint32_t));
+    off = HEADER_STORE_FILE_HEADER + store->count*HEADER_STORE_RECORD_SIZE;
+    if (pwrite(store->fd, rec, sizeof(rec), off) != sizeof(rec)) return 0;
+    if (store->count == 0) store->firstHeight = block->height;
+    BRSetAdd(store->index, (void *)_BRHeaderStoreRecord(store, store->count));
+    store->count++;
+    return 1;
+}
+
+// removes the header at height and all headers above it (use when the chain is reorganized)
+// returns true on success
+int BRHeaderStoreTruncate(BRHeaderStore *store, uint32_t height)
+{
+    size_t count;
+
+    assert(store != NULL);
+    if (store->count == 0 || (height >= store->firstHeight && height - store->firstHeight >= store->count)) return 1;
+    count = (height > store->firstHeight) ? height - store->firstHeight : 0;
+
+    // records past the end of the file can't be read, so remove them from the index before shrinking the file
+    for (size_t i = count; i < store->count; i++) {
+        BRSetRemove(store->index, _BRHeaderStoreRecord(store, i));
+    }
+
+    if (ftruncate(store->fd, HEADER_STORE_FILE_HEADER + count*HEADER_STORE_RECORD_SIZE) != 0) {
+        for (size_t i = count; i < store->count; i++) {
+            BRSetAdd(store->index, (void *)_BRHeaderStoreRecord(store, i));
+        }
+
+        return 0;
+    }
+
+    store->count = count;
+    if (store->count == 0) store->firstHeight = BLOCK_UNKNOWN_HEIGHT;
+    return 1;
+}
+
+// flushes appended headers to permanent storage, returns true on success
+int BRHeaderStoreSync(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    return (fsync(store->fd) == 0) ? 1 : 0;
+}
+
+// unmaps and closes the store, and frees memory allocated for it
+void BRHeaderStoreClose(BRHeaderStore *store)
+{
+    assert(store != NULL);
+    if (store->map) munmap(store->map, store->mapLen);
+    if (store->fd >= 0) close(store->fd);
+    if (store->index) BRSetFree(store->index);
+    free(store);
+}
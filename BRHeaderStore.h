@@ -0,0 +1,86 @@
+//
+//  BRHeaderStore.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRHeaderStore_h
+#define BRHeaderStore_h
+
+#include "BRMerkleBlock.h"
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// an append-only, memory-mapped file of consecutive block headers in a single chain, indexed by height and block hash
+// each record holds the block hash, the 80 byte header, the block height, the cumulative chain work, and a checksum,
+// so records torn by a crash during an append can be detected and dropped when the store is reopened
+// NOTE: a header store is not thread-safe, callers must serialize access (BRPeerManager does so with its own lock)
+
+typedef struct BRHeaderStoreStruct BRHeaderStore;
+
+// opens the header store at path, creating it if needed, and discards any incomplete or corrupt records at the tail
+// returns a header store that must be closed by calling BRHeaderStoreClose(), or NULL on error (errno is set)
+BRHeaderStore *BRHeaderStoreOpen(const char *path);
+
+// number of headers in the store
+size_t BRHeaderStoreCount(BRHeaderStore *store);
+
+// height of the first header in the store, or BLOCK_UNKNOWN_HEIGHT if the store is empty
+uint32_t BRHeaderStoreFirstHeight(BRHeaderStore *store);
+
+// height of the last header in the store, or BLOCK_UNKNOWN_HEIGHT if the store is empty
+uint32_t BRHeaderStoreLastHeight(BRHeaderStore *store);
+
+// populates the header fields and height of block with the stored header at the given height (hashes and flags are
+// left untouched), returns true if the store has a header at that height
+int BRHeaderStoreHeaderAtHeight(BRHeaderStore *store, uint32_t height, BRMerkleBlock *block);
+
+// returns the height of the stored header with the given blockHash, or BLOCK_UNKNOWN_HEIGHT if it isn't in the store
+uint32_t BRHeaderStoreHeightForHash(BRHeaderStore *store, UInt256 blockHash);
+
+// returns the cumulative proof-of-work of the stored chain up to and including height, as a little-endian 256bit
+// integer, counting from the first header in the store, or UINT256_ZERO if there's no header at that height
+UInt256 BRHeaderStoreChainWork(BRHeaderStore *store, uint32_t height);
+
+// appends the header of block to the store
+// unless the store is empty, block->height must follow the last stored height and block->prevBlock must be its hash
+// returns true on success
+int BRHeaderStoreAppend(BRHeaderStore *store, const BRMerkleBlock *block);
+
+// removes the header at height and all headers above it (use when the chain is reorganized)
+// returns true on success
+int BRHeaderStoreTruncate(BRHeaderStore *store, uint32_t height);
+
+// flushes appended headers to permanent storage, returns true on success
+int BRHeaderStoreSync(BRHeaderStore *store);
+
+// unmaps and closes the store, and frees memory allocated for it
+void BRHeaderStoreClose(BRHeaderStore *store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRHeaderStore_h
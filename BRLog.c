@@ -0,0 +1,468 @@
+//
+//  BRLog.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRLog.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#if defined(TARGET_OS_MAC)
+#include <Foundation/Foundation.h>
+#define _log_write(level, message) NSLog(@"%s", (message))
+#elif defined(__ANDROID__)
+#include <android/log.h>
+static const int _logPriority[] = { ANDROID_LOG_DEBUG, ANDROID_LOG_INFO, ANDROID_LOG_WARN, ANDROID_LOG_ERROR };
+#define _log_write(level, message) __android_log_print(_logPriority[(level)], "bread", "%s", (message))
+#else
+#define _log_write(level, message) printf("%s\n", (message))
+#endif
+
+#define LOG_RING_SIZE      1024  // records, must be a power of 2
+#define LOG_ARGS_SIZE      224   // bytes of arguments per record, longer strings are cut off
+#define LOG_MESSAGE_SIZE   1024  // longest formatted message
+#define LOG_STACK_SIZE     (64 * 1024)
+
+typedef struct {
+    size_t seq; // ring position the record is ready to be written at, or that position + 1 once it's been written
+    const char *fmt;
+    double timestamp;
+    uint16_t argsLen;
+    uint8_t level;
+    uint8_t truncated;
+    uint8_t args[LOG_ARGS_SIZE];
+} BRLogRecord;
+
+static BRLogRecord _ring[LOG_RING_SIZE];
+static size_t _writePos, _readPos, _dropped, _droppedReported;
+static int _level = BRLogLevelDebug, _threadStarted = 0, _sleeping = 0; // _sleeping is set while the ring is empty
+static void *_sinkInfo = NULL;
+static void (*_sink)(void *info, BRLogLevel level, double timestamp, const char *message) = NULL;
+static pthread_mutex_t _readLock = PTHREAD_MUTEX_INITIALIZER; // serializes readers and the sink
+static pthread_mutex_t _wakeLock = PTHREAD_MUTEX_INITIALIZER; // held by the log thread while it goes to sleep
+static pthread_cond_t _wakeCond = PTHREAD_COND_INITIALIZER; // signaled when a record is queued while _sleeping is set
+static pthread_once_t _once = PTHREAD_ONCE_INIT;
+
+static double _BRLogNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+// parses the conversion specification following a '%' in fmt, returning a pointer past it
+// specLen is set to the length of the flags, width and precision, length to the length modifier ('H' for hh, 'q' for
+// ll, or 0 for none), and conv to the conversion character
+static const char *_BRLogParseSpec(const char *fmt, size_t *specLen, char *length, char *conv)
+{
+    const char *s = fmt + strspn(fmt, "-+ #0'");
+
+    if (*s == '*') s++;
+    else s += strspn(s, "0123456789");
+
+    if (*s == '.') {
+        s++;
+        if (*s == '*') s++;
+        else s += strspn(s, "0123456789");
+    }
+
+    *specLen = s - fmt;
+    *length = 0;
+    if (s[0] == 'h' && s[1] == 'h') *length = 'H', s += 2;
+    else if (s[0] == 'l' && s[1] == 'l') *length = 'q', s += 2;
+    else if (*s != '\0' && strchr("hlqjztL", *s)) *length = *s++;
+    *conv = *s;
+    return (*s != '\0') ? s + 1 : s;
+}
+
+// copies the arguments of each conversion in fmt into args, widening integers to 64 bits and floats to double
+// returns the number of bytes used, and sets truncated if the arguments didn't fit
+static size_t _BRLogEncode(uint8_t *args, size_t argsLen, int *truncated, const char *fmt, va_list ap)
+{
+    size_t off = 0, specLen, i, len;
+    const char *s, *str;
+    char length, conv;
+    int64_t n;
+    uint64_t u;
+    double d;
+
+    *truncated = 0;
+
+    while (! *truncated && (fmt = strchr(fmt, '%')) != NULL) {
+        if (fmt[1] == '%') { fmt += 2; continue; }
+        s = fmt + 1;
+        fmt = _BRLogParseSpec(s, &specLen, &length, &conv);
+
+        for (i = 0; i < specLen && ! *truncated; i++) { // '*' width and precision
+            if (s[i] != '*') continue;
+            n = va_arg(ap, int);
+            if (off + sizeof(n) <= argsLen) memcpy(&args[off], &n, sizeof(n)), off += sizeof(n);
+            else *truncated = 1;
+        }
+
+        if (*truncated) break;
+
+        switch (conv) {
+            case 'd': case 'i': case 'c':
+                if (conv == 'c') n = va_arg(ap, int);
+                else if (length == 'H') n = (signed char)va_arg(ap, int);
+                else if (length == 'h') n = (short)va_arg(ap, int);
+                else if (length == 'l') n = va_arg(ap, long);
+                else if (length == 'q') n = va_arg(ap, long long);
+                else if (length == 'j') n = va_arg(ap, intmax_t);
+                else if (length == 'z') n = va_arg(ap, ssize_t);
+                else if (length == 't') n = va_arg(ap, ptrdiff_t);
+                else n = va_arg(ap, int);
+                if (off + sizeof(n) <= argsLen) memcpy(&args[off], &n, sizeof(n)), off += sizeof(n);
+                else *truncated = 1;
+                break;
+
+            case 'o': case 'u': case 'x': case 'X': case 'p':
+                if (conv == 'p') u = (uintptr_t)va_arg(ap, void *);
+                else if (length == 'H') u = (unsigned char)va_arg(ap, unsigned);
+                else if (length == 'h') u = (unsigned short)va_arg(ap, unsigned);
+                else if (length == 'l') u = va_arg(ap, unsigned long);
+                else if (length == 'q') u = va_arg(ap, unsigned long long);
+                else if (length == 'j') u = va_arg(ap, uintmax_t);
+                else if (length == 'z') u = va_arg(ap, size_t);
+                else if (length == 't') u = (size_t)va_arg(ap, ptrdiff_t);
+                else u = va_arg(ap, unsigned);
+                if (off + sizeof(u) <= argsLen) memcpy(&args[off], &u, sizeof(u)), off += sizeof(u);
+                else *truncated = 1;
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                d = (length == 'L') ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                if (off + sizeof(d) <= argsLen) memcpy(&args[off], &d, sizeof(d)), off += sizeof(d);
+                else *truncated = 1;
+                break;
+
+            case 's':
+                str = va_arg(ap, const char *);
+                if (! str) str = "(null)";
+                len = strlen(str);
+
+                if (off >= argsLen) { *truncated = 1; break; }
+                if (off + len + 1 > argsLen) len = argsLen - off - 1, *truncated = 1;
+                memcpy(&args[off], str, len);
+                args[off + len] = '\0';
+                off += len + 1;
+                break;
+
+            case 'n':
+                (void)va_arg(ap, void *); // deferred formatting has nowhere to store the count
+                break;
+
+            case '\0':
+                break;
+
+            default: // unknown conversion, the types of any remaining arguments can't be known
+                *truncated = 1;
+                break;
+        }
+    }
+
+    return off;
+}
+
+static void _BRLogAppend(char *message, size_t messageLen, size_t *off, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (*off + 1 >= messageLen) return;
+    va_start(ap, fmt);
+    n = vsnprintf(&message[*off], messageLen - *off, fmt, ap);
+    va_end(ap);
+    if (n > 0) *off = (*off + n < messageLen) ? *off + n : messageLen - 1;
+}
+
+static int _BRLogArg(const BRLogRecord *record, size_t *off, void *value, size_t valueLen)
+{
+    if (*off + valueLen > record->argsLen) return 0;
+    memcpy(value, &record->args[*off], valueLen);
+    *off += valueLen;
+    return 1;
+}
+
+// formats a record into message, using the arguments copied by _BRLogEncode()
+static void _BRLogFormat(char *message, size_t messageLen, const BRLogRecord *record)
+{
+    const char *fmt = record->fmt, *p, *s, *str;
+    size_t off = 0, argsOff = 0, specLen, i, j, len;
+    char spec[64], length, conv;
+    int stop = 0;
+    int64_t n;
+    uint64_t u;
+    double d;
+
+    message[0] = '\0';
+
+    while (! stop && (p = strchr(fmt, '%')) != NULL) {
+        _BRLogAppend(message, messageLen, &off, "%.*s", (int)(p - fmt), fmt);
+        if (p[1] == '%') { _BRLogAppend(message, messageLen, &off, "%%"); fmt = p + 2; continue; }
+        s = p + 1;
+        fmt = _BRLogParseSpec(s, &specLen, &length, &conv);
+        if (specLen > 24) { stop = 1; break; }
+        spec[0] = '%';
+
+        for (i = 0, j = 1; i < specLen && ! stop; i++) { // rebuild the spec, substituting any '*' values
+            if (s[i] != '*') spec[j++] = s[i];
+            else if (! _BRLogArg(record, &argsOff, &n, sizeof(n))) stop = 1;
+            else if (n < 0 && spec[j - 1] == '.') j--; // a negative precision is taken as if it were omitted
+            else j += snprintf(&spec[j], sizeof(spec) - j - 4, "%"PRId64, n);
+        }
+
+        if (stop) break;
+
+        switch (conv) {
+            case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                if (! _BRLogArg(record, &argsOff, &u, sizeof(u))) { stop = 1; break; }
+                strcpy(&spec[j], (char []) { 'l', 'l', conv, '\0' });
+                if (conv == 'd' || conv == 'i') _BRLogAppend(message, messageLen, &off, spec, (long long)u);
+                else _BRLogAppend(message, messageLen, &off, spec, (unsigned long long)u);
+                break;
+
+            case 'c':
+                if (! _BRLogArg(record, &argsOff, &n, sizeof(n))) { stop = 1; break; }
+                strcpy(&spec[j], "c");
+                _BRLogAppend(message, messageLen, &off, spec, (int)n);
+                break;
+
+            case 'p':
+                if (! _BRLogArg(record, &argsOff, &u, sizeof(u))) { stop = 1; break; }
+                strcpy(&spec[j], "p");
+                _BRLogAppend(message, messageLen, &off, spec, (void *)(uintptr_t)u);
+                break;
+
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                if (! _BRLogArg(record, &argsOff, &d, sizeof(d))) { stop = 1; break; }
+                strcpy(&spec[j], (char []) { conv, '\0' });
+                _BRLogAppend(message, messageLen, &off, spec, d);
+                break;
+
+            case 's':
+                if (argsOff >= record->argsLen) { stop = 1; break; }
+                str = (const char *)&record->args[argsOff];
+                len = strnlen(str, record->argsLen - argsOff);
+                argsOff += len + 1;
+                strcpy(&spec[j], "s");
+                _BRLogAppend(message, messageLen, &off, spec, str);
+                break;
+
+            case 'n': case '\0':
+                break;
+
+            default:
+                stop = 1;
+                break;
+        }
+    }
+
+    if (! stop) _BRLogAppend(message, messageLen, &off, "%s", fmt);
+    if (stop || record->truncated) _BRLogAppend(message, messageLen, &off, "...");
+}
+
+// formats and writes queued records until the ring is empty, returns the number written, _readLock must be held
+static size_t _BRLogDrain(void)
+{
+    char message[LOG_MESSAGE_SIZE];
+    BRLogRecord *record;
+    BRLogLevel level;
+    double timestamp;
+    size_t count = 0, dropped;
+
+    for (;;) {
+        record = &_ring[_readPos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != _readPos + 1) break; // not yet written
+        _BRLogFormat(message, sizeof(message), record);
+        level = record->level;
+        timestamp = record->timestamp;
+        __atomic_store_n(&record->seq, _readPos + LOG_RING_SIZE, __ATOMIC_RELEASE); // free for the next lap
+        __atomic_store_n(&_readPos, _readPos + 1, __ATOMIC_RELEASE);
+
+        if (_sink) _sink(_sinkInfo, level, timestamp, message);
+        else _log_write(level, message);
+        count++;
+    }
+
+    dropped = __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+
+    if (dropped != _droppedReported) {
+        snprintf(message, sizeof(message), "log buffer full, dropped %zu message(s)", dropped - _droppedReported);
+        if (_sink) _sink(_sinkInfo, BRLogLevelWarning, _BRLogNow(), message);
+        else _log_write(BRLogLevelWarning, message);
+        _droppedReported = dropped;
+        count++;
+    }
+
+    return count;
+}
+
+// true if the next record in the ring has been written, can be called without holding _readLock
+static int _BRLogPending(void)
+{
+    size_t pos = __atomic_load_n(&_readPos, __ATOMIC_ACQUIRE);
+
+    return (__atomic_load_n(&_ring[pos & (LOG_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE) == pos + 1);
+}
+
+static void *_BRLogThreadRoutine(void *arg)
+{
+    size_t count;
+
+    for (;;) {
+        pthread_mutex_lock(&_readLock);
+        count = _BRLogDrain();
+        pthread_mutex_unlock(&_readLock);
+        if (count > 0) continue;
+
+        // once _sleeping is set, a record published before it is seen by _BRLogPending(), and the writer of a record
+        // published after it sees _sleeping and signals _wakeCond, which can't happen until this thread is waiting
+        pthread_mutex_lock(&_wakeLock);
+        __atomic_store_n(&_sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (! _BRLogPending()) pthread_cond_wait(&_wakeCond, &_wakeLock);
+        __atomic_store_n(&_sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&_wakeLock);
+    }
+
+    return NULL; // detached threads don't need to return a value
+}
+
+static void _BRLogInit(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) _ring[i].seq = i;
+
+    if (pthread_attr_init(&attr) == 0) {
+        if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) == 0 &&
+            pthread_attr_setstacksize(&attr, LOG_STACK_SIZE) == 0 &&
+            pthread_create(&thread, &attr, _BRLogThreadRoutine, NULL) == 0) _threadStarted = 1;
+        pthread_attr_destroy(&attr);
+    }
+
+    atexit(BRLogFlush); // write out anything still queued when the process exits normally
+}
+
+// queues a log record, fmt must be a string literal, prefer the br_log() macro which skips disabled levels
+void BRLog(BRLogLevel level, const char *fmt, ...)
+{
+    BRLogRecord *record;
+    size_t pos, seq;
+    int truncated;
+    va_list ap;
+
+    assert(fmt != NULL);
+    if ((unsigned)level >= BRLogLevelNone) return;
+    pthread_once(&_once, _BRLogInit);
+    pos = __atomic_load_n(&_writePos, __ATOMIC_RELAXED);
+
+    for (;;) { // claim a free record, see: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+        record = &_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&_writePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+        else if ((intptr_t)(seq - pos) < 0) { // ring is full, the log thread hasn't caught up
+            __atomic_add_fetch(&_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else pos = __atomic_load_n(&_writePos, __ATOMIC_RELAXED);
+    }
+
+    record->fmt = fmt;
+    record->timestamp = _BRLogNow();
+    record->level = level;
+    va_start(ap, fmt);
+    record->argsLen = _BRLogEncode(record->args, sizeof(record->args), &truncated, fmt, ap);
+    va_end(ap);
+    record->truncated = truncated;
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE); // publish to the reader
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&_sleeping, __ATOMIC_RELAXED)) { // wake the log thread, which only waits when the ring is empty
+        pthread_mutex_lock(&_wakeLock);
+        pthread_cond_signal(&_wakeCond);
+        pthread_mutex_unlock(&_wakeLock);
+    }
+    else if (! _threadStarted && pthread_mutex_trylock(&_readLock) == 0) { // no log thread, so write it out now
+        _BRLogDrain();
+        pthread_mutex_unlock(&_readLock);
+    }
+}
+
+// true if messages at level are currently logged
+int BRLogLevelEnabled(BRLogLevel level)
+{
+    return (level >= __atomic_load_n(&_level, __ATOMIC_RELAXED) && level < BRLogLevelNone);
+}
+
+// sets the minimum level logged at runtime (BRLogLevelDebug by default), BRLogLevelNone disables logging
+void BRLogSetLevel(BRLogLevel level)
+{
+    __atomic_store_n(&_level, level, __ATOMIC_RELAXED);
+}
+
+// returns the minimum level logged at runtime
+BRLogLevel BRLogGetLevel(void)
+{
+    return __atomic_load_n(&_level, __ATOMIC_RELAXED);
+}
+
+// sets a sink to receive each formatted message along with its level and the unix time it was logged, from the log
+// thread, in the order messages were logged, pass NULL to restore the default sink
+// the sink must not call BRLogFlush() or BRLogSetSink()
+void BRLogSetSink(void *info, void (*sink)(void *info, BRLogLevel level, double timestamp, const char *message))
+{
+    pthread_once(&_once, _BRLogInit);
+    pthread_mutex_lock(&_readLock);
+    _BRLogDrain(); // queued records go to the sink that was set when they were logged
+    _sinkInfo = info;
+    _sink = sink;
+    pthread_mutex_unlock(&_readLock);
+}
+
+// formats and writes all queued records before returning
+void BRLogFlush(void)
+{
+    pthread_once(&_once, _BRLogInit);
+    pthread_mutex_lock(&_readLock);
+    _BRLogDrain();
+    if (! _sink) fflush(stdout);
+    pthread_mutex_unlock(&_readLock);
+}
+
+// number of records dropped because the ring buffer was full
+size_t BRLogDropped(void)
+{
+    return __atomic_load_n(&_dropped, __ATOMIC_RELAXED);
+}
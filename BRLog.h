@@ -0,0 +1,86 @@
+//
+//  BRLog.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRLog_h
+#define BRLog_h
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// asynchronous logging: a log call copies its format string pointer and arguments into a fixed size record in a
+// lock-free ring buffer and returns, and a background thread formats the records and hands them to the sink
+// (printf, NSLog or the android log by default), so callers never block on output, even while holding a lock
+// when the ring is full, new records are dropped and counted rather than blocking the caller
+// NOTE: since formatting is deferred, the format string must remain valid for the life of the process (use a string
+// literal), string arguments are copied, and arguments that don't fit in a record are cut off with "..."
+
+typedef enum {
+    BRLogLevelDebug = 0,
+    BRLogLevelInfo,
+    BRLogLevelWarning,
+    BRLogLevelError,
+    BRLogLevelNone
+} BRLogLevel;
+
+// log calls below this level are compiled out, e.g. build with -DBR_LOG_MIN_LEVEL=1 to drop debug logging
+#ifndef BR_LOG_MIN_LEVEL
+#define BR_LOG_MIN_LEVEL 0
+#endif
+
+// logs a message if level is enabled both at compile time and at runtime, arguments aren't evaluated otherwise
+#define br_log(level, ...) do {\
+    if ((level) >= BR_LOG_MIN_LEVEL && BRLogLevelEnabled(level)) BRLog((level), __VA_ARGS__);\
+} while (0)
+
+// queues a log record, fmt must be a string literal, prefer the br_log() macro which skips disabled levels
+void BRLog(BRLogLevel level, const char *fmt, ...);
+
+// true if messages at level are currently logged
+int BRLogLevelEnabled(BRLogLevel level);
+
+// sets the minimum level logged at runtime (BRLogLevelDebug by default), BRLogLevelNone disables logging
+void BRLogSetLevel(BRLogLevel level);
+
+// returns the minimum level logged at runtime
+BRLogLevel BRLogGetLevel(void);
+
+// sets a sink to receive each formatted message along with its level and the unix time it was logged, from the log
+// thread, in the order messages were logged, pass NULL to restore the default sink
+// the sink must not call BRLogFlush() or BRLogSetSink()
+void BRLogSetSink(void *info, void (*sink)(void *info, BRLogLevel level, double timestamp, const char *message));
+
+// formats and writes all queued records before returning
+void BRLogFlush(void);
+
+// number of records dropped because the ring buffer was full
+size_t BRLogDropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRLog_h
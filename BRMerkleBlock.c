@@ -25,14 +25,24 @@
 #include "BRMerkleBlock.h"
 #include "BRCrypto.h"
 #include "BRAddress.h"
+#include "BRArray.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <assert.h>
 
+#if BITCOIN_REGTEST
+#define MAX_PROOF_OF_WORK 0x207fffff    // regtest allows blocks mined at trivial difficulty
+#else
 #define MAX_PROOF_OF_WORK 0x1d00ffff    // highest value for difficulty target (higher values are less difficult)
+#endif
 #define TARGET_TIMESPAN   (14*24*60*60) // the targeted timespan between difficulty target adjustments
+#define MAX_WORKER_THREADS 16
+#define MIN_WORKER_BLOCKS  250          // don't hand a worker thread fewer blocks than this
+#define WORKER_STACK_SIZE  (64*1024)
 
 inline static int _ceil_log2(int x)
 {
@@ -141,6 +151,206 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
     return block;
 }
 
+// buf must contain a serialized merkleblock or header
+// populates the header fields of block without allocating memory (hashes and flags are set to NULL), and returns true
+// on success, useful for processing large batches of headers
+int BRMerkleBlockParseHeader(BRMerkleBlock *block, const uint8_t *buf, size_t bufLen)
+{
+    size_t off = 0;
+    
+    assert(block != NULL);
+    assert(buf != NULL || bufLen == 0);
+    if (! buf || bufLen < 80) return 0;
+    *block = BR_MERKLE_BLOCK_NONE;
+    block->version = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->prevBlock = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->merkleRoot = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->timestamp = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->target = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->nonce = UInt32GetLE(&buf[off]);
+    block->height = BLOCK_UNKNOWN_HEIGHT;
+    BRSHA256_2(&block->blockHash, buf, 80);
+    return 1;
+}
+
+typedef struct {
+    BRMerkleBlock *blocks;
+    const uint8_t *buf;
+    size_t count, headerLen, validCount;
+    uint32_t currentTime;
+    int done;
+} BRHeaderBatch;
+
+struct BRHeaderParserStruct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when a batch is queued or finished, or the workers should exit
+    pthread_t threads[MAX_WORKER_THREADS];
+    int threadCount, workerCount, exit; // workerCount is -1 until the workers are started
+    BRHeaderBatch **queue; // batches waiting for a worker, from any number of callers
+};
+
+static void _BRMerkleBlockParseBatch(BRHeaderBatch *batch)
+{
+    size_t i;
+    
+    for (i = 0; i < batch->count; i++) {
+        if (! BRMerkleBlockParseHeader(&batch->blocks[i], &batch->buf[i*batch->headerLen], batch->headerLen) ||
+            ! BRMerkleBlockIsValid(&batch->blocks[i], batch->currentTime)) break;
+    }
+    
+    batch->validCount = i;
+}
+
+static void *_BRHeaderParserRoutine(void *arg)
+{
+    BRHeaderParser *parser = arg;
+    BRHeaderBatch *batch;
+    
+    pthread_mutex_lock(&parser->lock);
+    
+    while (! parser->exit) {
+        if (array_count(parser->queue) == 0) {
+            pthread_cond_wait(&parser->cond, &parser->lock);
+            continue;
+        }
+        
+        batch = parser->queue[0];
+        array_rm(parser->queue, 0);
+        pthread_mutex_unlock(&parser->lock);
+        _BRMerkleBlockParseBatch(batch);
+        pthread_mutex_lock(&parser->lock);
+        batch->done = 1;
+        pthread_cond_broadcast(&parser->cond);
+    }
+    
+    pthread_mutex_unlock(&parser->lock);
+    return NULL;
+}
+
+// returns a pool of worker threads for BRMerkleBlockParseHeaders(), that spreads each call over up to threadCount
+// threads counting the calling one (0 for one per cpu core), the workers are started on first use and can be shared
+// by any number of threads, the pool must be freed by calling BRHeaderParserFree()
+BRHeaderParser *BRHeaderParserNew(int threadCount)
+{
+    BRHeaderParser *parser = calloc(1, sizeof(*parser));
+    
+    assert(parser != NULL);
+    if (threadCount <= 0) threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > MAX_WORKER_THREADS) threadCount = MAX_WORKER_THREADS;
+    if (threadCount < 1) threadCount = 1;
+    parser->threadCount = threadCount;
+    parser->workerCount = -1;
+    array_new(parser->queue, threadCount);
+    pthread_mutex_init(&parser->lock, NULL);
+    pthread_cond_init(&parser->cond, NULL);
+    return parser;
+}
+
+// starts the worker threads the first time they're needed, parser->lock must be held
+static void _BRHeaderParserStart(BRHeaderParser *parser)
+{
+    pthread_attr_t attr;
+    
+    parser->workerCount = 0;
+    
+    if (pthread_attr_init(&attr) == 0) {
+        if (pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE) == 0) {
+            while (parser->workerCount < parser->threadCount - 1 &&
+                   pthread_create(&parser->threads[parser->workerCount], &attr, _BRHeaderParserRoutine, parser) == 0) {
+                parser->workerCount++;
+            }
+        }
+        
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// parses count consecutive serialized headers, each headerLen bytes long (80, or 81 in a "headers" message), from buf
+// into blocks with BRMerkleBlockParseHeader(), and checks them with BRMerkleBlockIsValid(), spreading the work over the
+// worker threads of parser, or parsing on the calling thread if parser is NULL or there are too few headers to split
+// returns the number of leading headers that were successfully parsed and are valid
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock blocks[], size_t count, const uint8_t *buf, size_t headerLen,
+                                 uint32_t currentTime, BRHeaderParser *parser)
+{
+    size_t i, j, off, per, batchCount = (parser) ? parser->threadCount : 1, validCount = 0;
+    BRHeaderBatch *batch;
+    
+    assert(blocks != NULL || count == 0);
+    assert(buf != NULL || count == 0);
+    assert(headerLen >= 80);
+    if (batchCount > count/MIN_WORKER_BLOCKS) batchCount = count/MIN_WORKER_BLOCKS;
+    if (batchCount < 1) batchCount = 1;
+    
+    BRHeaderBatch batches[batchCount];
+    
+    per = (count + batchCount - 1)/batchCount;
+    
+    for (i = 0, off = 0; i < batchCount; i++, off += per) {
+        batches[i] = (BRHeaderBatch) { &blocks[off], &buf[off*headerLen], (off + per <= count) ? per : count - off,
+                                       headerLen, 0, currentTime, 0 };
+    }
+    
+    if (batchCount > 1) {
+        pthread_mutex_lock(&parser->lock);
+        if (parser->workerCount < 0) _BRHeaderParserStart(parser);
+        for (i = 1; i < batchCount; i++) array_add(parser->queue, &batches[i]);
+        pthread_cond_broadcast(&parser->cond);
+        pthread_mutex_unlock(&parser->lock);
+    }
+    
+    _BRMerkleBlockParseBatch(&batches[0]); // the first batch is parsed on the calling thread
+    
+    if (batchCount > 1) {
+        pthread_mutex_lock(&parser->lock);
+        
+        // batches no worker has taken yet, because the workers are busy with other callers' batches or couldn't be
+        // started, are parsed on the calling thread rather than waited for
+        for (i = 1; i < batchCount; i++) {
+            for (j = array_count(parser->queue); j > 0 && parser->queue[j - 1] != &batches[i]; j--);
+            if (j == 0) continue;
+            batch = parser->queue[j - 1];
+            array_rm(parser->queue, j - 1);
+            pthread_mutex_unlock(&parser->lock);
+            _BRMerkleBlockParseBatch(batch);
+            pthread_mutex_lock(&parser->lock);
+            batch->done = 1;
+        }
+        
+        for (i = 1; i < batchCount; i++) {
+            while (! batches[i].done) pthread_cond_wait(&parser->cond, &parser->lock);
+        }
+        
+        pthread_mutex_unlock(&parser->lock);
+    }
+    
+    for (i = 0; i < batchCount; i++) { // headers after the first invalid one don't count
+        validCount += batches[i].validCount;
+        if (batches[i].validCount < batches[i].count) break;
+    }
+    
+    return validCount;
+}
+
+// stops the worker threads of parser and frees it, no BRMerkleBlockParseHeaders() call may be using it
+void BRHeaderParserFree(BRHeaderParser *parser)
+{
+    assert(parser != NULL);
+    pthread_mutex_lock(&parser->lock);
+    parser->exit = 1;
+    pthread_cond_broadcast(&parser->cond);
+    pthread_mutex_unlock(&parser->lock);
+    for (int i = 0; i < parser->workerCount; i++) pthread_join(parser->threads[i], NULL);
+    array_free(parser->queue);
+    pthread_cond_destroy(&parser->cond);
+    pthread_mutex_destroy(&parser->lock);
+    free(parser);
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen)
 {
@@ -235,6 +445,75 @@ void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size
     if (block->flags) memcpy(block->flags, flags, flagsLen);
 }
 
+// returns the merkle tree hash of the node at the given height above the leaves, and position from the left
+static UInt256 _BRMerkleBlockNodeHash(const UInt256 txHashes[], size_t txCount, int height, size_t pos)
+{
+    UInt256 hashes[2], md;
+    
+    if (height == 0) return txHashes[pos];
+    hashes[0] = _BRMerkleBlockNodeHash(txHashes, txCount, height - 1, pos*2); // left branch
+    
+    if (pos*2 + 1 < ((txCount + ((size_t)1 << (height - 1)) - 1) >> (height - 1))) { // right branch
+        hashes[1] = _BRMerkleBlockNodeHash(txHashes, txCount, height - 1, pos*2 + 1);
+    }
+    else hashes[1] = hashes[0]; // if right branch is missing, dup left branch
+    
+    BRSHA256_2(&md, hashes, sizeof(hashes));
+    return md;
+}
+
+// recursively walks the merkle tree depth first, adding a flag for each node visited, and a hash for each leaf or node
+// without any matched transactions under it
+static void _BRMerkleBlockPartialTreeR(BRMerkleBlock *block, const UInt256 txHashes[], const int matches[],
+                                       size_t txCount, size_t *flagIdx, int height, size_t pos)
+{
+    int match = 0;
+    
+    for (size_t i = pos << height; ! match && i < ((pos + 1) << height) && i < txCount; i++) {
+        if (matches[i]) match = 1;
+    }
+    
+    if (match) block->flags[*flagIdx/8] |= (1 << (*flagIdx % 8));
+    (*flagIdx)++;
+    
+    if (height == 0 || ! match) {
+        block->hashes[block->hashesCount++] = _BRMerkleBlockNodeHash(txHashes, txCount, height, pos);
+    }
+    else {
+        _BRMerkleBlockPartialTreeR(block, txHashes, matches, txCount, flagIdx, height - 1, pos*2); // left branch
+        
+        if (pos*2 + 1 < ((txCount + ((size_t)1 << (height - 1)) - 1) >> (height - 1))) { // right branch
+            _BRMerkleBlockPartialTreeR(block, txHashes, matches, txCount, flagIdx, height - 1, pos*2 + 1);
+        }
+    }
+}
+
+// sets totalTx and the partial merkle tree for a block created with BRMerkleBlockNew(), given the hashes of all the
+// transactions in the block, so that BRMerkleBlockTxHashes() returns the hashes of those with a true matches[] value
+void BRMerkleBlockSetPartialTree(BRMerkleBlock *block, const UInt256 txHashes[], const int matches[], size_t txCount)
+{
+    size_t flagIdx = 0;
+    
+    assert(block != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    assert(matches != NULL || txCount == 0);
+    
+    if (block->hashes) free(block->hashes);
+    if (block->flags) free(block->flags);
+    block->totalTx = (uint32_t)txCount;
+    block->hashesCount = 0;
+    block->hashes = (txCount > 0) ? malloc(txCount*sizeof(UInt256)) : NULL; // there's at most one hash per tx
+    block->flagsLen = (txCount > 0) ? (2*txCount + 64)/8 : 0; // a tree has fewer than 2*txCount + log2(txCount) nodes
+    block->flags = (txCount > 0) ? calloc(block->flagsLen, sizeof(uint8_t)) : NULL;
+    
+    if (txCount > 0) {
+        assert(block->hashes != NULL);
+        assert(block->flags != NULL);
+        _BRMerkleBlockPartialTreeR(block, txHashes, matches, txCount, &flagIdx, _ceil_log2((int)txCount), 0);
+        block->flagsLen = (flagIdx + 7)/8;
+    }
+}
+
 // recursively walks the merkle tree to calculate the merkle root
 // NOTE: this merkle tree design has a security vulnerability (CVE-2012-2459), which can be defended against by
 // considering the merkle root invalid if there are duplicate hashes in any rows with an even number of elements
@@ -286,8 +565,10 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
     // check if proof-of-work target is out of range
     if (target == 0 || (block->target & 0x00800000) || block->target > MAX_PROOF_OF_WORK) r = 0;
     
-    if (size > 3) UInt32SetLE(&t.u8[size - 3], target);
-    else UInt32SetLE(t.u8, target >> (3 - size)*8);
+    if (r && size > 3) { // set only the three value bytes, since size can be 32 with a regtest target
+        t.u8[size - 3] = (uint8_t)target, t.u8[size - 2] = (uint8_t)(target >> 8), t.u8[size - 1] = target >> 16;
+    }
+    else if (r) UInt32SetLE(t.u8, target >> (3 - size)*8);
     
     for (int i = sizeof(t) - 1; r && i >= 0; i--) { // check proof-of-work
         if (block->blockHash.u8[i] < t.u8[i]) break;
@@ -66,6 +66,28 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block);
 // returns a merkle block struct that must be freed by calling BRMerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen);
 
+// buf must contain a serialized merkleblock or header
+// populates the header fields of block without allocating memory (hashes and flags are set to NULL), and returns true
+// on success, useful for processing large batches of headers
+int BRMerkleBlockParseHeader(BRMerkleBlock *block, const uint8_t *buf, size_t bufLen);
+
+typedef struct BRHeaderParserStruct BRHeaderParser;
+
+// returns a pool of worker threads for BRMerkleBlockParseHeaders(), that spreads each call over up to threadCount
+// threads counting the calling one (0 for one per cpu core), the workers are started on first use and can be shared
+// by any number of threads, the pool must be freed by calling BRHeaderParserFree()
+BRHeaderParser *BRHeaderParserNew(int threadCount);
+
+// parses count consecutive serialized headers, each headerLen bytes long (80, or 81 in a "headers" message), from buf
+// into blocks with BRMerkleBlockParseHeader(), and checks them with BRMerkleBlockIsValid(), spreading the work over the
+// worker threads of parser, or parsing on the calling thread if parser is NULL or there are too few headers to split
+// returns the number of leading headers that were successfully parsed and are valid
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock blocks[], size_t count, const uint8_t *buf, size_t headerLen,
+                                 uint32_t currentTime, BRHeaderParser *parser);
+
+// stops the worker threads of parser and frees it, no BRMerkleBlockParseHeaders() call may be using it
+void BRHeaderParserFree(BRHeaderParser *parser);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen);
 
@@ -77,6 +99,10 @@ size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size
 void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size_t hashesCount,
                               const uint8_t *flags, size_t flagsLen);
 
+// sets totalTx and the partial merkle tree for a block created with BRMerkleBlockNew(), given the hashes of all the
+// transactions in the block, so that BRMerkleBlockTxHashes() returns the hashes of those with a true matches[] value
+void BRMerkleBlockSetPartialTree(BRMerkleBlock *block, const UInt256 txHashes[], const int matches[], size_t txCount);
+
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
 // NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
 // target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
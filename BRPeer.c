@@ -24,6 +24,8 @@
 
 #include "BRPeer.h"
 #include "BRMerkleBlock.h"
+#include "BRBlockFilter.h"
+#include "BRBloomFilter.h"
 #include "BRAddress.h"
 #include "BRSet.h"
 #include "BRArray.h"
@@ -31,6 +33,7 @@
 #include "BRInt.h"
 #include <stdlib.h>
 #include <float.h>
+#include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
@@ -46,6 +49,7 @@
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000
 #define MAX_GETDATA_HASHES 50000
+#define MAX_FILTERADD_LENGTH 520 // BIP37 limits filteradd elements to the maximum script element size
 #define ENABLED_SERVICES   0ULL  // we don't provide full blocks to remote nodes
 #define PROTOCOL_VERSION   70013
 #define MIN_PROTO_VERSION  70002 // peers earlier than this protocol version not supported (need v0.9 txFee relay rules)
@@ -53,6 +57,10 @@
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
 #define WITNESS_FLAG       0x40000000
+#define MAX_GETDATA_PENDING 100 // most getdata requests to keep timing while waiting for their last item
+#define KNOWN_TX_RECENT     1000  // most recent tx hashes known to the peer that are kept exactly
+#define KNOWN_TX_GENERATION 10000 // tx hashes per rolling filter generation, between 10,000 and 20,000 are remembered
+#define KNOWN_TX_FP_RATE    0.000001
 
 #define PTHREAD_STACK_SIZE  (512 * 1024)
 
@@ -109,8 +117,11 @@ typedef struct {
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
     UInt256 lastBlockHash;
     BRMerkleBlock *currentBlock;
-    UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
-    BRSet *knownTxHashSet;
+    UInt256 *currentBlockTxHashes, *knownBlockHashes;
+    UInt256 *knownTxRecent; // ring buffer of the last KNOWN_TX_RECENT tx hashes known to the peer
+    size_t knownTxCount; // tx hashes added to knownTxRecent so far, the next one goes at knownTxCount % KNOWN_TX_RECENT
+    BRSet *knownTxRecentSet; // points into knownTxRecent
+    BRBloomFilter *knownTxFilters[2]; // rolling generations of older known tx hashes, [0] is the current generation
     volatile int socket;
     void *info;
     void (*connected)(void *info);
@@ -120,6 +131,13 @@ typedef struct {
     void (*hasTx)(void *info, UInt256 txHash);
     void (*rejectedTx)(void *info, UInt256 txHash, uint8_t code);
     void (*relayedBlock)(void *info, BRMerkleBlock *block);
+    void (*relayedHeaders)(void *info, BRMerkleBlock headers[], size_t headersCount);
+    BRHeaderParser *headerParser;
+    int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount);
+    void (*relayedCFHeaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader, const UInt256 filterHashes[],
+                             size_t filterHashesCount);
+    void (*relayedCFilter)(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen);
+    void (*relayedFullBlock)(void *info, BRMerkleBlock *block, BRTransaction *transactions[], size_t txCount);
     void (*notfound)(void *info, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                      size_t blockCount);
     void (*setFeePerKb)(void *info, uint64_t feePerKb);
@@ -130,6 +148,9 @@ typedef struct {
     void (**volatile pongCallback)(void *info, int success);
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
+    BRPeerMetrics metrics; // counters are updated with atomic adds, so they can be read while the peer is connected
+    UInt256 *getdataHashes; // last item requested by each getdata that's still waiting for it
+    double *getdataTimes; // when each of those getdata requests was sent
     pthread_t thread;
     pthread_mutex_t lock;
 } BRPeerContext;
@@ -138,29 +159,132 @@ void BRPeerSendVersionMessage(BRPeer *peer);
 void BRPeerSendVerackMessage(BRPeer *peer);
 void BRPeerSendAddr(BRPeer *peer);
 
+#define metric_add(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define metric_get(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+static const char *_BRPeerMsgTypeNames[] = {
+    MSG_VERSION, MSG_VERACK, MSG_ADDR, MSG_INV, MSG_GETDATA, MSG_NOTFOUND, MSG_GETBLOCKS, MSG_GETHEADERS, MSG_TX,
+    MSG_BLOCK, MSG_HEADERS, MSG_GETADDR, MSG_MEMPOOL, MSG_PING, MSG_PONG, MSG_FILTERLOAD, MSG_FILTERADD,
+    MSG_FILTERCLEAR, MSG_MERKLEBLOCK, MSG_REJECT, MSG_FEEFILTER, MSG_GETCFILTERS, MSG_CFILTER, MSG_GETCFHEADERS,
+    MSG_CFHEADERS, "other"
+};
+
+inline static double _BRPeerNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+static BRPeerMsgType _BRPeerMsgType(const char *type)
+{
+    BRPeerMsgType i;
+
+    for (i = 0; i < BRPeerMsgOther && strncmp(_BRPeerMsgTypeNames[i], type, 12) != 0; i++);
+    return i;
+}
+
+// notes the last item requested by a getdata, so its round trip time is recorded when that item arrives
+static void _BRPeerGetdataSent(BRPeer *peer, UInt256 lastHash)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    double now = _BRPeerNow();
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if (array_count(ctx->getdataHashes) >= MAX_GETDATA_PENDING) {
+        array_rm(ctx->getdataHashes, 0);
+        array_rm(ctx->getdataTimes, 0);
+    }
+
+    array_add(ctx->getdataHashes, lastHash);
+    array_add(ctx->getdataTimes, now);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// records the round trip time of the getdata whose last requested item is hash, and drops any sent before it, since
+// items arrive in the order they were requested
+static void _BRPeerGetdataReceived(BRPeer *peer, UInt256 hash)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    double sent = 0;
+    size_t i;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (i = 0; i < array_count(ctx->getdataHashes) && ! UInt256Eq(ctx->getdataHashes[i], hash); i++);
+
+    if (i < array_count(ctx->getdataHashes)) {
+        sent = ctx->getdataTimes[i];
+        array_rm_range(ctx->getdataHashes, 0, i + 1);
+        array_rm_range(ctx->getdataTimes, 0, i + 1);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+    if (sent > 0) BRPeerHistogramAdd(&ctx->metrics.getdataTime, _BRPeerNow() - sent);
+}
+
 inline static int _BRPeerIsIPv4(const BRPeer *peer)
 {
     return (peer->address.u64[0] == 0 && peer->address.u16[4] == 0 && peer->address.u16[5] == 0xffff);
 }
 
-static void _BRPeerAddKnownTxHashes(const BRPeer *peer, const UInt256 txHashes[], size_t txCount)
+// true if txHash is one of the most recent tx hashes known to the peer (must hold ctx->lock)
+inline static int _BRPeerKnowsRecentTx(BRPeerContext *ctx, UInt256 txHash)
+{
+    return BRSetContains(ctx->knownTxRecentSet, &txHash);
+}
+
+// true if txHash is known to the peer, or rarely, if it's a false positive of the rolling filter (must hold ctx->lock)
+inline static int _BRPeerKnowsTx(BRPeerContext *ctx, UInt256 txHash)
+{
+    return (BRSetContains(ctx->knownTxRecentSet, &txHash) ||
+            BRBloomFilterContainsData(ctx->knownTxFilters[0], txHash.u8, sizeof(txHash)) ||
+            BRBloomFilterContainsData(ctx->knownTxFilters[1], txHash.u8, sizeof(txHash)));
+}
+
+// adds txHash to the tx hashes known to the peer, which take fixed memory however long the peer stays connected: the
+// most recent are kept exactly, and older ones in two rolling bloom filter generations, the older of which is cleared
+// and reused once the current one is full (must hold ctx->lock)
+static void _BRPeerAddKnownTx(BRPeerContext *ctx, UInt256 txHash)
+{
+    UInt256 *slot = &ctx->knownTxRecent[ctx->knownTxCount % KNOWN_TX_RECENT];
+    BRBloomFilter *filter = ctx->knownTxFilters[0];
+
+    if (ctx->knownTxCount >= KNOWN_TX_RECENT) BRSetRemove(ctx->knownTxRecentSet, slot);
+    *slot = txHash;
+    BRSetAdd(ctx->knownTxRecentSet, slot);
+    ctx->knownTxCount++;
+
+    if (filter->elemCount >= KNOWN_TX_GENERATION) { // start a new generation
+        filter = ctx->knownTxFilters[1];
+        memset(filter->filter, 0, filter->length);
+        filter->elemCount = 0;
+        ctx->knownTxFilters[1] = ctx->knownTxFilters[0];
+        ctx->knownTxFilters[0] = filter;
+    }
+
+    BRBloomFilterInsertData(filter, txHash.u8, sizeof(txHash));
+}
+
+// adds the tx hashes that aren't among the most recent known to the peer, writes them to added unless it's NULL, and
+// returns the number added
+static size_t _BRPeerAddKnownTxHashes(const BRPeer *peer, const UInt256 txHashes[], size_t txCount, UInt256 added[])
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
-    UInt256 *knownTxHashes = ctx->knownTxHashes;
     size_t i, j;
-    
-    for (i = 0; i < txCount; i++) {
-        if (! BRSetContains(ctx->knownTxHashSet, &txHashes[i])) {
-            array_add(knownTxHashes, txHashes[i]);
-            
-            if (ctx->knownTxHashes != knownTxHashes) { // check if knownTxHashes was moved to a new memory location
-                ctx->knownTxHashes = knownTxHashes;
-                BRSetClear(ctx->knownTxHashSet);
-                for (j = array_count(knownTxHashes); j > 0; j--) BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[j - 1]);
-            }
-            else BRSetAdd(ctx->knownTxHashSet, &knownTxHashes[array_count(knownTxHashes) - 1]);
-        }
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (i = 0, j = 0; i < txCount; i++) {
+        if (_BRPeerKnowsRecentTx(ctx, txHashes[i])) continue;
+        _BRPeerAddKnownTx(ctx, txHashes[i]);
+        if (added) added[j] = txHashes[i];
+        j++;
     }
+
+    pthread_mutex_unlock(&ctx->lock);
+    return j;
 }
 
 static void _BRPeerDidConnect(BRPeer *peer)
@@ -284,7 +408,7 @@ static int _BRPeerAcceptAddrMessage(BRPeer *peer, const uint8_t *msg, size_t msg
         size_t peersCount = 0;
         time_t now = time(NULL);
         
-        peer_log(peer, "got addr with %zu address(es)", count);
+        peer_dbg(peer, "got addr with %zu address(es)", count);
 
         for (size_t i = 0; i < count; i++) {
             p.timestamp = UInt32GetLE(&msg[off]);
@@ -328,9 +452,9 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
     else {
         inv_type type;
         const uint8_t *transactions[count], *blocks[count];
-        size_t i, j, txCount = 0, blockCount = 0;
+        size_t i, j, k, txCount = 0, blockCount = 0;
         
-        peer_log(peer, "got inv with %zu item(s)", count);
+        peer_dbg(peer, "got inv with %zu item(s)", count);
 
         for (i = 0; i < count; i++) {
             type = UInt32GetLE(&msg[off]);
@@ -358,7 +482,7 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             r = 0;
         }
         else {
-            if (! ctx->sentFilter && ! ctx->sentGetblocks) blockCount = 0;
+            if (! ctx->sentFilter && ! ctx->sentGetblocks && ! ctx->relayedCFilter) blockCount = 0;
             if (blockCount == 1 && UInt256Eq(ctx->lastBlockHash, UInt256Get(blocks[0]))) blockCount = 0;
             if (blockCount == 1) ctx->lastBlockHash = UInt256Get(blocks[0]);
 
@@ -375,17 +499,24 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             }
         
             if (ctx->needsFilterUpdate) blockCount = 0;
+
+            // the peer manager may spread a batch of block hashes across several peers during chain download
+            if (blockCount > 0 && ctx->relayedBlockHashes &&
+                ctx->relayedBlockHashes(ctx->info, blockHashes, blockCount)) blockCount = 0;
         
-            for (i = 0, j = 0; i < txCount; i++) {
+            pthread_mutex_lock(&ctx->lock);
+
+            // unknown tx hashes go at the start of txHashes to be requested, and recently known ones at the end, to
+            // call hasTx with, older known ones (or rarely, rolling filter false positives) are ignored
+            for (i = 0, j = 0, k = txCount; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
-                
-                if (BRSetContains(ctx->knownTxHashSet, &hash)) {
-                    if (ctx->hasTx) ctx->hasTx(ctx->info, hash);
-                }
-                else txHashes[j++] = hash;
+
+                if (_BRPeerKnowsRecentTx(ctx, hash)) txHashes[--k] = hash;
+                else if (! _BRPeerKnowsTx(ctx, hash)) _BRPeerAddKnownTx(ctx, hash), txHashes[j++] = hash;
             }
-            
-            _BRPeerAddKnownTxHashes(peer, txHashes, j);
+
+            pthread_mutex_unlock(&ctx->lock);
+            for (i = txCount; ctx->hasTx && i > k; i--) ctx->hasTx(ctx->info, txHashes[i - 1]);
             if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
     
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
@@ -429,7 +560,8 @@ static int _BRPeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLe
     }
     else {
         txHash = tx->txHash;
-        peer_log(peer, "got tx: %s", u256hex(txHash));
+        peer_dbg(peer, "got tx: %s", u256hex(txHash));
+        _BRPeerGetdataReceived(peer, txHash);
 
         if (ctx->relayedTx) {
             ctx->relayedTx(ctx->info, tx);
@@ -467,49 +599,71 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
         r = 0;
     }
     else {
-        peer_log(peer, "got %zu header(s)", count);
+        peer_dbg(peer, "got %zu header(s)", count);
     
         // To improve chain download performance, if this message contains 2000 headers then request the next 2000
         // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime
         uint32_t timestamp = (count > 0) ? UInt32GetLE(&msg[off + 81*(count - 1) + 68]) : 0;
     
-        if (count >= 2000 || (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
+        if (ctx->relayedCFilter || count >= 2000 ||
+            (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
             size_t last = 0;
             time_t now = time(NULL);
             UInt256 locators[2];
             
-            BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
-            BRSHA256_2(&locators[1], &msg[off], 80);
+            if (! ctx->relayedCFilter) { // in compact filter mode, the peer manager requests headers as it needs them
+                BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
+                BRSHA256_2(&locators[1], &msg[off], 80);
 
-            if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
-                // request blocks for the remainder of the chain
-                timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
-
-                while (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT < ctx->earliestKeyTime) {
+                if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
+                    // request blocks for the remainder of the chain
                     timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
-                }
+
+                    while (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT < ctx->earliestKeyTime) {
+                        timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
+                    }
                 
-                BRSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
-                BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+                    BRSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
+                    BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+                }
+                else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
             }
-            else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
-            for (size_t i = 0; r && i < count; i++) {
-                BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
+            if (ctx->relayedHeaders) { // parse and validate on the worker pool, then relay all the headers at once
+                BRMerkleBlock *headers = malloc((count > 0 ? count : 1)*sizeof(*headers));
+                size_t headersCount;
                 
-                if (! block) {
-                    peer_log(peer, "malformed headers message with length: %zu", msgLen);
-                    r = 0;
-                }
-                else if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
-                    peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
-                    BRMerkleBlockFree(block);
+                assert(headers != NULL);
+                headersCount = BRMerkleBlockParseHeaders(headers, count, &msg[off], 81, (uint32_t)now,
+                                                         ctx->headerParser);
+                
+                if (headersCount < count) {
+                    peer_log(peer, "invalid block header: %s", u256hex(headers[headersCount].blockHash));
                     r = 0;
                 }
-                else if (ctx->relayedBlock) {
-                    ctx->relayedBlock(ctx->info, block);
+                
+                // in compact filter mode, fewer than 2000 headers (even none) tells the peer manager it has them all
+                if (headersCount > 0 || ctx->relayedCFilter) ctx->relayedHeaders(ctx->info, headers, headersCount);
+                free(headers);
+            }
+            else {
+                for (size_t i = 0; r && i < count; i++) {
+                    BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
+                
+                    if (! block) {
+                        peer_log(peer, "malformed headers message with length: %zu", msgLen);
+                        r = 0;
+                    }
+                    else if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
+                        peer_log(peer, "invalid block header: %s", u256hex(block->blockHash));
+                        BRMerkleBlockFree(block);
+                        r = 0;
+                    }
+                    else if (ctx->relayedBlock) {
+                        ctx->relayedBlock(ctx->info, block);
+                    }
+                    else BRMerkleBlockFree(block);
                 }
-                else BRMerkleBlockFree(block);
             }
         }
         else {
@@ -521,6 +675,129 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
     return r;
 }
 
+static int _BRPeerAcceptBlockMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRMerkleBlock *block = NULL;
+    BRTransaction **transactions = NULL;
+    size_t i, len = 0, off = 80, count = 0;
+    int r = 1;
+    
+    if (! ctx->relayedFullBlock) {
+        peer_log(peer, "dropping block message, full blocks weren't requested");
+    }
+    else {
+        if (off <= msgLen) count = (size_t)BRVarInt(&msg[off], msgLen - off, &len);
+        off += len;
+        
+        if (len == 0 || count == 0 || off + count*10 > msgLen) { // a tx is at least 10 bytes
+            peer_log(peer, "malformed block message with length: %zu", msgLen);
+            r = 0;
+        }
+        else {
+            block = BRMerkleBlockNew();
+            transactions = calloc(count, sizeof(*transactions));
+            assert(transactions != NULL);
+            if (! BRMerkleBlockParseHeader(block, msg, 80)) r = 0;
+
+            for (i = 0; r && i < count; i++) {
+                transactions[i] = BRTransactionParse(&msg[off], msgLen - off);
+                if (! transactions[i] || ! BRTransactionIsSigned(transactions[i])) r = 0;
+                if (r) off += BRTransactionSerialize(transactions[i], NULL, 0);
+            }
+            
+            if (! r || off != msgLen) {
+                peer_log(peer, "malformed block message with length: %zu", msgLen);
+                r = 0;
+            }
+            else if (! BRMerkleBlockIsValid(block, (uint32_t)time(NULL))) { // merkle root is checked by the receiver
+                peer_log(peer, "invalid block: %s", u256hex(block->blockHash));
+                r = 0;
+            }
+            
+            if (! r) {
+                for (i = 0; i < count; i++) {
+                    if (transactions[i]) BRTransactionFree(transactions[i]);
+                }
+                
+                BRMerkleBlockFree(block);
+            }
+            else {
+                peer_dbg(peer, "got block %s with %zu tx", u256hex(block->blockHash), count);
+                _BRPeerGetdataReceived(peer, block->blockHash);
+                block->totalTx = (uint32_t)count;
+                ctx->relayedFullBlock(ctx->info, block, transactions, count);
+            }
+            
+            free(transactions);
+        }
+    }
+    
+    return r;
+}
+
+static int _BRPeerAcceptCFHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t i, len = 0, off = 1 + 2*sizeof(UInt256), count = 0;
+    int r = 1;
+    
+    if (off <= msgLen) count = (size_t)BRVarInt(&msg[off], msgLen - off, &len);
+    off += len;
+    
+    if (len == 0 || off + count*sizeof(UInt256) > msgLen) {
+        peer_log(peer, "malformed cfheaders message, length is %zu, should be %zu for %zu filter hash(es)", msgLen,
+                 1 + 2*sizeof(UInt256) + BRVarIntSize(count) + count*sizeof(UInt256), count);
+        r = 0;
+    }
+    else if (msg[0] != BLOCK_FILTER_BASIC) {
+        peer_log(peer, "dropping cfheaders message, unknown filter type %d", msg[0]);
+    }
+    else {
+        UInt256 *filterHashes = malloc((count > 0 ? count : 1)*sizeof(*filterHashes));
+        
+        assert(filterHashes != NULL);
+        peer_dbg(peer, "got cfheaders with %zu filter hash(es)", count);
+        
+        for (i = 0; i < count; i++) {
+            filterHashes[i] = UInt256Get(&msg[off]);
+            off += sizeof(UInt256);
+        }
+        
+        if (ctx->relayedCFHeaders) {
+            ctx->relayedCFHeaders(ctx->info, UInt256Get(&msg[1]), UInt256Get(&msg[1 + sizeof(UInt256)]), filterHashes,
+                                  count);
+        }
+        
+        free(filterHashes);
+    }
+    
+    return r;
+}
+
+static int _BRPeerAcceptCFilterMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t len = 0, off = 1 + sizeof(UInt256), filterLen = 0;
+    int r = 1;
+    
+    if (off <= msgLen) filterLen = (size_t)BRVarInt(&msg[off], msgLen - off, &len);
+    off += len;
+    
+    if (len == 0 || off + filterLen > msgLen) {
+        peer_log(peer, "malformed cfilter message with length: %zu", msgLen);
+        r = 0;
+    }
+    else if (msg[0] != BLOCK_FILTER_BASIC) {
+        peer_log(peer, "dropping cfilter message, unknown filter type %d", msg[0]);
+    }
+    else if (ctx->relayedCFilter) {
+        ctx->relayedCFilter(ctx->info, UInt256Get(&msg[1]), &msg[off], filterLen);
+    }
+    
+    return r;
+}
+
 static int _BRPeerAcceptGetaddrMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen)
 {
     peer_log(peer, "got getaddr");
@@ -546,7 +823,7 @@ static int _BRPeerAcceptGetdataMessage(BRPeer *peer, const uint8_t *msg, size_t
         struct inv_item { uint8_t item[36]; } *notfound = NULL;
         BRTransaction *tx = NULL;
         
-        peer_log(peer, "got getdata with %zu item(s)", count);
+        peer_dbg(peer, "got getdata with %zu item(s)", count);
         
         for (size_t i = 0; i < count; i++) {
             inv_type type = UInt32GetLE(&msg[off]);
@@ -616,14 +893,15 @@ static int _BRPeerAcceptNotfoundMessage(BRPeer *peer, const uint8_t *msg, size_t
         inv_type type;
         UInt256 *txHashes, *blockHashes, hash;
         
-        peer_log(peer, "got notfound with %zu item(s)", count);
+        peer_dbg(peer, "got notfound with %zu item(s)", count);
         array_new(txHashes, 1);
         array_new(blockHashes, 1);
         
         for (size_t i = 0; i < count; i++) {
             type = UInt32GetLE(&msg[off]);
             hash = UInt256Get(&msg[off + sizeof(uint32_t)]);
-            
+            _BRPeerGetdataReceived(peer, hash);
+
             switch (type) {
                 case inv_witness_tx: // drop through
                 case inv_tx: array_add(txHashes, hash); break;
@@ -657,7 +935,7 @@ static int _BRPeerAcceptPingMessage(BRPeer *peer, const uint8_t *msg, size_t msg
         r = 0;
     }
     else {
-        peer_log(peer, "got ping");
+        peer_dbg(peer, "got ping");
         BRPeerSendMessage(peer, msg, msgLen, MSG_PONG);
     }
 
@@ -691,9 +969,9 @@ static int _BRPeerAcceptPongMessage(BRPeer *peer, const uint8_t *msg, size_t msg
             // 50% low pass filter on current ping time
             ctx->pingTime = ctx->pingTime*0.5 + pingTime*0.5;
             ctx->startTime = 0;
-            peer_log(peer, "got pong in %fs", pingTime);
+            peer_dbg(peer, "got pong in %fs", pingTime);
         }
-        else peer_log(peer, "got pong");
+        else peer_dbg(peer, "got pong");
 
         if (array_count(ctx->pongCallback) > 0) {
             void (*pongCallback)(void *, int) = ctx->pongCallback[0];
@@ -739,13 +1017,19 @@ static int _BRPeerAcceptMerkleblockMessage(BRPeer *peer, const uint8_t *msg, siz
                 *hashes = (sizeof(UInt256)*count <= 0x1000) ? _hashes : malloc(count*sizeof(*hashes));
         
         assert(hashes != NULL);
+        _BRPeerGetdataReceived(peer, block->blockHash);
         count = BRMerkleBlockTxHashes(block, hashes, count);
 
+        pthread_mutex_lock(&ctx->lock);
+
+        // only skip tx hashes recently known exactly, a rolling filter false positive would silently drop a matched tx
         for (size_t i = count; i > 0; i--) { // reverse order for more efficient removal as tx arrive
-            if (BRSetContains(ctx->knownTxHashSet, &hashes[i - 1])) continue;
+            if (_BRPeerKnowsRecentTx(ctx, hashes[i - 1])) continue;
             array_add(ctx->currentBlockTxHashes, hashes[i - 1]);
         }
 
+        pthread_mutex_unlock(&ctx->lock);
+
         if (hashes != _hashes) free(hashes);
     }
 
@@ -860,11 +1144,31 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     else if (strncmp(MSG_MERKLEBLOCK, type, 12) == 0) r = _BRPeerAcceptMerkleblockMessage(peer, msg, msgLen);
     else if (strncmp(MSG_REJECT, type, 12) == 0) r = _BRPeerAcceptRejectMessage(peer, msg, msgLen);
     else if (strncmp(MSG_FEEFILTER, type, 12) == 0) r = _BRPeerAcceptFeeFilterMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_BLOCK, type, 12) == 0) r = _BRPeerAcceptBlockMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFHEADERS, type, 12) == 0) r = _BRPeerAcceptCFHeadersMessage(peer, msg, msgLen);
+    else if (strncmp(MSG_CFILTER, type, 12) == 0) r = _BRPeerAcceptCFilterMessage(peer, msg, msgLen);
     else peer_log(peer, "dropping %s, length %zu, not implemented", type, msgLen);
 
     return r;
 }
 
+// accepts a received message, and counts it along with the time spent handling it
+static int _BRPeerHandleMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerMsgType msgType = _BRPeerMsgType(type);
+    double start = _BRPeerNow(), elapsed;
+    int r = _BRPeerAcceptMessage(peer, msg, msgLen, type);
+
+    elapsed = _BRPeerNow() - start;
+    metric_add(ctx->metrics.bytesIn[msgType], HEADER_LENGTH + msgLen);
+    metric_add(ctx->metrics.messagesIn[msgType], 1);
+    metric_add(ctx->metrics.handleUsec[msgType], (uint64_t)(elapsed*1000000));
+    BRPeerHistogramAdd(&ctx->metrics.handleTime, elapsed);
+    if (! r) metric_add(ctx->metrics.protocolErrors, 1);
+    return r;
+}
+
 static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -1079,7 +1383,7 @@ static void *_peerThreadRoutine(void *arg)
                                      ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256hex(hash));
                             error = EPROTO;
                         }
-                        else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
+                        else if (! _BRPeerHandleMessage(peer, payload, msgLen, type)) error = EPROTO;
                     }
                 }
             }
@@ -1090,10 +1394,11 @@ static void *_peerThreadRoutine(void *arg)
 
     pthread_mutex_lock(&ctx->lock);
     socket = ctx->socket;
+    ctx->socket = -1;
     ctx->status = BRPeerStatusDisconnected;
     pthread_mutex_unlock(&ctx->lock);
 
-    if (socket >= 0) close(socket);
+    if (socket >= 0) close(socket); // only the peer thread closes the socket, so its descriptor can't be reused early
     peer_log(peer, "disconnected");
     
     while (array_count(ctx->pongCallback) > 0) {
@@ -1126,10 +1431,15 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     array_new(ctx->useragent, 40);
     array_new(ctx->knownBlockHashes, 10);
     array_new(ctx->currentBlockTxHashes, 10);
-    array_new(ctx->knownTxHashes, 10);
-    ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    ctx->knownTxRecent = calloc(KNOWN_TX_RECENT, sizeof(*ctx->knownTxRecent));
+    assert(ctx->knownTxRecent != NULL);
+    ctx->knownTxRecentSet = BRSetNew(BRTransactionHash, BRTransactionEq, KNOWN_TX_RECENT);
+    ctx->knownTxFilters[0] = BRBloomFilterNew(KNOWN_TX_FP_RATE, KNOWN_TX_GENERATION, BRRand(0), BLOOM_UPDATE_NONE);
+    ctx->knownTxFilters[1] = BRBloomFilterNew(KNOWN_TX_FP_RATE, KNOWN_TX_GENERATION, BRRand(0), BLOOM_UPDATE_NONE);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
+    array_new(ctx->getdataHashes, 10);
+    array_new(ctx->getdataTimes, 10);
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
@@ -1191,6 +1501,50 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
     ctx->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// int relayedBlockHashes(void *, const UInt256[], size_t) - if not NULL, called with the block hashes of an "inv"
+//   message, returns true if the caller will request the blocks itself, otherwise they're requested from peer as usual
+void BRPeerSetRelayedBlockHashesCallback(BRPeer *peer,
+                                         int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[],
+                                                                   size_t blockCount))
+{
+    ((BRPeerContext *)peer)->relayedBlockHashes = relayedBlockHashes;
+}
+
+// void relayedHeaders(void *, BRMerkleBlock[], size_t) - if not NULL, called once with all the valid headers of a
+//   "headers" message instead of calling relayedBlock for each one, the headers are only valid during the call
+// parser - if not NULL, the worker pool the headers are parsed and validated on, which must outlive peer's connection
+void BRPeerSetRelayedHeadersCallback(BRPeer *peer,
+                                     void (*relayedHeaders)(void *info, BRMerkleBlock headers[], size_t headersCount),
+                                     BRHeaderParser *parser)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+
+    ctx->relayedHeaders = relayedHeaders;
+    ctx->headerParser = parser;
+}
+
+// switches peer to BIP157 compact filter mode, in which the caller requests headers, filters and full blocks as needed
+// void relayedCFHeaders(void *, UInt256, UInt256, const UInt256[], size_t) - called when a "cfheaders" message is
+//   received from peer, with the stop hash, the previous filter header, and the filter hashes
+// void relayedCFilter(void *, UInt256, const uint8_t *, size_t) - called when a "cfilter" message is received from
+//   peer, the filter is only valid during the call
+// void relayedFullBlock(void *, BRMerkleBlock *, BRTransaction *[], size_t) - called when a "block" message is received
+//   from peer, with the block header (including totalTx) and all its transactions, which the callee must free
+void BRPeerSetCompactFilterCallbacks(BRPeer *peer,
+                                     void (*relayedCFHeaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                                              const UInt256 filterHashes[], size_t filterHashesCount),
+                                     void (*relayedCFilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                            size_t filterLen),
+                                     void (*relayedFullBlock)(void *info, BRMerkleBlock *block,
+                                                              BRTransaction *transactions[], size_t txCount))
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    ctx->relayedCFHeaders = relayedCFHeaders;
+    ctx->relayedCFilter = relayedCFilter;
+    ctx->relayedFullBlock = relayedFullBlock;
+}
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime)
 {
@@ -1271,8 +1625,8 @@ void BRPeerDisconnect(BRPeer *peer)
         ctx->status = BRPeerStatusDisconnected;
         pthread_mutex_unlock(&ctx->lock);
 
+        // wakes the peer thread, which closes the socket when it exits
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
-        close(socket);
     }
 }
 
@@ -1346,6 +1700,70 @@ uint64_t BRPeerFeePerKb(BRPeer *peer)
     return feePerKb;
 }
 
+// a snapshot of the counters for peer, safe to call from any thread while peer is connected
+BRPeerMetrics BRPeerGetMetrics(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerMetrics metrics;
+    const uint64_t *src = (const uint64_t *)&ctx->metrics.bytesIn;
+    uint64_t *dst = (uint64_t *)&metrics.bytesIn;
+    size_t i, count = (sizeof(metrics) - offsetof(BRPeerMetrics, bytesIn))/sizeof(uint64_t);
+    double startTime = ctx->startTime;
+
+    assert(peer != NULL);
+    // every counter after connectedTime is a uint64_t, copied one at a time so none of them is read torn
+    for (i = 0; i < count; i++) dst[i] = metric_get(src[i]);
+    metrics.address = peer->address;
+    metrics.port = peer->port;
+    metrics.connectedTime = (startTime > 0) ? _BRPeerNow() - startTime : 0;
+    return metrics;
+}
+
+// adds count to the bloom filter false positives counted for peer
+void BRPeerAddFalsePositives(BRPeer *peer, size_t count)
+{
+    assert(peer != NULL);
+    metric_add(((BRPeerContext *)peer)->metrics.falsePositives, count);
+}
+
+// name of a message type counted in BRPeerMetrics
+const char *BRPeerMsgTypeName(BRPeerMsgType type)
+{
+    return (type < BRPeerMsgTypeCount) ? _BRPeerMsgTypeNames[type] : NULL;
+}
+
+// adds a sample of the given number of seconds to histogram, the caller must serialize calls for the same histogram
+void BRPeerHistogramAdd(BRPeerHistogram *histogram, double seconds)
+{
+    uint64_t usec = (seconds > 0) ? (uint64_t)(seconds*1000000) : 0;
+    size_t i = 0;
+
+    assert(histogram != NULL);
+    while (i + 1 < PEER_HISTOGRAM_BUCKETS && (usec >> i) > 0) i++;
+    metric_add(histogram->buckets[i], 1);
+    metric_add(histogram->totalUsec, usec);
+    metric_add(histogram->count, 1);
+    if (usec > metric_get(histogram->maxUsec)) __atomic_store_n(&histogram->maxUsec, usec, __ATOMIC_RELAXED);
+}
+
+// returns the upper bound in seconds of the bucket containing the given percentile (0 to 100) of the samples
+double BRPeerHistogramPercentile(const BRPeerHistogram *histogram, double percentile)
+{
+    uint64_t n = 0, rank = (uint64_t)(histogram->count*percentile/100.0 + 0.5);
+    size_t i;
+
+    assert(histogram != NULL);
+    if (histogram->count == 0) return 0;
+    if (rank == 0) rank = 1;
+
+    for (i = 0; i + 1 < PEER_HISTOGRAM_BUCKETS; i++) {
+        n += histogram->buckets[i];
+        if (n >= rank) break;
+    }
+
+    return (i + 1 < PEER_HISTOGRAM_BUCKETS) ? (double)(1ULL << i)/1000000 : (double)histogram->maxUsec/1000000;
+}
+
 #ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
 #define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
 #endif
@@ -1374,7 +1792,7 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
         memcpy(&buf[off], hash, sizeof(uint32_t));
         off += sizeof(uint32_t);
         memcpy(&buf[off], msg, msgLen);
-        peer_log(peer, "sending %s", type);
+        peer_dbg(peer, "sending %s", type);
         msgLen = 0;
         socket = _peerGetSocket(ctx);
         if (socket < 0) error = ENOTCONN;
@@ -1392,6 +1810,12 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
             peer_log(peer, "%s", strerror(error));
             BRPeerDisconnect(peer);
         }
+        else {
+            BRPeerMsgType msgType = _BRPeerMsgType(type);
+
+            metric_add(ctx->metrics.bytesOut[msgType], sizeof(buf));
+            metric_add(ctx->metrics.messagesOut[msgType], 1);
+        }
     }
 }
 
@@ -1453,6 +1877,25 @@ void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen)
     BRPeerSendMessage(peer, filter, filterLen, MSG_FILTERLOAD);
 }
 
+void BRPeerSendFilteradd(BRPeer *peer, const uint8_t *data, size_t dataLen)
+{
+    size_t off = 0, msgLen = BRVarIntSize(dataLen) + dataLen;
+    uint8_t msg[msgLen];
+
+    assert(data != NULL || dataLen == 0);
+    assert(((BRPeerContext *)peer)->sentFilter); // peers treat filteradd without a loaded filter as misbehavior
+
+    if (dataLen > MAX_FILTERADD_LENGTH) {
+        peer_log(peer, "couldn't send filteradd, %zu bytes is too long, max is %d", dataLen, MAX_FILTERADD_LENGTH);
+    }
+    else {
+        off += BRVarIntSet(&msg[off], msgLen - off, dataLen);
+        memcpy(&msg[off], data, dataLen);
+        off += dataLen;
+        BRPeerSendMessage(peer, msg, off, MSG_FILTERADD);
+    }
+}
+
 void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success))
 {
@@ -1463,7 +1906,7 @@ void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t known
     ctx->sentMempool = 1;
     
     if (! sentMempool && ! ctx->mempoolCallback) {
-        _BRPeerAddKnownTxHashes(peer, knownTxHashes, knownTxCount);
+        _BRPeerAddKnownTxHashes(peer, knownTxHashes, knownTxCount, NULL);
         
         if (completionCallback) {
             gettimeofday(&tv, NULL);
@@ -1536,11 +1979,9 @@ void BRPeerSendGetblocks(BRPeer *peer, const UInt256 locators[], size_t locators
 
 void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
 {
-    BRPeerContext *ctx = (BRPeerContext *)peer;
-    size_t knownCount = array_count(ctx->knownTxHashes);
+    UInt256 added[(txCount > 0) ? txCount : 1];
 
-    _BRPeerAddKnownTxHashes(peer, txHashes, txCount);
-    txCount = array_count(ctx->knownTxHashes) - knownCount;
+    txCount = _BRPeerAddKnownTxHashes(peer, txHashes, txCount, added);
 
     if (txCount > 0) {
         size_t i, off = 0, msgLen = BRVarIntSize(txCount) + (sizeof(uint32_t) + sizeof(*txHashes))*txCount;
@@ -1551,7 +1992,7 @@ void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
         for (i = 0; i < txCount; i++) {
             UInt32SetLE(&msg[off], inv_tx);
             off += sizeof(uint32_t);
-            UInt256Set(&msg[off], ctx->knownTxHashes[knownCount + i]);
+            UInt256Set(&msg[off], added[i]);
             off += sizeof(UInt256);
         }
 
@@ -1588,10 +2029,59 @@ void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, c
         }
         
         ((BRPeerContext *)peer)->sentGetdata = 1;
+        _BRPeerGetdataSent(peer, (blockCount > 0) ? blockHashes[blockCount - 1] : txHashes[txCount - 1]);
+        BRPeerSendMessage(peer, msg, off, MSG_GETDATA);
+    }
+}
+
+void BRPeerSendGetdataBlocks(BRPeer *peer, const UInt256 blockHashes[], size_t blockCount)
+{
+    size_t i, off = 0;
+    
+    if (blockCount > MAX_GETDATA_HASHES) { // limit total hash count to MAX_GETDATA_HASHES
+        peer_log(peer, "couldn't send getdata, %zu is too many items, max is %d", blockCount, MAX_GETDATA_HASHES);
+    }
+    else if (blockCount > 0) {
+        size_t msgLen = BRVarIntSize(blockCount) + (sizeof(uint32_t) + sizeof(UInt256))*blockCount;
+        uint8_t msg[msgLen];
+        
+        off += BRVarIntSet(&msg[off], (off <= msgLen ? msgLen - off : 0), blockCount);
+        
+        for (i = 0; i < blockCount; i++) {
+            UInt32SetLE(&msg[off], inv_witness_block);
+            off += sizeof(uint32_t);
+            UInt256Set(&msg[off], blockHashes[i]);
+            off += sizeof(UInt256);
+        }
+        
+        ((BRPeerContext *)peer)->sentGetdata = 1;
+        _BRPeerGetdataSent(peer, blockHashes[blockCount - 1]);
         BRPeerSendMessage(peer, msg, off, MSG_GETDATA);
     }
 }
 
+void BRPeerSendGetcfheaders(BRPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    uint8_t msg[1 + sizeof(uint32_t) + sizeof(UInt256)];
+    
+    msg[0] = BLOCK_FILTER_BASIC;
+    UInt32SetLE(&msg[1], startHeight);
+    UInt256Set(&msg[1 + sizeof(uint32_t)], stopHash);
+    peer_log(peer, "calling getcfheaders from height %"PRIu32" to block %s", startHeight, u256hex(stopHash));
+    BRPeerSendMessage(peer, msg, sizeof(msg), MSG_GETCFHEADERS);
+}
+
+void BRPeerSendGetcfilters(BRPeer *peer, uint32_t startHeight, UInt256 stopHash)
+{
+    uint8_t msg[1 + sizeof(uint32_t) + sizeof(UInt256)];
+    
+    msg[0] = BLOCK_FILTER_BASIC;
+    UInt32SetLE(&msg[1], startHeight);
+    UInt256Set(&msg[1 + sizeof(uint32_t)], stopHash);
+    peer_log(peer, "calling getcfilters from height %"PRIu32" to block %s", startHeight, u256hex(stopHash));
+    BRPeerSendMessage(peer, msg, sizeof(msg), MSG_GETCFILTERS);
+}
+
 void BRPeerSendGetaddr(BRPeer *peer)
 {
     ((BRPeerContext *)peer)->sentGetaddr = 1;
@@ -1634,10 +2124,14 @@ void BRPeerFree(BRPeer *peer)
     if (ctx->useragent) array_free(ctx->useragent);
     if (ctx->currentBlockTxHashes) array_free(ctx->currentBlockTxHashes);
     if (ctx->knownBlockHashes) array_free(ctx->knownBlockHashes);
-    if (ctx->knownTxHashes) array_free(ctx->knownTxHashes);
-    if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
+    if (ctx->knownTxRecent) free(ctx->knownTxRecent);
+    if (ctx->knownTxRecentSet) BRSetFree(ctx->knownTxRecentSet);
+    if (ctx->knownTxFilters[0]) BRBloomFilterFree(ctx->knownTxFilters[0]);
+    if (ctx->knownTxFilters[1]) BRBloomFilterFree(ctx->knownTxFilters[1]);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
+    if (ctx->getdataHashes) array_free(ctx->getdataHashes);
+    if (ctx->getdataTimes) array_free(ctx->getdataTimes);
     
     pthread_mutex_destroy(&ctx->lock);
     free(ctx);
@@ -1647,3 +2141,20 @@ void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t msgLen, co
 {
     _BRPeerAcceptMessage(peer, msg, msgLen, type);
 }
+
+void BRPeerAddKnownTxTest(BRPeer *peer, const UInt256 txHashes[], size_t txCount)
+{
+    _BRPeerAddKnownTxHashes(peer, txHashes, txCount, NULL);
+}
+
+// returns 2 if txHash is among the most recent tx hashes known to peer, 1 if it's only in the rolling filter, else 0
+int BRPeerKnowsTxTest(BRPeer *peer, UInt256 txHash)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int r;
+
+    pthread_mutex_lock(&ctx->lock);
+    r = (_BRPeerKnowsRecentTx(ctx, txHash)) ? 2 : (_BRPeerKnowsTx(ctx, txHash)) ? 1 : 0;
+    pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
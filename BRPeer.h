@@ -29,25 +29,19 @@
 #include "BRMerkleBlock.h"
 #include "BRAddress.h"
 #include "BRInt.h"
+#include "BRLog.h"
 #include <stddef.h>
 #include <inttypes.h>
 
-#define peer_log(peer, ...) _peer_log("%s:%"PRIu16" " _va_first(__VA_ARGS__, NULL) "\n", BRPeerHost(peer),\
-                                      (peer)->port, _va_rest(__VA_ARGS__, NULL))
+// peer_log() and peer_dbg() queue a message prefixed with the peer's address on the BRLog ring buffer, at info and
+// debug level respectively, so they don't block on output and are cheap to call while holding a lock
+#define peer_log(peer, ...) _peer_log(BRLogLevelInfo, peer, __VA_ARGS__)
+#define peer_dbg(peer, ...) _peer_log(BRLogLevelDebug, peer, __VA_ARGS__)
+#define _peer_log(level, peer, ...) br_log((level), "%s:%"PRIu16" " _va_first(__VA_ARGS__, NULL), BRPeerHost(peer),\
+                                          (peer)->port, _va_rest(__VA_ARGS__, NULL))
 #define _va_first(first, ...) first
 #define _va_rest(first, ...) __VA_ARGS__
 
-#if defined(TARGET_OS_MAC)
-#include <Foundation/Foundation.h>
-#define _peer_log(...) NSLog(__VA_ARGS__)
-#elif defined(__ANDROID__)
-#include <android/log.h>
-#define _peer_log(...) __android_log_print(ANDROID_LOG_INFO, "bread", __VA_ARGS__)
-#else
-#include <stdio.h>
-#define _peer_log(...) printf(__VA_ARGS__)
-#endif
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -56,6 +50,7 @@ extern "C" {
 #define SERVICES_NODE_BLOOM   0x04 // BIP111: https://github.com/bitcoin/bips/blob/master/bip-0111.mediawiki
 #define SERVICES_NODE_WITNESS 0x08 // BIP144: https://github.com/bitcoin/bips/blob/master/bip-0144.mediawiki
 #define SERVICES_NODE_BCASH   0x20 // https://github.com/Bitcoin-UAHF/spec/blob/master/uahf-technical-spec.md
+#define SERVICES_NODE_COMPACT_FILTERS 0x40 // BIP157: https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
     
 #define BR_VERSION "2.1"
 #define USER_AGENT "/bread:" BR_VERSION "/"
@@ -83,6 +78,10 @@ extern "C" {
 #define MSG_ALERT       "alert"
 #define MSG_REJECT      "reject"   // described in BIP61: https://github.com/bitcoin/bips/blob/master/bip-0061.mediawiki
 #define MSG_FEEFILTER   "feefilter"// described in BIP133 https://github.com/bitcoin/bips/blob/master/bip-0133.mediawiki
+#define MSG_GETCFILTERS  "getcfilters" // described in BIP157 https://github.com/bitcoin/bips/blob/master/bip-0157.mediawiki
+#define MSG_CFILTER      "cfilter"
+#define MSG_GETCFHEADERS "getcfheaders"
+#define MSG_CFHEADERS    "cfheaders"
 
 #define REJECT_INVALID     0x10 // transaction is invalid for some reason (invalid signature, output value > input, etc)
 #define REJECT_SPENT       0x12 // an input is already spent
@@ -106,6 +105,64 @@ typedef struct {
 
 #define BR_PEER_NONE ((const BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+// message types counted separately in BRPeerMetrics, any other type is counted as BRPeerMsgOther
+typedef enum {
+    BRPeerMsgVersion = 0,
+    BRPeerMsgVerack,
+    BRPeerMsgAddr,
+    BRPeerMsgInv,
+    BRPeerMsgGetdata,
+    BRPeerMsgNotfound,
+    BRPeerMsgGetblocks,
+    BRPeerMsgGetheaders,
+    BRPeerMsgTx,
+    BRPeerMsgBlock,
+    BRPeerMsgHeaders,
+    BRPeerMsgGetaddr,
+    BRPeerMsgMempool,
+    BRPeerMsgPing,
+    BRPeerMsgPong,
+    BRPeerMsgFilterload,
+    BRPeerMsgFilteradd,
+    BRPeerMsgFilterclear,
+    BRPeerMsgMerkleblock,
+    BRPeerMsgReject,
+    BRPeerMsgFeefilter,
+    BRPeerMsgGetcfilters,
+    BRPeerMsgCfilter,
+    BRPeerMsgGetcfheaders,
+    BRPeerMsgCfheaders,
+    BRPeerMsgOther,
+    BRPeerMsgTypeCount
+} BRPeerMsgType;
+
+#define PEER_HISTOGRAM_BUCKETS 24
+
+// distribution of durations, bucket i counts the samples shorter than 2^i microseconds that aren't in bucket i - 1, and
+// the last bucket also counts everything longer
+typedef struct {
+    uint64_t count;
+    uint64_t totalUsec;
+    uint64_t maxUsec;
+    uint64_t buckets[PEER_HISTOGRAM_BUCKETS];
+} BRPeerHistogram;
+
+// counters for one peer connection, arrival rates are the message counts divided by connectedTime
+typedef struct {
+    UInt128 address;
+    uint16_t port;
+    double connectedTime; // seconds since the connection was opened, or 0 if it hasn't been
+    uint64_t bytesIn[BRPeerMsgTypeCount]; // including message headers
+    uint64_t bytesOut[BRPeerMsgTypeCount];
+    uint64_t messagesIn[BRPeerMsgTypeCount];
+    uint64_t messagesOut[BRPeerMsgTypeCount];
+    uint64_t handleUsec[BRPeerMsgTypeCount]; // total time spent handling received messages of each type
+    BRPeerHistogram handleTime; // time spent handling each received message
+    BRPeerHistogram getdataTime; // time from sending a getdata until the last item it requested arrives
+    uint64_t falsePositives; // tx matched by the bloom filter that weren't wallet tx, as reported by BRPeerManager
+    uint64_t protocolErrors; // received messages rejected as malformed or unexpected
+} BRPeerMetrics;
+
 // NOTE: BRPeer functions are not thread-safe
 
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
@@ -138,6 +195,34 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         int (*networkIsReachable)(void *info),
                         void (*threadCleanup)(void *info));
 
+// int relayedBlockHashes(void *, const UInt256[], size_t) - if not NULL, called with the block hashes of an "inv"
+//   message, returns true if the caller will request the blocks itself, otherwise they're requested from peer as usual
+void BRPeerSetRelayedBlockHashesCallback(BRPeer *peer,
+                                         int (*relayedBlockHashes)(void *info, const UInt256 blockHashes[],
+                                                                   size_t blockCount));
+
+// void relayedHeaders(void *, BRMerkleBlock[], size_t) - if not NULL, called once with all the valid headers of a
+//   "headers" message instead of calling relayedBlock for each one, the headers are only valid during the call
+// parser - if not NULL, the worker pool the headers are parsed and validated on, which must outlive peer's connection
+void BRPeerSetRelayedHeadersCallback(BRPeer *peer,
+                                     void (*relayedHeaders)(void *info, BRMerkleBlock headers[], size_t headersCount),
+                                     BRHeaderParser *parser);
+
+// switches peer to BIP157 compact filter mode, in which the caller requests headers, filters and full blocks as needed
+// void relayedCFHeaders(void *, UInt256, UInt256, const UInt256[], size_t) - called when a "cfheaders" message is
+//   received from peer, with the stop hash, the previous filter header, and the filter hashes
+// void relayedCFilter(void *, UInt256, const uint8_t *, size_t) - called when a "cfilter" message is received from
+//   peer, the filter is only valid during the call
+// void relayedFullBlock(void *, BRMerkleBlock *, BRTransaction *[], size_t) - called when a "block" message is received
+//   from peer, with the block header (including totalTx) and all its transactions, which the callee must free
+void BRPeerSetCompactFilterCallbacks(BRPeer *peer,
+                                     void (*relayedCFHeaders)(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                                              const UInt256 filterHashes[], size_t filterHashesCount),
+                                     void (*relayedCFilter)(void *info, UInt256 blockHash, const uint8_t *filter,
+                                                            size_t filterLen),
+                                     void (*relayedFullBlock)(void *info, BRMerkleBlock *block,
+                                                              BRTransaction *transactions[], size_t txCount));
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
@@ -177,9 +262,25 @@ uint64_t BRPeerFeePerKb(BRPeer *peer);
 // average ping time for connected peer
 double BRPeerPingTime(BRPeer *peer);
 
+// a snapshot of the counters for peer, safe to call from any thread while peer is connected
+BRPeerMetrics BRPeerGetMetrics(BRPeer *peer);
+
+// adds count to the bloom filter false positives counted for peer
+void BRPeerAddFalsePositives(BRPeer *peer, size_t count);
+
+// name of a message type counted in BRPeerMetrics
+const char *BRPeerMsgTypeName(BRPeerMsgType type);
+
+// adds a sample of the given number of seconds to histogram, the caller must serialize calls for the same histogram
+void BRPeerHistogramAdd(BRPeerHistogram *histogram, double seconds);
+
+// returns the upper bound in seconds of the bucket containing the given percentile (0 to 100) of the samples
+double BRPeerHistogramPercentile(const BRPeerHistogram *histogram, double percentile);
+
 // sends a bitcoin protocol message to peer
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen);
+void BRPeerSendFilteradd(BRPeer *peer, const uint8_t *data, size_t dataLen); // adds one element to the loaded filter
 void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
                        void (*completionCallback)(void *info, int success));
 void BRPeerSendGetheaders(BRPeer *peer, const UInt256 locators[], size_t locatorsCount, UInt256 hashStop);
@@ -187,6 +288,9 @@ void BRPeerSendGetblocks(BRPeer *peer, const UInt256 locators[], size_t locators
 void BRPeerSendInv(BRPeer *peer, const UInt256 txHashes[], size_t txCount);
 void BRPeerSendGetdata(BRPeer *peer, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                        size_t blockCount);
+void BRPeerSendGetdataBlocks(BRPeer *peer, const UInt256 blockHashes[], size_t blockCount); // full witness blocks
+void BRPeerSendGetcfheaders(BRPeer *peer, uint32_t startHeight, UInt256 stopHash);
+void BRPeerSendGetcfilters(BRPeer *peer, uint32_t startHeight, UInt256 stopHash);
 void BRPeerSendGetaddr(BRPeer *peer);
 void BRPeerSendPing(BRPeer *peer, void *info, void (*pongCallback)(void *info, int success));
 
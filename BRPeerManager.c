@@ -24,11 +24,13 @@
 
 #include "BRPeerManager.h"
 #include "BRBloomFilter.h"
+#include "BRBlockFilter.h"
 #include "BRSet.h"
 #include "BRArray.h"
 #include "BRInt.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <time.h>
@@ -38,14 +40,36 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/time.h>
 
 #define PROTOCOL_TIMEOUT      20.0
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define PEER_FLAG_DOWNLOAD    0x04 // peer has the bloom filter loaded and can be assigned download windows
+#define PEER_FLAG_STALLED     0x08 // peer let a download window time out, and hasn't answered the ping after it yet
+
+#define DOWNLOAD_WINDOW_SIZE    100 // number of merkleblocks requested from one peer at a time during chain download
+#define DOWNLOAD_WINDOW_TIMEOUT 30  // seconds before an unfinished download window is reassigned to another peer
+#define MAX_DOWNLOAD_WINDOWS    20  // maximum number of download windows queued ahead of the chain tip
+
+#define CF_MAX_PENDING_HEADERS  4000 // max block headers held past the chain tip while waiting for compact filters
+#define CF_MAX_FILTER_HASHES    2000 // max filter hashes per getcfheaders request (BIP157 limit)
+#define CF_MAX_FILTERS          500  // max filters per getcfilters request (BIP157 allows up to 1000)
+
+#define SAVE_MAX_PENDING_BLOCKS 10000 // callers wait for the save thread once this many blocks are waiting to be saved
+#define SAVE_THREAD_STACK_SIZE  (512 * 1024)
+#define TIMER_THREAD_STACK_SIZE (512 * 1024)
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
+// logs a message about a block prefixed with the address of the peer that relayed it, or without one if it was
+// replayed from the block cache
+#define _block_log(peer, ...) do {\
+    if (peer) peer_log((peer), __VA_ARGS__);\
+    else br_log(BRLogLevelInfo, __VA_ARGS__);\
+} while (0)
+
 typedef struct {
     BRPeerManager *manager;
     const char *hostname;
@@ -58,6 +82,22 @@ typedef struct {
     UInt256 hash;
 } BRPeerCallbackInfo;
 
+typedef struct {
+    UInt256 blockHashes[DOWNLOAD_WINDOW_SIZE];
+    uint8_t received[DOWNLOAD_WINDOW_SIZE];
+    size_t count;
+    BRPeer *peer; // peer the window was last requested from, or NULL if it needs to be requested
+    time_t requestTime;
+} BRDownloadWindow;
+
+typedef struct {
+    BRMerkleBlock *block; // header past the chain tip, or the block with its matched tx once it's been downloaded
+    UInt256 filterHash, filterHeader;
+    uint8_t *filter; // NULL until the compact filter is received
+    size_t filterLen;
+    int fullRequested;
+} BRCFilterEntry;
+
 typedef struct {
     BRTransaction *tx;
     void *info;
@@ -69,6 +109,52 @@ typedef struct {
     BRPeer *peers;
 } BRTxPeerList;
 
+// the manager's state is split into three lock domains, which are always taken in this order when nested:
+// lock - the chain, bloom/compact filters, download scheduling and sync state, connectedPeers and the download peer
+// peerLock - the known peer list, peer thread counts and the fixed peer, plus connectedPeers, which may be read while
+//            holding either lock but is only changed while holding both
+// txLock - tx publish and relay tracking: publishedTx, publishedTxHashes, txRelays and txRequests
+// no wallet function or embedder callback is called while holding peerLock or txLock, so wallet state a tx is looked up
+// or checked against is read beforehand (see _BRPeerManagerTxsToPublish()), the one exception is BRPeerManagerFree(),
+// which looks up published tx in the wallet after every other thread using the manager is gone
+typedef struct {
+    pthread_mutex_t mutex;
+    const char *name;
+    const char *function; // call site that took the mutex, if lock profiling was on at the time
+    int line;
+    double lockTime, waitTime; // when the mutex was taken, and how long it was waited on
+} BRManagerLock;
+
+// saveBlocks and savePeers calls waiting for the save thread, so the embedder's storage latency never holds up peers
+// consecutive block saves are merged into one call, consecutive peer saves are merged into one call with each peer
+// listed once, at its most recent state, and a replacing save drops any still waiting, so at most one call of each
+// kind is pending, and each kind is saved in the order queued
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when a save is queued or finished, or the save thread should exit
+    pthread_t thread;
+    int threadState; // 0 - not started, 1 - running, -1 - couldn't be started, so saves are made inline
+    int busy, exit;
+    int blocksPending, blocksReplace;
+    BRMerkleBlock **blocks; // copies of the blocks to save
+    int peersPending, peersReplace;
+    BRPeer *peers;
+    int headersPending; // the header store needs to be synced to disk
+} BRSaveQueue;
+
+// wakes the download scheduler when the earliest unfinished download window times out, so a window held by a peer that
+// stopped responding is reassigned even when no other peer event arrives to trigger it, the thread runs while a sync is
+// in progress, and is stopped and joined when the sync stops or the manager disconnects
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when the deadline moves earlier, or the timer thread should exit
+    pthread_t thread;
+    int threadState; // 0 - not started, 1 - running, 2 - stopping, -1 - couldn't be started, so timeouts are only
+                     // checked on events
+    int exit;
+    time_t deadline; // when to run the download scheduler, or 0 if no download window is outstanding
+} BRDownloadTimer;
+
 // true if peer is contained in the list of peers associated with txHash
 static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
@@ -174,9 +260,26 @@ struct BRPeerManagerStruct {
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     BRBloomFilter *bloomFilter;
+    double filterFpRate; // false positive rate bloomFilter was built for
+    UInt160 *filterAdds; // elements inserted into bloomFilter that still need to be sent to peers with filteradd
     double fpRate, averageTxPerBlock;
     BRSet *blocks, *orphans, *checkpoints;
     BRMerkleBlock *lastBlock, *lastOrphan;
+    BRHeaderStore *headerStore;
+    BRBlockCache *blockCache;
+    BRHeaderParser *headerParser; // worker pool shared by all peers for parsing "headers" messages
+    BRDownloadWindow *downloadWindows;
+    UInt256 downloadLocators[2];
+    int downloadTimeout; // seconds before an unfinished download window is reassigned to another peer
+    int compactFilters, cfHeadersPending, cfHeadersDone;
+    BRCFilterEntry *cfEntries;
+    size_t cfHashesCount, cfHashesPending, cfFiltersCount, cfFiltersPending, cfAddrsCount, cfScriptsCount;
+    size_t cfCheckedCount, cfCheckPending; // filter hashes cross-checked with cfCheckPeer, and being checked
+    BRPeer *cfCheckPeer, *cfDisputePeer; // cfDisputePeer disagreed with the download peer's filter hashes
+    UInt256 cfFilterHeader; // filter header of the block before cfEntries[0], or UINT256_ZERO if it isn't known
+    uint8_t *cfScriptData;
+    const uint8_t **cfScripts;
+    size_t *cfScriptLens;
     BRTxPeerList *txRelays, *txRequests;
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
@@ -188,53 +291,365 @@ struct BRPeerManagerStruct {
     void (*savePeers)(void *info, int replace, const BRPeer peers[], size_t peersCount);
     int (*networkIsReachable)(void *info);
     void (*threadCleanup)(void *info);
-    pthread_mutex_t lock;
+    BRPeerManagerMetrics metrics;
+    double syncStartTime; // when the current sync started
+    int lockProfiling;
+    BRPeerManagerLockSite *lockSites;
+    pthread_mutex_t profileLock; // guards lockSites
+    BRManagerLock lock, peerLock, txLock;
+    BRSaveQueue saveQueue;
+    BRDownloadTimer downloadTimer;
 };
 
+inline static double _BRPeerManagerNow(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double)tv.tv_usec/1000000;
+}
+
+static void _BRManagerLockInit(BRManagerLock *lock, const char *name)
+{
+    pthread_mutex_init(&lock->mutex, NULL);
+    lock->name = name;
+}
+
+// takes a lock, noting when so _BRPeerManagerReleaseLock() can record how long it was held, and when lock profiling
+// is on, also how long it was waited on and from where
+static void _BRPeerManagerTakeLock(BRPeerManager *manager, BRManagerLock *lock, const char *function, int line)
+{
+    double start;
+
+    if (__atomic_load_n(&manager->lockProfiling, __ATOMIC_RELAXED)) {
+        start = _BRPeerManagerNow();
+        pthread_mutex_lock(&lock->mutex);
+        lock->lockTime = _BRPeerManagerNow();
+        lock->waitTime = lock->lockTime - start;
+        lock->function = function;
+        lock->line = line;
+    }
+    else {
+        pthread_mutex_lock(&lock->mutex);
+        lock->lockTime = _BRPeerManagerNow();
+        lock->function = NULL;
+    }
+}
+
+static void _BRPeerManagerReleaseLock(BRPeerManager *manager, BRManagerLock *lock)
+{
+    double hold = _BRPeerManagerNow() - lock->lockTime;
+    BRPeerManagerLockSite *site = NULL;
+    uint64_t holdUsec = hold*1000000, waitUsec;
+
+    if (lock == &manager->lock) BRPeerHistogramAdd(&manager->metrics.lockTime, hold);
+    else if (lock == &manager->peerLock) BRPeerHistogramAdd(&manager->metrics.peerLockTime, hold);
+    else BRPeerHistogramAdd(&manager->metrics.txLockTime, hold);
+
+    if (lock->function) {
+        waitUsec = lock->waitTime*1000000;
+        pthread_mutex_lock(&manager->profileLock);
+
+        for (size_t i = 0; ! site && i < array_count(manager->lockSites); i++) {
+            if (manager->lockSites[i].line != lock->line || manager->lockSites[i].function != lock->function) continue;
+            site = &manager->lockSites[i];
+        }
+
+        if (! site) {
+            array_add(manager->lockSites, ((const BRPeerManagerLockSite) { lock->function, lock->line, lock->name }));
+            site = &manager->lockSites[array_count(manager->lockSites) - 1];
+        }
+
+        site->count++;
+        site->waitUsec += waitUsec;
+        if (waitUsec > site->maxWaitUsec) site->maxWaitUsec = waitUsec;
+        site->holdUsec += holdUsec;
+        if (holdUsec > site->maxHoldUsec) site->maxHoldUsec = holdUsec;
+        pthread_mutex_unlock(&manager->profileLock);
+        lock->function = NULL;
+    }
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+#define _BRPeerManagerLock(manager)        _BRPeerManagerTakeLock((manager), &(manager)->lock, __func__, __LINE__)
+#define _BRPeerManagerUnlock(manager)      _BRPeerManagerReleaseLock((manager), &(manager)->lock)
+#define _BRPeerManagerLockPeers(manager)   _BRPeerManagerTakeLock((manager), &(manager)->peerLock, __func__, __LINE__)
+#define _BRPeerManagerUnlockPeers(manager) _BRPeerManagerReleaseLock((manager), &(manager)->peerLock)
+#define _BRPeerManagerLockTx(manager)      _BRPeerManagerTakeLock((manager), &(manager)->txLock, __func__, __LINE__)
+#define _BRPeerManagerUnlockTx(manager)    _BRPeerManagerReleaseLock((manager), &(manager)->txLock)
+
+// true if a chain sync is in progress with peer as the download peer, may be called without holding manager->lock
+// (syncStartHeight and downloadPeer are only changed while holding it, so the answer can be stale by then)
+inline static int _BRPeerManagerIsSyncPeer(BRPeerManager *manager, const BRPeer *peer)
+{
+    return (__atomic_load_n(&manager->syncStartHeight, __ATOMIC_RELAXED) > 0 &&
+            __atomic_load_n(&manager->downloadPeer, __ATOMIC_RELAXED) == peer);
+}
+
+// must not be called while holding peerLock or txLock
 static void _BRPeerManagerPeerMisbehavin(BRPeerManager *manager, BRPeer *peer)
 {
+    _BRPeerManagerLockPeers(manager);
+
     for (size_t i = array_count(manager->peers); i > 0; i--) {
         if (BRPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
     }
 
+    manager->metrics.misbehavingPeers++;
+
     if (++manager->misbehavinCount >= 10) { // clear out stored peers so we get a fresh list from DNS for next connect
         manager->misbehavinCount = 0;
         array_clear(manager->peers);
     }
 
+    _BRPeerManagerUnlockPeers(manager);
     BRPeerDisconnect(peer);
 }
 
+// makes the saves waiting in the queue, saveQueue.lock must be held, and is released while the callbacks run
+static void _BRPeerManagerSavePending(BRPeerManager *manager)
+{
+    BRSaveQueue *q = &manager->saveQueue;
+    BRMerkleBlock **blocks = NULL;
+    BRPeer *peers = NULL;
+    int blocksReplace = q->blocksReplace, peersReplace = q->peersReplace, syncHeaders = q->headersPending;
+
+    if (q->blocksPending) {
+        blocks = q->blocks;
+        array_new(q->blocks, 100);
+    }
+
+    if (q->peersPending) {
+        peers = q->peers;
+        array_new(q->peers, 100);
+    }
+
+    q->blocksPending = q->peersPending = q->headersPending = 0;
+    q->busy = 1;
+    pthread_cond_broadcast(&q->cond); // wake callers waiting for room in the queue
+    pthread_mutex_unlock(&q->lock);
+
+    if (blocks) {
+        if (manager->saveBlocks) manager->saveBlocks(manager->info, blocksReplace, blocks, array_count(blocks));
+        for (size_t i = array_count(blocks); i > 0; i--) BRMerkleBlockFree(blocks[i - 1]);
+        array_free(blocks);
+    }
+
+    if (syncHeaders && manager->headerStore) BRHeaderStoreSync(manager->headerStore);
+
+    if (peers) {
+        if (manager->savePeers) manager->savePeers(manager->info, peersReplace, peers, array_count(peers));
+        array_free(peers);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->busy = 0;
+    pthread_cond_broadcast(&q->cond);
+}
+
+static void *_saveThreadRoutine(void *arg)
+{
+    BRPeerManager *manager = arg;
+    BRSaveQueue *q = &manager->saveQueue;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (! q->exit || q->blocksPending || q->peersPending || q->headersPending) {
+        if (q->blocksPending || q->peersPending || q->headersPending) _BRPeerManagerSavePending(manager);
+        else pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+    manager->threadCleanup(manager->info);
+    return NULL;
+}
+
+// hands queued saves to the save thread, starting it the first time, or if it couldn't be started, makes them on the
+// calling thread, saveQueue.lock must be held
+static void _BRPeerManagerSaveSignal(BRPeerManager *manager)
+{
+    BRSaveQueue *q = &manager->saveQueue;
+    pthread_attr_t attr;
+
+    if (q->threadState == 0) {
+        q->threadState = -1;
+
+        if (pthread_attr_init(&attr) == 0) {
+            if (pthread_attr_setstacksize(&attr, SAVE_THREAD_STACK_SIZE) == 0 &&
+                pthread_create(&q->thread, &attr, _saveThreadRoutine, manager) == 0) q->threadState = 1;
+            pthread_attr_destroy(&attr);
+        }
+
+        if (q->threadState < 0) br_log(BRLogLevelWarning, "error creating save thread, saving inline");
+    }
+
+    if (q->threadState > 0) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    else {
+        while (q->busy) pthread_cond_wait(&q->cond, &q->lock); // keep saves in order if another thread is saving
+        if (q->blocksPending || q->peersPending || q->headersPending) _BRPeerManagerSavePending(manager);
+    }
+}
+
+// queues blocks to be saved with the saveBlocks callback (the blocks are copied), and if syncHeaders is true, the
+// header store to be synced to disk, waiting only if SAVE_MAX_PENDING_BLOCKS are already queued
+static void _BRPeerManagerQueueSaveBlocks(BRPeerManager *manager, int replace, BRMerkleBlock *blocks[],
+                                          size_t blocksCount, int syncHeaders)
+{
+    BRSaveQueue *q = &manager->saveQueue;
+
+    if (! manager->saveBlocks) blocksCount = 0;
+    if (blocksCount == 0 && ! syncHeaders) return;
+    pthread_mutex_lock(&q->lock);
+
+    while (! replace && q->threadState > 0 && array_count(q->blocks) > 0 &&
+           array_count(q->blocks) + blocksCount > SAVE_MAX_PENDING_BLOCKS) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    if (blocksCount > 0) {
+        if (replace) { // blocks waiting to be saved would be removed by this save anyway
+            for (size_t i = array_count(q->blocks); i > 0; i--) BRMerkleBlockFree(q->blocks[i - 1]);
+            array_clear(q->blocks);
+            q->blocksReplace = 1;
+        }
+        else if (! q->blocksPending) q->blocksReplace = 0;
+
+        for (size_t i = 0; i < blocksCount; i++) array_add(q->blocks, BRMerkleBlockCopy(blocks[i]));
+        q->blocksPending = 1;
+    }
+
+    if (syncHeaders) q->headersPending = 1;
+    _BRPeerManagerSaveSignal(manager);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// queues peers to be saved with the savePeers callback, a peer already waiting to be saved is updated in place
+static void _BRPeerManagerQueueSavePeers(BRPeerManager *manager, int replace, const BRPeer peers[], size_t peersCount)
+{
+    BRSaveQueue *q = &manager->saveQueue;
+    size_t i, j;
+
+    if (! manager->savePeers) return;
+    pthread_mutex_lock(&q->lock);
+
+    if (replace) { // the peers waiting to be saved would be removed by this save anyway
+        array_clear(q->peers);
+        q->peersReplace = 1;
+    }
+    else if (! q->peersPending) q->peersReplace = 0;
+
+    for (i = 0; i < peersCount; i++) {
+        for (j = array_count(q->peers); j > 0 && ! BRPeerEq(&q->peers[j - 1], &peers[i]); j--);
+
+        if (j > 0) {
+            q->peers[j - 1] = peers[i];
+        }
+        else array_add(q->peers, peers[i]);
+    }
+
+    q->peersPending = 1;
+    _BRPeerManagerSaveSignal(manager);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// waits until all queued saves have been made
+static void _BRPeerManagerSaveFlush(BRPeerManager *manager)
+{
+    BRSaveQueue *q = &manager->saveQueue;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (q->busy || (q->threadState > 0 && (q->blocksPending || q->peersPending || q->headersPending))) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void _BRPeerManagerDownloadTimerStop(BRPeerManager *manager);
+
+// makes the syncStopped callback once every save queued so far has been made, so the embedder can rely on the blocks
+// and peers the sync produced being persisted, no manager lock may be held
+static void _BRPeerManagerSyncStoppedCallback(BRPeerManager *manager, int error)
+{
+    _BRPeerManagerDownloadTimerStop(manager); // there are no download windows left to time out
+    if (! manager->syncStopped) return;
+    _BRPeerManagerSaveFlush(manager);
+    manager->syncStopped(manager->info, error);
+}
+
 static void _BRPeerManagerSyncStopped(BRPeerManager *manager)
 {
-    manager->syncStartHeight = 0;
+    if (manager->syncStartHeight > 0) { // freeze the sync metrics at their final values
+        manager->metrics.syncBlocks = (manager->lastBlock->height + 1 > manager->syncStartHeight) ?
+                                      manager->lastBlock->height + 1 - manager->syncStartHeight : 0;
+        manager->metrics.syncTime = _BRPeerManagerNow() - manager->syncStartTime;
+    }
+
+    __atomic_store_n(&manager->syncStartHeight, 0, __ATOMIC_RELAXED);
+    array_clear(manager->downloadWindows);
+    manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
 
     if (manager->downloadPeer) {
+        int hasPendingCallbacks = 0;
+
         // don't cancel timeout if there's a pending tx publish callback
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (manager->publishedTx[i - 1].callback != NULL) return;
+        _BRPeerManagerLockTx(manager);
+
+        for (size_t i = array_count(manager->publishedTx); ! hasPendingCallbacks && i > 0; i--) {
+            if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
         }
-    
-        BRPeerScheduleDisconnect(manager->downloadPeer, -1); // cancel sync timeout
+
+        _BRPeerManagerUnlockTx(manager);
+        if (! hasPendingCallbacks) BRPeerScheduleDisconnect(manager->downloadPeer, -1); // cancel sync timeout
     }
 }
 
-// adds transaction to list of tx to be published, along with any unconfirmed inputs
-static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransaction *tx, void *info,
-                                             void (*callback)(void *, int))
+// returns tx followed by its unconfirmed wallet ancestors, or an empty array if tx is confirmed, for passing to
+// _BRPeerManagerAddTxToPublishList(), it calls into the wallet so txLock must not be held, free with array_free()
+static BRTransaction **_BRPeerManagerTxsToPublish(BRPeerManager *manager, BRTransaction *tx)
 {
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) {
-        for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
-            if (BRTransactionEq(manager->publishedTx[i - 1].tx, tx)) return;
+    BRTransaction **txs, *t;
+    size_t i, j, k;
+
+    array_new(txs, 1);
+    if (tx && tx->blockHeight == TX_UNCONFIRMED) array_add(txs, tx);
+
+    for (i = 0; i < array_count(txs); i++) {
+        for (j = 0; j < txs[i]->inCount; j++) {
+            t = BRWalletTransactionForHash(manager->wallet, txs[i]->inputs[j].txHash);
+            if (! t || t->blockHeight != TX_UNCONFIRMED) continue;
+
+            for (k = array_count(txs); k > 0; k--) {
+                if (BRTransactionEq(txs[k - 1], t)) break;
+            }
+
+            if (k == 0) array_add(txs, t);
         }
-        
-        array_add(manager->publishedTx, ((const BRPublishedTx) { tx, info, callback }));
-        array_add(manager->publishedTxHashes, tx->txHash);
+    }
 
-        for (size_t i = 0; i < tx->inCount; i++) {
-            _BRPeerManagerAddTxToPublishList(manager, BRWalletTransactionForHash(manager->wallet, tx->inputs[i].txHash),
-                                             NULL, NULL);
+    return txs;
+}
+
+// adds the txs returned by _BRPeerManagerTxsToPublish() to the list of tx to be published, with info and callback for
+// the first of them, txLock must be held
+static void _BRPeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransaction *txs[], size_t txCount, void *info,
+                                             void (*callback)(void *, int))
+{
+    size_t i, j;
+
+    for (i = 0; i < txCount; i++) {
+        for (j = array_count(manager->publishedTx); j > 0; j--) {
+            if (BRTransactionEq(manager->publishedTx[j - 1].tx, txs[i])) break;
         }
+
+        if (j > 0) continue; // already being published
+        array_add(manager->publishedTx, ((const BRPublishedTx) { txs[i], (i == 0) ? info : NULL,
+                                                                 (i == 0) ? callback : NULL }));
+        array_add(manager->publishedTxHashes, txs[i]->txHash);
     }
 }
 
@@ -242,7 +657,8 @@ static size_t _BRPeerManagerBlockLocators(BRPeerManager *manager, UInt256 locato
 {
     // append 10 most recent block hashes, decending, then continue appending, doubling the step back each time,
     // finishing with the genesis block (top, -1, -2, -3, -4, -5, -6, -7, -8, -9, -11, -15, -23, -39, -71, -135, ..., 0)
-    BRMerkleBlock *block = manager->lastBlock;
+    BRMerkleBlock *block = manager->lastBlock, *prev, stored = BR_MERKLE_BLOCK_NONE;
+    UInt256 prevBlock;
     int32_t step = 1, i = 0, j;
     
     while (block && block->height > 0) {
@@ -250,7 +666,15 @@ static size_t _BRPeerManagerBlockLocators(BRPeerManager *manager, UInt256 locato
         if (++i >= 10) step *= 2;
         
         for (j = 0; block && j < step; j++) {
-            block = BRSetGet(manager->blocks, &block->prevBlock);
+            prevBlock = block->prevBlock;
+            prev = BRSetGet(manager->blocks, &prevBlock);
+
+            // blocks before the previous difficulty transition are only kept in the header store
+            if (! prev && manager->headerStore && block->height > 0 &&
+                BRHeaderStoreHeaderAtHeight(manager->headerStore, block->height - 1, &stored) &&
+                UInt256Eq(stored.blockHash, prevBlock)) prev = &stored;
+
+            block = prev;
         }
     }
     
@@ -265,6 +689,10 @@ static void _setApplyFreeBlock(void *info, void *block)
 
 static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
 {
+    if (manager->compactFilters) return; // compact filters are matched locally, so peers don't need a bloom filter
+
+    double start = _BRPeerManagerNow();
+
     // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
     // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
     // wallet transaction is encountered during the chain sync
@@ -277,8 +705,8 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     manager->filterUpdateHeight = manager->lastBlock->height;
     manager->fpRate = BLOOM_REDUCED_FALSEPOSITIVE_RATE;
     
-    size_t addrsCount = BRWalletAllAddrs(manager->wallet, NULL, 0);
-    BRAddress *addrs = malloc(addrsCount*sizeof(*addrs));
+    size_t pkhCount = BRWalletAllPKH(manager->wallet, NULL, 0);
+    UInt160 *pkh = malloc(pkhCount*sizeof(*pkh));
     size_t utxosCount = BRWalletUTXOs(manager->wallet, NULL, 0);
     BRUTXO *utxos = malloc(utxosCount*sizeof(*utxos));
     uint32_t blockHeight = (manager->lastBlock->height > 100) ? manager->lastBlock->height - 100 : 0;
@@ -286,35 +714,33 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     BRTransaction **transactions = malloc(txCount*sizeof(*transactions));
     BRBloomFilter *filter;
     
-    assert(addrs != NULL);
+    assert(pkh != NULL);
     assert(utxos != NULL);
     assert(transactions != NULL);
-    addrsCount = BRWalletAllAddrs(manager->wallet, addrs, addrsCount);
+    pkhCount = BRWalletAllPKH(manager->wallet, pkh, pkhCount);
     utxosCount = BRWalletUTXOs(manager->wallet, utxos, utxosCount);
     txCount = BRWalletTxUnconfirmedBefore(manager->wallet, transactions, txCount, blockHeight);
-    filter = BRBloomFilterNew(manager->fpRate, addrsCount + utxosCount + txCount + 100, (uint32_t)BRPeerHash(peer),
+    manager->filterFpRate = manager->fpRate; // leave room for 100 elements to be added with filteradd
+    filter = BRBloomFilterNew(manager->fpRate, pkhCount + utxosCount + txCount + 100, (uint32_t)BRPeerHash(peer),
                               BLOOM_UPDATE_ALL); // BUG: XXX txCount not the same as number of spent wallet outputs
     
-    for (size_t i = 0; i < addrsCount; i++) { // add addresses to watch for tx receiveing money to the wallet
-        UInt160 hash = UINT160_ZERO;
-        
-        BRAddressHash160(&hash, addrs[i].s);
-        
-        if (! UInt160IsZero(hash) && ! BRBloomFilterContainsData(filter, hash.u8, sizeof(hash))) {
-            BRBloomFilterInsertData(filter, hash.u8, sizeof(hash));
-        }
-    }
-
-    free(addrs);
-        
-    for (size_t i = 0; i < utxosCount; i++) { // add UTXOs to watch for tx sending money from the wallet
-        uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
-        
-        UInt256Set(o, utxos[i].hash);
-        UInt32SetLE(&o[sizeof(UInt256)], utxos[i].n);
-        if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o, sizeof(o));
+    // add addresses to watch for tx receiveing money to the wallet
+    BRBloomFilterInsertElements(filter, (const uint8_t *)pkh, sizeof(*pkh), pkhCount);
+    if (manager->blockCache) BRBlockCacheSetFilter(manager->blockCache, pkh, pkhCount);
+    free(pkh);
+    
+    // add UTXOs to watch for tx sending money from the wallet
+    uint8_t *o = malloc(utxosCount*(sizeof(UInt256) + sizeof(uint32_t)) + 1);
+    
+    assert(o != NULL);
+    
+    for (size_t i = 0; i < utxosCount; i++) {
+        UInt256Set(&o[i*(sizeof(UInt256) + sizeof(uint32_t))], utxos[i].hash);
+        UInt32SetLE(&o[i*(sizeof(UInt256) + sizeof(uint32_t)) + sizeof(UInt256)], utxos[i].n);
     }
     
+    BRBloomFilterInsertElements(filter, o, sizeof(UInt256) + sizeof(uint32_t), utxosCount);
+    free(o);
     free(utxos);
         
     for (size_t i = 0; i < txCount; i++) { // also add TXOs spent within the last 100 blocks
@@ -324,10 +750,11 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
             uint8_t o[sizeof(UInt256) + sizeof(uint32_t)];
             
             if (tx && input->index < tx->outCount &&
-                BRWalletContainsAddress(manager->wallet, tx->outputs[input->index].address)) {
+                BRWalletContainsScript(manager->wallet, tx->outputs[input->index].script,
+                                       tx->outputs[input->index].scriptLen)) {
                 UInt256Set(o, input->txHash);
                 UInt32SetLE(&o[sizeof(UInt256)], input->index);
-                if (! BRBloomFilterContainsData(filter, o, sizeof(o))) BRBloomFilterInsertData(filter, o,sizeof(o));
+                BRBloomFilterInsertElements(filter, o, sizeof(o), 1);
             }
         }
     }
@@ -340,124 +767,558 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
     size_t len = BRBloomFilterSerialize(filter, data, sizeof(data));
     
+    manager->metrics.filterRebuilds++;
+    manager->metrics.filterRebuildTime += _BRPeerManagerNow() - start;
     BRPeerSendFilterload(peer, data, len);
 }
 
-static void _updateFilterRerequestDone(void *info, int success)
+// sends the current bloom filter to a peer that isn't the download peer, so it can help download the chain
+static void _BRPeerManagerLoadDownloadFilter(BRPeerManager *manager, BRPeer *peer)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    
-    free(info);
-    
-    if (success) {
-        pthread_mutex_lock(&manager->lock);
+    uint8_t data[BRBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+    size_t len = BRBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
 
-        if ((peer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
-            UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
-            size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
-            
-            BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
-        }
+    BRPeerSendFilterload(peer, data, len);
+    peer->flags |= PEER_FLAG_DOWNLOAD;
+}
 
-        pthread_mutex_unlock(&manager->lock);
+// returns the download window containing blockHash and sets *index to the block's position in it, or returns NULL if
+// the block isn't scheduled for download
+static BRDownloadWindow *_BRPeerManagerDownloadWindow(BRPeerManager *manager, UInt256 blockHash, size_t *index)
+{
+    for (size_t i = 0; i < array_count(manager->downloadWindows); i++) {
+        for (size_t j = 0; j < manager->downloadWindows[i].count; j++) {
+            if (! UInt256Eq(manager->downloadWindows[i].blockHashes[j], blockHash)) continue;
+            if (index) *index = j;
+            return &manager->downloadWindows[i];
+        }
     }
+
+    return NULL;
 }
 
-static void _updateFilterLoadDone(void *info, int success)
+// returns the connected peer with the lowest ping time that can be assigned a download window and has none pending
+static BRPeer *_BRPeerManagerIdleDownloadPeer(BRPeerManager *manager)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    BRPeerCallbackInfo *peerInfo;
+    BRPeer *p, *peer = NULL;
+    size_t i, j;
 
-    free(info);
-    
-    if (success) {
-        pthread_mutex_lock(&manager->lock);
-        BRPeerSetNeedsFilterUpdate(peer, 0);
-        peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
-        
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
-            if (manager->downloadPeer) {
-                peerInfo = calloc(1, sizeof(*peerInfo));
-                assert(peerInfo != NULL);
-                peerInfo->peer = peer;
-                peerInfo->manager = manager;
-                BRPeerRerequestBlocks(manager->downloadPeer, manager->lastBlock->blockHash);
-                BRPeerSendPing(manager->downloadPeer, peerInfo, _updateFilterRerequestDone);
-            }
-        }
-        else BRPeerSendMempool(peer, NULL, 0, NULL, NULL); // if not syncing, request mempool
-        
-        pthread_mutex_unlock(&manager->lock);
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        p = manager->connectedPeers[i - 1];
+        if (BRPeerConnectStatus(p) != BRPeerStatusConnected || (p->flags & PEER_FLAG_DOWNLOAD) == 0) continue;
+        if ((p->flags & (PEER_FLAG_NEEDSUPDATE | PEER_FLAG_STALLED)) != 0) continue;
+        j = array_count(manager->downloadWindows);
+        while (j > 0 && manager->downloadWindows[j - 1].peer != p) j--;
+        if (j == 0 && (! peer || BRPeerPingTime(p) < BRPeerPingTime(peer))) peer = p;
     }
+
+    return peer;
 }
 
-static void _updateFilterPingDone(void *info, int success)
+static void _downloadWindowDone(void *info, int success);
+
+// requests the blocks in window that haven't been received yet from peer, followed by a ping so we know when the peer
+// is done sending them
+static void _BRPeerManagerRequestWindow(BRPeerManager *manager, BRDownloadWindow *window, BRPeer *peer)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
-    BRPeerCallbackInfo *peerInfo;
-    
-    if (success) {
-        pthread_mutex_lock(&manager->lock);
-        peer_log(peer, "updating filter with newly created wallet addresses");
-        if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
-        manager->bloomFilter = NULL;
+    BRPeerCallbackInfo *info = calloc(1, sizeof(*info));
+    UInt256 blockHashes[DOWNLOAD_WINDOW_SIZE];
+    size_t count = 0;
 
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if we're syncing, only update download peer
-            if (manager->downloadPeer) {
-                _BRPeerManagerLoadBloomFilter(manager, manager->downloadPeer);
-                BRPeerSendPing(manager->downloadPeer, info, _updateFilterLoadDone); // wait for pong so filter is loaded
-            }
-            else free(info);
-        }
-        else {
-            free(info);
-            
-            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
-                if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusConnected) continue;
-                peerInfo = calloc(1, sizeof(*peerInfo));
-                assert(peerInfo != NULL);
-                peerInfo->peer = manager->connectedPeers[i - 1];
-                peerInfo->manager = manager;
-                _BRPeerManagerLoadBloomFilter(manager, peerInfo->peer);
-                BRPeerSendPing(peerInfo->peer, peerInfo, _updateFilterLoadDone); // wait for pong so filter is loaded
-            }
-        }
+    assert(info != NULL);
+    info->peer = peer;
+    info->manager = manager;
+    info->hash = window->blockHashes[0];
 
-         pthread_mutex_unlock(&manager->lock);
+    for (size_t i = 0; i < window->count; i++) {
+        if (! window->received[i]) blockHashes[count++] = window->blockHashes[i];
     }
-    else free(info);
+
+    window->peer = peer;
+    window->requestTime = time(NULL);
+    BRPeerSendGetdata(peer, NULL, 0, blockHashes, count);
+    BRPeerSendPing(peer, info, _downloadWindowDone);
 }
 
-static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
+static void _BRPeerManagerScheduleDownloads(BRPeerManager *manager);
+
+static void *_downloadTimerRoutine(void *arg)
 {
-    BRPeerCallbackInfo *info;
+    BRPeerManager *manager = arg;
+    BRDownloadTimer *t = &manager->downloadTimer;
+    struct timespec ts;
 
-    if (manager->downloadPeer && (manager->downloadPeer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
-        BRPeerSetNeedsFilterUpdate(manager->downloadPeer, 1);
-        manager->downloadPeer->flags |= PEER_FLAG_NEEDSUPDATE;
-        peer_log(manager->downloadPeer, "filter update needed, waiting for pong");
-        info = calloc(1, sizeof(*info));
-        assert(info != NULL);
-        info->peer = manager->downloadPeer;
-        info->manager = manager;
-        // wait for pong so we're sure to include any tx already sent by the peer in the updated filter
-        BRPeerSendPing(manager->downloadPeer, info, _updateFilterPingDone);
+    pthread_mutex_lock(&t->lock);
+
+    while (! t->exit) {
+        if (t->deadline == 0) pthread_cond_wait(&t->cond, &t->lock);
+        else if (t->deadline > time(NULL)) {
+            ts.tv_sec = t->deadline;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+        }
+        else {
+            t->deadline = 0;
+            pthread_mutex_unlock(&t->lock); // the manager lock is taken before the timer lock, never after
+            _BRPeerManagerLock(manager);
+            _BRPeerManagerScheduleDownloads(manager);
+            _BRPeerManagerUnlock(manager);
+            pthread_mutex_lock(&t->lock);
+        }
     }
+
+    pthread_mutex_unlock(&t->lock);
+    manager->threadCleanup(manager->info);
+    return NULL;
 }
 
-// unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
-static void _requestUnrelayedTxGetdataDone(void *info, int success)
+// makes the download timer run the download scheduler no later than deadline, starting the timer thread the first time
+static void _BRPeerManagerDownloadTimerSet(BRPeerManager *manager, time_t deadline)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRDownloadTimer *t = &manager->downloadTimer;
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->threadState == 0) {
+        t->threadState = -1;
+
+        if (pthread_attr_init(&attr) == 0) {
+            if (pthread_attr_setstacksize(&attr, TIMER_THREAD_STACK_SIZE) == 0 &&
+                pthread_create(&t->thread, &attr, _downloadTimerRoutine, manager) == 0) t->threadState = 1;
+            pthread_attr_destroy(&attr);
+        }
+
+        if (t->threadState < 0) br_log(BRLogLevelWarning, "error creating download timer thread");
+    }
+
+    if (t->deadline == 0 || deadline < t->deadline) { // a later deadline is picked up when the earlier one fires
+        t->deadline = deadline;
+        pthread_cond_broadcast(&t->cond);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+}
+
+// stops the download timer thread and waits for it to exit, the next download window restarts it, the timer thread
+// takes the manager lock, so it must not be held
+static void _BRPeerManagerDownloadTimerStop(BRPeerManager *manager)
+{
+    BRDownloadTimer *t = &manager->downloadTimer;
+    pthread_t thread;
+
+    pthread_mutex_lock(&t->lock);
+    t->deadline = 0;
+
+    if (t->threadState != 1 || pthread_equal(t->thread, pthread_self())) { // not running, or already being stopped
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+
+    t->threadState = 2;
+    t->exit = 1;
+    thread = t->thread;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_lock(&t->lock);
+    t->threadState = 0;
+    t->exit = 0;
+    pthread_mutex_unlock(&t->lock);
+}
+
+// assigns download windows that haven't been requested yet, or that a slow peer hasn't finished in time, to idle peers,
+// then asks the download peer for more block hashes once there's room for more windows
+static void _BRPeerManagerScheduleDownloads(BRPeerManager *manager)
+{
+    time_t now = time(NULL), deadline = 0;
+    BRDownloadWindow *window;
+    BRPeer *peer;
+
+    for (size_t i = 0; i < array_count(manager->downloadWindows); i++) {
+        window = &manager->downloadWindows[i];
+        if (window->peer && window->requestTime + manager->downloadTimeout > now) continue; // still downloading
+        peer = _BRPeerManagerIdleDownloadPeer(manager);
+        if (! peer) break;
+
+        if (window->peer) { // don't give the slow peer more windows until it answers the ping sent after this one
+            peer_log(window->peer, "download window timed out, reassigning to %s", BRPeerHost(peer));
+            window->peer->flags |= PEER_FLAG_STALLED;
+        }
+
+        _BRPeerManagerRequestWindow(manager, window, peer);
+    }
+
+    // windows that timed out without an idle peer to take them are reassigned when a peer finishes its window
+    for (size_t i = 0; i < array_count(manager->downloadWindows); i++) {
+        window = &manager->downloadWindows[i];
+        if (! window->peer || window->requestTime + manager->downloadTimeout <= now) continue;
+        if (deadline == 0 || window->requestTime + manager->downloadTimeout < deadline) {
+            deadline = window->requestTime + manager->downloadTimeout;
+        }
+    }
+
+    if (deadline != 0) _BRPeerManagerDownloadTimerSet(manager, deadline);
+
+    // blocks downloaded ahead of the chain tip are held as orphans until the blocks before them arrive
+    if (manager->downloadPeer && ! UInt256IsZero(manager->downloadLocators[0]) &&
+        array_count(manager->downloadWindows) < MAX_DOWNLOAD_WINDOWS/2 &&
+        BRSetCount(manager->orphans) < MAX_DOWNLOAD_WINDOWS*DOWNLOAD_WINDOW_SIZE) {
+        BRPeerSendGetblocks(manager->downloadPeer, manager->downloadLocators, 2, UINT256_ZERO);
+        manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
+    }
+}
+
+static void _downloadWindowDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRDownloadWindow *window;
+    size_t i, missing = 0;
+
+    _BRPeerManagerLock(manager);
+    window = _BRPeerManagerDownloadWindow(manager, ((BRPeerCallbackInfo *)info)->hash, NULL);
+    free(info);
+    peer->flags &= ~PEER_FLAG_STALLED; // the peer has caught up with its requests
+
+    // the window is removed once all its blocks are received, so if it's still here the peer skipped some of them
+    if (window && window->peer == peer) {
+        for (i = 0; i < window->count; i++) {
+            if (! window->received[i]) missing++;
+        }
+
+        if (success) peer_log(peer, "%zu block(s) missing from download window, rescheduling", missing);
+        window->peer = NULL;
+    }
+
+    _BRPeerManagerScheduleDownloads(manager);
+    _BRPeerManagerUnlock(manager);
+}
+
+// marks blockHash as received, and removes its download window when all of the window's blocks have been received
+static void _BRPeerManagerDownloadReceived(BRPeerManager *manager, UInt256 blockHash)
+{
+    size_t i, j = 0;
+    BRDownloadWindow *window = _BRPeerManagerDownloadWindow(manager, blockHash, &j);
+
+    if (window) {
+        window->received[j] = 1;
+        for (i = 0; i < window->count && window->received[i]; i++);
+
+        if (i == window->count) {
+            array_rm(manager->downloadWindows, (size_t)(window - manager->downloadWindows));
+            _BRPeerManagerScheduleDownloads(manager);
+        }
+    }
+}
+
+// discards the headers waiting for compact filters after the first count, along with any filters received for them,
+// requests still pending for discarded headers are ignored when they're answered
+static void _BRPeerManagerCFTruncate(BRPeerManager *manager, size_t count)
+{
+    size_t i;
+
+    if (count == 0 && array_count(manager->cfEntries) > 0 &&
+        ! UInt256Eq(manager->cfEntries[0].block->prevBlock, manager->lastBlock->blockHash)) {
+        manager->cfFilterHeader = UINT256_ZERO; // the discarded headers were on a fork, so it isn't lastBlock's
+    }
+
+    for (i = count; i < array_count(manager->cfEntries); i++) {
+        BRMerkleBlockFree(manager->cfEntries[i].block);
+        if (manager->cfEntries[i].filter) free(manager->cfEntries[i].filter);
+    }
+
+    if (count < array_count(manager->cfEntries)) array_set_count(manager->cfEntries, count);
+    if (manager->cfHashesCount + manager->cfHashesPending > count) manager->cfHashesPending = 0;
+    if (manager->cfCheckedCount + manager->cfCheckPending > count) manager->cfCheckPending = 0;
+    if (manager->cfHashesCount > count) manager->cfHashesCount = count;
+    if (manager->cfCheckedCount > count) manager->cfCheckedCount = count;
+    if (manager->cfFiltersCount > count) manager->cfFiltersCount = count;
+
+    for (i = 0, manager->cfFiltersPending = 0; i < manager->cfFiltersCount; i++) {
+        if (! manager->cfEntries[i].filter) manager->cfFiltersPending++;
+    }
+}
+
+// discards headers waiting for compact filters, along with any filters received for them, and starts over with
+// selecting a peer to cross-check filter headers with
+static void _BRPeerManagerCFClear(BRPeerManager *manager)
+{
+    _BRPeerManagerCFTruncate(manager, 0);
+    manager->cfHeadersPending = manager->cfHeadersDone = 0;
+    manager->cfCheckPeer = manager->cfDisputePeer = NULL;
+}
+
+// returns the peer that filter hashes from the download peer are cross-checked with, selecting one if needed, or NULL
+// if no other connected peer serves compact filters
+static BRPeer *_BRPeerManagerCFCheckPeer(BRPeerManager *manager)
+{
+    for (size_t i = array_count(manager->connectedPeers); ! manager->cfCheckPeer && i > 0; i--) {
+        BRPeer *p = manager->connectedPeers[i - 1];
+
+        if (p == manager->downloadPeer || p == manager->cfDisputePeer) continue;
+        if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+        if ((p->services & SERVICES_NODE_COMPACT_FILTERS) == SERVICES_NODE_COMPACT_FILTERS) manager->cfCheckPeer = p;
+    }
+
+    return manager->cfCheckPeer;
+}
+
+// asks another peer for the filter hashes the download peer relayed that haven't been cross-checked yet, a filter is
+// only matched once its hash is checked, so a single peer can't hide wallet transactions by lying about filters
+// if there are no other peers connected or connecting, the download peer's filter hashes are trusted, and if there's
+// no peer left to settle a dispute with cfDisputePeer, both are disconnected
+static void _BRPeerManagerCFCheck(BRPeerManager *manager)
+{
+    BRPeer *peer;
+    size_t n = manager->cfHashesCount - manager->cfCheckedCount;
+
+    if (manager->cfCheckPending > 0 || n == 0) return;
+    if (n > CF_MAX_FILTER_HASHES) n = CF_MAX_FILTER_HASHES;
+    peer = _BRPeerManagerCFCheckPeer(manager);
+
+    if (peer) {
+        BRPeerSendGetcfheaders(peer, manager->cfEntries[manager->cfCheckedCount].block->height,
+                               manager->cfEntries[manager->cfCheckedCount + n - 1].block->blockHash);
+        manager->cfCheckPending = n;
+    }
+    else if (manager->cfDisputePeer && array_count(manager->connectedPeers) <= 2) {
+        peer_log(manager->downloadPeer, "no peer left to settle a dispute over filter headers, disconnecting");
+        BRPeerDisconnect(manager->cfDisputePeer);
+        BRPeerDisconnect(manager->downloadPeer);
+        manager->cfDisputePeer = NULL;
+    }
+    else if (! manager->cfDisputePeer && array_count(manager->connectedPeers) <= 1) {
+        manager->cfCheckedCount = manager->cfHashesCount;
+    }
+}
+
+// keeps the compact filter sync pipeline going: requests headers past the chain tip from the download peer, then the
+// filter hashes for those headers, then the filters themselves
+static void _BRPeerManagerCFRequest(BRPeerManager *manager)
+{
+    BRPeer *peer = manager->downloadPeer;
+    size_t n, count = array_count(manager->cfEntries);
+
+    if (! peer) return;
+
+    if (! manager->cfHeadersPending && ! manager->cfHeadersDone && count < CF_MAX_PENDING_HEADERS) {
+        if (count > 0) {
+            UInt256 locators[] = { manager->cfEntries[count - 1].block->blockHash, manager->lastBlock->blockHash };
+
+            BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+        }
+        else {
+            UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+            size_t locatorsCount = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+
+            BRPeerSendGetheaders(peer, locators, locatorsCount, UINT256_ZERO);
+        }
+
+        manager->cfHeadersPending = 1;
+    }
+
+    if (manager->cfHashesPending == 0 && manager->cfHashesCount < count) {
+        n = count - manager->cfHashesCount;
+        if (n > CF_MAX_FILTER_HASHES) n = CF_MAX_FILTER_HASHES;
+        BRPeerSendGetcfheaders(peer, manager->cfEntries[manager->cfHashesCount].block->height,
+                               manager->cfEntries[manager->cfHashesCount + n - 1].block->blockHash);
+        manager->cfHashesPending = n;
+    }
+
+    if (manager->cfFiltersPending == 0 && manager->cfFiltersCount < manager->cfHashesCount) {
+        n = manager->cfHashesCount - manager->cfFiltersCount;
+        if (n > CF_MAX_FILTERS) n = CF_MAX_FILTERS;
+        BRPeerSendGetcfilters(peer, manager->cfEntries[manager->cfFiltersCount].block->height,
+                              manager->cfEntries[manager->cfFiltersCount + n - 1].block->blockHash);
+        manager->cfFiltersCount += n;
+        manager->cfFiltersPending = n;
+    }
+
+    _BRPeerManagerCFCheck(manager);
+}
+
+static void _updateFilterRerequestDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    free(info);
+    
+    if (success) {
+        _BRPeerManagerLock(manager);
+
+        if ((peer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
+            UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0)];
+            size_t count = _BRPeerManagerBlockLocators(manager, locators, sizeof(locators)/sizeof(*locators));
+            
+            BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
+        }
+
+        _BRPeerManagerUnlock(manager);
+    }
+}
+
+static void _updateFilterLoadDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRPeerCallbackInfo *peerInfo;
+
+    free(info);
+    
+    if (success) {
+        _BRPeerManagerLock(manager);
+        BRPeerSetNeedsFilterUpdate(peer, 0);
+        peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
+        
+        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
+            if (manager->downloadPeer) {
+                peerInfo = calloc(1, sizeof(*peerInfo));
+                assert(peerInfo != NULL);
+                peerInfo->peer = peer;
+                peerInfo->manager = manager;
+                BRPeerRerequestBlocks(manager->downloadPeer, manager->lastBlock->blockHash);
+                BRPeerSendPing(manager->downloadPeer, peerInfo, _updateFilterRerequestDone);
+            }
+        }
+        else BRPeerSendMempool(peer, NULL, 0, NULL, NULL); // if not syncing, request mempool
+        
+        _BRPeerManagerUnlock(manager);
+    }
+}
+
+// sends the elements inserted into bloomFilter since it was loaded to every peer that has a filter loaded, then waits
+// for pong the same way as after a filterload, instead of rebuilding and reloading the whole filter
+static void _BRPeerManagerSendFilterAdds(BRPeerManager *manager, BRPeerCallbackInfo *info)
+{
+    BRPeerCallbackInfo *peerInfo;
+    size_t i, j, count = array_count(manager->filterAdds);
+    BRPeer *p;
+
+    peer_log(info->peer, "adding %zu newly created wallet address(es) to filter", count);
+    manager->metrics.filterAdds += count;
+    if (manager->blockCache) BRBlockCacheAddFilterElements(manager->blockCache, manager->filterAdds, count);
+
+    if (manager->lastBlock->height < manager->estimatedHeight) { // if we're syncing, only download peers have filters
+        for (i = array_count(manager->connectedPeers); i > 0; i--) {
+            p = manager->connectedPeers[i - 1];
+            if (p != manager->downloadPeer && (p->flags & PEER_FLAG_DOWNLOAD) == 0) continue;
+            if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+            for (j = 0; j < count; j++) BRPeerSendFilteradd(p, manager->filterAdds[j].u8, sizeof(UInt160));
+        }
+
+        if (manager->downloadPeer) {
+            // blocks in download windows may have been filtered before the new elements were added, the download
+            // peer will rerequest them
+            array_clear(manager->downloadWindows);
+            manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
+            BRPeerSendPing(manager->downloadPeer, info, _updateFilterLoadDone); // wait for pong so filter is updated
+        }
+        else free(info);
+    }
+    else {
+        free(info);
+
+        for (i = array_count(manager->connectedPeers); i > 0; i--) {
+            p = manager->connectedPeers[i - 1];
+            if (BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+            for (j = 0; j < count; j++) BRPeerSendFilteradd(p, manager->filterAdds[j].u8, sizeof(UInt160));
+            peerInfo = calloc(1, sizeof(*peerInfo));
+            assert(peerInfo != NULL);
+            peerInfo->peer = p;
+            peerInfo->manager = manager;
+            BRPeerSendPing(p, peerInfo, _updateFilterLoadDone); // wait for pong so filter is updated
+        }
+    }
+}
+
+static void _updateFilterPingDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRPeerCallbackInfo *peerInfo;
+    
+    if (success) {
+        _BRPeerManagerLock(manager);
+
+        if (manager->bloomFilter && array_count(manager->filterAdds) > 0) { // add new elements to the loaded filters
+            _BRPeerManagerSendFilterAdds(manager, info);
+            array_clear(manager->filterAdds);
+            _BRPeerManagerUnlock(manager);
+            return;
+        }
+
+        peer_log(peer, "updating filter with newly created wallet addresses");
+        if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+        manager->bloomFilter = NULL;
+        array_clear(manager->filterAdds); // the rebuilt filter includes them
+
+        if (manager->lastBlock->height < manager->estimatedHeight) { // if we're syncing, only update download peer
+            if (manager->downloadPeer) {
+                _BRPeerManagerLoadBloomFilter(manager, manager->downloadPeer);
+                BRPeerSendPing(manager->downloadPeer, info, _updateFilterLoadDone); // wait for pong so filter is loaded
+                
+                // blocks in download windows may have been filtered with the old filter, the download peer will
+                // rerequest them, and peers helping with the download get the new filter
+                array_clear(manager->downloadWindows);
+                manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
+
+                for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+                    BRPeer *p = manager->connectedPeers[i - 1];
+
+                    if (p == manager->downloadPeer || (p->flags & PEER_FLAG_DOWNLOAD) == 0) continue;
+                    if (BRPeerConnectStatus(p) == BRPeerStatusConnected) _BRPeerManagerLoadDownloadFilter(manager, p);
+                }
+            }
+            else free(info);
+        }
+        else {
+            free(info);
+            
+            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+                if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusConnected) continue;
+                peerInfo = calloc(1, sizeof(*peerInfo));
+                assert(peerInfo != NULL);
+                peerInfo->peer = manager->connectedPeers[i - 1];
+                peerInfo->manager = manager;
+                _BRPeerManagerLoadBloomFilter(manager, peerInfo->peer);
+                BRPeerSendPing(peerInfo->peer, peerInfo, _updateFilterLoadDone); // wait for pong so filter is loaded
+            }
+        }
+
+         _BRPeerManagerUnlock(manager);
+    }
+    else free(info);
+}
+
+static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
+{
+    BRPeerCallbackInfo *info;
+
+    if (manager->downloadPeer && (manager->downloadPeer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
+        BRPeerSetNeedsFilterUpdate(manager->downloadPeer, 1);
+        manager->downloadPeer->flags |= PEER_FLAG_NEEDSUPDATE;
+        peer_log(manager->downloadPeer, "filter update needed, waiting for pong");
+        info = calloc(1, sizeof(*info));
+        assert(info != NULL);
+        info->peer = manager->downloadPeer;
+        info->manager = manager;
+        // wait for pong so we're sure to include any tx already sent by the peer in the updated filter
+        BRPeerSendPing(manager->downloadPeer, info, _updateFilterPingDone);
+    }
+}
+
+// unconfirmed transactions that aren't in the mempools of any of connected peers have likely dropped off the network
+static void _requestUnrelayedTxGetdataDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     int isPublishing;
-    size_t count = 0;
+    size_t count = 0, relayCount, requestCount;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (success) peer->flags |= PEER_FLAG_SYNCED;
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -480,26 +1341,30 @@ static void _requestUnrelayedTxGetdataDone(void *info, int success)
         for (size_t i = txCount; i > 0; i--) {
             hash = tx[i - 1]->txHash;
             isPublishing = 0;
+            _BRPeerManagerLockTx(manager);
             
             for (size_t j = array_count(manager->publishedTx); ! isPublishing && j > 0; j--) {
                 if (BRTransactionEq(manager->publishedTx[j - 1].tx, tx[i - 1]) &&
                     manager->publishedTx[j - 1].callback != NULL) isPublishing = 1;
             }
+
+            relayCount = _BRTxPeerListCount(manager->txRelays, hash);
+            requestCount = _BRTxPeerListCount(manager->txRequests, hash);
+            _BRPeerManagerUnlockTx(manager);
             
-            if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) == 0 &&
-                _BRTxPeerListCount(manager->txRequests, hash) == 0) {
+            if (! isPublishing && relayCount == 0 && requestCount == 0) {
                 peer_log(peer, "removing tx unconfirmed at: %d, txHash: %s", manager->lastBlock->height, u256hex(hash));
                 assert(tx[i - 1]->blockHeight == TX_UNCONFIRMED);
                 BRWalletRemoveTransaction(manager->wallet, hash);
             }
-            else if (! isPublishing && _BRTxPeerListCount(manager->txRelays, hash) < manager->maxConnectCount) {
+            else if (! isPublishing && relayCount < manager->maxConnectCount) {
                 // set timestamp 0 to mark as unverified
                 BRWalletUpdateTransactions(manager->wallet, &hash, 1, TX_UNCONFIRMED, 0);
             }
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
 }
 
 static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *peer)
@@ -510,6 +1375,7 @@ static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *pee
     UInt256 txHashes[txCount];
     
     txCount = BRWalletTxUnconfirmedBefore(manager->wallet, tx, txCount, TX_UNCONFIRMED);
+    _BRPeerManagerLockTx(manager);
     
     for (size_t i = 0; i < txCount; i++) {
         if (! _BRTxPeerListHasPeer(manager->txRelays, tx[i]->txHash, peer) &&
@@ -519,6 +1385,8 @@ static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *pee
         }
     }
 
+    _BRPeerManagerUnlockTx(manager);
+
     if (hashCount > 0) {
         BRPeerSendGetdata(peer, txHashes, hashCount, NULL, 0);
     
@@ -535,6 +1403,8 @@ static void _BRPeerManagerRequestUnrelayedTx(BRPeerManager *manager, BRPeer *pee
 
 static void _BRPeerManagerPublishPendingTx(BRPeerManager *manager, BRPeer *peer)
 {
+    _BRPeerManagerLockTx(manager);
+
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         if (manager->publishedTx[i - 1].callback == NULL) continue;
         BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule publish timeout
@@ -542,6 +1412,16 @@ static void _BRPeerManagerPublishPendingTx(BRPeerManager *manager, BRPeer *peer)
     }
     
     BRPeerSendInv(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes));
+    _BRPeerManagerUnlockTx(manager);
+}
+
+// sends a mempool request, along with an inv for any tx being published
+static void _BRPeerManagerSendMempool(BRPeerManager *manager, BRPeer *peer, void *info,
+                                      void (*callback)(void *info, int success))
+{
+    _BRPeerManagerLockTx(manager);
+    BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info, callback);
+    _BRPeerManagerUnlockTx(manager);
 }
 
 static void _mempoolDone(void *info, int success)
@@ -554,7 +1434,7 @@ static void _mempoolDone(void *info, int success)
     
     if (success) {
         peer_log(peer, "mempool request finished");
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
         if (manager->syncStartHeight > 0) {
             peer_log(peer, "sync succeeded");
             syncFinished = 1;
@@ -563,9 +1443,9 @@ static void _mempoolDone(void *info, int success)
 
         _BRPeerManagerRequestUnrelayedTx(manager, peer);
         BRPeerSendGetaddr(peer); // request a list of other bitcoin peers
-        pthread_mutex_unlock(&manager->lock);
+        _BRPeerManagerUnlock(manager);
         if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
-        if (syncFinished && manager->syncStopped) manager->syncStopped(manager->info, 0);
+        if (syncFinished) _BRPeerManagerSyncStoppedCallback(manager, 0);
     }
     else peer_log(peer, "mempool request failed");
 }
@@ -575,12 +1455,11 @@ static void _loadBloomFilterDone(void *info, int success)
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     
     if (success) {
-        BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
-                          _mempoolDone);
-        pthread_mutex_unlock(&manager->lock);
+        _BRPeerManagerSendMempool(manager, peer, info, _mempoolDone);
+        _BRPeerManagerUnlock(manager);
     }
     else {
         free(info);
@@ -588,10 +1467,10 @@ static void _loadBloomFilterDone(void *info, int success)
         if (peer == manager->downloadPeer) {
             peer_log(peer, "sync succeeded");
             _BRPeerManagerSyncStopped(manager);
-            pthread_mutex_unlock(&manager->lock);
-            if (manager->syncStopped) manager->syncStopped(manager->info, 0);
+            _BRPeerManagerUnlock(manager);
+            _BRPeerManagerSyncStoppedCallback(manager, 0);
         }
-        else pthread_mutex_unlock(&manager->lock);
+        else _BRPeerManagerUnlock(manager);
     }
 }
 
@@ -608,13 +1487,16 @@ static void _BRPeerManagerLoadMempools(BRPeerManager *manager)
         info->peer = peer;
         info->manager = manager;
         
-        if (peer != manager->downloadPeer || manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*5.0) {
+        if (manager->compactFilters) { // without a bloom filter, a mempool request would return every tx
+            _BRPeerManagerPublishPendingTx(manager, peer);
+            BRPeerSendPing(peer, info, _mempoolDone);
+        }
+        else if (peer != manager->downloadPeer || manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*5.0) {
             _BRPeerManagerLoadBloomFilter(manager, peer);
             _BRPeerManagerPublishPendingTx(manager, peer);
             BRPeerSendPing(peer, info, _loadBloomFilterDone); // load mempool after updating bloomfilter
         }
-        else BRPeerSendMempool(peer, manager->publishedTxHashes, array_count(manager->publishedTxHashes), info,
-                               _mempoolDone);
+        else _BRPeerManagerSendMempool(manager, peer, info, _mempoolDone);
     }
 }
 
@@ -657,7 +1539,7 @@ static void *_findPeersThreadRoutine(void *arg)
     pthread_cleanup_push(manager->threadCleanup, manager->info);
     addrList = _addressLookup(((BRFindPeersInfo *)arg)->hostname);
     free(arg);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockPeers(manager);
     
     for (addr = addrList; addr && ! UInt128IsZero(*addr); addr++) {
         age = 24*60*60 + BRRand(2*24*60*60); // add between 1 and 3 days
@@ -665,16 +1547,17 @@ static void *_findPeersThreadRoutine(void *arg)
     }
 
     manager->dnsThreadCount--;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
     if (addrList) free(addrList);
     pthread_cleanup_pop(1);
     return NULL;
 }
 
-// DNS peer discovery
+// DNS peer discovery, called with both manager->lock and peerLock held
 static void _BRPeerManagerFindPeers(BRPeerManager *manager)
 {
-    uint64_t services = SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | manager->params->services;
+    uint64_t services = SERVICES_NODE_NETWORK | manager->params->services |
+                        (manager->compactFilters ? SERVICES_NODE_COMPACT_FILTERS : SERVICES_NODE_BLOOM);
     time_t now = time(NULL);
     struct timespec ts;
     pthread_t thread;
@@ -708,9 +1591,11 @@ static void _BRPeerManagerFindPeers(BRPeerManager *manager)
         ts.tv_nsec = 1;
 
         do {
-            pthread_mutex_unlock(&manager->lock);
+            _BRPeerManagerUnlockPeers(manager);
+            _BRPeerManagerUnlock(manager);
             nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-            pthread_mutex_lock(&manager->lock);
+            _BRPeerManagerLock(manager);
+            _BRPeerManagerLockPeers(manager);
         } while (manager->dnsThreadCount > 0 && array_count(manager->peers) < PEER_MAX_CONNECTIONS);
     
         qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
@@ -724,7 +1609,7 @@ static void _peerConnected(void *info)
     BRPeerCallbackInfo *peerInfo;
     time_t now = time(NULL);
     
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (peer->timestamp > now + 2*60*60 || peer->timestamp < now - 2*60*60) peer->timestamp = now; // sanity check
     
     // TODO: XXX does this work with 0.11 pruned nodes?
@@ -740,7 +1625,13 @@ static void _peerConnected(void *info)
         peer_log(peer, "node isn't synced");
         BRPeerDisconnect(peer);
     }
-    else if (BRPeerVersion(peer) >= 70011 && (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
+    else if (manager->compactFilters &&
+             (peer->services & SERVICES_NODE_COMPACT_FILTERS) != SERVICES_NODE_COMPACT_FILTERS) {
+        peer_log(peer, "node doesn't serve compact block filters");
+        BRPeerDisconnect(peer);
+    }
+    else if (! manager->compactFilters && BRPeerVersion(peer) >= 70011 &&
+             (peer->services & SERVICES_NODE_BLOOM) != SERVICES_NODE_BLOOM) {
         peer_log(peer, "node doesn't support SPV mode");
         BRPeerDisconnect(peer);
     }
@@ -755,7 +1646,14 @@ static void _peerConnected(void *info)
             assert(peerInfo != NULL);
             peerInfo->peer = peer;
             peerInfo->manager = manager;
-            BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
+            BRPeerSendPing(peer, peerInfo, (manager->compactFilters) ? _mempoolDone : _loadBloomFilterDone);
+        }
+        else if (manager->bloomFilter && (manager->downloadPeer->flags & PEER_FLAG_NEEDSUPDATE) == 0) {
+            _BRPeerManagerLoadDownloadFilter(manager, peer); // help the download peer with the chain download
+            _BRPeerManagerScheduleDownloads(manager);
+        }
+        else if (manager->compactFilters) {
+            _BRPeerManagerCFRequest(manager); // cross-check the download peer's filter hashes with the new peer
         }
     }
     else { // select the peer with the lowest ping time to download the chain from if we're behind
@@ -774,10 +1672,15 @@ static void _peerConnected(void *info)
             BRPeerDisconnect(manager->downloadPeer);
         }
         
-        manager->downloadPeer = peer;
-        manager->isConnected = 1;
+        __atomic_store_n(&manager->downloadPeer, peer, __ATOMIC_RELAXED);
+        __atomic_store_n(&manager->isConnected, 1, __ATOMIC_RELAXED);
         manager->estimatedHeight = BRPeerLastBlock(peer);
+        array_clear(manager->downloadWindows); // the new download peer will relay the remaining block hashes again
+        manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
+        _BRPeerManagerCFClear(manager);
+        array_clear(manager->filterAdds); // the new download peer gets a rebuilt filter that includes them
         _BRPeerManagerLoadBloomFilter(manager, peer);
+        peer->flags |= PEER_FLAG_DOWNLOAD;
         BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
         _BRPeerManagerPublishPendingTx(manager, peer);
             
@@ -788,8 +1691,12 @@ static void _peerConnected(void *info)
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // schedule sync timeout
 
             // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that
+            // (or in compact filter mode, headers all the way and then filters for them)
             // we do not reset connect failure count yet incase this request times out
-            if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
+            if (manager->compactFilters) {
+                _BRPeerManagerCFRequest(manager);
+            }
+            else if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
                 BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
             }
             else BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
@@ -800,9 +1707,11 @@ static void _peerConnected(void *info)
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
 }
 
+static BRMerkleBlock *_BRPeerManagerCFConnect(BRPeerManager *manager, BRPeer *peer);
+
 static void _peerDisconnected(void *info, int error)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
@@ -812,51 +1721,78 @@ static void _peerDisconnected(void *info, int error)
     size_t txCount = 0;
     
     //free(info);
-    pthread_mutex_lock(&manager->lock);
-
-    BRPublishedTx pubTx[array_count(manager->publishedTx)];
+    _BRPeerManagerLock(manager);
     
     if (error == EPROTO) { // if it's protocol error, the peer isn't following standard policy
         _BRPeerManagerPeerMisbehavin(manager, peer);
     }
     else if (error) { // timeout or some non-protocol related network error
+        _BRPeerManagerLockPeers(manager);
+
         for (size_t i = array_count(manager->peers); i > 0; i--) {
             if (BRPeerEq(&manager->peers[i - 1], peer)) array_rm(manager->peers, i - 1);
         }
         
+        _BRPeerManagerUnlockPeers(manager);
         manager->connectFailureCount++;
+        manager->metrics.connectFailures++;
         
         // if it's a timeout and there's pending tx publish callbacks, the tx publish timed out
         // BUG: XXX what if it's a connect timeout and not a publish timeout?
         if (error == ETIMEDOUT && (peer != manager->downloadPeer || manager->syncStartHeight == 0 ||
                                    array_count(manager->connectedPeers) == 1)) txError = ETIMEDOUT;
     }
-    
-    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
-        peerList = &manager->txRelays[i - 1];
 
-        for (size_t j = array_count(peerList->peers); j > 0; j--) {
-            if (BRPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
-        }
+    if (peer == manager->cfCheckPeer) { // filter hashes being checked will be checked with another peer
+        manager->cfCheckPeer = NULL;
+        manager->cfCheckPending = 0;
     }
 
+    if (peer == manager->cfDisputePeer) manager->cfDisputePeer = NULL;
+
     if (peer == manager->downloadPeer) { // download peer disconnected
-        manager->isConnected = 0;
-        manager->downloadPeer = NULL;
+        __atomic_store_n(&manager->isConnected, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&manager->downloadPeer, NULL, __ATOMIC_RELAXED);
+        array_clear(manager->downloadWindows);
+        manager->downloadLocators[0] = manager->downloadLocators[1] = UINT256_ZERO;
+        _BRPeerManagerCFClear(manager);
+        array_clear(manager->filterAdds); // filters are reloaded when the next download peer is selected
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES) manager->connectFailureCount = MAX_CONNECT_FAILURES;
     }
+    else if ((peer->flags & PEER_FLAG_DOWNLOAD) != 0) { // reassign any download window the peer didn't finish
+        for (size_t i = array_count(manager->downloadWindows); i > 0; i--) {
+            if (manager->downloadWindows[i - 1].peer == peer) manager->downloadWindows[i - 1].peer = NULL;
+        }
+
+        peer->flags &= ~PEER_FLAG_DOWNLOAD;
+        _BRPeerManagerScheduleDownloads(manager);
+    }
 
     if (! manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
         _BRPeerManagerSyncStopped(manager);
         
         // clear out stored peers so we get a fresh list from DNS on next connect attempt
+        _BRPeerManagerLockPeers(manager);
         array_clear(manager->peers);
+        _BRPeerManagerUnlockPeers(manager);
         txError = ENOTCONN; // trigger any pending tx publish callbacks
         willSave = 1;
         peer_log(peer, "sync failed");
     }
     else if (manager->connectFailureCount < MAX_CONNECT_FAILURES) willReconnect = 1;
+
+    _BRPeerManagerLockTx(manager);
+
+    BRPublishedTx pubTx[array_count(manager->publishedTx)];
     
+    for (size_t i = array_count(manager->txRelays); i > 0; i--) {
+        peerList = &manager->txRelays[i - 1];
+
+        for (size_t j = array_count(peerList->peers); j > 0; j--) {
+            if (BRPeerEq(&peerList->peers[j - 1], peer)) array_rm(peerList->peers, j - 1);
+        }
+    }
+
     if (txError) {
         for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
             if (manager->publishedTx[i - 1].callback == NULL) continue;
@@ -866,6 +1802,9 @@ static void _peerDisconnected(void *info, int error)
             manager->publishedTx[i - 1].info = NULL;
         }
     }
+
+    _BRPeerManagerUnlockTx(manager);
+    _BRPeerManagerLockPeers(manager);
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (manager->connectedPeers[i - 1] != peer) continue;
@@ -873,15 +1812,22 @@ static void _peerDisconnected(void *info, int error)
         break;
     }
 
+    _BRPeerManagerUnlockPeers(manager);
+
+    if (manager->compactFilters && manager->downloadPeer) { // check filter hashes with another peer, or trust them
+        _BRPeerManagerCFConnect(manager, manager->downloadPeer);
+        _BRPeerManagerCFRequest(manager);
+    }
+
     BRPeerFree(peer);
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     
     for (size_t i = 0; i < txCount; i++) {
         pubTx[i].callback(pubTx[i].info, txError);
     }
     
-    if (willSave && manager->savePeers) manager->savePeers(manager->info, 1, NULL, 0);
-    if (willSave && manager->syncStopped) manager->syncStopped(manager->info, error);
+    if (willSave) _BRPeerManagerQueueSavePeers(manager, 1, NULL, 0);
+    if (willSave) _BRPeerManagerSyncStoppedCallback(manager, error);
     if (willReconnect) BRPeerManagerConnect(manager); // try connecting to another peer
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
 }
@@ -892,8 +1838,8 @@ static void _peerRelayedPeers(void *info, const BRPeer peers[], size_t peersCoun
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     time_t now = time(NULL);
 
-    pthread_mutex_lock(&manager->lock);
-    peer_log(peer, "relayed %zu peer(s)", peersCount);
+    _BRPeerManagerLockPeers(manager);
+    peer_dbg(peer, "relayed %zu peer(s)", peersCount);
 
     array_add_array(manager->peers, peers, peersCount);
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers), _peerTimestampCompare);
@@ -909,24 +1855,26 @@ static void _peerRelayedPeers(void *info, const BRPeer peers[], size_t peersCoun
     BRPeer save[peersCount];
 
     for (size_t i = 0; i < peersCount; i++) save[i] = manager->peers[i];
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
     
     // peer relaying is complete when we receive <1000
-    if (peersCount > 1 && peersCount < 1000 &&
-        manager->savePeers) manager->savePeers(manager->info, 1, save, peersCount);
+    if (peersCount > 1 && peersCount < 1000) _BRPeerManagerQueueSavePeers(manager, 1, save, peersCount);
 }
 
+// tx relay is tracked under txLock, so unlike blocks, relayed mempool tx don't wait on manager->lock, which is only
+// taken for a wallet tx that may have used up addresses in the bloom filter
 static void _peerRelayedTx(void *info, BRTransaction *tx)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     void *txInfo = NULL;
     void (*txCallback)(void *, int) = NULL;
-    int isWalletTx = 0, hasPendingCallbacks = 0;
+    int isWalletTx = 0, hasPendingCallbacks = 0, isSynced;
     size_t relayCount = 0;
     
-    pthread_mutex_lock(&manager->lock);
-    peer_log(peer, "relayed tx: %s", u256hex(tx->txHash));
+    peer_dbg(peer, "relayed tx: %s", u256hex(tx->txHash));
+    isSynced = (__atomic_load_n(&manager->syncStartHeight, __ATOMIC_RELAXED) == 0);
+    _BRPeerManagerLockTx(manager);
     
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
         if (UInt256Eq(manager->publishedTxHashes[i - 1], tx->txHash)) {
@@ -939,62 +1887,89 @@ static void _peerRelayedTx(void *info, BRTransaction *tx)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
+    _BRPeerManagerUnlockTx(manager);
+
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    if (! hasPendingCallbacks && ! _BRPeerManagerIsSyncPeer(manager, peer)) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    if (manager->syncStartHeight == 0 || BRWalletContainsTransaction(manager->wallet, tx)) {
+    if (isSynced || BRWalletContainsTransaction(manager->wallet, tx)) {
         isWalletTx = BRWalletRegisterTransaction(manager->wallet, tx);
         if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
     }
-    else {
+    else { // a bloom filter false positive
+        _BRPeerManagerLockTx(manager);
+        manager->metrics.falsePositives++;
+        _BRPeerManagerUnlockTx(manager);
+        BRPeerAddFalsePositives(peer, 1);
         BRTransactionFree(tx);
         tx = NULL;
     }
     
     if (tx && isWalletTx) {
+        BRTransaction **txs = NULL;
+
         // reschedule sync timeout
-        if (manager->syncStartHeight > 0 && peer == manager->downloadPeer) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
-        }
-        
+        if (_BRPeerManagerIsSyncPeer(manager, peer)) BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+
         if (BRWalletAmountSentByTx(manager->wallet, tx) > 0 && BRWalletTransactionIsValid(manager->wallet, tx)) {
-            _BRPeerManagerAddTxToPublishList(manager, tx, NULL, NULL); // add valid send tx to mempool
+            txs = _BRPeerManagerTxsToPublish(manager, tx); // add valid send tx to mempool
         }
 
+        _BRPeerManagerLockTx(manager);
+        if (txs) _BRPeerManagerAddTxToPublishList(manager, txs, array_count(txs), NULL, NULL);
+
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
+        if (isSynced) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, tx->txHash, peer);
         
         _BRTxPeerListRemovePeer(manager->txRequests, tx->txHash, peer);
+        _BRPeerManagerUnlockTx(manager);
+        if (txs) array_free(txs);
+        _BRPeerManagerLock(manager);
         
         if (manager->bloomFilter != NULL) { // check if bloom filter is already being updated
-            BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
-            UInt160 hash;
+            UInt160 pkh[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL], hash;
+            size_t pkhCount;
 
             // the transaction likely consumed one or more wallet addresses, so check that at least the next <gap limit>
             // unused addresses are still matched by the bloom filter
-            BRWalletUnusedAddrs(manager->wallet, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
-            BRWalletUnusedAddrs(manager->wallet, addrs + SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+            pkhCount = BRWalletUnusedPKH(manager->wallet, pkh, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+            pkhCount += BRWalletUnusedPKH(manager->wallet, &pkh[pkhCount], SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+
+            for (size_t i = 0; i < pkhCount; i++) {
+                hash = pkh[i];
+                if (BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
+
+                // while the filter's expected false positive rate is within the rate it was built for, and the
+                // noisier rate observed in blocks hasn't degraded past the point a mempool request reloads the filter,
+                // add the new address to it, and send it to peers with filteradd once any pending requests are done,
+                // otherwise rebuild the filter so it's sized for the wallet's addresses again
+                if (BRBloomFilterFalsePositiveRate(manager->bloomFilter) < manager->filterFpRate &&
+                    manager->fpRate <= manager->filterFpRate*5.0) {
+                    BRBloomFilterInsertData(manager->bloomFilter, hash.u8, sizeof(hash));
+                    array_add(manager->filterAdds, hash);
+                    continue;
+                }
 
-            for (size_t i = 0; i < SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL; i++) {
-                if (! BRAddressHash160(&hash, addrs[i].s) ||
-                    BRBloomFilterContainsData(manager->bloomFilter, hash.u8, sizeof(hash))) continue;
                 if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
                 manager->bloomFilter = NULL; // reset bloom filter so it's recreated with new wallet addresses
-                _BRPeerManagerUpdateFilter(manager);
                 break;
             }
+
+            if (! manager->bloomFilter || array_count(manager->filterAdds) > 0) _BRPeerManagerUpdateFilter(manager);
         }
+
+        _BRPeerManagerUnlock(manager);
     }
     
     // set timestamp when tx is verified
-    if (tx && relayCount >= manager->maxConnectCount && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
+    if (tx && relayCount >= __atomic_load_n(&manager->maxConnectCount, __ATOMIC_RELAXED) &&
+        tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
         BRWalletUpdateTransactions(manager->wallet, &tx->txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
     }
     
-    pthread_mutex_unlock(&manager->lock);
     if (txCallback) txCallback(txInfo, 0);
 }
 
@@ -1007,9 +1982,9 @@ static void _peerHasTx(void *info, UInt256 txHash)
     int isWalletTx = 0, hasPendingCallbacks = 0;
     size_t relayCount = 0;
     
-    pthread_mutex_lock(&manager->lock);
     tx = BRWalletTransactionForHash(manager->wallet, txHash);
-    peer_log(peer, "has tx: %s", u256hex(txHash));
+    peer_dbg(peer, "has tx: %s", u256hex(txHash));
+    _BRPeerManagerLockTx(manager);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) { // see if tx is in list of published tx
         if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
@@ -1022,8 +1997,10 @@ static void _peerHasTx(void *info, UInt256 txHash)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
     
+    _BRPeerManagerUnlockTx(manager);
+
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    if (! hasPendingCallbacks && ! _BRPeerManagerIsSyncPeer(manager, peer)) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
@@ -1032,23 +2009,25 @@ static void _peerHasTx(void *info, UInt256 txHash)
         if (isWalletTx) tx = BRWalletTransactionForHash(manager->wallet, tx->txHash);
 
         // reschedule sync timeout
-        if (manager->syncStartHeight > 0 && peer == manager->downloadPeer && isWalletTx) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
-        }
+        if (isWalletTx && _BRPeerManagerIsSyncPeer(manager, peer)) BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT);
+        _BRPeerManagerLockTx(manager);
         
         // keep track of how many peers have or relay a tx, this indicates how likely the tx is to confirm
         // (we only need to track this after syncing is complete)
-        if (manager->syncStartHeight == 0) relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        if (__atomic_load_n(&manager->syncStartHeight, __ATOMIC_RELAXED) == 0) {
+            relayCount = _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+        }
+
+        _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+        _BRPeerManagerUnlockTx(manager);
 
         // set timestamp when tx is verified
-        if (relayCount >= manager->maxConnectCount && tx && tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
+        if (relayCount >= __atomic_load_n(&manager->maxConnectCount, __ATOMIC_RELAXED) && tx &&
+            tx->blockHeight == TX_UNCONFIRMED && tx->timestamp == 0) {
             BRWalletUpdateTransactions(manager->wallet, &txHash, 1, TX_UNCONFIRMED, (uint32_t)time(NULL));
         }
-
-        _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
     }
     
-    pthread_mutex_unlock(&manager->lock);
     if (pubTx.callback) pubTx.callback(pubTx.info, 0);
 }
 
@@ -1057,14 +2036,17 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     BRTransaction *tx, *t;
+    int wasRelayed;
 
-    pthread_mutex_lock(&manager->lock);
     peer_log(peer, "rejected tx: %s", u256hex(txHash));
     tx = BRWalletTransactionForHash(manager->wallet, txHash);
+    _BRPeerManagerLockTx(manager);
     _BRTxPeerListRemovePeer(manager->txRequests, txHash, peer);
+    wasRelayed = (tx && _BRTxPeerListRemovePeer(manager->txRelays, txHash, peer));
+    _BRPeerManagerUnlockTx(manager);
 
     if (tx) {
-        if (_BRTxPeerListRemovePeer(manager->txRelays, txHash, peer) && tx->blockHeight == TX_UNCONFIRMED) {
+        if (wasRelayed && tx->blockHeight == TX_UNCONFIRMED) {
             // set timestamp 0 to mark tx as unverified
             BRWalletUpdateTransactions(manager->wallet, &txHash, 1, TX_UNCONFIRMED, 0);
         }
@@ -1082,7 +2064,6 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code)
         }
     }
 
-    pthread_mutex_unlock(&manager->lock);
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
 }
 
@@ -1102,7 +2083,8 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
         }
 
         if (! b) {
-            peer_log(peer, "missing previous difficulty tansition, can't verify block: %s", u256hex(block->blockHash));
+            _block_log(peer, "missing previous difficulty tansition, can't verify block: %s",
+                       u256hex(block->blockHash));
             r = 0;
         }
         else prevBlock = b->prevBlock;
@@ -1120,8 +2102,8 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
 
     // verify block difficulty
     if (r && ! manager->params->verifyDifficulty(block, manager->blocks)) {
-        peer_log(peer, "relayed block with invalid difficulty target %x, blockHash: %s", block->target,
-                 u256hex(block->blockHash));
+        _block_log(peer, "relayed block with invalid difficulty target %x, blockHash: %s", block->target,
+                   u256hex(block->blockHash));
         r = 0;
     }
     
@@ -1130,8 +2112,8 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
 
         // verify blockchain checkpoints
         if (checkpoint && ! BRMerkleBlockEq(block, checkpoint)) {
-            peer_log(peer, "relayed a block that differs from the checkpoint at height %"PRIu32", blockHash: %s, "
-                     "expected: %s", block->height, u256hex(block->blockHash), u256hex(checkpoint->blockHash));
+            _block_log(peer, "relayed a block that differs from the checkpoint at height %"PRIu32", blockHash: %s, "
+                       "expected: %s", block->height, u256hex(block->blockHash), u256hex(checkpoint->blockHash));
             r = 0;
         }
     }
@@ -1139,20 +2121,352 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+// loads the stored headers from fromHeight to toHeight into manager->blocks, and returns the last block loaded
+static BRMerkleBlock *_BRPeerManagerLoadStoredBlocks(BRPeerManager *manager, uint32_t fromHeight, uint32_t toHeight)
+{
+    BRMerkleBlock *block, *b = NULL;
+    uint32_t height = BRHeaderStoreFirstHeight(manager->headerStore);
+
+    if (height == BLOCK_UNKNOWN_HEIGHT) return NULL;
+    if (fromHeight < height) fromHeight = height;
+
+    for (height = fromHeight; height <= toHeight; height++) {
+        block = BRMerkleBlockNew();
+
+        if (! BRHeaderStoreHeaderAtHeight(manager->headerStore, height, block)) {
+            BRMerkleBlockFree(block);
+            break;
+        }
+
+        b = BRSetGet(manager->blocks, block);
+
+        if (b) {
+            BRMerkleBlockFree(block);
+        }
+        else BRSetAdd(manager->blocks, (b = block));
+    }
+
+    return b;
+}
+
+// appends block to the header store, along with any of its ancestors that aren't stored yet
+static void _BRPeerManagerStoreBlock(BRPeerManager *manager, BRMerkleBlock *block)
+{
+    BRHeaderStore *store = manager->headerStore;
+    uint32_t minHeight = block->height - (block->height % BLOCK_DIFFICULTY_INTERVAL);
+    BRMerkleBlock *b = block, **chain;
+    int canStart;
+
+    if (BRHeaderStoreCount(store) > 0 && BRHeaderStoreAppend(store, block)) return; // block extends the stored chain
+    array_new(chain, 10);
+
+    // walk back to where the chain joins the store (after a chain reorg), or to the last difficulty transition if the
+    // store is new, checkpoints only have partial headers and are never stored
+    while (b && b->height >= minHeight && BRHeaderStoreHeightForHash(store, b->blockHash) != b->height &&
+           BRSetGet(manager->checkpoints, b) != b) {
+        array_add(chain, b);
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+    }
+
+    // a new store must start at the difficulty transition, or right after a checkpoint at the transition, so the chain
+    // loaded from it can verify the next retarget, if the blocks back to there aren't in memory, wait for the next one
+    canStart = (array_count(chain) > 0 &&
+                (chain[array_count(chain) - 1]->height == minHeight || (b && b->height == minHeight)));
+    if (BRHeaderStoreCount(store) == 0 && ! canStart) array_clear(chain);
+
+    if (array_count(chain) > 0) {
+        b = chain[array_count(chain) - 1];
+        BRHeaderStoreTruncate(store, b->height); // remove stored headers that are no longer in the main chain
+
+        if (! BRHeaderStoreAppend(store, b)) { // start a new store if the chain doesn't connect to what's stored
+            BRHeaderStoreTruncate(store, 0);
+            if (canStart) BRHeaderStoreAppend(store, b);
+        }
+
+        for (size_t i = array_count(chain) - 1; BRHeaderStoreCount(store) > 0 && i > 0; i--) {
+            BRHeaderStoreAppend(store, chain[i - 1]);
+        }
+    }
+
+    array_free(chain);
+}
+
+// adds a main chain block to the block cache, along with its wallet transactions
+static void _BRPeerManagerCacheBlock(BRPeerManager *manager, BRMerkleBlock *block, const UInt256 txHashes[],
+                                     size_t txCount)
+{
+    BRTransaction *tx, **transactions;
+    size_t i, count = 0;
+
+    if (! manager->blockCache || manager->compactFilters) return; // compact filter blocks aren't filtered blocks
+    transactions = malloc(txCount*sizeof(*transactions) + 1);
+    assert(transactions != NULL);
+
+    for (i = 0; i < txCount; i++) { // skip bloom filter false positives
+        tx = BRWalletTransactionForHash(manager->wallet, txHashes[i]);
+        if (tx && BRWalletContainsTransaction(manager->wallet, tx)) transactions[count++] = tx;
+    }
+
+    if (! BRBlockCacheAdd(manager->blockCache, block, transactions, count)) {
+        br_log(BRLogLevelWarning, "error adding block #%"PRIu32" to block cache", block->height);
+    }
+
+    free(transactions);
+}
+
+// sets the heights of the wallet transactions in confirmations, whose hashes were appended to hashes in the same order,
+// with a single wallet update, and frees both arrays
+static void _BRPeerManagerConfirmTransactions(BRPeerManager *manager, BRTxConfirmation *confirmations, UInt256 *hashes)
+{
+    for (size_t i = 0, j = 0; i < array_count(confirmations); j += confirmations[i].txCount, i++) {
+        confirmations[i].txHashes = &hashes[j];
+    }
+
+    if (array_count(confirmations) > 0) {
+        BRWalletConfirmTransactions(manager->wallet, confirmations, array_count(confirmations));
+    }
+
+    array_free(confirmations);
+    array_free(hashes);
+}
+
+// adds block to the end of the main chain, returns the number of blocks that should now be saved
+static size_t _BRPeerManagerExtendChain(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block,
+                                        const UInt256 txHashes[], size_t txCount, uint32_t txTime)
+{
+    size_t saveCount = 0;
+
+    if ((block->height % 500) == 0 || txCount > 0 || block->height >= BRPeerLastBlock(peer)) {
+        peer_log(peer, "adding block #%"PRIu32", false positive rate: %f", block->height, manager->fpRate);
+    }
+    
+    BRSetAdd(manager->blocks, block);
+    manager->lastBlock = block;
+    if (manager->headerStore) _BRPeerManagerStoreBlock(manager, block);
+    if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
+    _BRPeerManagerCacheBlock(manager, block, txHashes, txCount);
+    if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
+        
+    if (block->height < manager->estimatedHeight && manager->downloadPeer &&
+        (peer == manager->downloadPeer || (peer->flags & PEER_FLAG_DOWNLOAD) != 0)) {
+        BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
+    }
+    
+    if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0 && block->height + 100 < manager->estimatedHeight) {
+        saveCount = 1; // save transition blocks immediately
+    }
+    
+    if (block->height == manager->estimatedHeight) { // chain download is complete
+        saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+        _BRPeerManagerLoadMempools(manager);
+    }
+
+    return saveCount;
+}
+
+// queues up to saveCount blocks of the chain ending in block to be saved, starting at a difficulty transition
+static void _BRPeerManagerSaveBlocks(BRPeerManager *manager, BRMerkleBlock *block, size_t saveCount)
+{
+    BRMerkleBlock *saveBlocks[saveCount], *b;
+    size_t i, j;
+    
+    for (i = 0, b = block; b && i < saveCount; i++) {
+        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
+        saveBlocks[i] = b;
+        b = BRSetGet(manager->blocks, &b->prevBlock);
+    }
+    
+    // make sure the set of blocks to be saved starts at a difficulty interval
+    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
+    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
+    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
+    _BRPeerManagerQueueSaveBlocks(manager, (i > 1 ? 1 : 0), saveBlocks, i, (manager->headerStore != NULL));
+}
+
+// rebuilds the wallet scriptPubKeys that compact filters are matched against, when new addresses have been generated
+static void _BRPeerManagerCFUpdateScripts(BRPeerManager *manager)
+{
+    size_t i, pkhCount = BRWalletAllPKH(manager->wallet, NULL, 0);
+    UInt160 *pkh;
+    uint8_t *s;
+
+    if (manager->cfScripts && pkhCount == manager->cfAddrsCount) return;
+    pkh = malloc(pkhCount*sizeof(*pkh));
+    assert(pkh != NULL);
+    pkhCount = BRWalletAllPKH(manager->wallet, pkh, pkhCount);
+    manager->cfScriptData = realloc(manager->cfScriptData, pkhCount*(25 + 22) + 1);
+    manager->cfScripts = realloc(manager->cfScripts, (pkhCount*2 + 1)*sizeof(*manager->cfScripts));
+    manager->cfScriptLens = realloc(manager->cfScriptLens, (pkhCount*2 + 1)*sizeof(*manager->cfScriptLens));
+    assert(manager->cfScriptData != NULL);
+    assert(manager->cfScripts != NULL);
+    assert(manager->cfScriptLens != NULL);
+    manager->cfScriptsCount = 0;
+
+    for (i = 0, s = manager->cfScriptData; i < pkhCount; i++) {
+        // a wallet key can be paid to with either a legacy pay-to-pubkey-hash or a pay-to-witness-pubkey-hash script
+        s[0] = OP_DUP, s[1] = OP_HASH160, s[2] = sizeof(*pkh);
+        UInt160Set(&s[3], pkh[i]);
+        s[23] = OP_EQUALVERIFY, s[24] = OP_CHECKSIG;
+        manager->cfScripts[manager->cfScriptsCount] = s;
+        manager->cfScriptLens[manager->cfScriptsCount++] = 25;
+        s += 25;
+        s[0] = OP_0, s[1] = sizeof(*pkh);
+        UInt160Set(&s[2], pkh[i]);
+        manager->cfScripts[manager->cfScriptsCount] = s;
+        manager->cfScriptLens[manager->cfScriptsCount++] = 22;
+        s += 22;
+    }
+
+    manager->cfAddrsCount = pkhCount;
+    free(pkh);
+}
+
+// adds a header from the download peer to the headers waiting for compact filters, a header that forks off them
+// replaces the ones after its fork point, and one that forks off the main chain starts a new list of waiting headers,
+// which replaces the main chain after the fork point once it's longer (see _BRPeerManagerCFReorganize())
+static void _BRPeerManagerCFAddHeader(BRPeerManager *manager, BRPeer *peer, const BRMerkleBlock *header)
+{
+    size_t i, count = array_count(manager->cfEntries);
+    UInt256 base = (count > 0) ? manager->cfEntries[0].block->prevBlock : manager->lastBlock->blockHash;
+    BRMerkleBlock *prev = NULL, *b;
+
+    for (i = count; i > 0 && ! UInt256Eq(manager->cfEntries[i - 1].block->blockHash, header->prevBlock); i--);
+    if (i < count && UInt256Eq(manager->cfEntries[i].block->blockHash, header->blockHash)) return; // already waiting
+    if (i > 0) prev = manager->cfEntries[i - 1].block;
+
+    if (! prev && ! BRSetContains(manager->blocks, header)) { // check if header forks off the main chain
+        prev = BRSetGet(manager->blocks, &header->prevBlock);
+        b = manager->lastBlock;
+        while (b && prev && b->height > prev->height) b = BRSetGet(manager->blocks, &b->prevBlock);
+        if (b != prev) prev = NULL;
+    }
+
+    if (! prev) return; // header is already in the chain, or doesn't connect to it
+
+    if (i == 0 && ! UInt256Eq(header->prevBlock, base)) {
+        if (prev != manager->lastBlock &&
+            prev->height <= manager->params->checkpoints[manager->params->checkpointsCount - 1].height) {
+            peer_log(peer, "ignoring header on fork older than most recent checkpoint, block #%"PRIu32", hash: %s",
+                     prev->height + 1, u256hex(header->blockHash));
+            return;
+        }
+
+        manager->cfFilterHeader = UINT256_ZERO; // the filter header of the fork point isn't known
+    }
+
+    if (i == 0 && prev != manager->lastBlock) peer_log(peer, "chain fork reached height %"PRIu32, prev->height + 1);
+
+    if (i < count) {
+        peer_log(peer, "chain fork at height %"PRIu32", dropping %zu header(s) waiting for compact filters",
+                 prev->height + 1, count - i);
+        _BRPeerManagerCFTruncate(manager, i);
+    }
+
+    array_add(manager->cfEntries, ((const BRCFilterEntry) { BRMerkleBlockCopy(header) }));
+    manager->cfEntries[i].block->height = prev->height + 1;
+}
+
+// replaces the main chain after the fork point of the headers waiting for compact filters once they're longer, marking
+// wallet transactions after the fork point as unconfirmed until they're found again with the new chain's filters, or
+// discards the headers if the download peer has no more of them, returns true if the main chain was replaced
+static int _BRPeerManagerCFReorganize(BRPeerManager *manager, BRPeer *peer)
+{
+    size_t count = array_count(manager->cfEntries);
+    BRMerkleBlock *b = BRSetGet(manager->blocks, &manager->cfEntries[0].block->prevBlock);
+    uint32_t height = manager->cfEntries[count - 1].block->height;
+
+    if (! b || (manager->cfHeadersDone && height <= manager->lastBlock->height)) {
+        peer_log(peer, "ignoring chain fork that isn't longer than the main chain");
+        _BRPeerManagerCFTruncate(manager, 0);
+        return 0;
+    }
+
+    if (height <= manager->lastBlock->height) return 0; // wait for more headers
+
+    // TODO: calculate chain work and use that instead of block height to determine longest chain
+    peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, height);
+    BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+    manager->lastBlock = b;
+    return 1;
+}
+
+// adds headers waiting for compact filters to the chain in order, for as long as their filter hashes have been
+// cross-checked, and their filters show no wallet transactions, or their full blocks have been downloaded, and requests
+// the full block for the first filter that matches, returns the last block added to the chain, or NULL if none were
+static BRMerkleBlock *_BRPeerManagerCFConnect(BRPeerManager *manager, BRPeer *peer)
+{
+    BRCFilterEntry *e;
+    BRMerkleBlock *block = NULL;
+    size_t i, txCount, saveCount;
+    uint32_t txTime;
+
+    _BRPeerManagerCFUpdateScripts(manager);
+    _BRPeerManagerCFCheck(manager);
+
+    for (i = 0; i < manager->cfCheckedCount; i++) {
+        e = &manager->cfEntries[i];
+
+        if (e->block->totalTx == 0) { // full block hasn't been downloaded
+            if (! e->filter || e->fullRequested) break;
+
+            if (BRBlockFilterMatchAny(e->filter, e->filterLen, e->block->blockHash, manager->cfScripts,
+                                      manager->cfScriptLens, manager->cfScriptsCount)) {
+                BRPeerSendGetdataBlocks(peer, &e->block->blockHash, 1);
+                e->fullRequested = 1;
+                break;
+            }
+        }
+
+        if (i == 0 && ! UInt256Eq(e->block->prevBlock, manager->lastBlock->blockHash) &&
+            ! _BRPeerManagerCFReorganize(manager, peer)) break;
+
+        if (! _BRPeerManagerVerifyBlock(manager, e->block, manager->lastBlock, peer)) {
+            peer_log(peer, "relayed invalid block");
+            _BRPeerManagerPeerMisbehavin(manager, peer);
+            break;
+        }
+
+        txCount = BRMerkleBlockTxHashes(e->block, NULL, 0);
+
+        UInt256 txHashes[(txCount > 0) ? txCount : 1];
+
+        txCount = BRMerkleBlockTxHashes(e->block, txHashes, txCount);
+        txTime = e->block->timestamp/2 + manager->lastBlock->timestamp/2;
+        block = e->block;
+        e->block = NULL;
+        saveCount = _BRPeerManagerExtendChain(manager, peer, block, txHashes, txCount, txTime);
+        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+        if (saveCount > 0) _BRPeerManagerSaveBlocks(manager, block, saveCount);
+        manager->cfFilterHeader = e->filterHeader;
+        free(e->filter);
+        e->filter = NULL;
+    }
+
+    if (i > 0) {
+        array_rm_range(manager->cfEntries, 0, i);
+        manager->cfHashesCount -= i;
+        manager->cfCheckedCount -= i;
+        manager->cfFiltersCount -= i;
+    }
+
+    return block;
+}
+
+// adds a block relayed by peer to the chain, or holds it as an orphan, and returns the next block if it was received as
+// an orphan and can now be added
+static BRMerkleBlock *_BRPeerManagerAcceptBlock(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block)
 {
-    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
-    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     size_t txCount = BRMerkleBlockTxHashes(block, NULL, 0);
     UInt256 _txHashes[(sizeof(UInt256)*txCount <= 0x1000) ? txCount : 0],
             *txHashes = (sizeof(UInt256)*txCount <= 0x1000) ? _txHashes : malloc(txCount*sizeof(*txHashes));
-    size_t i, j, fpCount = 0, saveCount = 0;
+    size_t i, fpCount = 0, saveCount = 0;
     BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
     uint32_t txTime = 0;
     
     assert(txHashes != NULL);
     txCount = BRMerkleBlockTxHashes(block, txHashes, txCount);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     prev = BRSetGet(manager->blocks, &block->prevBlock);
 
     if (prev) {
@@ -1182,6 +2496,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         }
         else if (manager->lastBlock->height + 500 < BRPeerLastBlock(peer) &&
                  manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*10.0) {
+            array_clear(manager->filterAdds); // a full rebuild includes any pending additions
             _BRPeerManagerUpdateFilter(manager); // rebuild bloom filter when it starts to degrade
         }
     }
@@ -1191,7 +2506,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         BRMerkleBlockFree(block);
         block = NULL;
     }
-    else if (manager->bloomFilter == NULL) { // ingore potentially incomplete blocks when a filter update is pending
+    else if ((manager->bloomFilter == NULL && ! manager->compactFilters) || array_count(manager->filterAdds) > 0) {
+        // ingore potentially incomplete blocks when a filter update is pending
         BRMerkleBlockFree(block);
         block = NULL;
 
@@ -1205,7 +2521,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
                  u256hex(block->blockHash), u256hex(block->prevBlock), u256hex(manager->lastBlock->blockHash),
                  manager->lastBlock->height);
         
-        if (block->timestamp + 7*24*60*60 < time(NULL)) { // ignore orphans older than one week ago
+        // ignore orphans older than one week ago, unless they were downloaded ahead of the chain tip
+        if (block->timestamp + 7*24*60*60 < time(NULL) &&
+            ! _BRPeerManagerDownloadWindow(manager, block->blockHash, NULL)) {
             BRMerkleBlockFree(block);
             block = NULL;
         }
@@ -1221,7 +2539,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
                 BRPeerSendGetblocks(peer, locators, locatorsCount, UINT256_ZERO);
             }
             
-            BRSetAdd(manager->orphans, block); // BUG: limit total orphans to avoid memory exhaustion attack
+            b = BRSetAdd(manager->orphans, block); // BUG: limit total orphans to avoid memory exhaustion attack
+            if (b && b != block) BRMerkleBlockFree(b); // replaced an orphan with the same previous block
             manager->lastOrphan = block;
         }
     }
@@ -1231,140 +2550,465 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         block = NULL;
         _BRPeerManagerPeerMisbehavin(manager, peer);
     }
-    else if (UInt256Eq(block->prevBlock, manager->lastBlock->blockHash)) { // new block extends main chain
-        if ((block->height % 500) == 0 || txCount > 0 || block->height >= BRPeerLastBlock(peer)) {
-            peer_log(peer, "adding block #%"PRIu32", false positive rate: %f", block->height, manager->fpRate);
+    else if (UInt256Eq(block->prevBlock, manager->lastBlock->blockHash)) { // new block extends main chain
+        saveCount = _BRPeerManagerExtendChain(manager, peer, block, txHashes, txCount, txTime);
+    }
+    else if (BRSetContains(manager->blocks, block)) { // we already have the block (or at least the header)
+        if ((block->height % 500) == 0 || txCount > 0 || block->height >= BRPeerLastBlock(peer)) {
+            peer_log(peer, "relayed existing block #%"PRIu32, block->height);
+        }
+        
+        b = manager->lastBlock;
+        while (b && b->height > block->height) b = BRSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
+        
+        if (BRMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
+            if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
+            if (block->height == manager->lastBlock->height) manager->lastBlock = block;
+            if (block->totalTx > 0) _BRPeerManagerCacheBlock(manager, block, txHashes, txCount);
+        }
+        
+        b = BRSetAdd(manager->blocks, block);
+
+        if (b != block) {
+            if (BRSetGet(manager->orphans, b) == b) BRSetRemove(manager->orphans, b);
+            if (manager->lastOrphan == b) manager->lastOrphan = NULL;
+            BRMerkleBlockFree(b);
+        }
+    }
+    else if (manager->lastBlock->height < BRPeerLastBlock(peer) &&
+             block->height > manager->lastBlock->height + 1) { // special case, new block mined durring rescan
+        peer_log(peer, "marking new block #%"PRIu32" as orphan until rescan completes", block->height);
+        BRSetAdd(manager->orphans, block); // mark as orphan til we're caught up
+        manager->lastOrphan = block;
+    }
+    else if (block->height <= manager->params->checkpoints[manager->params->checkpointsCount - 1].height) { // old fork
+        peer_log(peer, "ignoring block on fork older than most recent checkpoint, block #%"PRIu32", hash: %s",
+                 block->height, u256hex(block->blockHash));
+        BRMerkleBlockFree(block);
+        block = NULL;
+    }
+    else { // new block is on a fork
+        peer_log(peer, "chain fork reached height %"PRIu32, block->height);
+        BRSetAdd(manager->blocks, block);
+
+        // TODO: calculate chain work and use that instead of block height to determine longest chain
+        if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
+            b = block;
+            b2 = manager->lastBlock;
+            
+            while (b && b2 && ! BRMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
+                b = BRSetGet(manager->blocks, &b->prevBlock);
+                if (b && b->height < b2->height) b2 = BRSetGet(manager->blocks, &b2->prevBlock);
+            }
+            
+            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
+        
+            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+
+            BRTxConfirmation *confirmations;
+            UInt256 *hashes;
+
+            array_new(confirmations, 10);
+            array_new(hashes, 10);
+            b = block;
+        
+            while (b && b2 && b->height > b2->height) { // collect transaction heights for new main chain
+                size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
+                uint32_t height = b->height, timestamp = b->timestamp;
+                
+                if (count > txCount) {
+                    txHashes = (txHashes != _txHashes) ? realloc(txHashes, count*sizeof(*txHashes)) :
+                               malloc(count*sizeof(*txHashes));
+                    assert(txHashes != NULL);
+                    txCount = count;
+                }
+                
+                count = BRMerkleBlockTxHashes(b, txHashes, count);
+                if (b->totalTx > 0) _BRPeerManagerCacheBlock(manager, b, txHashes, count);
+                b = BRSetGet(manager->blocks, &b->prevBlock);
+                if (b) timestamp = timestamp/2 + b->timestamp/2;
+                if (count == 0) continue;
+                array_add_array(hashes, txHashes, count);
+                array_add(confirmations, ((const BRTxConfirmation) { NULL, count, height, timestamp }));
+            }
+
+            _BRPeerManagerConfirmTransactions(manager, confirmations, hashes); // set them in one wallet update
+        
+            manager->lastBlock = block;
+            if (manager->headerStore) _BRPeerManagerStoreBlock(manager, block);
+            
+            if (block->height == manager->estimatedHeight) { // chain download is complete
+                saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
+                _BRPeerManagerLoadMempools(manager);
+            }
+        }
+    }
+   
+    if (txHashes != _txHashes) free(txHashes);
+   
+    if (block && block->height != BLOCK_UNKNOWN_HEIGHT) {
+        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+        
+        // check if the next block was received as an orphan
+        orphan.prevBlock = block->blockHash;
+        next = BRSetRemove(manager->orphans, &orphan);
+    }
+    
+    if (saveCount > 0) _BRPeerManagerSaveBlocks(manager, block, saveCount);
+    if (block && array_count(manager->downloadWindows) > 0) _BRPeerManagerDownloadReceived(manager, block->blockHash);
+    _BRPeerManagerUnlock(manager);
+    
+    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
+        manager->txStatusUpdate) {
+        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    }
+    
+    return next;
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+
+    // blocks downloaded out of order can leave a long run of orphans, so connect them in a loop rather than recursing
+    while (block) block = _BRPeerManagerAcceptBlock(manager, peer, block);
+}
+
+// headers are only valid for the duration of the call, and are copied into manager->blocks if they're kept
+static void _peerRelayedHeaders(void *info, BRMerkleBlock headers[], size_t headersCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRMerkleBlock orphan, *header, *block, *prev, *next;
+    size_t count, saveCount;
+    uint32_t lastHeight = BLOCK_UNKNOWN_HEIGHT;
+
+    _BRPeerManagerLock(manager);
+
+    for (size_t i = 0; i < headersCount; i++) {
+        header = &headers[i];
+        prev = manager->lastBlock;
+        count = array_count(manager->cfEntries);
+
+        // in compact filter mode, headers newer than one week before earliestKeyTime wait for their filters
+        if (manager->compactFilters &&
+            (count > 0 || header->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60)) {
+            if (peer == manager->downloadPeer) _BRPeerManagerCFAddHeader(manager, peer, header);
+            continue;
+        }
+
+        // ignore block headers that are newer than one week before earliestKeyTime
+        if (header->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) continue;
+
+        // headers that don't simply extend the main chain take the slower block-at-a-time path
+        if ((! manager->bloomFilter && ! manager->compactFilters) || ! UInt256Eq(header->prevBlock, prev->blockHash)) {
+            _BRPeerManagerUnlock(manager);
+            _peerRelayedBlock(info, BRMerkleBlockCopy(header));
+            _BRPeerManagerLock(manager);
+            continue;
+        }
+
+        header->height = prev->height + 1;
+
+        if (! _BRPeerManagerVerifyBlock(manager, header, prev, peer)) { // header is invalid
+            peer_log(peer, "relayed invalid block");
+            _BRPeerManagerPeerMisbehavin(manager, peer);
+            break;
+        }
+
+        block = BRMerkleBlockCopy(header);
+        saveCount = _BRPeerManagerExtendChain(manager, peer, block, NULL, 0, 0);
+        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+        if (saveCount > 0) _BRPeerManagerSaveBlocks(manager, block, saveCount);
+        manager->cfFilterHeader = UINT256_ZERO; // the filter header for the new chain tip isn't known
+        lastHeight = block->height;
+
+        // check if the next block was received as an orphan
+        orphan.prevBlock = block->blockHash;
+        next = BRSetRemove(manager->orphans, &orphan);
+
+        if (next) {
+            _BRPeerManagerUnlock(manager);
+            _peerRelayedBlock(info, next);
+            _BRPeerManagerLock(manager);
+        }
+    }
+
+    // in compact filter mode, the download peer's headers are requested one batch at a time, fewer than 2000 means
+    // we've reached its chain tip
+    if (manager->compactFilters && peer == manager->downloadPeer) {
+        manager->cfHeadersPending = 0;
+        if (headersCount < 2000) manager->cfHeadersDone = 1;
+
+        if (manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        }
+
+        _BRPeerManagerCFRequest(manager);
+    }
+
+    _BRPeerManagerUnlock(manager);
+
+    if (lastHeight != BLOCK_UNKNOWN_HEIGHT && lastHeight >= BRPeerLastBlock(peer) && manager->txStatusUpdate) {
+        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    }
+}
+
+// during chain download, splits a batch of block hashes from the download peer into download windows to be requested
+// from all the peers helping with the download
+static int _peerRelayedBlockHashes(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRDownloadWindow window;
+    size_t i, j, helperCount = 0;
+    int r = 0;
+
+    _BRPeerManagerLock(manager);
+
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        BRPeer *p = manager->connectedPeers[i - 1];
+
+        if (p == peer || BRPeerConnectStatus(p) != BRPeerStatusConnected) continue;
+        if ((p->flags & PEER_FLAG_DOWNLOAD) != 0) helperCount++;
+    }
+
+    if (manager->compactFilters) { // new blocks are fetched as headers and filters instead
+        if (peer == manager->downloadPeer) {
+            manager->cfHeadersDone = 0;
+            _BRPeerManagerCFRequest(manager);
+        }
+
+        r = 1;
+    }
+    else if (peer == manager->downloadPeer && helperCount > 0 && manager->bloomFilter &&
+        manager->lastBlock->height < manager->estimatedHeight) {
+        peer_log(peer, "scheduling %zu block(s) for download from %zu peer(s)", blockCount, helperCount + 1);
+
+        for (i = 0; i < blockCount; i += j) {
+            memset(&window, 0, sizeof(window));
+            for (j = 0; j < DOWNLOAD_WINDOW_SIZE && i + j < blockCount; j++) window.blockHashes[j] = blockHashes[i + j];
+            window.count = j;
+            array_add(manager->downloadWindows, window);
+        }
+
+        // a full batch means there are more block hashes to get once there's room for more windows
+        if (blockCount >= 500) {
+            manager->downloadLocators[0] = blockHashes[blockCount - 1];
+            manager->downloadLocators[1] = blockHashes[0];
+        }
+
+        _BRPeerManagerScheduleDownloads(manager);
+        r = 1;
+    }
+
+    _BRPeerManagerUnlock(manager);
+    return r;
+}
+
+// compares filter hashes relayed by the peer cross-checking them with those relayed by the download peer, when they
+// disagree, a third peer settles the dispute, and whichever peer it disagrees with is banned
+static BRMerkleBlock *_BRPeerManagerCFChecked(BRPeerManager *manager, BRPeer *peer, UInt256 prevFilterHeader,
+                                              const UInt256 filterHashes[], size_t filterHashesCount)
+{
+    size_t i, start = manager->cfCheckedCount;
+    UInt256 filterHeader = (start > 0) ? manager->cfEntries[start - 1].filterHeader : manager->cfFilterHeader;
+    BRMerkleBlock *block = NULL;
+
+    for (i = 0; i < filterHashesCount && UInt256Eq(filterHashes[i], manager->cfEntries[start + i].filterHash); i++);
+    manager->cfCheckPending = 0;
+
+    if (i == filterHashesCount && UInt256Eq(prevFilterHeader, filterHeader)) {
+        if (manager->cfDisputePeer) {
+            peer_log(manager->cfDisputePeer, "relayed cfheaders that other peers disagree with");
+            _BRPeerManagerPeerMisbehavin(manager, manager->cfDisputePeer);
+            manager->cfDisputePeer = NULL;
+        }
+
+        manager->cfCheckedCount += filterHashesCount;
+        block = _BRPeerManagerCFConnect(manager, manager->downloadPeer);
+    }
+    else if (manager->cfDisputePeer) { // two other peers disagree with the download peer
+        peer_log(manager->downloadPeer, "relayed cfheaders that other peers disagree with");
+        _BRPeerManagerPeerMisbehavin(manager, manager->downloadPeer);
+        manager->cfDisputePeer = NULL;
+    }
+    else {
+        peer_log(peer, "relayed cfheaders that disagree with the download peer from block #%"PRIu32,
+                 manager->cfEntries[start + ((i < filterHashesCount) ? i : 0)].block->height);
+        manager->cfDisputePeer = peer;
+        manager->cfCheckPeer = NULL;
+    }
+
+    _BRPeerManagerCFRequest(manager);
+    return block;
+}
+
+static void _peerRelayedCFHeaders(void *info, UInt256 stopHash, UInt256 prevFilterHeader,
+                                  const UInt256 filterHashes[], size_t filterHashesCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRMerkleBlock *block = NULL;
+    size_t i, start;
+    UInt256 filterHeader;
+
+    _BRPeerManagerLock(manager);
+    start = manager->cfHashesCount;
+    filterHeader = (start > 0) ? manager->cfEntries[start - 1].filterHeader : manager->cfFilterHeader;
+
+    if (peer == manager->cfCheckPeer && manager->downloadPeer && manager->cfCheckPending > 0 &&
+        filterHashesCount == manager->cfCheckPending && UInt256Eq(stopHash,
+            manager->cfEntries[manager->cfCheckedCount + filterHashesCount - 1].block->blockHash)) {
+        block = _BRPeerManagerCFChecked(manager, peer, prevFilterHeader, filterHashes, filterHashesCount);
+    }
+    else if (peer != manager->downloadPeer || manager->cfHashesPending == 0 ||
+        filterHashesCount != manager->cfHashesPending ||
+        ! UInt256Eq(stopHash, manager->cfEntries[start + filterHashesCount - 1].block->blockHash)) {
+        peer_log(peer, "ignoring unrequested cfheaders");
+    }
+    else if (! UInt256IsZero(filterHeader) && ! UInt256Eq(filterHeader, prevFilterHeader)) {
+        peer_log(peer, "relayed cfheaders that don't connect to the previous filter header");
+        _BRPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        // the first filter header isn't known after a rescan or a chain fork, it's cross-checked along with the rest
+        if (start == 0) manager->cfFilterHeader = prevFilterHeader;
+
+        for (i = 0, filterHeader = prevFilterHeader; i < filterHashesCount; i++) {
+            filterHeader = BRBlockFilterHeader(filterHashes[i], filterHeader);
+            manager->cfEntries[start + i].filterHash = filterHashes[i];
+            manager->cfEntries[start + i].filterHeader = filterHeader;
         }
-        
-        BRSetAdd(manager->blocks, block);
-        manager->lastBlock = block;
-        if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
-        if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
-            
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
+
+        manager->cfHashesCount += filterHashesCount;
+        manager->cfHashesPending = 0;
+
+        if (manager->lastBlock->height < manager->estimatedHeight) {
             BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
-            manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
-        }
-        
-        if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0 && block->height + 100 < manager->estimatedHeight) {
-            saveCount = 1; // save transition blocks immediately
-        }
-        
-        if (block->height == manager->estimatedHeight) { // chain download is complete
-            saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
-            _BRPeerManagerLoadMempools(manager);
         }
+
+        _BRPeerManagerCFRequest(manager);
     }
-    else if (BRSetContains(manager->blocks, block)) { // we already have the block (or at least the header)
-        if ((block->height % 500) == 0 || txCount > 0 || block->height >= BRPeerLastBlock(peer)) {
-            peer_log(peer, "relayed existing block #%"PRIu32, block->height);
-        }
-        
-        b = manager->lastBlock;
-        while (b && b->height > block->height) b = BRSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
-        
-        if (BRMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
-            if (txCount > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, txCount, block->height, txTime);
-            if (block->height == manager->lastBlock->height) manager->lastBlock = block;
-        }
-        
-        b = BRSetAdd(manager->blocks, block);
 
-        if (b != block) {
-            if (BRSetGet(manager->orphans, b) == b) BRSetRemove(manager->orphans, b);
-            if (manager->lastOrphan == b) manager->lastOrphan = NULL;
-            BRMerkleBlockFree(b);
+    _BRPeerManagerUnlock(manager);
+
+    if (block && block->height >= BRPeerLastBlock(peer) && manager->txStatusUpdate) {
+        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    }
+}
+
+// filter is only valid for the duration of the call, and is copied if it's kept
+static void _peerRelayedCFilter(void *info, UInt256 blockHash, const uint8_t *filter, size_t filterLen)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    BRCFilterEntry *e = NULL;
+    BRMerkleBlock *block = NULL;
+
+    _BRPeerManagerLock(manager);
+
+    for (size_t i = 0; peer == manager->downloadPeer && ! e && i < manager->cfFiltersCount; i++) {
+        if (! manager->cfEntries[i].filter && UInt256Eq(manager->cfEntries[i].block->blockHash, blockHash)) {
+            e = &manager->cfEntries[i];
         }
     }
-    else if (manager->lastBlock->height < BRPeerLastBlock(peer) &&
-             block->height > manager->lastBlock->height + 1) { // special case, new block mined durring rescan
-        peer_log(peer, "marking new block #%"PRIu32" as orphan until rescan completes", block->height);
-        BRSetAdd(manager->orphans, block); // mark as orphan til we're caught up
-        manager->lastOrphan = block;
+
+    if (! e) {
+        peer_log(peer, "ignoring unrequested cfilter for block %s", u256hex(blockHash));
     }
-    else if (block->height <= manager->params->checkpoints[manager->params->checkpointsCount - 1].height) { // old fork
-        peer_log(peer, "ignoring block on fork older than most recent checkpoint, block #%"PRIu32", hash: %s",
-                 block->height, u256hex(block->blockHash));
-        BRMerkleBlockFree(block);
-        block = NULL;
+    else if (! UInt256Eq(BRBlockFilterHash(filter, filterLen), e->filterHash)) {
+        peer_log(peer, "relayed cfilter that doesn't match its filter header, block %s", u256hex(blockHash));
+        _BRPeerManagerPeerMisbehavin(manager, peer);
     }
-    else { // new block is on a fork
-        peer_log(peer, "chain fork reached height %"PRIu32, block->height);
-        BRSetAdd(manager->blocks, block);
+    else {
+        e->filter = malloc((filterLen > 0) ? filterLen : 1);
+        assert(e->filter != NULL);
+        if (filterLen > 0) memcpy(e->filter, filter, filterLen);
+        e->filterLen = filterLen;
+        if (manager->cfFiltersPending > 0) manager->cfFiltersPending--;
 
-        // TODO: calculate chain work and use that instead of block height to determine longest chain
-        if (block->height > manager->lastBlock->height) { // check if fork is now longer than main chain
-            b = block;
-            b2 = manager->lastBlock;
-            
-            while (b && b2 && ! BRMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
-                b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b && b->height < b2->height) b2 = BRSetGet(manager->blocks, &b2->prevBlock);
-            }
-            
-            peer_log(peer, "reorganizing chain from height %"PRIu32", new height is %"PRIu32, b->height, block->height);
-        
-            BRWalletSetTxUnconfirmedAfter(manager->wallet, b->height); // mark tx after the join point as unconfirmed
+        if (manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        }
 
-            b = block;
-        
-            while (b && b2 && b->height > b2->height) { // set transaction heights for new main chain
-                size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
-                uint32_t height = b->height, timestamp = b->timestamp;
-                
-                if (count > txCount) {
-                    txHashes = (txHashes != _txHashes) ? realloc(txHashes, count*sizeof(*txHashes)) :
-                               malloc(count*sizeof(*txHashes));
-                    assert(txHashes != NULL);
-                    txCount = count;
-                }
-                
-                count = BRMerkleBlockTxHashes(b, txHashes, count);
-                b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b) timestamp = timestamp/2 + b->timestamp/2;
-                if (count > 0) BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+        block = _BRPeerManagerCFConnect(manager, peer);
+        _BRPeerManagerCFRequest(manager);
+    }
+
+    _BRPeerManagerUnlock(manager);
+
+    if (block && block->height >= BRPeerLastBlock(peer) && manager->txStatusUpdate) {
+        manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
+    }
+}
+
+// takes ownership of block and transactions
+static void _peerRelayedFullBlock(void *info, BRMerkleBlock *block, BRTransaction *transactions[], size_t txCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    UInt256 *txHashes = calloc((txCount > 0) ? txCount : 1, sizeof(*txHashes));
+    int *matches = calloc((txCount > 0) ? txCount : 1, sizeof(*matches));
+    BRCFilterEntry *e;
+    BRMerkleBlock *next = NULL;
+    size_t i;
+
+    assert(txHashes != NULL);
+    assert(matches != NULL);
+    for (i = 0; i < txCount; i++) txHashes[i] = transactions[i]->txHash;
+    BRMerkleBlockSetPartialTree(block, txHashes, matches, txCount);
+    _BRPeerManagerLock(manager);
+    e = (array_count(manager->cfEntries) > 0) ? &manager->cfEntries[0] : NULL;
+
+    if (peer != manager->downloadPeer || ! e || ! e->fullRequested ||
+        ! UInt256Eq(e->block->blockHash, block->blockHash)) {
+        peer_log(peer, "ignoring unrequested block %s", u256hex(block->blockHash));
+    }
+    else if (! BRMerkleBlockIsValid(block, (uint32_t)time(NULL))) { // verifies the merkle root
+        peer_log(peer, "relayed block with an invalid merkle root: %s", u256hex(block->blockHash));
+        _BRPeerManagerPeerMisbehavin(manager, peer);
+    }
+    else {
+        // register wallet transactions in block order, so spends of outputs created earlier in the block are found
+        for (i = 0; i < txCount; i++) {
+            if (BRWalletTransactionForHash(manager->wallet, txHashes[i])) {
+                matches[i] = 1;
             }
-        
-            manager->lastBlock = block;
-            
-            if (block->height == manager->estimatedHeight) { // chain download is complete
-                saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
-                _BRPeerManagerLoadMempools(manager);
+            else if (BRWalletContainsTransaction(manager->wallet, transactions[i]) &&
+                     BRWalletRegisterTransaction(manager->wallet, transactions[i])) {
+                transactions[i] = NULL; // the wallet took ownership
+                matches[i] = 1;
             }
         }
+
+        // registering wallet transactions generated any new addresses needed to keep the gap limit, and the next
+        // filters are matched against them without another round-trip to the peer
+        BRMerkleBlockSetPartialTree(e->block, txHashes, matches, txCount);
+        e->fullRequested = 0;
+
+        if (manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        }
+
+        next = _BRPeerManagerCFConnect(manager, peer);
+        _BRPeerManagerCFRequest(manager);
     }
-   
-    if (txHashes != _txHashes) free(txHashes);
-   
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT) {
-        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
-        
-        // check if the next block was received as an orphan
-        orphan.prevBlock = block->blockHash;
-        next = BRSetRemove(manager->orphans, &orphan);
-    }
-    
-    BRMerkleBlock *saveBlocks[saveCount];
-    
-    for (i = 0, b = block; b && i < saveCount; i++) {
-        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
-        saveBlocks[i] = b;
-        b = BRSetGet(manager->blocks, &b->prevBlock);
+
+    _BRPeerManagerUnlock(manager);
+
+    for (i = 0; i < txCount; i++) {
+        if (transactions[i]) BRTransactionFree(transactions[i]);
     }
-    
-    // make sure the set of blocks to be saved starts at a difficulty interval
-    j = (i > 0) ? saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL : 0;
-    if (j > 0) i -= (i > BLOCK_DIFFICULTY_INTERVAL - j) ? BLOCK_DIFFICULTY_INTERVAL - j : i;
-    assert(i == 0 || (saveBlocks[i - 1]->height % BLOCK_DIFFICULTY_INTERVAL) == 0);
-    if (i > 0 && manager->saveBlocks) manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
-    pthread_mutex_unlock(&manager->lock);
-    
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
-        manager->txStatusUpdate) {
+
+    BRMerkleBlockFree(block);
+    free(matches);
+    free(txHashes);
+
+    if (next && next->height >= BRPeerLastBlock(peer) && manager->txStatusUpdate) {
         manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
     }
-    
-    if (next) _peerRelayedBlock(info, next);
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1373,14 +3017,14 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockTx(manager);
 
     for (size_t i = 0; i < txCount; i++) {
         _BRTxPeerListRemovePeer(manager->txRelays, txHashes[i], peer);
         _BRTxPeerListRemovePeer(manager->txRequests, txHashes[i], peer);
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockTx(manager);
 }
 
 static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
@@ -1389,7 +3033,7 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     uint64_t maxFeePerKb = 0, secondFeePerKb = 0;
     
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockPeers(manager);
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) { // find second highest fee rate
         p = manager->connectedPeers[i - 1];
@@ -1397,13 +3041,13 @@ static void _peerSetFeePerKb(void *info, uint64_t feePerKb)
         if (BRPeerFeePerKb(p) > maxFeePerKb) secondFeePerKb = maxFeePerKb, maxFeePerKb = BRPeerFeePerKb(p);
     }
     
+    _BRPeerManagerUnlockPeers(manager);
+
     if (secondFeePerKb*3/2 > DEFAULT_FEE_PER_KB && secondFeePerKb*3/2 <= MAX_FEE_PER_KB &&
         secondFeePerKb*3/2 > BRWalletFeePerKb(manager->wallet)) {
         peer_log(peer, "increasing feePerKb to %"PRIu64" based on feefilter messages from peers", secondFeePerKb*3/2);
         BRWalletSetFeePerKb(manager->wallet, secondFeePerKb*3/2);
     }
-
-    pthread_mutex_unlock(&manager->lock);
 }
 
 static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
@@ -1413,7 +3057,7 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
     BRPublishedTx pubTx = { NULL, NULL, NULL };
     int hasPendingCallbacks = 0, error = 0;
 
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockTx(manager);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         if (UInt256Eq(manager->publishedTxHashes[i - 1], txHash)) {
@@ -1424,15 +3068,16 @@ static BRTransaction *_peerRequestedTx(void *info, UInt256 txHash)
         else if (manager->publishedTx[i - 1].callback != NULL) hasPendingCallbacks = 1;
     }
 
+    _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
+    _BRPeerManagerUnlockTx(manager);
+
     // cancel tx publish timeout if no publish callbacks are pending, and syncing is done or this is not downloadPeer
-    if (! hasPendingCallbacks && (manager->syncStartHeight == 0 || peer != manager->downloadPeer)) {
+    if (! hasPendingCallbacks && ! _BRPeerManagerIsSyncPeer(manager, peer)) {
         BRPeerScheduleDisconnect(peer, -1); // cancel publish tx timeout
     }
 
-    _BRTxPeerListAddPeer(&manager->txRelays, txHash, peer);
     if (pubTx.tx) BRWalletRegisterTransaction(manager->wallet, pubTx.tx);
     if (pubTx.tx && ! BRWalletTransactionIsValid(manager->wallet, pubTx.tx)) error = EINVAL;
-    pthread_mutex_unlock(&manager->lock);
     if (pubTx.callback) pubTx.callback(pubTx.info, error);
     return pubTx.tx;
 }
@@ -1449,9 +3094,9 @@ static void _peerThreadCleanup(void *info)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
 
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockPeers(manager);
     manager->peerThreadCount--;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
     if (manager->threadCleanup) manager->threadCleanup(manager->info);
 }
 
@@ -1519,7 +3164,22 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     array_new(manager->txRequests, 10);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
-    pthread_mutex_init(&manager->lock, NULL);
+    array_new(manager->downloadWindows, MAX_DOWNLOAD_WINDOWS);
+    array_new(manager->cfEntries, 100);
+    array_new(manager->filterAdds, SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL);
+    array_new(manager->lockSites, 50);
+    pthread_mutex_init(&manager->profileLock, NULL);
+    _BRManagerLockInit(&manager->lock, "chain");
+    _BRManagerLockInit(&manager->peerLock, "peers");
+    _BRManagerLockInit(&manager->txLock, "tx");
+    pthread_mutex_init(&manager->saveQueue.lock, NULL);
+    pthread_cond_init(&manager->saveQueue.cond, NULL);
+    array_new(manager->saveQueue.blocks, 100);
+    array_new(manager->saveQueue.peers, 100);
+    pthread_mutex_init(&manager->downloadTimer.lock, NULL);
+    pthread_cond_init(&manager->downloadTimer.cond, NULL);
+    manager->downloadTimeout = DOWNLOAD_WINDOW_TIMEOUT;
+    manager->headerParser = BRHeaderParserNew(0);
     manager->threadCleanup = _dummyThreadCleanup;
     return manager;
 }
@@ -1528,11 +3188,14 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
 // info is a void pointer that will be passed along with each callback call
 // void syncStarted(void *) - called when blockchain syncing starts
 // void syncStopped(void *, int) - called when blockchain syncing stops, error is an errno.h code
+// - called only after every saveBlocks and savePeers call queued before syncing stopped has returned
 // void txStatusUpdate(void *) - called when transaction status may have changed such as when a new block arrives
 // void saveBlocks(void *, int, BRMerkleBlock *[], size_t) - called when blocks should be saved to the persistent store
 // - if replace is true, remove any previously saved blocks first
 // void savePeers(void *, int, const BRPeer[], size_t) - called when peers should be saved to the persistent store
 // - if replace is true, remove any previously saved peers first
+// - saveBlocks and savePeers are called in order from a separate save thread, so a slow store doesn't hold up peers,
+//   and saves queued while a call is running may be merged into the next call, blocks are only valid during the call
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
 // void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
 void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
@@ -1555,17 +3218,71 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
     manager->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// not thread-safe, set the header store once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// if the chain in store is longer than the blocks passed to BRPeerManagerNew(), the headers following its last
+// difficulty transition are loaded from it, and from then on every block added to the main chain is appended to it,
+// making the saveBlocks callback optional
+// store must remain open until after BRPeerManagerFree() is called
+void BRPeerManagerSetHeaderStore(BRPeerManager *manager, BRHeaderStore *store)
+{
+    BRMerkleBlock *block;
+    uint32_t height;
+
+    assert(manager != NULL);
+    assert(store != NULL);
+    _BRPeerManagerLock(manager);
+    manager->headerStore = store;
+    height = BRHeaderStoreLastHeight(store);
+
+    if (height != BLOCK_UNKNOWN_HEIGHT && (! manager->lastBlock || height > manager->lastBlock->height)) {
+        block = _BRPeerManagerLoadStoredBlocks(manager, height - (height % BLOCK_DIFFICULTY_INTERVAL), height);
+        if (block) manager->lastBlock = block;
+    }
+
+    _BRPeerManagerUnlock(manager);
+}
+
+// not thread-safe, set the block cache once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// every filtered block added to the main chain is added to cache along with its wallet transactions, and a rescan
+// replays the cached blocks that follow the rescan starting point, for as long as they were matched against a bloom
+// filter that included the wallet's addresses up to the gap limit, before downloading the rest of the chain from peers
+// NOTE: blocks are only cached when syncing with bloom filters, not compact filters
+// cache must remain open until after BRPeerManagerFree() is called
+void BRPeerManagerSetBlockCache(BRPeerManager *manager, BRBlockCache *cache)
+{
+    assert(manager != NULL);
+    assert(cache != NULL);
+    _BRPeerManagerLock(manager);
+    manager->blockCache = cache;
+    _BRPeerManagerUnlock(manager);
+}
+
+// not thread-safe, call once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// if enabled, the chain is synced with BIP157/158 compact block filters instead of BIP37 bloom filters: only peers that
+// serve compact filters are used, each filter is matched against the wallet scripts locally, and a block is only
+// downloaded in full when its filter matches, so generating new wallet addresses doesn't require a filter update
+// NOTE: unconfirmed transactions aren't relayed by peers in this mode, wallet transactions are seen once confirmed
+void BRPeerManagerSetCompactFilters(BRPeerManager *manager, int enabled)
+{
+    assert(manager != NULL);
+    _BRPeerManagerLock(manager);
+    manager->compactFilters = enabled;
+    _BRPeerManagerUnlock(manager);
+}
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port)
 {
     assert(manager != NULL);
     BRPeerManagerDisconnect(manager);
-    pthread_mutex_lock(&manager->lock);
-    manager->maxConnectCount = UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1;
+    _BRPeerManagerLock(manager);
+    __atomic_store_n(&manager->maxConnectCount, UInt128IsZero(address) ? PEER_MAX_CONNECTIONS : 1, __ATOMIC_RELAXED);
+    _BRPeerManagerLockPeers(manager);
     manager->fixedPeer = ((const BRPeer) { address, port, 0, 0, 0 });
     array_clear(manager->peers);
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
+    _BRPeerManagerUnlock(manager);
 }
 
 // current connect status
@@ -1574,15 +3291,15 @@ BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
     BRPeerStatus status = BRPeerStatusDisconnected;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
-    if (manager->isConnected != 0) status = BRPeerStatusConnected;
+    _BRPeerManagerLockPeers(manager);
+    if (__atomic_load_n(&manager->isConnected, __ATOMIC_RELAXED) != 0) status = BRPeerStatusConnected;
 
     for (size_t i = array_count(manager->connectedPeers); i > 0 && status == BRPeerStatusDisconnected; i--) {
         if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) == BRPeerStatusDisconnected) continue;
         status = BRPeerStatusConnecting;
     }
 
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
     return status;
 }
 
@@ -1590,15 +3307,17 @@ BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager)
 void BRPeerManagerConnect(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (manager->connectFailureCount >= MAX_CONNECT_FAILURES) manager->connectFailureCount = 0; //this is a manual retry
     
     if ((! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
-        manager->syncStartHeight = manager->lastBlock->height + 1;
-        pthread_mutex_unlock(&manager->lock);
+        __atomic_store_n(&manager->syncStartHeight, manager->lastBlock->height + 1, __ATOMIC_RELAXED);
+        manager->syncStartTime = _BRPeerManagerNow();
+        manager->metrics.syncStartHeight = manager->syncStartHeight;
+        _BRPeerManagerUnlock(manager);
         if (manager->syncStarted) manager->syncStarted(manager->info);
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLock(manager);
     }
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
@@ -1611,6 +3330,8 @@ void BRPeerManagerConnect(BRPeerManager *manager)
         time_t now = time(NULL);
         BRPeer *peers;
 
+        _BRPeerManagerLockPeers(manager);
+
         if (array_count(manager->peers) < manager->maxConnectCount ||
             manager->peers[manager->maxConnectCount - 1].timestamp + 3*24*60*60 < now) {
             _BRPeerManagerFindPeers(manager);
@@ -1619,6 +3340,7 @@ void BRPeerManagerConnect(BRPeerManager *manager)
         array_new(peers, 100);
         array_add_array(peers, manager->peers,
                         (array_count(manager->peers) < 100) ? array_count(manager->peers) : 100);
+        _BRPeerManagerUnlockPeers(manager);
 
         while (array_count(peers) > 0 && array_count(manager->connectedPeers) < manager->maxConnectCount) {
             size_t i = BRRand((uint32_t)array_count(peers)); // index of random peer
@@ -1639,19 +3361,32 @@ void BRPeerManagerConnect(BRPeerManager *manager)
                 info->peer = BRPeerNew(manager->params->magicNumber);
                 *info->peer = peers[i];
                 array_rm(peers, i);
+                _BRPeerManagerLockPeers(manager);
                 array_add(manager->connectedPeers, info->peer);
                 manager->peerThreadCount++;
+                manager->metrics.connects++;
+                _BRPeerManagerUnlockPeers(manager);
                 BRPeerSetCallbacks(info->peer, info, _peerConnected, _peerDisconnected, _peerRelayedPeers,
                                    _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
                                    _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
+                BRPeerSetRelayedHeadersCallback(info->peer, _peerRelayedHeaders, manager->headerParser);
+                BRPeerSetRelayedBlockHashesCallback(info->peer, _peerRelayedBlockHashes);
                 BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+
+                if (manager->compactFilters) {
+                    BRPeerSetCompactFilterCallbacks(info->peer, _peerRelayedCFHeaders, _peerRelayedCFilter,
+                                                    _peerRelayedFullBlock);
+                }
+
                 BRPeerConnect(info->peer);
 
                 if (BRPeerConnectStatus(info->peer) == BRPeerStatusDisconnected) {
-                    pthread_mutex_unlock(&manager->lock);
+                    _BRPeerManagerUnlock(manager);
                     _peerDisconnected(info, ENOTCONN);
-                    pthread_mutex_lock(&manager->lock);
+                    _BRPeerManagerLock(manager);
+                    _BRPeerManagerLockPeers(manager);
                     manager->peerThreadCount--;
+                    _BRPeerManagerUnlockPeers(manager);
                 }
             }
         }
@@ -1661,10 +3396,10 @@ void BRPeerManagerConnect(BRPeerManager *manager)
     
     if (array_count(manager->connectedPeers) == 0) {
         _BRPeerManagerSyncStopped(manager);
-        pthread_mutex_unlock(&manager->lock);
-        if (manager->syncStopped) manager->syncStopped(manager->info, ENETUNREACH);
+        _BRPeerManagerUnlock(manager);
+        _BRPeerManagerSyncStoppedCallback(manager, ENETUNREACH);
     }
-    else pthread_mutex_unlock(&manager->lock);
+    else _BRPeerManagerUnlock(manager);
 }
 
 void BRPeerManagerDisconnect(BRPeerManager *manager)
@@ -1674,11 +3409,12 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
     BRPeer *p;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     // prevent new peers from being spawned
     maxConnectCount = manager->maxConnectCount;
-    manager->maxConnectCount = 0;
+    __atomic_store_n(&manager->maxConnectCount, 0, __ATOMIC_RELAXED);
+    _BRPeerManagerLockPeers(manager);
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         p = manager->connectedPeers[i - 1];
@@ -1689,37 +3425,133 @@ void BRPeerManagerDisconnect(BRPeerManager *manager)
 
     peerThreadCount = manager->peerThreadCount;
     dnsThreadCount = manager->dnsThreadCount;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
+    _BRPeerManagerUnlock(manager);
     ts.tv_sec = 0;
     ts.tv_nsec = 1;
     
     while (peerThreadCount > 0 || dnsThreadCount > 0) {
         nanosleep(&ts, NULL); // pthread_yield() isn't POSIX standard :(
-        pthread_mutex_lock(&manager->lock);
+        _BRPeerManagerLockPeers(manager);
         peerThreadCount = manager->peerThreadCount;
         dnsThreadCount = manager->dnsThreadCount;
-        pthread_mutex_unlock(&manager->lock);
+        _BRPeerManagerUnlockPeers(manager);
+    }
+
+    _BRPeerManagerLock(manager);
+    __atomic_store_n(&manager->maxConnectCount, maxConnectCount, __ATOMIC_RELAXED);
+    _BRPeerManagerUnlock(manager);
+    _BRPeerManagerDownloadTimerStop(manager);
+    _BRPeerManagerSaveFlush(manager); // make sure everything the disconnected peers triggered is saved
+}
+
+// true if the block cache filter with the given id included the next unused addresses within the gap limit on both
+// wallet chains, filters are built from every wallet address generated so far, so it then included all earlier ones too
+static int _BRPeerManagerCacheFilterCovers(BRPeerManager *manager, uint32_t filterId)
+{
+    UInt160 pkh[SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL];
+    size_t pkhCount;
+
+    pkhCount = BRWalletUnusedPKH(manager->wallet, pkh, SEQUENCE_GAP_LIMIT_EXTERNAL, 0);
+    pkhCount += BRWalletUnusedPKH(manager->wallet, &pkh[pkhCount], SEQUENCE_GAP_LIMIT_INTERNAL, 1);
+    return (filterId != 0 && BRBlockCacheFilterCovers(manager->blockCache, filterId, pkh, pkhCount));
+}
+
+// adds the cached blocks that follow lastBlock to the chain, along with their wallet transactions, until one is
+// missing, doesn't connect, or was filtered without the wallet's addresses, so the rescan only downloads the rest
+static void _BRPeerManagerReplayCachedBlocks(BRPeerManager *manager)
+{
+    BRMerkleBlock *block, *b;
+    BRTransaction **transactions;
+    BRTxConfirmation *confirmations;
+    UInt256 *hashes;
+    uint32_t filterId, now = (uint32_t)time(NULL), startHeight = manager->lastBlock->height;
+    size_t i, txCount, hashCount;
+
+    if (! manager->blockCache || manager->compactFilters) return;
+    array_new(confirmations, 10);
+    array_new(hashes, 10);
+
+    while ((block = BRBlockCacheBlockAtHeight(manager->blockCache, manager->lastBlock->height + 1, &filterId,
+                                             &txCount)) != NULL) {
+        // headers are only replayed where the sync would have requested headers, and merkleblocks only if their
+        // filter matched every wallet address
+        if (! UInt256Eq(block->prevBlock, manager->lastBlock->blockHash) || ! BRMerkleBlockIsValid(block, now) ||
+            (block->totalTx == 0 && block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60) ||
+            (block->totalTx > 0 && ! _BRPeerManagerCacheFilterCovers(manager, filterId)) ||
+            ! _BRPeerManagerVerifyBlock(manager, block, manager->lastBlock, NULL)) {
+            BRMerkleBlockFree(block);
+            break;
+        }
+
+        transactions = malloc(txCount*sizeof(*transactions) + 1);
+        assert(transactions != NULL);
+        txCount = BRBlockCacheTransactions(manager->blockCache, block->height, transactions, txCount);
+
+        for (i = 0; i < txCount; i++) {
+            if (BRWalletTransactionForHash(manager->wallet, transactions[i]->txHash) ||
+                ! BRWalletContainsTransaction(manager->wallet, transactions[i]) ||
+                ! BRWalletRegisterTransaction(manager->wallet, transactions[i])) BRTransactionFree(transactions[i]);
+        }
+
+        free(transactions);
+        hashCount = BRMerkleBlockTxHashes(block, NULL, 0);
+
+        UInt256 txHashes[(hashCount > 0) ? hashCount : 1];
+
+        hashCount = BRMerkleBlockTxHashes(block, txHashes, hashCount);
+
+        if (hashCount > 0) { // the heights are set with one wallet update once the replay is done
+            BRTxConfirmation confirmation = { NULL, hashCount, block->height,
+                                              block->timestamp/2 + manager->lastBlock->timestamp/2 };
+
+            array_add_array(hashes, txHashes, hashCount);
+            array_add(confirmations, confirmation);
+        }
+
+        b = BRSetGet(manager->blocks, block);
+
+        if (b) { // keep the block that's already in the chain, its pointer may be held elsewhere
+            BRMerkleBlockFree(block);
+            block = b;
+        }
+        else BRSetAdd(manager->blocks, block);
+
+        manager->lastBlock = block;
+        if (manager->headerStore) _BRPeerManagerStoreBlock(manager, block);
+        if (block->height > manager->estimatedHeight) manager->estimatedHeight = block->height;
+        manager->metrics.replayedBlocks++;
     }
 
-    pthread_mutex_lock(&manager->lock);
-    manager->maxConnectCount = maxConnectCount;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerConfirmTransactions(manager, confirmations, hashes);
+
+    if (manager->lastBlock->height > startHeight) {
+        br_log(BRLogLevelInfo, "replayed blocks #%"PRIu32" to #%"PRIu32" from block cache", startHeight + 1,
+               manager->lastBlock->height);
+    }
 }
 
 static int _BRPeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBlock) {
     if (NULL == newLastBlock) return 0;
 
     manager->lastBlock = newLastBlock;
+    manager->cfFilterHeader = UINT256_ZERO;
+    _BRPeerManagerCFClear(manager);
+    _BRPeerManagerReplayCachedBlocks(manager);
 
     if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
+        _BRPeerManagerLockPeers(manager);
+
         for (size_t i = array_count(manager->peers); i > 0; i--) {
             if (BRPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
         }
 
+        _BRPeerManagerUnlockPeers(manager);
         BRPeerDisconnect(manager->downloadPeer);
     }
 
-    manager->syncStartHeight = 0; // a syncStartHeight of 0 indicates that syncing hasn't started yet
+    // a syncStartHeight of 0 indicates that syncing hasn't started yet
+    __atomic_store_n(&manager->syncStartHeight, 0, __ATOMIC_RELAXED);
     return 1;
 }
 
@@ -1728,7 +3560,7 @@ static int _BRPeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBl
 void BRPeerManagerRescan(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     
     int needConnect = 0;
     if (manager->isConnected) {
@@ -1746,7 +3578,7 @@ void BRPeerManagerRescan(BRPeerManager *manager)
 
         needConnect = _BRPeerManagerRescan(manager, newLastBlock);
     }
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     if (needConnect) BRPeerManagerConnect(manager);
 }
 
@@ -1754,7 +3586,7 @@ void BRPeerManagerRescan(BRPeerManager *manager)
 void BRPeerManagerRescanFromLastHardcodedCheckpoint(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     int needConnect = 0;
     if (manager->isConnected) {
@@ -1764,7 +3596,7 @@ void BRPeerManagerRescanFromLastHardcodedCheckpoint(BRPeerManager *manager)
             needConnect = _BRPeerManagerRescan(manager, BRSetGet (manager->blocks, &hash));
         }
     }
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     if (needConnect) BRPeerManagerConnect(manager);
 }
 
@@ -1778,6 +3610,14 @@ static BRMerkleBlock *_BRPeerManagerLookupBlockFromBlockNumber(BRPeerManager *ma
         block = BRSetGet (manager->blocks, &block->prevBlock);
     }
 
+    // blockNumber is before the previous difficulty transition - load it from the header store, along with the blocks
+    // needed to verify the next transition
+    if (manager->headerStore && blockNumber <= manager->lastBlock->height) {
+        block = _BRPeerManagerLoadStoredBlocks(manager, blockNumber - (blockNumber % BLOCK_DIFFICULTY_INTERVAL),
+                                               blockNumber);
+        if (block && block->height == blockNumber) return block;
+    }
+
     // blockNumber not in the (abbreviated) chain - look through checkpoints
     for (int i = 0; i < manager->params->checkpointsCount; i++)
         if (manager->params->checkpoints[i].height == blockNumber) {
@@ -1793,7 +3633,7 @@ static BRMerkleBlock *_BRPeerManagerLookupBlockFromBlockNumber(BRPeerManager *ma
 void BRPeerManagerRescanFromBlockNumber(BRPeerManager *manager, uint32_t blockNumber)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     int needConnect = 0;
     if (manager->isConnected) {
@@ -1812,7 +3652,7 @@ void BRPeerManagerRescanFromBlockNumber(BRPeerManager *manager, uint32_t blockNu
 
         needConnect = _BRPeerManagerRescan(manager, block);
     }
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     if (needConnect) BRPeerManagerConnect(manager);
 }
 
@@ -1822,10 +3662,10 @@ uint32_t BRPeerManagerEstimatedBlockHeight(BRPeerManager *manager)
     uint32_t height;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     height = (manager->lastBlock->height < manager->estimatedHeight) ? manager->estimatedHeight :
              manager->lastBlock->height;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     return height;
 }
 
@@ -1835,9 +3675,9 @@ uint32_t BRPeerManagerLastBlockHeight(BRPeerManager *manager)
     uint32_t height;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     height = manager->lastBlock->height;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     return height;
 }
 
@@ -1847,9 +3687,9 @@ uint32_t BRPeerManagerLastBlockTimestamp(BRPeerManager *manager)
     uint32_t timestamp;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     timestamp = manager->lastBlock->timestamp;
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     return timestamp;
 }
 
@@ -1860,7 +3700,7 @@ double BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
     double progress;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     if (startHeight == 0) startHeight = manager->syncStartHeight;
     
     if (! manager->downloadPeer && manager->syncStartHeight == 0) {
@@ -1874,7 +3714,7 @@ double BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
     }
     else progress = 1.0;
 
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     return progress;
 }
 
@@ -1884,13 +3724,13 @@ size_t BRPeerManagerPeerCount(BRPeerManager *manager)
     size_t count = 0;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockPeers(manager);
     
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusDisconnected) count++;
     }
     
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockPeers(manager);
     return count;
 }
 
@@ -1898,14 +3738,14 @@ size_t BRPeerManagerPeerCount(BRPeerManager *manager)
 const char *BRPeerManagerDownloadPeerName(BRPeerManager *manager)
 {
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
 
     if (manager->downloadPeer) {
         sprintf(manager->downloadPeerName, "%s:%d", BRPeerHost(manager->downloadPeer), manager->downloadPeer->port);
     }
     else manager->downloadPeerName[0] = '\0';
     
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
     return manager->downloadPeerName;
 }
 
@@ -1915,9 +3755,9 @@ static void _publishTxInvDone(void *info, int success)
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
     
     free(info);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLock(manager);
     _BRPeerManagerRequestUnrelayedTx(manager, peer);
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlock(manager);
 }
 
 // publishes tx to bitcoin network (do not call BRTransactionFree() on tx afterward)
@@ -1926,31 +3766,37 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
 {
     assert(manager != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    if (tx) pthread_mutex_lock(&manager->lock);
     
     if (tx && ! BRTransactionIsSigned(tx)) {
-        pthread_mutex_unlock(&manager->lock);
         if (callback) callback(info, EINVAL); // transaction not signed
         tx = NULL;
     }
-    else if (tx && ! manager->isConnected) {
-        int connectFailureCount = manager->connectFailureCount;
+    else if (tx && ! __atomic_load_n(&manager->isConnected, __ATOMIC_RELAXED)) {
+        int connectFailureCount;
 
-        pthread_mutex_unlock(&manager->lock);
+        _BRPeerManagerLock(manager);
+        connectFailureCount = manager->connectFailureCount;
+        _BRPeerManagerUnlock(manager);
 
         if (connectFailureCount >= MAX_CONNECT_FAILURES ||
             (manager->networkIsReachable && ! manager->networkIsReachable(manager->info))) {
             if (callback) callback(info, ENOTCONN); // not connected to bitcoin network
             tx = NULL;
         }
-        else pthread_mutex_lock(&manager->lock);
     }
     
-    if (tx) {
+    if (tx) { // publishing only needs the peer and tx locks, so it doesn't wait on block processing
+        BRPeer *downloadPeer = __atomic_load_n(&manager->downloadPeer, __ATOMIC_RELAXED);
+        BRTransaction **txs;
         size_t i, count = 0;
         
         tx->timestamp = (uint32_t)time(NULL); // set timestamp to publish time
-        _BRPeerManagerAddTxToPublishList(manager, tx, info, callback);
+        txs = _BRPeerManagerTxsToPublish(manager, tx);
+        _BRPeerManagerLockPeers(manager);
+        _BRPeerManagerLockTx(manager);
+        _BRPeerManagerAddTxToPublishList(manager, txs, array_count(txs), info, callback);
+        _BRPeerManagerUnlockTx(manager);
+        array_free(txs);
 
         for (i = array_count(manager->connectedPeers); i > 0; i--) {
             if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) == BRPeerStatusConnected) count++;
@@ -1964,7 +3810,7 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
             
             // instead of publishing to all peers, leave out downloadPeer to see if tx propogates/gets relayed back
             // TODO: XXX connect to a random peer with an empty or fake bloom filter just for publishing
-            if (peer != manager->downloadPeer || count == 1) {
+            if (peer != downloadPeer || count == 1) {
                 _BRPeerManagerPublishPendingTx(manager, peer);
                 peerInfo = calloc(1, sizeof(*peerInfo));
                 assert(peerInfo != NULL);
@@ -1974,7 +3820,7 @@ void BRPeerManagerPublishTx(BRPeerManager *manager, BRTransaction *tx, void *inf
             }
         }
 
-        pthread_mutex_unlock(&manager->lock);
+        _BRPeerManagerUnlockPeers(manager);
     }
 }
 
@@ -1985,7 +3831,7 @@ size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash)
 
     assert(manager != NULL);
     assert(! UInt256IsZero(txHash));
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerLockTx(manager);
     
     for (size_t i = array_count(manager->txRelays); i > 0; i--) {
         if (! UInt256Eq(manager->txRelays[i - 1].txHash, txHash)) continue;
@@ -1993,7 +3839,7 @@ size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash)
         break;
     }
     
-    pthread_mutex_unlock(&manager->lock);
+    _BRPeerManagerUnlockTx(manager);
     return count;
 }
 
@@ -2001,16 +3847,101 @@ const BRChainParams *BRPeerManagerChainParams (BRPeerManager *manager) {
     return manager->params;
 }
 
+// a snapshot of the counters for manager, totals are since BRPeerManagerNew()
+BRPeerManagerMetrics BRPeerManagerGetMetrics(BRPeerManager *manager)
+{
+    BRPeerManagerMetrics metrics;
+
+    assert(manager != NULL);
+    _BRPeerManagerLock(manager);
+
+    if (manager->syncStartHeight > 0) { // a sync is in progress
+        manager->metrics.syncBlocks = (manager->lastBlock->height + 1 > manager->syncStartHeight) ?
+                                      manager->lastBlock->height + 1 - manager->syncStartHeight : 0;
+        manager->metrics.syncTime = _BRPeerManagerNow() - manager->syncStartTime;
+    }
+
+    _BRPeerManagerLockPeers(manager);
+    _BRPeerManagerLockTx(manager);
+    metrics = manager->metrics;
+    _BRPeerManagerUnlockTx(manager);
+    _BRPeerManagerUnlockPeers(manager);
+    _BRPeerManagerUnlock(manager);
+    metrics.syncBlocksPerSec = (metrics.syncTime > 0) ? metrics.syncBlocks/metrics.syncTime : 0;
+    return metrics;
+}
+
+// writes a snapshot of the counters for each connected peer to metrics, up to metricsCount, and returns the number
+// written, or if metrics is NULL, returns the number of connected peers
+size_t BRPeerManagerPeerMetrics(BRPeerManager *manager, BRPeerMetrics metrics[], size_t metricsCount)
+{
+    size_t i, count = 0;
+
+    assert(manager != NULL);
+    _BRPeerManagerLockPeers(manager);
+
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        if (BRPeerConnectStatus(manager->connectedPeers[i - 1]) != BRPeerStatusConnected) continue;
+        if (metrics && count < metricsCount) metrics[count] = BRPeerGetMetrics(manager->connectedPeers[i - 1]);
+        count++;
+    }
+
+    _BRPeerManagerUnlockPeers(manager);
+    return (! metrics || count < metricsCount) ? count : metricsCount;
+}
+
+// turns recording of lock wait and hold times per call site on or off (off by default), turning it off keeps the
+// sites recorded so far
+void BRPeerManagerSetLockProfiling(BRPeerManager *manager, int enabled)
+{
+    assert(manager != NULL);
+    __atomic_store_n(&manager->lockProfiling, (enabled) ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+static int _BRLockSiteWaitCompare(const void *a, const void *b)
+{
+    const BRPeerManagerLockSite *s1 = a, *s2 = b;
+
+    return (s1->waitUsec < s2->waitUsec) ? 1 : (s1->waitUsec > s2->waitUsec) ? -1 : 0;
+}
+
+// writes the lock call sites recorded while profiling was on to sites, most contended (total wait time) first, up
+// to sitesCount, and returns the number written, or if sites is NULL, returns the number of sites recorded
+size_t BRPeerManagerLockProfile(BRPeerManager *manager, BRPeerManagerLockSite sites[], size_t sitesCount)
+{
+    size_t count;
+
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->profileLock);
+    count = array_count(manager->lockSites);
+    if (sites) qsort(manager->lockSites, count, sizeof(*manager->lockSites), _BRLockSiteWaitCompare);
+    if (sites && count > sitesCount) count = sitesCount;
+    if (sites && count > 0) memcpy(sites, manager->lockSites, count*sizeof(*sites));
+    pthread_mutex_unlock(&manager->profileLock);
+    return count;
+}
+
 // frees memory allocated for manager
 void BRPeerManagerFree(BRPeerManager *manager)
 {
+    BRSaveQueue *q = &manager->saveQueue;
+    BRDownloadTimer *t = &manager->downloadTimer;
     BRTransaction *tx;
     
     assert(manager != NULL);
-    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerDownloadTimerStop(manager);
+    pthread_mutex_lock(&q->lock);
+    q->exit = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    if (q->threadState > 0) pthread_join(q->thread, NULL); // the save thread makes any remaining saves before exiting
+    _BRPeerManagerLock(manager);
+    _BRPeerManagerLockPeers(manager);
+    _BRPeerManagerLockTx(manager);
     array_free(manager->peers);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
+    _BRPeerManagerCFClear(manager);
     BRSetApply(manager->blocks, NULL, _setApplyFreeBlock);
     BRSetFree(manager->blocks);
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
@@ -2027,10 +3958,63 @@ void BRPeerManagerFree(BRPeerManager *manager)
     }
 
     if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
+    array_free(manager->filterAdds);
 
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
-    pthread_mutex_unlock(&manager->lock);
-    pthread_mutex_destroy(&manager->lock);
+    array_free(manager->downloadWindows);
+    array_free(manager->cfEntries);
+    if (manager->cfScriptData) free(manager->cfScriptData);
+    if (manager->cfScripts) free(manager->cfScripts);
+    if (manager->cfScriptLens) free(manager->cfScriptLens);
+    _BRPeerManagerUnlockTx(manager);
+    _BRPeerManagerUnlockPeers(manager);
+    _BRPeerManagerUnlock(manager);
+    array_free(manager->lockSites);
+    BRHeaderParserFree(manager->headerParser);
+    for (size_t i = array_count(q->blocks); i > 0; i--) BRMerkleBlockFree(q->blocks[i - 1]);
+    array_free(q->blocks);
+    array_free(q->peers);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    pthread_mutex_destroy(&manager->txLock.mutex);
+    pthread_mutex_destroy(&manager->peerLock.mutex);
+    pthread_mutex_destroy(&manager->lock.mutex);
+    pthread_mutex_destroy(&manager->profileLock);
     free(manager);
 }
+
+void BRPeerManagerQueueSaveBlocksTest(BRPeerManager *manager, int replace, BRMerkleBlock *blocks[], size_t blocksCount)
+{
+    _BRPeerManagerQueueSaveBlocks(manager, replace, blocks, blocksCount, 0);
+}
+
+void BRPeerManagerQueueSavePeersTest(BRPeerManager *manager, int replace, const BRPeer peers[], size_t peersCount)
+{
+    _BRPeerManagerQueueSavePeers(manager, replace, peers, peersCount);
+}
+
+void BRPeerManagerSyncStoppedTest(BRPeerManager *manager, int error)
+{
+    _BRPeerManagerSyncStoppedCallback(manager, error);
+}
+
+void BRPeerManagerSetDownloadTimeoutTest(BRPeerManager *manager, int seconds)
+{
+    _BRPeerManagerLock(manager);
+    manager->downloadTimeout = seconds;
+    _BRPeerManagerUnlock(manager);
+}
+
+int BRPeerManagerDownloadTimerRunningTest(BRPeerManager *manager)
+{
+    BRDownloadTimer *t = &manager->downloadTimer;
+    int running;
+
+    pthread_mutex_lock(&t->lock);
+    running = (t->threadState == 1);
+    pthread_mutex_unlock(&t->lock);
+    return running;
+}
@@ -30,6 +30,8 @@
 #include "BRTransaction.h"
 #include "BRWallet.h"
 #include "BRChainParams.h"
+#include "BRHeaderStore.h"
+#include "BRBlockCache.h"
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -41,6 +43,34 @@ extern "C" {
 
 typedef struct BRPeerManagerStruct BRPeerManager;
 
+typedef struct {
+    uint32_t syncStartHeight; // first block height of the current or last chain sync, or 0 if there hasn't been one
+    uint32_t syncBlocks; // blocks added to the chain during the current or last sync
+    double syncTime; // seconds spent on the current or last sync
+    double syncBlocksPerSec;
+    uint64_t filterRebuilds; // bloom filters built and sent with filterload
+    double filterRebuildTime; // total seconds spent building them
+    uint64_t filterAdds; // wallet addresses sent with filteradd instead of rebuilding the filter
+    uint64_t falsePositives; // tx matched by the bloom filter during a sync that weren't wallet tx
+    uint64_t connects; // peer connection attempts
+    uint64_t connectFailures; // connections that ended with a network error
+    uint64_t misbehavingPeers; // peers disconnected for breaking protocol rules
+    uint64_t replayedBlocks; // blocks a rescan replayed from the block cache instead of downloading them
+    BRPeerHistogram lockTime; // how long the chain lock (blocks, sync state and bloom filter) is held each time
+    BRPeerHistogram peerLockTime; // how long the peer list lock is held each time
+    BRPeerHistogram txLockTime; // how long the tx relay and publish lock is held each time
+} BRPeerManagerMetrics;
+
+// contention at one place a peer manager lock is taken, see BRPeerManagerLockProfile()
+typedef struct {
+    const char *function; // function that took the lock
+    int line; // source line the lock was taken on
+    const char *lock; // "chain", "peers" or "tx"
+    size_t count; // times the lock was taken here
+    uint64_t waitUsec, maxWaitUsec; // microseconds spent waiting for the lock, in total and the longest wait
+    uint64_t holdUsec, maxHoldUsec; // microseconds the lock was held, in total and the longest hold
+} BRPeerManagerLockSite;
+
 // returns a newly allocated BRPeerManager struct that must be freed by calling BRPeerManagerFree()
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
                                 BRMerkleBlock *blocks[], size_t blocksCount, const BRPeer peers[], size_t peersCount);
@@ -49,11 +79,14 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
 // info is a void pointer that will be passed along with each callback call
 // void syncStarted(void *) - called when blockchain syncing starts
 // void syncStopped(void *, int) - called when blockchain syncing stops, error is an errno.h code
+// - called only after every saveBlocks and savePeers call queued before syncing stopped has returned
 // void txStatusUpdate(void *) - called when transaction status may have changed such as when a new block arrives
 // void saveBlocks(void *, int, BRMerkleBlock *[], size_t) - called when blocks should be saved to the persistent store
 // - if replace is true, remove any previously saved blocks first
 // void savePeers(void *, int, const BRPeer[], size_t) - called when peers should be saved to the persistent store
 // - if replace is true, remove any previously saved peers first
+// - saveBlocks and savePeers are called in order from a separate save thread, so a slow store doesn't hold up peers,
+//   and saves queued while a call is running may be merged into the next call, blocks are only valid during the call
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
 // void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
 void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
@@ -65,6 +98,28 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
                                int (*networkIsReachable)(void *info),
                                void (*threadCleanup)(void *info));
 
+// not thread-safe, set the header store once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// if the chain in store is longer than the blocks passed to BRPeerManagerNew(), the headers following its last
+// difficulty transition are loaded from it, and from then on every block added to the main chain is appended to it,
+// making the saveBlocks callback optional
+// store must remain open until after BRPeerManagerFree() is called
+void BRPeerManagerSetHeaderStore(BRPeerManager *manager, BRHeaderStore *store);
+
+// not thread-safe, set the block cache once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// every filtered block added to the main chain is added to cache along with its wallet transactions, and a rescan
+// replays the cached blocks that follow the rescan starting point, for as long as they were matched against a bloom
+// filter that included the wallet's addresses up to the gap limit, before downloading the rest of the chain from peers
+// NOTE: blocks are only cached when syncing with bloom filters, not compact filters
+// cache must remain open until after BRPeerManagerFree() is called
+void BRPeerManagerSetBlockCache(BRPeerManager *manager, BRBlockCache *cache);
+
+// not thread-safe, call once after BRPeerManagerNew(), before calling BRPeerManagerConnect()
+// if enabled, the chain is synced with BIP157/158 compact block filters instead of BIP37 bloom filters: only peers that
+// serve compact filters are used, each filter is matched against the wallet scripts locally, and a block is only
+// downloaded in full when its filter matches, so generating new wallet addresses doesn't require a filter update
+// NOTE: unconfirmed transactions aren't relayed by peers in this mode, wallet transactions are seen once confirmed
+void BRPeerManagerSetCompactFilters(BRPeerManager *manager, int enabled);
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
@@ -76,6 +131,7 @@ BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 void BRPeerManagerConnect(BRPeerManager *manager);
 
 // disconnect from bitcoin peer-to-peer network (may cause syncFailed(), saveBlocks() or savePeers() callbacks to fire)
+// returns once all queued saves have been made
 void BRPeerManagerDisconnect(BRPeerManager *manager);
 
 // rescans blocks and transactions after earliestKeyTime (a new random download peer is also selected due to the
@@ -118,6 +174,21 @@ size_t BRPeerManagerRelayCount(BRPeerManager *manager, UInt256 txHash);
 // return the BRChainParams used to create this peer manager
 const BRChainParams *BRPeerManagerChainParams(BRPeerManager *manager);
 
+// a snapshot of the counters for manager, totals are since BRPeerManagerNew()
+BRPeerManagerMetrics BRPeerManagerGetMetrics(BRPeerManager *manager);
+
+// writes a snapshot of the counters for each connected peer to metrics, up to metricsCount, and returns the number
+// written, or if metrics is NULL, returns the number of connected peers
+size_t BRPeerManagerPeerMetrics(BRPeerManager *manager, BRPeerMetrics metrics[], size_t metricsCount);
+
+// turns recording of lock wait and hold times per call site on or off (off by default), turning it off keeps the
+// sites recorded so far
+void BRPeerManagerSetLockProfiling(BRPeerManager *manager, int enabled);
+
+// writes the lock call sites recorded while profiling was on to sites, most contended (total wait time) first, up
+// to sitesCount, and returns the number written, or if sites is NULL, returns the number of sites recorded
+size_t BRPeerManagerLockProfile(BRPeerManager *manager, BRPeerManagerLockSite sites[], size_t sitesCount);
+
 // frees memory allocated for manager (call BRPeerManagerDisconnect() first if connected)
 void BRPeerManagerFree(BRPeerManager *manager);
 
@@ -0,0 +1,983 @@
+//
+//  BRReplayPeer.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRReplayPeer.h"
+#include "BRBloomFilter.h"
+#include "BRBlockFilter.h"
+#include "BRAddress.h"
+#include "BRCrypto.h"
+#include "BRArray.h"
+#include "BRSet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+#define REPLAY_HEADER_LENGTH   24
+#define REPLAY_MAX_MSG_LENGTH  0x02000000
+#define REPLAY_VERSION         70013
+#define REPLAY_SERVICES        (SERVICES_NODE_NETWORK | SERVICES_NODE_BLOOM | SERVICES_NODE_WITNESS |\
+                                SERVICES_NODE_COMPACT_FILTERS)
+#define REPLAY_USER_AGENT      "/replaypeer:0.1/"
+#define REPLAY_TARGET          0x207fffff // regtest proof-of-work limit, any hash with the top bit clear
+#define REPLAY_MAX_HEADERS     2000
+#define REPLAY_MAX_BLOCKS      500
+#define REPLAY_MAX_CFHEADERS   2000 // BIP157 limits
+#define REPLAY_MAX_CFILTERS    1000
+#define REPLAY_MAX_MINE_TRIES  1000
+
+#define INV_TX             1
+#define INV_BLOCK          2
+#define INV_FILTERED_BLOCK 3
+#define INV_WITNESS_FLAG   0x40000000
+
+typedef struct {
+    BRMerkleBlock *block;
+    BRTransaction **txs;
+    size_t txCount;
+    uint8_t *filter; // BIP158 basic filter, NULL until the replay peer starts listening
+    size_t filterLen;
+    UInt256 filterHash, filterHeader;
+} BRReplayBlock;
+
+struct BRReplayPeerStruct {
+    uint32_t magicNumber;
+    BRReplayBlock *chain; // chain[0] is the checkpoint the client syncs from
+    BRSet *blocks; // the blocks in chain, indexed by blockHash
+    BRTransaction **mempool;
+    BRBloomFilter *filter; // NULL until filterload, and after filterclear, meaning everything matches
+    BRCheckPoint checkpoint;
+    BRChainParams params;
+    BRReplayPeerStats stats;
+    int listenSocket;
+    volatile int socket, stopped;
+    unsigned stallSeconds; // how long to hold up the next getdata request for blocks
+    uint32_t hideHeight; // filters for blocks from this height on are built without their transactions' scripts
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stallCond; // signalled when the replay peer is stopped, to end a stall early
+};
+
+static const char *_BRReplayPeerDNSSeeds[] = { NULL };
+
+static int _BRReplayPeerVerifyDifficulty(const BRMerkleBlock *block, const BRSet *blockSet)
+{
+    return 1; // synthetic chains don't follow difficulty retargeting
+}
+
+// calculates the merkle root of count tx hashes, destroying the contents of hashes
+static UInt256 _BRReplayPeerMerkleRoot(UInt256 hashes[], size_t count)
+{
+    UInt256 pair[2];
+
+    if (count == 0) return UINT256_ZERO;
+
+    while (count > 1) {
+        for (size_t i = 0; i < count; i += 2) {
+            pair[0] = hashes[i];
+            pair[1] = (i + 1 < count) ? hashes[i + 1] : hashes[i]; // an odd hash at the end is paired with itself
+            BRSHA256_2(&hashes[i/2], pair, sizeof(pair));
+        }
+
+        count = (count + 1)/2;
+    }
+
+    return hashes[0];
+}
+
+static void _BRReplayBlockFree(BRReplayBlock *b)
+{
+    for (size_t i = 0; i < b->txCount; i++) BRTransactionFree(b->txs[i]);
+    if (b->txs) free(b->txs);
+    if (b->filter) free(b->filter);
+    BRMerkleBlockFree(b->block);
+}
+
+// adds script to the scripts of a block filter, unless it's empty, an OP_RETURN output, or already added
+static void _BRReplayPeerAddFilterScript(const uint8_t ***scripts, size_t **scriptLens, const uint8_t *script,
+                                         size_t scriptLen)
+{
+    for (size_t i = 0; i < array_count(*scripts); i++) {
+        if ((*scriptLens)[i] == scriptLen && memcmp((*scripts)[i], script, scriptLen) == 0) return;
+    }
+
+    if (scriptLen == 0 || script[0] == OP_RETURN) return;
+    array_add(*scripts, script);
+    array_add(*scriptLens, scriptLen);
+}
+
+// builds the BIP158 basic filter of each block in the chain, along with its filter hash and header, from the output
+// scripts in the block, and the scripts of the outputs it spends that are found earlier in the chain
+static void _BRReplayPeerBuildFilters(BRReplayPeer *peer)
+{
+    BRSet *txs = BRSetNew(BRTransactionHash, BRTransactionEq, 1000);
+    UInt256 prevHeader = UINT256_ZERO;
+    const uint8_t **scripts;
+    size_t i, j, k, *scriptLens;
+    BRTransaction *tx, *prevTx, key;
+    BRReplayBlock *b;
+
+    array_new(scripts, 100);
+    array_new(scriptLens, 100);
+
+    for (i = 0; i < array_count(peer->chain); i++) {
+        b = &peer->chain[i];
+        array_clear(scripts);
+        array_clear(scriptLens);
+
+        for (j = 0; j < b->txCount; j++) {
+            tx = b->txs[j];
+
+            for (k = 0; b->block->height < peer->hideHeight && k < tx->inCount; k++) {
+                key.txHash = tx->inputs[k].txHash;
+                prevTx = BRSetGet(txs, &key);
+                if (! prevTx || tx->inputs[k].index >= prevTx->outCount) continue;
+                _BRReplayPeerAddFilterScript(&scripts, &scriptLens, prevTx->outputs[tx->inputs[k].index].script,
+                                             prevTx->outputs[tx->inputs[k].index].scriptLen);
+            }
+
+            for (k = 0; b->block->height < peer->hideHeight && k < tx->outCount; k++) {
+                _BRReplayPeerAddFilterScript(&scripts, &scriptLens, tx->outputs[k].script, tx->outputs[k].scriptLen);
+            }
+
+            BRSetAdd(txs, tx);
+        }
+
+        b->filterLen = BRBlockFilterBuild(NULL, 0, b->block->blockHash, scripts, scriptLens, array_count(scripts));
+        b->filter = malloc(b->filterLen);
+        assert(b->filter != NULL);
+        BRBlockFilterBuild(b->filter, b->filterLen, b->block->blockHash, scripts, scriptLens, array_count(scripts));
+        b->filterHash = BRBlockFilterHash(b->filter, b->filterLen);
+        b->filterHeader = prevHeader = BRBlockFilterHeader(b->filterHash, prevHeader);
+    }
+
+    array_free(scriptLens);
+    array_free(scripts);
+    BRSetFree(txs);
+}
+
+// true if the filter matches tx, following the BIP37 rules: the tx hash, a data element in an output script, a spent
+// outpoint, or a data element in an input signature script
+// with BLOOM_UPDATE_ALL, the outpoints of matched outputs are added to the filter so that spends of them also match
+static int _BRReplayPeerFilterMatches(BRReplayPeer *peer, const BRTransaction *tx)
+{
+    BRBloomFilter *filter = peer->filter;
+    const uint8_t *elems[128], *data;
+    uint8_t outpoint[sizeof(UInt256) + sizeof(uint32_t)];
+    size_t i, j, count, dataLen;
+    int r = 0, outMatch;
+
+    if (! filter) return 1;
+    if (BRBloomFilterContainsData(filter, tx->txHash.u8, sizeof(UInt256))) r = 1;
+
+    for (i = 0; i < tx->outCount; i++) {
+        count = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), tx->outputs[i].script, tx->outputs[i].scriptLen);
+
+        for (j = 0, outMatch = 0; ! outMatch && j < count; j++) {
+            data = BRScriptData(elems[j], &dataLen);
+            if (data && dataLen > 0 && BRBloomFilterContainsData(filter, data, dataLen)) outMatch = 1;
+        }
+
+        if (outMatch && filter->flags == BLOOM_UPDATE_ALL) {
+            UInt256Set(outpoint, tx->txHash);
+            UInt32SetLE(&outpoint[sizeof(UInt256)], (uint32_t)i);
+            BRBloomFilterInsertData(filter, outpoint, sizeof(outpoint));
+        }
+
+        if (outMatch) r = 1;
+    }
+
+    for (i = 0; ! r && i < tx->inCount; i++) {
+        UInt256Set(outpoint, tx->inputs[i].txHash);
+        UInt32SetLE(&outpoint[sizeof(UInt256)], tx->inputs[i].index);
+        if (BRBloomFilterContainsData(filter, outpoint, sizeof(outpoint))) r = 1;
+        count = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), tx->inputs[i].signature, tx->inputs[i].sigLen);
+
+        for (j = 0; ! r && j < count; j++) {
+            data = BRScriptData(elems[j], &dataLen);
+            if (data && dataLen > 0 && BRBloomFilterContainsData(filter, data, dataLen)) r = 1;
+        }
+    }
+
+    return r;
+}
+
+static void _BRReplayPeerSend(BRReplayPeer *peer, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    uint8_t header[REPLAY_HEADER_LENGTH] = { 0 }, hash[32];
+    size_t off = 0;
+    ssize_t n = 0;
+
+    UInt32SetLE(&header[0], peer->magicNumber);
+    strncpy((char *)&header[4], type, 12);
+    UInt32SetLE(&header[16], (uint32_t)msgLen);
+    BRSHA256_2(hash, msg, msgLen);
+    memcpy(&header[20], hash, sizeof(uint32_t));
+
+    while (n >= 0 && off < sizeof(header) + msgLen) {
+        if (off < sizeof(header)) n = send(peer->socket, &header[off], sizeof(header) - off, MSG_NOSIGNAL);
+        else n = send(peer->socket, &msg[off - sizeof(header)], sizeof(header) + msgLen - off, MSG_NOSIGNAL);
+        if (n > 0) off += n;
+        if (n < 0 && errno == EINTR) n = 0;
+    }
+
+    pthread_mutex_lock(&peer->lock);
+    peer->stats.bytesOut += off;
+    peer->stats.messagesOut++;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static void _BRReplayPeerSendVersion(BRReplayPeer *peer)
+{
+    size_t off = 0, userAgentLen = strlen(REPLAY_USER_AGENT);
+    uint8_t msg[80 + 1 + userAgentLen + 5];
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+
+    UInt32SetLE(&msg[off], REPLAY_VERSION);
+    off += sizeof(uint32_t);
+    UInt64SetLE(&msg[off], REPLAY_SERVICES);
+    off += sizeof(uint64_t);
+    UInt64SetLE(&msg[off], (uint64_t)time(NULL));
+    off += sizeof(uint64_t);
+    UInt64SetLE(&msg[off], 0); // services of remote peer
+    off += sizeof(uint64_t);
+    UInt128Set(&msg[off], localHost);
+    off += sizeof(UInt128);
+    UInt16SetBE(&msg[off], 0);
+    off += sizeof(uint16_t);
+    UInt64SetLE(&msg[off], REPLAY_SERVICES);
+    off += sizeof(uint64_t);
+    UInt128Set(&msg[off], localHost);
+    off += sizeof(UInt128);
+    UInt16SetBE(&msg[off], peer->params.standardPort);
+    off += sizeof(uint16_t);
+    UInt64SetLE(&msg[off], ((uint64_t)BRRand(0) << 32) | (uint64_t)BRRand(0)); // nonce
+    off += sizeof(uint64_t);
+    msg[off++] = (uint8_t)userAgentLen;
+    memcpy(&msg[off], REPLAY_USER_AGENT, userAgentLen);
+    off += userAgentLen;
+    // a replay peer hiding transactions claims an extra block, so that it's selected as the client's download peer
+    UInt32SetLE(&msg[off], BRReplayPeerLastHeight(peer) + (peer->hideHeight != UINT32_MAX ? 1 : 0)); // last block
+    off += sizeof(uint32_t);
+    msg[off++] = 1; // relay transactions
+    _BRReplayPeerSend(peer, "version", msg, off);
+    _BRReplayPeerSend(peer, "verack", NULL, 0);
+}
+
+// returns the index in the chain of the block after the first locator found, or 1 if none of them are in the chain
+static size_t _BRReplayPeerLocate(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen, size_t *stop)
+{
+    size_t i, off = sizeof(uint32_t), len = 0, count, start = 1;
+    BRMerkleBlock *b, key;
+
+    count = (off <= msgLen) ? (size_t)BRVarInt(&msg[off], msgLen - off, &len) : 0;
+    off += len;
+    *stop = array_count(peer->chain);
+
+    for (i = 0; i < count && off + sizeof(UInt256) <= msgLen; i++, off += sizeof(UInt256)) {
+        key.blockHash = UInt256Get(&msg[off]);
+        b = BRSetGet(peer->blocks, &key);
+        if (b) start = b->height - peer->chain[0].block->height + 1;
+        if (b) break;
+    }
+
+    off = sizeof(uint32_t) + len + count*sizeof(UInt256);
+
+    if (off + sizeof(UInt256) <= msgLen) {
+        key.blockHash = UInt256Get(&msg[off]);
+        b = BRSetGet(peer->blocks, &key);
+        if (b) *stop = b->height - peer->chain[0].block->height + 1;
+    }
+
+    return start;
+}
+
+static void _BRReplayPeerGetheaders(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    size_t i, off = 0, stop, start = _BRReplayPeerLocate(peer, msg, msgLen, &stop);
+    size_t count = (start < stop) ? stop - start : 0;
+    uint8_t *buf;
+
+    if (count > REPLAY_MAX_HEADERS) count = REPLAY_MAX_HEADERS;
+    buf = malloc(BRVarIntSize(count) + count*81);
+    assert(buf != NULL);
+    off += BRVarIntSet(buf, BRVarIntSize(count), count);
+
+    for (i = start; i < start + count; i++) {
+        off += BRMerkleBlockSerialize(peer->chain[i].block, &buf[off], 80);
+        buf[off++] = 0; // tx count
+    }
+
+    _BRReplayPeerSend(peer, "headers", buf, off);
+    free(buf);
+}
+
+static void _BRReplayPeerGetblocks(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    size_t i, off = 0, stop, start = _BRReplayPeerLocate(peer, msg, msgLen, &stop);
+    size_t count = (start < stop) ? stop - start : 0;
+    uint8_t *buf;
+
+    if (count > REPLAY_MAX_BLOCKS) count = REPLAY_MAX_BLOCKS;
+    if (count == 0) return;
+    buf = malloc(BRVarIntSize(count) + count*36);
+    assert(buf != NULL);
+    off += BRVarIntSet(buf, BRVarIntSize(count), count);
+
+    for (i = start; i < start + count; i++) {
+        UInt32SetLE(&buf[off], INV_BLOCK);
+        UInt256Set(&buf[off + sizeof(uint32_t)], peer->chain[i].block->blockHash);
+        off += 36;
+    }
+
+    _BRReplayPeerSend(peer, "inv", buf, off);
+    free(buf);
+}
+
+// returns the chain index of the stop block of a getcfheaders or getcfilters request, and stores the chain index of
+// its start block in start, or returns 0 if the request is malformed or doesn't match the chain
+static size_t _BRReplayPeerFilterRange(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen, size_t *start)
+{
+    uint32_t startHeight, baseHeight = peer->chain[0].block->height;
+    BRMerkleBlock *b, key;
+
+    if (msgLen < 1 + sizeof(uint32_t) + sizeof(UInt256) || msg[0] != BLOCK_FILTER_BASIC) return 0;
+    startHeight = UInt32GetLE(&msg[1]);
+    key.blockHash = UInt256Get(&msg[1 + sizeof(uint32_t)]);
+    b = BRSetGet(peer->blocks, &key);
+    if (! b || startHeight <= baseHeight || startHeight > b->height) return 0;
+    *start = startHeight - baseHeight;
+    return b->height - baseHeight;
+}
+
+static void _BRReplayPeerGetcfheaders(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    size_t i, off = 0, start = 0, stop = _BRReplayPeerFilterRange(peer, msg, msgLen, &start);
+    size_t count = (stop > 0) ? stop + 1 - start : 0;
+    uint8_t *buf;
+
+    if (count == 0 || count > REPLAY_MAX_CFHEADERS) return;
+    buf = malloc(1 + 2*sizeof(UInt256) + BRVarIntSize(count) + count*sizeof(UInt256));
+    assert(buf != NULL);
+    buf[off++] = BLOCK_FILTER_BASIC;
+    UInt256Set(&buf[off], peer->chain[stop].block->blockHash);
+    off += sizeof(UInt256);
+    UInt256Set(&buf[off], peer->chain[start - 1].filterHeader);
+    off += sizeof(UInt256);
+    off += BRVarIntSet(&buf[off], BRVarIntSize(count), count);
+
+    for (i = start; i <= stop; i++) {
+        UInt256Set(&buf[off], peer->chain[i].filterHash);
+        off += sizeof(UInt256);
+    }
+
+    _BRReplayPeerSend(peer, "cfheaders", buf, off);
+    free(buf);
+}
+
+static void _BRReplayPeerGetcfilters(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    size_t i, off, start = 0, stop = _BRReplayPeerFilterRange(peer, msg, msgLen, &start);
+    uint8_t *buf;
+
+    if (stop == 0 || stop + 1 - start > REPLAY_MAX_CFILTERS) return;
+
+    for (i = start; i <= stop; i++) {
+        buf = malloc(1 + sizeof(UInt256) + BRVarIntSize(peer->chain[i].filterLen) + peer->chain[i].filterLen);
+        assert(buf != NULL);
+        off = 0;
+        buf[off++] = BLOCK_FILTER_BASIC;
+        UInt256Set(&buf[off], peer->chain[i].block->blockHash);
+        off += sizeof(UInt256);
+        off += BRVarIntSet(&buf[off], BRVarIntSize(peer->chain[i].filterLen), peer->chain[i].filterLen);
+        memcpy(&buf[off], peer->chain[i].filter, peer->chain[i].filterLen);
+        off += peer->chain[i].filterLen;
+        _BRReplayPeerSend(peer, "cfilter", buf, off);
+        free(buf);
+        pthread_mutex_lock(&peer->lock);
+        peer->stats.cfilters++;
+        pthread_mutex_unlock(&peer->lock);
+    }
+}
+
+static void _BRReplayPeerSendTx(BRReplayPeer *peer, const BRTransaction *tx)
+{
+    uint8_t _buf[0x1000], *buf = _buf;
+    size_t len = BRTransactionSerialize(tx, NULL, 0);
+
+    if (len > sizeof(_buf)) buf = malloc(len);
+    assert(buf != NULL);
+    len = BRTransactionSerialize(tx, buf, len);
+    _BRReplayPeerSend(peer, "tx", buf, len);
+    if (buf != _buf) free(buf);
+    pthread_mutex_lock(&peer->lock);
+    peer->stats.transactions++;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// sends the block as a merkleblock with the transactions matching the filter, followed by tx messages for them
+static void _BRReplayPeerSendMerkleblock(BRReplayPeer *peer, const BRReplayBlock *b)
+{
+    BRMerkleBlock *block = BRMerkleBlockCopy(b->block);
+    UInt256 *hashes = calloc(b->txCount + 1, sizeof(*hashes));
+    int *matches = calloc(b->txCount + 1, sizeof(*matches));
+    size_t i, len;
+    uint8_t *buf;
+
+    assert(hashes != NULL && matches != NULL);
+
+    for (i = 0; i < b->txCount; i++) {
+        hashes[i] = b->txs[i]->txHash;
+        matches[i] = _BRReplayPeerFilterMatches(peer, b->txs[i]);
+    }
+
+    BRMerkleBlockSetPartialTree(block, hashes, matches, b->txCount);
+    len = BRMerkleBlockSerialize(block, NULL, 0);
+    buf = malloc(len);
+    assert(buf != NULL);
+    len = BRMerkleBlockSerialize(block, buf, len);
+    _BRReplayPeerSend(peer, "merkleblock", buf, len);
+    pthread_mutex_lock(&peer->lock);
+    peer->stats.merkleblocks++;
+    pthread_mutex_unlock(&peer->lock);
+
+    for (i = 0; i < b->txCount; i++) {
+        if (matches[i]) _BRReplayPeerSendTx(peer, b->txs[i]);
+    }
+
+    free(buf);
+    free(matches);
+    free(hashes);
+    BRMerkleBlockFree(block);
+}
+
+// sends the full block with all its transactions
+static void _BRReplayPeerSendBlock(BRReplayPeer *peer, const BRReplayBlock *b)
+{
+    size_t i, off = 0, len = 80 + BRVarIntSize(b->txCount);
+    uint8_t *buf;
+
+    for (i = 0; i < b->txCount; i++) len += BRTransactionSerialize(b->txs[i], NULL, 0);
+    buf = malloc(len);
+    assert(buf != NULL);
+    off += BRMerkleBlockSerialize(b->block, buf, 80);
+    off += BRVarIntSet(&buf[off], len - off, b->txCount);
+    for (i = 0; i < b->txCount; i++) off += BRTransactionSerialize(b->txs[i], &buf[off], len - off);
+    _BRReplayPeerSend(peer, "block", buf, off);
+    free(buf);
+    pthread_mutex_lock(&peer->lock);
+    peer->stats.blocks++;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// waits out a stall set with BRReplayPeerStall() if msg requests any blocks, or until the replay peer is stopped
+static void _BRReplayPeerStallGetdata(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen, size_t off)
+{
+    struct timespec deadline;
+    uint32_t type;
+    int blocks = 0;
+
+    for (; ! blocks && off + 36 <= msgLen; off += 36) {
+        type = UInt32GetLE(&msg[off]) & ~INV_WITNESS_FLAG;
+        blocks = (type == INV_FILTERED_BLOCK || type == INV_BLOCK);
+    }
+
+    pthread_mutex_lock(&peer->lock);
+
+    if (blocks && peer->stallSeconds > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += peer->stallSeconds;
+        peer->stallSeconds = 0;
+        peer->stats.stalls++;
+        while (! peer->stopped && pthread_cond_timedwait(&peer->stallCond, &peer->lock, &deadline) == 0);
+    }
+
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static void _BRReplayPeerGetdata(BRReplayPeer *peer, const uint8_t *msg, size_t msgLen)
+{
+    size_t i, j, off = 0, count = (size_t)BRVarInt(msg, msgLen, &off), notfoundCount = 0;
+    uint8_t *notfound = malloc(BRVarIntSize(count) + count*36 + 1);
+    BRMerkleBlock *b, key;
+    BRTransaction *tx;
+    uint32_t type;
+
+    assert(notfound != NULL);
+    off = (off == 0) ? msgLen : off;
+    _BRReplayPeerStallGetdata(peer, msg, msgLen, off);
+
+    for (i = 0; i < count && off + 36 <= msgLen; i++, off += 36) {
+        type = UInt32GetLE(&msg[off]) & ~INV_WITNESS_FLAG;
+        key.blockHash = UInt256Get(&msg[off + sizeof(uint32_t)]);
+        b = (type == INV_FILTERED_BLOCK || type == INV_BLOCK) ? BRSetGet(peer->blocks, &key) : NULL;
+        tx = NULL;
+
+        if (b && type == INV_BLOCK) {
+            _BRReplayPeerSendBlock(peer, &peer->chain[b->height - peer->chain[0].block->height]);
+            continue;
+        }
+        else if (b) {
+            _BRReplayPeerSendMerkleblock(peer, &peer->chain[b->height - peer->chain[0].block->height]);
+            continue;
+        }
+
+        pthread_mutex_lock(&peer->lock);
+
+        for (j = 0; type == INV_TX && ! tx && j < array_count(peer->mempool); j++) {
+            if (UInt256Eq(peer->mempool[j]->txHash, key.blockHash)) tx = peer->mempool[j];
+        }
+
+        pthread_mutex_unlock(&peer->lock);
+        if (tx) _BRReplayPeerSendTx(peer, tx);
+        else memcpy(&notfound[BRVarIntSize(count) + 36*notfoundCount++], &msg[off], 36);
+    }
+
+    if (notfoundCount > 0) {
+        off = BRVarIntSet(notfound, BRVarIntSize(count), notfoundCount);
+        memmove(&notfound[off], &notfound[BRVarIntSize(count)], 36*notfoundCount);
+        _BRReplayPeerSend(peer, "notfound", notfound, off + 36*notfoundCount);
+    }
+
+    free(notfound);
+}
+
+static void _BRReplayPeerMempool(BRReplayPeer *peer)
+{
+    size_t i, off, count = 0;
+    uint8_t *buf;
+
+    pthread_mutex_lock(&peer->lock);
+    buf = malloc(BRVarIntSize(array_count(peer->mempool)) + array_count(peer->mempool)*36);
+    assert(buf != NULL);
+    off = BRVarIntSize(array_count(peer->mempool));
+
+    for (i = 0; i < array_count(peer->mempool); i++) {
+        if (! _BRReplayPeerFilterMatches(peer, peer->mempool[i])) continue;
+        UInt32SetLE(&buf[off], INV_TX);
+        UInt256Set(&buf[off + sizeof(uint32_t)], peer->mempool[i]->txHash);
+        off += 36;
+        count++;
+    }
+
+    pthread_mutex_unlock(&peer->lock);
+
+    if (count > 0) { // like bitcoind, don't send an inv if nothing in the mempool matches
+        i = BRVarIntSet(buf, BRVarIntSize(count), count);
+        memmove(&buf[i], &buf[BRVarIntSize(array_count(peer->mempool))], count*36);
+        _BRReplayPeerSend(peer, "inv", buf, i + count*36);
+    }
+
+    free(buf);
+}
+
+static void _BRReplayPeerAcceptMessage(BRReplayPeer *peer, const char *type, const uint8_t *msg, size_t msgLen)
+{
+    size_t off = 0, len;
+
+    if (strcmp(type, "version") == 0) {
+        _BRReplayPeerSendVersion(peer);
+    }
+    else if (strcmp(type, "ping") == 0) {
+        _BRReplayPeerSend(peer, "pong", msg, msgLen);
+    }
+    else if (strcmp(type, "getheaders") == 0) {
+        _BRReplayPeerGetheaders(peer, msg, msgLen);
+    }
+    else if (strcmp(type, "getblocks") == 0) {
+        _BRReplayPeerGetblocks(peer, msg, msgLen);
+    }
+    else if (strcmp(type, "getdata") == 0) {
+        _BRReplayPeerGetdata(peer, msg, msgLen);
+    }
+    else if (strcmp(type, "mempool") == 0) {
+        _BRReplayPeerMempool(peer);
+    }
+    else if (strcmp(type, "getcfheaders") == 0) {
+        _BRReplayPeerGetcfheaders(peer, msg, msgLen);
+    }
+    else if (strcmp(type, "getcfilters") == 0) {
+        _BRReplayPeerGetcfilters(peer, msg, msgLen);
+    }
+    else if (strcmp(type, "filterload") == 0) {
+        pthread_mutex_lock(&peer->lock);
+        if (peer->filter) BRBloomFilterFree(peer->filter);
+        peer->filter = BRBloomFilterParse(msg, msgLen);
+        pthread_mutex_unlock(&peer->lock);
+    }
+    else if (strcmp(type, "filteradd") == 0) {
+        len = (size_t)BRVarInt(msg, msgLen, &off);
+        pthread_mutex_lock(&peer->lock);
+        if (peer->filter && off > 0 && off + len <= msgLen) BRBloomFilterInsertData(peer->filter, &msg[off], len);
+        pthread_mutex_unlock(&peer->lock);
+    }
+    else if (strcmp(type, "filterclear") == 0) {
+        pthread_mutex_lock(&peer->lock);
+        if (peer->filter) BRBloomFilterFree(peer->filter);
+        peer->filter = NULL;
+        pthread_mutex_unlock(&peer->lock);
+    }
+    // verack, getaddr, addr, inv, tx, sendheaders, feefilter and the rest are ignored
+}
+
+// reads exactly len bytes from the socket, returns false if the connection was closed or failed
+static int _BRReplayPeerRead(BRReplayPeer *peer, uint8_t *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < len) {
+        n = read(peer->socket, &buf[off], len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        off += n;
+    }
+
+    return 1;
+}
+
+static void *_BRReplayPeerThreadRoutine(void *info)
+{
+    BRReplayPeer *peer = info;
+    uint8_t header[REPLAY_HEADER_LENGTH], *msg = NULL;
+    char type[13];
+    size_t msgLen;
+    int socket;
+
+    while (! peer->stopped) {
+        socket = accept(peer->listenSocket, NULL, NULL);
+
+        if (socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // the listen socket was shut down
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        peer->socket = socket;
+        peer->stats.connections++;
+        if (peer->filter) BRBloomFilterFree(peer->filter); // each connection starts without a filter
+        peer->filter = NULL;
+        pthread_mutex_unlock(&peer->lock);
+
+        while (! peer->stopped && _BRReplayPeerRead(peer, header, sizeof(header))) {
+            msgLen = UInt32GetLE(&header[16]);
+            strncpy(type, (const char *)&header[4], 12); // a 12 character type like getcfheaders isn't NUL terminated
+            type[12] = '\0';
+            if (UInt32GetLE(header) != peer->magicNumber || msgLen > REPLAY_MAX_MSG_LENGTH) break;
+            msg = realloc(msg, msgLen + 1);
+            assert(msg != NULL);
+            if (! _BRReplayPeerRead(peer, msg, msgLen)) break;
+            pthread_mutex_lock(&peer->lock);
+            peer->stats.bytesIn += sizeof(header) + msgLen;
+            peer->stats.messagesIn++;
+            pthread_mutex_unlock(&peer->lock);
+            _BRReplayPeerAcceptMessage(peer, type, msg, msgLen);
+        }
+
+        pthread_mutex_lock(&peer->lock);
+        peer->socket = -1;
+        pthread_mutex_unlock(&peer->lock);
+        close(socket);
+    }
+
+    if (msg) free(msg);
+    return NULL;
+}
+
+// returns a newly allocated replay peer with an empty chain that must be freed by calling BRReplayPeerFree()
+BRReplayPeer *BRReplayPeerNew(uint32_t magicNumber)
+{
+    BRReplayPeer *peer = calloc(1, sizeof(*peer));
+
+    assert(peer != NULL);
+    peer->magicNumber = magicNumber;
+    array_new(peer->chain, 1000);
+    array_new(peer->mempool, 10);
+    peer->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, 1000);
+    peer->listenSocket = peer->socket = -1;
+    peer->hideHeight = UINT32_MAX;
+    pthread_mutex_init(&peer->lock, NULL);
+    pthread_cond_init(&peer->stallCond, NULL);
+    return peer;
+}
+
+// appends block to the chain along with all txCount of its transactions, and takes ownership of both
+// block->blockHash must be set, and unless the chain is empty, block->prevBlock must be the hash of the last block
+// the height of the first block added is taken from block->height, later blocks are numbered consecutively
+// returns true on success
+int BRReplayPeerAddBlock(BRReplayPeer *peer, BRMerkleBlock *block, BRTransaction *txs[], size_t txCount)
+{
+    BRReplayBlock b = { block, NULL, txCount };
+    size_t count;
+
+    assert(peer != NULL);
+    assert(block != NULL);
+    assert(txs != NULL || txCount == 0);
+    assert(peer->listenSocket < 0);
+    count = array_count(peer->chain);
+
+    if (count > 0) {
+        if (! UInt256Eq(block->prevBlock, peer->chain[count - 1].block->blockHash)) return 0;
+        block->height = peer->chain[count - 1].block->height + 1;
+    }
+    else if (block->height == BLOCK_UNKNOWN_HEIGHT) block->height = 0;
+
+    if (txCount > 0) {
+        b.txs = malloc(txCount*sizeof(*txs));
+        assert(b.txs != NULL);
+        memcpy(b.txs, txs, txCount*sizeof(*txs));
+    }
+
+    array_add(peer->chain, b);
+    BRSetAdd(peer->blocks, block);
+    return 1;
+}
+
+// creates a block containing txs on top of the chain (or a base block at height 0 if the chain is empty), mines it,
+// and appends it to the chain, taking ownership of txs
+// returns the new block, owned by the replay peer, or NULL if it couldn't be mined at a difficulty the library accepts
+const BRMerkleBlock *BRReplayPeerMineBlock(BRReplayPeer *peer, BRTransaction *txs[], size_t txCount,
+                                           uint32_t timestamp)
+{
+    BRMerkleBlock *block = BRMerkleBlockNew();
+    UInt256 *hashes = calloc(txCount + 1, sizeof(*hashes));
+    uint8_t header[80];
+    size_t i;
+
+    assert(peer != NULL);
+    assert(txs != NULL || txCount == 0);
+    assert(hashes != NULL);
+    for (i = 0; i < txCount; i++) hashes[i] = txs[i]->txHash;
+    block->version = 4;
+    if (array_count(peer->chain) > 0) block->prevBlock = peer->chain[array_count(peer->chain) - 1].block->blockHash;
+    block->merkleRoot = _BRReplayPeerMerkleRoot(hashes, txCount);
+    block->timestamp = timestamp;
+    block->target = REPLAY_TARGET;
+    free(hashes);
+
+    for (i = 0; i < REPLAY_MAX_MINE_TRIES; i++) {
+        block->nonce = (uint32_t)i;
+        BRMerkleBlockSerialize(block, header, sizeof(header));
+        BRSHA256_2(&block->blockHash, header, sizeof(header));
+        if (BRMerkleBlockIsValid(block, timestamp)) break;
+    }
+
+    if (i == REPLAY_MAX_MINE_TRIES || ! BRReplayPeerAddBlock(peer, block, txs, txCount)) {
+        BRMerkleBlockFree(block);
+        block = NULL;
+    }
+
+    return block;
+}
+
+// appends the blocks recorded in a file laid out like bitcoind's blk*.dat files (magic number, length, and block,
+// repeated), numbering them from height if the chain is empty
+// returns the number of blocks added, stopping at the first block that doesn't connect to the chain
+size_t BRReplayPeerLoadBlocks(BRReplayPeer *peer, const char *path, uint32_t height)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t prefix[8], *buf = NULL;
+    size_t i, off, len, txCount, count = 0;
+    BRMerkleBlock *block;
+    BRTransaction **txs;
+    int r = 1;
+
+    assert(peer != NULL);
+    assert(path != NULL);
+
+    while (f && r && fread(prefix, 1, sizeof(prefix), f) == sizeof(prefix)) {
+        len = UInt32GetLE(&prefix[4]);
+        if (UInt32GetLE(prefix) != peer->magicNumber || len < 81 || len > REPLAY_MAX_MSG_LENGTH) break;
+        buf = realloc(buf, len);
+        assert(buf != NULL);
+        if (fread(buf, 1, len, f) != len) break;
+        block = BRMerkleBlockParse(buf, 80);
+        if (! block) break;
+        if (array_count(peer->chain) == 0) block->height = height;
+        off = 80;
+        txCount = (size_t)BRVarInt(&buf[off], len - off, &i);
+        off += i;
+        txs = calloc(txCount + 1, sizeof(*txs));
+        assert(txs != NULL);
+
+        for (i = 0; i < txCount && off < len; i++) {
+            txs[i] = BRTransactionParse(&buf[off], len - off);
+            if (! txs[i]) break;
+            off += BRTransactionSerialize(txs[i], NULL, 0);
+        }
+
+        if (i < txCount || ! BRReplayPeerAddBlock(peer, block, txs, txCount)) {
+            while (i > 0) BRTransactionFree(txs[--i]);
+            BRMerkleBlockFree(block);
+            r = 0;
+        }
+        else count++;
+
+        free(txs);
+    }
+
+    if (buf) free(buf);
+    if (f) fclose(f);
+    return count;
+}
+
+// adds tx to the mempool, served in response to mempool and getdata messages, and takes ownership of it
+void BRReplayPeerAddMempoolTx(BRReplayPeer *peer, BRTransaction *tx)
+{
+    assert(peer != NULL);
+    assert(tx != NULL);
+    pthread_mutex_lock(&peer->lock);
+    array_add(peer->mempool, tx);
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// height of the last block in the chain, or BLOCK_UNKNOWN_HEIGHT if the chain is empty
+uint32_t BRReplayPeerLastHeight(BRReplayPeer *peer)
+{
+    assert(peer != NULL);
+    return (array_count(peer->chain) > 0) ? peer->chain[array_count(peer->chain) - 1].block->height : BLOCK_UNKNOWN_HEIGHT;
+}
+
+// chain params for a BRPeerManager syncing from the replay peer, with the first block in the chain as the checkpoint
+// the returned params are valid until the replay peer is freed, and the chain must not be empty
+const BRChainParams *BRReplayPeerChainParams(BRReplayPeer *peer)
+{
+    const BRMerkleBlock *base;
+
+    assert(peer != NULL);
+    assert(array_count(peer->chain) > 0);
+    base = peer->chain[0].block;
+    peer->checkpoint = (BRCheckPoint) { base->height, UInt256Reverse(base->blockHash), base->timestamp, base->target };
+    peer->params = (BRChainParams) { _BRReplayPeerDNSSeeds, peer->params.standardPort, peer->magicNumber,
+                                     SERVICES_NODE_NETWORK, _BRReplayPeerVerifyDifficulty, &peer->checkpoint, 1 };
+    return &peer->params;
+}
+
+// starts serving the chain on 127.0.0.1 from a background thread, blocks must not be added after this
+// returns the port listened on, or 0 on error (errno is set)
+uint16_t BRReplayPeerListen(BRReplayPeer *peer)
+{
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    int err = 0, on = 1;
+
+    assert(peer != NULL);
+    assert(peer->listenSocket < 0);
+    _BRReplayPeerBuildFilters(peer);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // let the system pick a free port
+    peer->listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (peer->listenSocket < 0) return 0;
+    setsockopt(peer->listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(peer->listenSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(peer->listenSocket, 1) < 0 ||
+        getsockname(peer->listenSocket, (struct sockaddr *)&addr, &addrLen) < 0 ||
+        pthread_create(&peer->thread, NULL, _BRReplayPeerThreadRoutine, peer) != 0) {
+        err = errno;
+        close(peer->listenSocket);
+        peer->listenSocket = -1;
+        errno = err;
+        return 0;
+    }
+
+    peer->params.standardPort = ntohs(addr.sin_port);
+    return peer->params.standardPort;
+}
+
+// traffic counters since BRReplayPeerListen() was called
+BRReplayPeerStats BRReplayPeerGetStats(BRReplayPeer *peer)
+{
+    BRReplayPeerStats stats;
+
+    assert(peer != NULL);
+    pthread_mutex_lock(&peer->lock);
+    stats = peer->stats;
+    pthread_mutex_unlock(&peer->lock);
+    return stats;
+}
+
+// resets the traffic counters to zero
+void BRReplayPeerResetStats(BRReplayPeer *peer)
+{
+    assert(peer != NULL);
+    pthread_mutex_lock(&peer->lock);
+    memset(&peer->stats, 0, sizeof(peer->stats));
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// holds up the response to the next getdata request for blocks by the given number of seconds, along with everything
+// sent after it on the connection, like a node that stops responding for a while
+void BRReplayPeerStall(BRReplayPeer *peer, unsigned seconds)
+{
+    assert(peer != NULL);
+    pthread_mutex_lock(&peer->lock);
+    peer->stallSeconds = seconds;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+// makes the replay peer act like a malicious node hiding transactions from the client: the compact filters it serves
+// for blocks from the given height on are built without the scripts of their transactions, so its filter headers
+// differ from honest nodes', and it reports a chain one block longer than it has, to be selected as download peer
+// must be called before BRReplayPeerListen()
+void BRReplayPeerHideTransactions(BRReplayPeer *peer, uint32_t height)
+{
+    assert(peer != NULL);
+    assert(peer->listenSocket < 0);
+    peer->hideHeight = height;
+}
+
+// stops serving, closing any open connection, and frees memory allocated for the replay peer
+void BRReplayPeerFree(BRReplayPeer *peer)
+{
+    assert(peer != NULL);
+
+    if (peer->listenSocket >= 0) {
+        pthread_mutex_lock(&peer->lock);
+        peer->stopped = 1;
+        shutdown(peer->listenSocket, SHUT_RDWR); // wakes the thread if it's waiting in accept()
+        if (peer->socket >= 0) shutdown(peer->socket, SHUT_RDWR); // or in read()
+        pthread_cond_broadcast(&peer->stallCond); // or in a stall
+        pthread_mutex_unlock(&peer->lock);
+        pthread_join(peer->thread, NULL);
+        close(peer->listenSocket);
+    }
+
+    for (size_t i = 0; i < array_count(peer->chain); i++) _BRReplayBlockFree(&peer->chain[i]);
+    for (size_t i = 0; i < array_count(peer->mempool); i++) BRTransactionFree(peer->mempool[i]);
+    array_free(peer->chain);
+    array_free(peer->mempool);
+    BRSetFree(peer->blocks);
+    if (peer->filter) BRBloomFilterFree(peer->filter);
+    pthread_cond_destroy(&peer->stallCond);
+    pthread_mutex_destroy(&peer->lock);
+    free(peer);
+}
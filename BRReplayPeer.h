@@ -0,0 +1,120 @@
+//
+//  BRReplayPeer.h
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef BRReplayPeer_h
+#define BRReplayPeer_h
+
+#include "BRChainParams.h"
+#include "BRMerkleBlock.h"
+#include "BRTransaction.h"
+#include "BRInt.h"
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a stand-in for a remote bitcoin node, for measuring chain sync offline and deterministically
+// it listens on the loopback interface and serves a recorded or synthetic chain to one connection at a time, speaking
+// enough of the p2p protocol for SPV mode: version/verack, ping, getheaders, getblocks, getdata for filtered blocks
+// (sent as merkleblock followed by the matched tx messages), full blocks and mempool transactions, mempool, the bloom
+// filter messages filterload, filteradd and filterclear, and getcfheaders and getcfilters for BIP158 basic filters
+// the first block of the chain is the base the client syncs from, and is reported as the only checkpoint in the chain
+// params returned by BRReplayPeerChainParams()
+// NOTE: synthetic blocks are mined at regtest difficulty, so they're only accepted by a library built with
+// BITCOIN_REGTEST defined
+
+typedef struct BRReplayPeerStruct BRReplayPeer;
+
+typedef struct {
+    uint64_t bytesIn;      // bytes received, including message headers
+    uint64_t bytesOut;     // bytes sent, including message headers
+    size_t messagesIn;
+    size_t messagesOut;
+    size_t merkleblocks;   // merkleblock messages sent
+    size_t blocks;         // full block messages sent
+    size_t cfilters;       // cfilter messages sent
+    size_t transactions;   // tx messages sent
+    size_t connections;    // connections accepted
+    size_t stalls;         // getdata requests held up by BRReplayPeerStall()
+} BRReplayPeerStats;
+
+// returns a newly allocated replay peer with an empty chain that must be freed by calling BRReplayPeerFree()
+BRReplayPeer *BRReplayPeerNew(uint32_t magicNumber);
+
+// appends block to the chain along with all txCount of its transactions, and takes ownership of both
+// block->blockHash must be set, and unless the chain is empty, block->prevBlock must be the hash of the last block
+// the height of the first block added is taken from block->height, later blocks are numbered consecutively
+// returns true on success
+int BRReplayPeerAddBlock(BRReplayPeer *peer, BRMerkleBlock *block, BRTransaction *txs[], size_t txCount);
+
+// creates a block containing txs on top of the chain (or a base block at height 0 if the chain is empty), mines it,
+// and appends it to the chain, taking ownership of txs
+// returns the new block, owned by the replay peer, or NULL if it couldn't be mined at a difficulty the library accepts
+const BRMerkleBlock *BRReplayPeerMineBlock(BRReplayPeer *peer, BRTransaction *txs[], size_t txCount,
+                                           uint32_t timestamp);
+
+// appends the blocks recorded in a file laid out like bitcoind's blk*.dat files (magic number, length, and block,
+// repeated), numbering them from height if the chain is empty
+// returns the number of blocks added, stopping at the first block that doesn't connect to the chain
+size_t BRReplayPeerLoadBlocks(BRReplayPeer *peer, const char *path, uint32_t height);
+
+// adds tx to the mempool, served in response to mempool and getdata messages, and takes ownership of it
+void BRReplayPeerAddMempoolTx(BRReplayPeer *peer, BRTransaction *tx);
+
+// height of the last block in the chain, or BLOCK_UNKNOWN_HEIGHT if the chain is empty
+uint32_t BRReplayPeerLastHeight(BRReplayPeer *peer);
+
+// chain params for a BRPeerManager syncing from the replay peer, with the first block in the chain as the checkpoint
+// the returned params are valid until the replay peer is freed, and the chain must not be empty
+const BRChainParams *BRReplayPeerChainParams(BRReplayPeer *peer);
+
+// starts serving the chain on 127.0.0.1 from a background thread, blocks must not be added after this
+// returns the port listened on, or 0 on error (errno is set)
+uint16_t BRReplayPeerListen(BRReplayPeer *peer);
+
+// traffic counters since BRReplayPeerListen() was called
+BRReplayPeerStats BRReplayPeerGetStats(BRReplayPeer *peer);
+
+// resets the traffic counters to zero
+void BRReplayPeerResetStats(BRReplayPeer *peer);
+
+// holds up the response to the next getdata request for blocks by the given number of seconds, along with everything
+// sent after it on the connection, like a node that stops responding for a while
+void BRReplayPeerStall(BRReplayPeer *peer, unsigned seconds);
+
+// makes the replay peer act like a malicious node hiding transactions from the client: the compact filters it serves
+// for blocks from the given height on are built without the scripts of their transactions, so its filter headers
+// differ from honest nodes', and it reports a chain one block longer than it has, to be selected as download peer
+// must be called before BRReplayPeerListen()
+void BRReplayPeerHideTransactions(BRReplayPeer *peer, uint32_t height);
+
+// stops serving, closing any open connection, and frees memory allocated for the replay peer
+void BRReplayPeerFree(BRReplayPeer *peer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRReplayPeer_h
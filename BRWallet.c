@@ -26,6 +26,8 @@
 #include "BRSet.h"
 #include "BRAddress.h"
 #include "BRArray.h"
+#include "BRCrypto.h"
+#include "BRKey.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -51,30 +53,64 @@ inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
     return (fee > standardFee) ? fee : standardFee;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const UInt160 *chain)
-{
-    const uint8_t *pkh;
-    
-    for (size_t i = array_count(chain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
-            if (pkh && _pkhEq(pkh, &chain[i - 1])) return i - 1;
-        }
-    }
-    
-    return -1;
-}
+#define TX_DELTA_RECEIVES       0x01 // an output pays a wallet address
+#define TX_DELTA_SENDS          0x02 // an input spends an output to a wallet address
+#define TX_DELTA_MISSING_INPUTS 0x04 // an input spends an output of a tx that isn't in allTx, so the fee is unknown
+#define TX_DELTA_IN_HISTORY     0x08 // tx is in wallet->history and balance is the wallet balance after it
+
+// the wallet's view of a tx in allTx, calculated once when the tx is added, so history queries don't have to rescan
+// its inputs and outputs, it only changes when a tx its inputs spend is added or removed, or addresses are generated
+// wallet transactions are also nodes of wallet->history, an order-statistic treap sorted by the key fields, which are
+// copies so a node can still be found after its tx's blockHeight changes
+typedef struct BRTxDeltaStruct {
+    UInt256 txHash; // must be first so txDeltas can be searched by tx or tx hash
+    const BRTransaction *tx;
+    uint64_t received, sent, fee, balance;
+    size_t chainIndex; // highest internal chain index an output pays, or if none, highest external chain index
+    uint32_t statusEpoch; // status is only memoized while this matches wallet->statusEpoch
+    uint32_t walkMark; // wallet->walkMark of the last spend graph walk that reached this tx
+    uint8_t flags, status;
+    uint32_t keyHeight, keyDepth, seq; // history key: height, depth in the spend graph, chain index, seq
+    uint32_t priority; // treap heap order, keyed so transactions can't be ground to unbalance the tree
+    size_t keyChain, size; // size is the number of nodes in the subtree rooted here
+    uint32_t timestamp, minTime, maxTime; // timestamp when last sorted, and the range of them in the subtree
+    uint8_t kinds, subtreeKinds; // WALLET_HISTORY_* flags the tx could match, and all of them in the subtree
+    struct BRTxDeltaStruct *left, *right;
+} BRTxDelta;
+
+#define TX_STATUS_VALID        0x01
+#define TX_STATUS_PENDING      0x02
+#define TX_STATUS_VERIFIED     0x04
+#define TX_STATUS_HAS_VALID    0x10 // TX_STATUS_VALID bit is memoized
+#define TX_STATUS_HAS_PENDING  0x20 // TX_STATUS_PENDING bit is memoized
+#define TX_STATUS_HAS_VERIFIED 0x40 // TX_STATUS_VERIFIED bit is memoized
+#define TX_STATUS_PENDING_LOCKED  0x08 // pending until a future lockTime, found by the status walk in progress
+#define TX_STATUS_VERIFIED_LOCKED 0x80 // unverified for a reason that can change, found by the status walk in progress
+
+// the spend graph edges out of a tx: the transactions in allTx with an input spending one of its outputs, the tx
+// itself doesn't have to be in allTx, so children that arrive before their parent are found when it does
+typedef struct {
+    UInt256 txHash; // must be first so txChildren can be searched by tx or tx hash
+    BRTransaction **children;
+} BRTxChildren;
+
+// the outputs of transactions in allTx that pay an address, wallet address or not, so per-address queries only have to
+// look at the transactions that touch the address, inputs spending them are found through txChildren
+typedef struct {
+    UInt160 pkh; // must be first so addrOutputs can be searched by pkh
+    BRUTXO *outputs;
+} BRAddrOutputs;
 
 struct BRWalletStruct {
-    uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
-    uint32_t blockHeight;
+    uint64_t balance, totalSent, totalReceived, feePerKb;
+    uint32_t blockHeight, statusEpoch, txSeq, walkMark;
+    UInt128 treeKey; // BRSip64() key for treap priorities
     BRUTXO *utxos;
-    BRTransaction **transactions;
+    BRTxDelta *history; // root of the tree of wallet transactions, sorted by date, oldest first
     BRMasterPubKey masterPubKey;
     int forkId;
     UInt160 *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedPKH, *allPKH;
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedPKH, *allPKH, *txDeltas, *txChildren, *addrOutputs;
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
     void (*txAdded)(void *info, BRTransaction *tx);
@@ -95,60 +131,527 @@ inline static void _BRWalletAddressFromHash160(BRWallet *wallet, char *addr, siz
     else BRAddressFromHash160(addr, addrLen, &h);
 }
 
-inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+inline static size_t _BRTxTreeSize(const BRTxDelta *node)
 {
-    if (! tx1 || ! tx2) return 0;
-    if (tx1->blockHeight > tx2->blockHeight) return 1;
-    if (tx1->blockHeight < tx2->blockHeight) return 0;
-    
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (UInt256Eq(tx1->inputs[i].txHash, tx2->txHash)) return 1;
+    return (node) ? node->size : 0;
+}
+
+// recalculates the subtree totals of node from its children
+inline static void _BRTxTreeUpdate(BRTxDelta *node)
+{
+    node->size = 1;
+    node->subtreeKinds = node->kinds;
+    node->minTime = node->maxTime = node->timestamp;
+
+    for (int i = 0; i < 2; i++) {
+        const BRTxDelta *child = (i == 0) ? node->left : node->right;
+
+        if (! child) continue;
+        node->size += child->size;
+        node->subtreeKinds |= child->subtreeKinds;
+        if (child->minTime < node->minTime) node->minTime = child->minTime;
+        if (child->maxTime > node->maxTime) node->maxTime = child->maxTime;
     }
-    
-    for (size_t i = 0; i < tx2->inCount; i++) {
-        if (UInt256Eq(tx2->inputs[i].txHash, tx1->txHash)) return 0;
+}
+
+inline static int _BRTxTreeCompare(const BRTxDelta *a, const BRTxDelta *b)
+{
+    if (a->keyHeight != b->keyHeight) return (a->keyHeight < b->keyHeight) ? -1 : 1;
+    if (a->keyDepth != b->keyDepth) return (a->keyDepth < b->keyDepth) ? -1 : 1;
+    if (a->keyChain != b->keyChain) return (a->keyChain < b->keyChain) ? -1 : 1;
+    if (a->seq != b->seq) return (a->seq < b->seq) ? -1 : 1;
+    return 0;
+}
+
+inline static uint32_t _BRTxTreePriority(const BRTxDelta *node)
+{
+    return node->priority;
+}
+
+// inserts node into the tree at root, and returns the new root
+static BRTxDelta *_BRTxTreeInsert(BRTxDelta *root, BRTxDelta *node)
+{
+    BRTxDelta *child;
+
+    if (! root) {
+        node->left = node->right = NULL;
+        _BRTxTreeUpdate(node);
+        return node;
+    }
+
+    if (_BRTxTreeCompare(node, root) < 0) {
+        root->left = _BRTxTreeInsert(root->left, node);
+
+        if (_BRTxTreePriority(root->left) > _BRTxTreePriority(root)) { // rotate right
+            child = root->left;
+            root->left = child->right;
+            child->right = root;
+            _BRTxTreeUpdate(root);
+            root = child;
+        }
+    }
+    else {
+        root->right = _BRTxTreeInsert(root->right, node);
+
+        if (_BRTxTreePriority(root->right) > _BRTxTreePriority(root)) { // rotate left
+            child = root->right;
+            root->right = child->left;
+            child->left = root;
+            _BRTxTreeUpdate(root);
+            root = child;
+        }
     }
 
-    for (size_t i = 0; i < tx1->inCount; i++) {
-        if (_BRWalletTxIsAscending(wallet, BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash)), tx2)) return 1;
+    _BRTxTreeUpdate(root);
+    return root;
+}
+
+// joins two trees where every node of left sorts before every node of right, and returns the new root
+static BRTxDelta *_BRTxTreeJoin(BRTxDelta *left, BRTxDelta *right)
+{
+    if (! left) return right;
+    if (! right) return left;
+
+    if (_BRTxTreePriority(left) > _BRTxTreePriority(right)) {
+        left->right = _BRTxTreeJoin(left->right, right);
+        _BRTxTreeUpdate(left);
+        return left;
     }
 
-    return 0;
+    right->left = _BRTxTreeJoin(left, right->left);
+    _BRTxTreeUpdate(right);
+    return right;
 }
 
-inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
+// removes node from the tree at root, and returns the new root
+static BRTxDelta *_BRTxTreeRemove(BRTxDelta *root, const BRTxDelta *node)
 {
-    size_t i = -1, j = -1;
+    int c;
+
+    if (! root) return NULL;
+    if (root == node) return _BRTxTreeJoin(root->left, root->right);
+    c = _BRTxTreeCompare(node, root);
+    if (c < 0) root->left = _BRTxTreeRemove(root->left, node);
+    if (c >= 0) root->right = _BRTxTreeRemove(root->right, node);
+    _BRTxTreeUpdate(root);
+    return root;
+}
 
-    if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
-    if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    if ((i = _txChainIndex(tx1, wallet->internalChain)) != -1) j = _txChainIndex(tx2, wallet->internalChain);
-    if (j == -1 && (i = _txChainIndex(tx1, wallet->externalChain)) != -1) j = _txChainIndex(tx2, wallet->externalChain);
-    if (i != -1 && j != -1 && i != j) return (i > j) ? 1 : -1;
-    return 0;
+// writes up to count transactions from the tree at root to txs in order, starting at the given index, and returns
+// the number written
+static size_t _BRTxTreeGet(const BRTxDelta *root, size_t index, BRTransaction *txs[], size_t count)
+{
+    size_t n = 0, leftSize = _BRTxTreeSize((root) ? root->left : NULL);
+
+    if (! root || count == 0) return 0;
+    if (index < leftSize) n = _BRTxTreeGet(root->left, index, txs, count);
+    if (n < count && index <= leftSize) txs[n++] = (BRTransaction *)root->tx;
+    if (n < count) n += _BRTxTreeGet(root->right, (index > leftSize) ? index - leftSize - 1 : 0, &txs[n], count - n);
+    return n;
 }
 
-// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+// returns the node at index in the tree at root, in order
+static BRTxDelta *_BRTxTreeAt(BRTxDelta *root, size_t index)
 {
-    size_t i = array_count(wallet->transactions);
-    
-    array_set_count(wallet->transactions, i + 1);
-    
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    while (root && index != _BRTxTreeSize(root->left)) {
+        if (index < _BRTxTreeSize(root->left)) {
+            root = root->left;
+        }
+        else {
+            index -= _BRTxTreeSize(root->left) + 1;
+            root = root->right;
+        }
     }
-    
-    wallet->transactions[i] = tx;
+
+    return root;
+}
+
+// number of nodes in the tree at root with a height key lower than blockHeight
+static size_t _BRTxTreeCountBelow(const BRTxDelta *root, uint32_t blockHeight)
+{
+    size_t n = 0;
+
+    while (root) {
+        if (root->keyHeight < blockHeight) n += _BRTxTreeSize(root->left) + 1;
+        root = (root->keyHeight < blockHeight) ? root->right : root->left;
+    }
+
+    return n;
+}
+
+// recalculates the amounts and flags in delta from its tx, the transactions in allTx, and the wallet addresses
+static void _BRWalletUpdateTxDelta(BRWallet *wallet, BRTxDelta *delta)
+{
+    const BRTransaction *tx = delta->tx, *t;
+    uint64_t inAmount = 0, outAmount = 0;
+    size_t internal = 0, external = 0, count = array_count(wallet->internalChain);
+    const uint8_t *pkh;
+    const UInt160 *p;
+    uint32_t n;
+    uint8_t kinds;
+
+    delta->received = delta->sent = 0;
+    delta->flags &= TX_DELTA_IN_HISTORY;
+
+    // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
+    for (size_t i = 0; i < tx->outCount; i++) {
+        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+        outAmount += tx->outputs[i].amount;
+        p = (pkh) ? BRSetGet(wallet->allPKH, pkh) : NULL; // allPKH members point into the address chains
+        if (! p) continue;
+        delta->received += tx->outputs[i].amount;
+        delta->flags |= TX_DELTA_RECEIVES;
+
+        if (p >= wallet->internalChain && p < wallet->internalChain + count) {
+            if (p - wallet->internalChain >= internal) internal = p - wallet->internalChain + 1;
+        }
+        else if (p - wallet->externalChain >= external) external = p - wallet->externalChain + 1;
+    }
+
+    delta->chainIndex = (internal > 0) ? internal - 1 : (external > 0) ? external - 1 : 0;
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
+        n = tx->inputs[i].index;
+
+        if (t && n < t->outCount) {
+            pkh = BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen);
+            inAmount += t->outputs[n].amount;
+            if (! pkh || ! BRSetContains(wallet->allPKH, pkh)) continue;
+            delta->sent += t->outputs[n].amount;
+            delta->flags |= TX_DELTA_SENDS;
+        }
+        else delta->flags |= TX_DELTA_MISSING_INPUTS;
+    }
+
+    delta->fee = (delta->flags & TX_DELTA_MISSING_INPUTS) ? UINT64_MAX : inAmount - outAmount;
+    kinds = (delta->kinds & WALLET_HISTORY_PENDING);
+    if (delta->sent > delta->received) kinds |= WALLET_HISTORY_SENT;
+    if (delta->received > delta->sent) kinds |= WALLET_HISTORY_RECEIVED;
+
+    if (kinds != delta->kinds) { // move it back into the tree to update the subtree totals
+        if (delta->flags & TX_DELTA_IN_HISTORY) wallet->history = _BRTxTreeRemove(wallet->history, delta);
+        delta->kinds = kinds;
+        if (delta->flags & TX_DELTA_IN_HISTORY) wallet->history = _BRTxTreeInsert(wallet->history, delta);
+    }
+}
+
+// recalculates the history key and timestamp of delta, moving it to its new position in wallet->history if either
+// changed, and returns true if its depth changed
+static int _BRWalletUpdateTxKey(BRWallet *wallet, BRTxDelta *delta)
+{
+    const BRTransaction *tx = delta->tx;
+    const BRTxDelta *d;
+    uint32_t depth = 0, prevDepth = delta->keyDepth;
+
+    for (size_t i = 0; i < tx->inCount; i++) { // sort after every input tx, whatever its height
+        d = BRSetGet(wallet->txDeltas, &tx->inputs[i].txHash);
+        if (d && d->keyDepth != UINT32_MAX && d->keyDepth >= depth) depth = d->keyDepth + 1;
+    }
+
+    if (delta->keyHeight == tx->blockHeight && delta->keyDepth == depth && delta->keyChain == delta->chainIndex &&
+        delta->timestamp == tx->timestamp) return 0;
+    if (delta->flags & TX_DELTA_IN_HISTORY) wallet->history = _BRTxTreeRemove(wallet->history, delta);
+    delta->keyHeight = tx->blockHeight;
+    delta->keyDepth = depth;
+    delta->keyChain = delta->chainIndex;
+    delta->timestamp = tx->timestamp;
+    delta->kinds &= ~WALLET_HISTORY_PENDING; // only unconfirmed transactions can be pending
+    if (tx->blockHeight == TX_UNCONFIRMED) delta->kinds |= WALLET_HISTORY_PENDING;
+    if (delta->flags & TX_DELTA_IN_HISTORY) wallet->history = _BRTxTreeInsert(wallet->history, delta);
+    return (depth != prevDepth);
+}
+
+inline static int _BRTxDepthCompare(const void *a, const void *b)
+{
+    const BRTxDelta *d1 = *(BRTxDelta * const *)a, *d2 = *(BRTxDelta * const *)b;
+
+    return (d1->keyDepth < d2->keyDepth) ? -1 : (d1->keyDepth > d2->keyDepth) ? 1 : 0;
+}
+
+// updates the history key of delta, and if its depth changed, the depths of the transactions descending from it,
+// which only happens when a tx it descends from is added to or removed from allTx, confirming a tx only moves that tx
+static void _BRWalletUpdateTxOrder(BRWallet *wallet, BRTxDelta *delta)
+{
+    BRTxDelta **found, *d;
+    BRTxChildren *node;
+    uint32_t mark;
+
+    if (! _BRWalletUpdateTxKey(wallet, delta)) return;
+    mark = ++wallet->walkMark;
+    delta->walkMark = mark;
+    array_new(found, 10);
+    array_add(found, delta);
+
+    for (size_t i = 0; i < array_count(found); i++) { // collect the descendants, each once
+        node = BRSetGet(wallet->txChildren, found[i]);
+
+        for (size_t j = 0; node && j < array_count(node->children); j++) {
+            d = BRSetGet(wallet->txDeltas, node->children[j]);
+            if (! d || d->walkMark == mark) continue;
+            d->walkMark = mark;
+            array_add(found, d);
+        }
+    }
+
+    // the edges between the descendants haven't changed, so their current depths are a topological order, and each
+    // can be recalculated once, after all of its input transactions
+    qsort(&found[1], array_count(found) - 1, sizeof(*found), _BRTxDepthCompare);
+    for (size_t i = 1; i < array_count(found); i++) _BRWalletUpdateTxKey(wallet, found[i]);
+    array_free(found);
+}
+
+// returns the cached delta for tx, calculating it if it hasn't been yet, or NULL if tx isn't the instance in allTx
+static BRTxDelta *_BRWalletTxDelta(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxDelta *delta = BRSetGet(wallet->txDeltas, tx);
+
+    if (! delta && BRSetGet(wallet->allTx, tx) == tx) {
+        delta = calloc(1, sizeof(*delta));
+        assert(delta != NULL);
+        delta->txHash = tx->txHash;
+        delta->tx = tx;
+        delta->seq = wallet->txSeq++;
+        delta->priority = (uint32_t)BRSip64(&wallet->treeKey, &tx->txHash, sizeof(tx->txHash));
+        delta->keyDepth = UINT32_MAX; // not yet calculated
+        _BRWalletUpdateTxDelta(wallet, delta);
+        BRSetAdd(wallet->txDeltas, delta);
+        _BRWalletUpdateTxOrder(wallet, delta);
+    }
+
+    return (delta && delta->tx == tx) ? delta : NULL;
+}
+
+// returns the cached delta for tx if it's in allTx, otherwise calculates one without caching it
+static BRTxDelta _BRWalletGetTxDelta(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxDelta *delta = _BRWalletTxDelta(wallet, tx), d = { tx->txHash, tx, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    if (! delta) _BRWalletUpdateTxDelta(wallet, (delta = &d));
+    return *delta;
+}
+
+// adds tx to the children of each tx its inputs spend
+static void _BRWalletAddSpendEdges(BRWallet *wallet, BRTransaction *tx)
+{
+    BRTxChildren *node;
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        node = BRSetGet(wallet->txChildren, &tx->inputs[i].txHash);
+
+        if (! node) {
+            node = calloc(1, sizeof(*node));
+            assert(node != NULL);
+            node->txHash = tx->inputs[i].txHash;
+            array_new(node->children, 1);
+            BRSetAdd(wallet->txChildren, node);
+        }
+
+        // an input spending another output of the same tx has already added tx
+        if (array_count(node->children) == 0 || node->children[array_count(node->children) - 1] != tx) {
+            array_add(node->children, tx);
+        }
+    }
+}
+
+// removes tx from the children of each tx its inputs spend
+static void _BRWalletRemoveSpendEdges(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxChildren *node;
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        node = BRSetGet(wallet->txChildren, &tx->inputs[i].txHash);
+        if (! node) continue;
+
+        for (size_t j = array_count(node->children); j > 0; j--) {
+            if (node->children[j - 1] == tx) array_rm(node->children, j - 1);
+        }
+
+        if (array_count(node->children) == 0) {
+            BRSetRemove(wallet->txChildren, node);
+            array_free(node->children);
+            free(node);
+        }
+    }
+}
+
+// adds the outputs of tx that pay an address to addrOutputs
+static void _BRWalletAddAddrOutputs(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRAddrOutputs *node;
+    const uint8_t *pkh;
+
+    for (size_t i = 0; i < tx->outCount; i++) {
+        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+        if (! pkh) continue;
+        node = BRSetGet(wallet->addrOutputs, pkh);
+
+        if (! node) {
+            node = calloc(1, sizeof(*node));
+            assert(node != NULL);
+            UInt160Set(&node->pkh, UInt160Get(pkh));
+            array_new(node->outputs, 1);
+            BRSetAdd(wallet->addrOutputs, node);
+        }
+
+        array_add(node->outputs, ((const BRUTXO) { tx->txHash, (uint32_t)i }));
+    }
+}
+
+// removes the outputs of tx from addrOutputs
+static void _BRWalletRemoveAddrOutputs(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRAddrOutputs *node;
+    const uint8_t *pkh;
+
+    for (size_t i = 0; i < tx->outCount; i++) {
+        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
+        node = (pkh) ? BRSetGet(wallet->addrOutputs, pkh) : NULL;
+        if (! node) continue;
+
+        for (size_t j = array_count(node->outputs); j > 0; j--) {
+            if (UInt256Eq(node->outputs[j - 1].hash, tx->txHash)) array_rm(node->outputs, j - 1);
+        }
+
+        if (array_count(node->outputs) == 0) {
+            BRSetRemove(wallet->addrOutputs, node);
+            array_free(node->outputs);
+            free(node);
+        }
+    }
+}
+
+// recalculates the cached deltas of the transactions spending an output of the tx with txHash
+static void _BRWalletUpdateChildDeltas(BRWallet *wallet, UInt256 txHash)
+{
+    BRTxChildren *node = BRSetGet(wallet->txChildren, &txHash);
+    BRTxDelta *delta;
+
+    for (size_t i = 0; node && i < array_count(node->children); i++) {
+        delta = BRSetGet(wallet->txDeltas, node->children[i]);
+        if (delta) _BRWalletUpdateTxDelta(wallet, delta);
+    }
+}
+
+// forgets the memoized status of the tx with txHash and of its descendants in the spend graph that could depend on it
+// a memoized status only depends on inputs that were consulted, and those are memoized too, so the walk stops at
+// transactions with nothing memoized, and at confirmed ones, since their status doesn't depend on their inputs
+static void _BRWalletInvalidateTxStatus(BRWallet *wallet, UInt256 txHash)
+{
+    BRTxChildren *node = BRSetGet(wallet->txChildren, &txHash);
+    BRTxDelta *delta = BRSetGet(wallet->txDeltas, &txHash), *d, **stack;
+    uint32_t mark = ++wallet->walkMark;
+
+    if (delta) delta->status = 0, delta->walkMark = mark;
+    if (! node) return;
+    array_new(stack, array_count(node->children));
+
+    for (;;) {
+        for (size_t i = 0; node && i < array_count(node->children); i++) {
+            if (node->children[i]->blockHeight != TX_UNCONFIRMED) continue;
+            d = BRSetGet(wallet->txDeltas, node->children[i]);
+            if (! d || d->walkMark == mark) continue;
+            d->walkMark = mark;
+            if (d->statusEpoch == wallet->statusEpoch && d->status != 0) array_add(stack, d);
+        }
+
+        if (array_count(stack) == 0) break;
+        d = stack[array_count(stack) - 1];
+        array_rm_last(stack);
+        d->status = 0;
+        node = BRSetGet(wallet->txChildren, d);
+    }
+
+    array_free(stack);
+}
+
+// call after tx is added to allTx
+static void _BRWalletTxAdded(BRWallet *wallet, BRTransaction *tx)
+{
+    _BRWalletAddSpendEdges(wallet, tx);
+    _BRWalletAddAddrOutputs(wallet, tx);
+    _BRWalletUpdateChildDeltas(wallet, tx->txHash);
+    _BRWalletTxDelta(wallet, tx);
+    _BRWalletInvalidateTxStatus(wallet, tx->txHash);
+}
+
+// call after tx is removed from allTx, and before it's freed
+static void _BRWalletTxRemoved(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxDelta *delta = BRSetRemove(wallet->txDeltas, tx);
+    BRTxChildren *node;
+
+    if (delta) free(delta);
+    _BRWalletRemoveSpendEdges(wallet, tx);
+    _BRWalletRemoveAddrOutputs(wallet, tx);
+    _BRWalletUpdateChildDeltas(wallet, tx->txHash);
+    _BRWalletInvalidateTxStatus(wallet, tx->txHash);
+    node = BRSetGet(wallet->txChildren, tx);
+
+    for (size_t i = 0; node && i < array_count(node->children); i++) { // the children are no longer below tx
+        delta = BRSetGet(wallet->txDeltas, node->children[i]);
+        if (delta) _BRWalletUpdateTxOrder(wallet, delta);
+    }
+}
+
+// call after the addresses in pkh are added to allPKH, recalculates the cached deltas they could change, found through
+// addrOutputs, so only the transactions paying the new addresses and those spending their outputs are visited
+static void _BRWalletPKHAdded(BRWallet *wallet, const UInt160 pkh[], size_t pkhCount)
+{
+    BRAddrOutputs *node;
+    BRTxDelta *delta, **found;
+    uint32_t mark;
+    size_t chainIndex;
+
+    if (pkhCount == 0 || BRSetCount(wallet->txDeltas) == 0) return;
+    mark = ++wallet->walkMark;
+    array_new(found, 1);
+
+    for (size_t i = 0; i < pkhCount; i++) { // the transactions paying the new addresses, each once
+        node = BRSetGet(wallet->addrOutputs, &pkh[i]);
+
+        for (size_t j = 0; node && j < array_count(node->outputs); j++) {
+            delta = BRSetGet(wallet->txDeltas, &node->outputs[j].hash);
+            if (! delta || delta->walkMark == mark) continue;
+            delta->walkMark = mark;
+            array_add(found, delta);
+        }
+    }
+
+    for (size_t i = 0; i < array_count(found); i++) {
+        delta = found[i];
+        chainIndex = delta->chainIndex;
+        _BRWalletUpdateTxDelta(wallet, delta);
+        if (delta->chainIndex != chainIndex) _BRWalletUpdateTxOrder(wallet, delta); // re-key it by its chain index
+        _BRWalletUpdateChildDeltas(wallet, delta->txHash); // transactions spending outputs to the new addresses
+    }
+
+    array_free(found);
+}
+
+inline static void _BRWalletAddToHistory(BRWallet *wallet, BRTxDelta *delta)
+{
+    if (! delta || (delta->flags & TX_DELTA_IN_HISTORY)) return;
+    delta->flags |= TX_DELTA_IN_HISTORY;
+    wallet->history = _BRTxTreeInsert(wallet->history, delta);
+}
+
+inline static void _BRWalletRemoveFromHistory(BRWallet *wallet, BRTxDelta *delta)
+{
+    if (! delta || ! (delta->flags & TX_DELTA_IN_HISTORY)) return;
+    delta->flags &= ~TX_DELTA_IN_HISTORY;
+    wallet->history = _BRTxTreeRemove(wallet->history, delta);
 }
 
 // non-threadsafe version of BRWalletContainsTransaction()
 static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    BRTxDelta *delta = BRSetGet(wallet->txDeltas, tx);
     int r = 0;
     const uint8_t *pkh;
     
+    if (delta && delta->tx == tx) return (delta->flags & (TX_DELTA_RECEIVES | TX_DELTA_SENDS)) ? 1 : 0;
+
     for (size_t i = 0; ! r && i < tx->outCount; i++) {
         pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
         if (pkh && BRSetContains(wallet->allPKH, pkh)) r = 1;
@@ -170,21 +673,25 @@ static void _BRWalletUpdateBalance(BRWallet *wallet)
     int isInvalid, isPending;
     uint64_t balance = 0, prevBalance = 0;
     time_t now = time(NULL);
-    size_t i, j;
-    BRTransaction *tx, *t;
+    size_t i, j, count = _BRTxTreeSize(wallet->history);
+    BRTransaction *tx, *t, **txs = malloc(count*sizeof(*txs));
+    BRTxDelta *delta;
     const uint8_t *pkh;
     
+    assert(txs != NULL || count == 0);
+    _BRTxTreeGet(wallet->history, 0, txs, count);
     array_clear(wallet->utxos);
-    array_clear(wallet->balanceHist);
     BRSetClear(wallet->spentOutputs);
     BRSetClear(wallet->invalidTx);
     BRSetClear(wallet->pendingTx);
     BRSetClear(wallet->usedPKH);
     wallet->totalSent = 0;
     wallet->totalReceived = 0;
+    wallet->statusEpoch++; // invalidTx and pendingTx are about to change
 
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
+    for (i = 0; i < count; i++) {
+        tx = txs[i];
+        delta = BRSetGet(wallet->txDeltas, tx);
 
         // check if any inputs are invalid or already spent
         if (tx->blockHeight == TX_UNCONFIRMED) {
@@ -195,7 +702,7 @@ static void _BRWalletUpdateBalance(BRWallet *wallet)
         
             if (isInvalid) {
                 BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
+                delta->balance = balance;
                 continue;
             }
         }
@@ -224,7 +731,7 @@ static void _BRWalletUpdateBalance(BRWallet *wallet)
             
             if (isPending) {
                 BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
+                delta->balance = balance;
                 continue;
             }
         }
@@ -255,12 +762,157 @@ static void _BRWalletUpdateBalance(BRWallet *wallet)
         
         if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
         if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
+        delta->balance = balance;
         prevBalance = balance;
     }
 
-    assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
     wallet->balance = balance;
+    if (txs) free(txs);
+}
+
+// returns the delta for tx, with its memoized status cleared if the wallet has changed since it was memoized, or NULL
+// if tx isn't the instance in allTx and its status can't be memoized
+static BRTxDelta *_BRWalletTxStatus(BRWallet *wallet, const BRTransaction *tx)
+{
+    BRTxDelta *delta = _BRWalletTxDelta(wallet, tx);
+
+    if (delta && delta->statusEpoch != wallet->statusEpoch) {
+        delta->status = 0;
+        delta->statusEpoch = wallet->statusEpoch;
+    }
+
+    return delta;
+}
+
+// a tx on the stack of a spend graph walk evaluating one of its status bits
+typedef struct {
+    const BRTransaction *tx;
+    BRTxDelta *delta;
+    size_t next; // index of the next input to check
+    int r, locked; // the status bit so far, and whether it can change as time passes
+} BRTxStatusFrame;
+
+static int _BRWalletTxIsValid(BRWallet *wallet, const BRTransaction *tx);
+static int _BRWalletTxIsPending(BRWallet *wallet, const BRTransaction *tx, time_t now, int *timeLocked);
+
+// returns a stack frame for tx with the status bit that tx has on its own, before its inputs are checked
+static BRTxStatusFrame _BRWalletTxStatusFrame(BRWallet *wallet, const BRTransaction *tx, uint8_t bit, time_t now)
+{
+    BRTxStatusFrame f = { tx, _BRWalletTxStatus(wallet, tx), 0, (bit != TX_STATUS_PENDING), 0 };
+
+    if (tx->blockHeight != TX_UNCONFIRMED) { // confirmed transactions don't depend on their inputs
+        f.next = tx->inCount;
+    }
+    else if (bit == TX_STATUS_VALID) {
+        if (! BRSetContains(wallet->allTx, tx)) {
+            for (size_t i = 0; f.r && i < tx->inCount; i++) {
+                if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) f.r = 0;
+            }
+        }
+        else if (BRSetContains(wallet->invalidTx, tx)) f.r = 0;
+    }
+    else if (bit == TX_STATUS_PENDING) {
+        if (BRTransactionVSize(tx) > TX_MAX_SIZE) f.r = 1; // check transaction size is under TX_MAX_SIZE
+
+        for (size_t i = 0; ! f.r && i < tx->inCount; i++) {
+            if (tx->inputs[i].sequence < UINT32_MAX - 1) f.r = 1; // check for replace-by-fee
+            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) f.r = 1; // future lockTime
+            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime > now) f.r = f.locked = 1; // future lockTime
+        }
+
+        for (size_t i = 0; ! f.r && i < tx->outCount; i++) { // check that no outputs are dust
+            if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) f.r = 1;
+        }
+    }
+    else {
+        if (tx->timestamp == 0) f.locked = 1;
+        if (tx->timestamp == 0 || ! _BRWalletTxIsValid(wallet, tx) ||
+            _BRWalletTxIsPending(wallet, tx, now, &f.locked)) f.r = 0;
+    }
+
+    return f;
+}
+
+// returns the TX_STATUS_VALID, TX_STATUS_PENDING or TX_STATUS_VERIFIED bit of tx, which is the bit tx has on its own
+// combined with the bits of the transactions its inputs spend, found by walking up the spend graph with an explicit
+// stack, since chains of unconfirmed transactions can be arbitrarily long, bits that can change as time passes set
+// *timeLocked and are only kept until the walk ends, the rest are memoized
+static int _BRWalletTxStatusWalk(BRWallet *wallet, const BRTransaction *tx, uint8_t bit, time_t now, int *timeLocked)
+{
+    uint8_t has = (uint8_t)(bit << 4), // the TX_STATUS_HAS_* flag for bit
+            lockedBit = (bit == TX_STATUS_PENDING) ? TX_STATUS_PENDING_LOCKED :
+                        (bit == TX_STATUS_VERIFIED) ? TX_STATUS_VERIFIED_LOCKED : 0;
+    int good = (bit != TX_STATUS_PENDING), r; // good is the bit a tx has when nothing about it or its inputs is off
+    BRTxStatusFrame *stack, *f;
+    BRTxDelta **locked, *d;
+    const BRTransaction *t;
+
+    d = _BRWalletTxStatus(wallet, tx);
+    if (d && (d->status & has)) return (d->status & bit) ? 1 : 0;
+    array_new(stack, 10);
+    array_new(locked, 1);
+    array_add(stack, _BRWalletTxStatusFrame(wallet, tx, bit, now));
+
+    for (;;) {
+        f = &stack[array_count(stack) - 1];
+        t = NULL;
+
+        // the input transactions evaluated so far leave the frame on top of the stack with a known status once one
+        // of them doesn't have the good bit, or they've all been checked
+        while (! t && f->r == good && f->next < f->tx->inCount) {
+            t = BRSetGet(wallet->allTx, &f->tx->inputs[f->next].txHash);
+            d = (t) ? _BRWalletTxStatus(wallet, t) : NULL; // every tx in allTx has a delta
+            if (! d) t = NULL;
+            else if (d->status & lockedBit) f->r = ! good, f->locked = 1, t = NULL;
+            else if (d->status & has) f->r = (d->status & bit) ? 1 : 0, t = NULL;
+            if (! t) f->next++;
+        }
+
+        if (t) { // evaluate the input tx first, and come back to this input once it's known
+            array_add(stack, _BRWalletTxStatusFrame(wallet, t, bit, now));
+            continue;
+        }
+
+        r = f->r;
+        if (array_count(stack) == 1 && f->locked) *timeLocked = 1;
+
+        if (f->delta && f->locked) { // only known until the walk ends
+            f->delta->status |= lockedBit;
+            array_add(locked, f->delta);
+        }
+        else if (f->delta) f->delta->status = (f->delta->status & ~bit) | has | ((r) ? bit : 0);
+
+        array_rm_last(stack);
+        if (array_count(stack) == 0) break;
+    }
+
+    for (size_t i = 0; i < array_count(locked); i++) locked[i]->status &= ~lockedBit;
+    array_free(locked);
+    array_free(stack);
+    return r;
+}
+
+// non-threadsafe version of BRWalletTransactionIsValid()
+static int _BRWalletTxIsValid(BRWallet *wallet, const BRTransaction *tx)
+{
+    int timeLocked = 0;
+
+    return _BRWalletTxStatusWalk(wallet, tx, TX_STATUS_VALID, 0, &timeLocked);
+}
+
+// non-threadsafe version of BRWalletTransactionIsPending(), sets *timeLocked if the result can change as time passes,
+// in which case it isn't memoized
+static int _BRWalletTxIsPending(BRWallet *wallet, const BRTransaction *tx, time_t now, int *timeLocked)
+{
+    return _BRWalletTxStatusWalk(wallet, tx, TX_STATUS_PENDING, now, timeLocked);
+}
+
+// non-threadsafe version of BRWalletTransactionIsVerified(), sets *timeLocked like _BRWalletTxIsPending(), and also
+// if the result depends on a zero timestamp, since BRPeerManagerPublishTx() sets it without telling the wallet
+static int _BRWalletTxIsVerified(BRWallet *wallet, const BRTransaction *tx, time_t now, int *timeLocked)
+{
+    return _BRWalletTxStatusWalk(wallet, tx, TX_STATUS_VERIFIED, now, timeLocked);
 }
 
 // allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
@@ -275,26 +927,34 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
     array_new(wallet->utxos, 100);
-    array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
     wallet->masterPubKey = mpk;
+
+    // BRRand() isn't cryptographic, so the key also mixes in the chain code, which a remote attacker doesn't know
+    for (size_t i = 0; i < sizeof(wallet->treeKey)/sizeof(uint32_t); i++) {
+        wallet->treeKey.u32[i] = BRRand(0) ^ mpk.chainCode.u32[i];
+    }
+
     wallet->forkId = forkId;
     array_new(wallet->internalChain, 100);
     array_new(wallet->externalChain, 100);
-    array_new(wallet->balanceHist, txCount + 100);
     wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
     wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
     wallet->usedPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
     wallet->allPKH = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
+    wallet->txDeltas = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->txChildren = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
+    wallet->addrOutputs = BRSetNew(_pkhHash, _pkhEq, txCount + 100);
     pthread_mutex_init(&wallet->lock, NULL);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
         BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
+        _BRWalletAddSpendEdges(wallet, tx);
+        _BRWalletAddAddrOutputs(wallet, tx);
 
         for (size_t j = 0; j < tx->outCount; j++) {
             pkh = BRScriptPKH(tx->outputs[j].script, tx->outputs[j].scriptLen);
@@ -305,6 +965,12 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_EXTERNAL_CHAIN);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, SEQUENCE_INTERNAL_CHAIN);
 
+    for (size_t i = 0; transactions && i < txCount; i++) { // now that there are addresses to sort by
+        if (BRSetGet(wallet->allTx, transactions[i]) == transactions[i]) {
+            _BRWalletAddToHistory(wallet, _BRWalletTxDelta(wallet, transactions[i]));
+        }
+    }
+
     _BRWalletUpdateBalance(wallet);
 
     if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
@@ -345,6 +1011,24 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // addrs may be NULL to only generate addresses for BRWalletContainsAddress()
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, uint32_t internal)
+{
+    UInt160 *pkh = (addrs) ? malloc(gapLimit*sizeof(*pkh)) : NULL;
+    size_t i, count;
+
+    assert(pkh != NULL || addrs == NULL);
+    count = BRWalletUnusedPKH(wallet, pkh, gapLimit, internal);
+
+    for (i = 0; addrs && i < count; i++) {
+        _BRWalletAddressFromHash160(wallet, addrs[i].s, sizeof(*addrs), pkh[i]);
+    }
+
+    if (pkh) free(pkh);
+    return count;
+}
+
+// same as BRWalletUnusedAddrs(), but writes the pubkey hashes of the unused addresses to pkh instead of encoding them
+// returns the number of pubkey hashes written to pkh
+size_t BRWalletUnusedPKH(BRWallet *wallet, UInt160 pkh[], uint32_t gapLimit, uint32_t internal)
 {
     UInt160 *chain = NULL, *origChain;
     size_t i, j = 0, count, startCount;
@@ -372,9 +1056,9 @@ size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimi
         if (BRSetContains(wallet->usedPKH, &chain[array_count(chain) - 1])) i = count;
     }
 
-    if (addrs && i + gapLimit <= count) {
+    if (pkh && i + gapLimit <= count) {
         for (j = 0; j < gapLimit; j++) {
-            _BRWalletAddressFromHash160(wallet, addrs[j].s, sizeof(*addrs), chain[i + j]);
+            pkh[j] = chain[i + j];
         }
     }
     
@@ -399,6 +1083,7 @@ size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimi
         }
     }
 
+    _BRWalletPKHAdded(wallet, &chain[startCount], count - startCount);
     pthread_mutex_unlock(&wallet->lock);
     return j;
 }
@@ -436,12 +1121,8 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 {
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (! transactions || array_count(wallet->transactions) < txCount) txCount = array_count(wallet->transactions);
-
-    for (size_t i = 0; transactions && i < txCount; i++) {
-        transactions[i] = wallet->transactions[i];
-    }
-    
+    if (! transactions || _BRTxTreeSize(wallet->history) < txCount) txCount = _BRTxTreeSize(wallet->history);
+    if (transactions) txCount = _BRTxTreeGet(wallet->history, 0, transactions, txCount);
     pthread_mutex_unlock(&wallet->lock);
     return txCount;
 }
@@ -451,22 +1132,214 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight)
 {
-    size_t total, n = 0;
+    size_t total, n;
 
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
-    total = array_count(wallet->transactions);
-    while (n < total && wallet->transactions[(total - n) - 1]->blockHeight >= blockHeight) n++;
+    total = _BRTxTreeSize(wallet->history);
+    n = total - _BRTxTreeCountBelow(wallet->history, blockHeight);
     if (! transactions || n < txCount) txCount = n;
+    if (transactions) txCount = _BRTxTreeGet(wallet->history, total - n, transactions, txCount);
+    pthread_mutex_unlock(&wallet->lock);
+    return txCount;
+}
+
+// compares the history key of node with the position of cursor, which must be set
+inline static int _BRHistoryCursorCompare(const BRTxDelta *node, const BRHistoryCursor *cursor)
+{
+    if (node->keyHeight != cursor->blockHeight) return (node->keyHeight < cursor->blockHeight) ? -1 : 1;
+    if (node->keyDepth != cursor->depth) return (node->keyDepth < cursor->depth) ? -1 : 1;
+    if (node->keyChain != cursor->chainIndex) return (node->keyChain < cursor->chainIndex) ? -1 : 1;
+    if (node->seq != cursor->seq) return (node->seq < cursor->seq) ? -1 : 1;
+    return 0;
+}
+
+inline static BRHistoryCursor _BRHistoryCursorAt(const BRTxDelta *node)
+{
+    return (node) ? (BRHistoryCursor) { node->keyHeight, node->keyDepth, node->seq, node->keyChain, 1 } :
+                    WALLET_HISTORY_START;
+}
+
+// true if node matches the kinds and timestamps of query, heights and the cursor are checked by the caller
+static int _BRWalletHistoryMatches(BRWallet *wallet, const BRTxDelta *node, const BRHistoryQuery *query)
+{
+    int timeLocked = 0;
+
+    if (node->timestamp < query->fromTime || node->timestamp > query->toTime) return 0;
+    if (query->kinds == 0 || (node->kinds & query->kinds & (WALLET_HISTORY_SENT | WALLET_HISTORY_RECEIVED))) return 1;
+    return ((node->kinds & query->kinds & WALLET_HISTORY_PENDING) &&
+            _BRWalletTxIsPending(wallet, node->tx, time(NULL), &timeLocked));
+}
+
+// writes up to count nodes from the tree at root that match query and follow cursor, in query order, to nodes, and
+// returns the number written
+static size_t _BRWalletHistoryPage(BRWallet *wallet, BRTxDelta *root, const BRHistoryQuery *query,
+                                   const BRHistoryCursor *cursor, BRTxDelta *nodes[], size_t count)
+{
+    BRTxDelta *first, *last;
+    int follows, firstSide, lastSide;
+    size_t n = 0;
+
+    if (! root || count == 0) return 0;
+    if (query->kinds != 0 && ! (root->subtreeKinds & query->kinds)) return 0;
+    if (root->maxTime < query->fromTime || root->minTime > query->toTime) return 0;
+    follows = (! cursor->isSet) ? 1 : _BRHistoryCursorCompare(root, cursor)*((query->newestFirst) ? -1 : 1) > 0;
+    first = (query->newestFirst) ? root->right : root->left;
+    last = (query->newestFirst) ? root->left : root->right;
+    // the first subtree can only have something in range that follows cursor if root is past the range start and
+    // follows cursor itself, and the last can only have something in range if root is before the range end
+    firstSide = (query->newestFirst) ? root->keyHeight <= query->toHeight : root->keyHeight >= query->fromHeight;
+    lastSide = (query->newestFirst) ? root->keyHeight >= query->fromHeight : root->keyHeight <= query->toHeight;
+    if (firstSide && follows) n = _BRWalletHistoryPage(wallet, first, query, cursor, nodes, count);
+
+    if (n < count && follows && root->keyHeight >= query->fromHeight && root->keyHeight <= query->toHeight &&
+        _BRWalletHistoryMatches(wallet, root, query)) nodes[n++] = root;
+
+    if (n < count && lastSide) n += _BRWalletHistoryPage(wallet, last, query, cursor, &nodes[n], count - n);
+    return n;
+}
+
+// returns a cursor just before the transaction at index in the history, counting from the oldest transaction, or from
+// the newest if newestFirst is true
+BRHistoryCursor BRWalletHistoryCursor(BRWallet *wallet, size_t index, int newestFirst)
+{
+    BRHistoryCursor cursor = WALLET_HISTORY_START;
+    size_t total;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    total = _BRTxTreeSize(wallet->history);
+    if (index > total) index = total;
+    if (index > 0) cursor = _BRHistoryCursorAt(_BRTxTreeAt(wallet->history, (newestFirst) ? total - index : index - 1));
+    pthread_mutex_unlock(&wallet->lock);
+    return cursor;
+}
+
+// writes the transactions that match query and follow cursor, in the order of the query, to the transactions array,
+// and moves cursor past them, use WALLET_HISTORY_START for the first page
+// takes O(log n) plus the size of the page, subtrees with no matching kinds or timestamps are skipped
+// returns the number of transactions written
+size_t BRWalletHistory(BRWallet *wallet, const BRHistoryQuery *query, BRHistoryCursor *cursor,
+                       BRTransaction *transactions[], size_t txCount)
+{
+    BRTxDelta **nodes = (txCount > 0) ? malloc(txCount*sizeof(*nodes)) : NULL;
+    size_t count;
+
+    assert(wallet != NULL);
+    assert(query != NULL);
+    assert(cursor != NULL);
+    assert(transactions != NULL || txCount == 0);
+    assert(nodes != NULL || txCount == 0);
+    pthread_mutex_lock(&wallet->lock);
+    count = _BRWalletHistoryPage(wallet, wallet->history, query, cursor, nodes, txCount);
+    for (size_t i = 0; i < count; i++) transactions[i] = (BRTransaction *)nodes[i]->tx;
+    if (count > 0) *cursor = _BRHistoryCursorAt(nodes[count - 1]);
+    pthread_mutex_unlock(&wallet->lock);
+    if (nodes) free(nodes);
+    return count;
+}
+
+static int _BRTxDeltaCompare(const void *a, const void *b)
+{
+    return _BRTxTreeCompare(*(BRTxDelta * const *)a, *(BRTxDelta * const *)b);
+}
+
+// returns the deltas of the wallet transactions that pay to pkh or spend an output to it, sorted by history order,
+// the result must be freed by calling array_free()
+static BRTxDelta **_BRWalletAddrDeltas(BRWallet *wallet, UInt160 pkh)
+{
+    BRAddrOutputs *node = BRSetGet(wallet->addrOutputs, &pkh);
+    BRTxChildren *spends;
+    BRTxDelta *delta, **deltas;
+    const BRTransaction *t;
+    size_t i, j, k;
+
+    array_new(deltas, (node) ? array_count(node->outputs)*2 : 1);
+
+    for (i = 0; node && i < array_count(node->outputs); i++) {
+        delta = BRSetGet(wallet->txDeltas, &node->outputs[i].hash);
+        if (delta && (delta->flags & TX_DELTA_IN_HISTORY)) array_add(deltas, delta);
+        spends = BRSetGet(wallet->txChildren, &node->outputs[i].hash);
+
+        for (j = 0; spends && j < array_count(spends->children); j++) {
+            t = spends->children[j];
+
+            for (k = 0; k < t->inCount; k++) {
+                if (t->inputs[k].index != node->outputs[i].n ||
+                    ! UInt256Eq(t->inputs[k].txHash, node->outputs[i].hash)) continue;
+                delta = BRSetGet(wallet->txDeltas, t);
+                if (delta && (delta->flags & TX_DELTA_IN_HISTORY)) array_add(deltas, delta);
+                break;
+            }
+        }
+    }
+
+    qsort(deltas, array_count(deltas), sizeof(*deltas), _BRTxDeltaCompare);
+
+    for (i = 0, j = 0; i < array_count(deltas); i++) { // drop transactions touching pkh more than once
+        if (j == 0 || deltas[j - 1] != deltas[i]) deltas[j++] = deltas[i];
+    }
+
+    array_set_count(deltas, j);
+    return deltas;
+}
+
+// writes the wallet transactions that pay to addr or spend an output to it, sorted by date, oldest first, to the given
+// transactions array, looking only at the transactions that touch addr
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletAddressTransactions(BRWallet *wallet, const char *addr, BRTransaction *transactions[], size_t txCount)
+{
+    UInt160 pkh = UINT160_ZERO;
+    BRTxDelta **deltas;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    if (addr) BRAddressHash160(&pkh, addr);
+    deltas = _BRWalletAddrDeltas(wallet, pkh);
+    if (! transactions || array_count(deltas) < txCount) txCount = array_count(deltas);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
-        transactions[i] = wallet->transactions[(total - n) + i];
+        transactions[i] = (BRTransaction *)deltas[i]->tx;
     }
 
+    array_free(deltas);
     pthread_mutex_unlock(&wallet->lock);
     return txCount;
 }
 
+// total of the unspent outputs to addr if it's a wallet address, not including transactions known to be invalid or
+// that are pending, and sets unconfirmed (if not NULL) to the part of it from unconfirmed transactions
+uint64_t BRWalletAddressBalance(BRWallet *wallet, const char *addr, uint64_t *unconfirmed)
+{
+    UInt160 pkh = UINT160_ZERO;
+    BRAddrOutputs *node;
+    BRTxDelta *delta;
+    const BRUTXO *o;
+    uint64_t balance = 0, pending = 0;
+
+    assert(wallet != NULL);
+    assert(addr != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    if (addr) BRAddressHash160(&pkh, addr);
+    node = (BRSetContains(wallet->allPKH, &pkh)) ? BRSetGet(wallet->addrOutputs, &pkh) : NULL;
+
+    // the same outputs _BRWalletUpdateBalance() adds to wallet->utxos
+    for (size_t i = 0; node && i < array_count(node->outputs); i++) {
+        o = &node->outputs[i];
+        delta = BRSetGet(wallet->txDeltas, &o->hash);
+        if (! delta || ! (delta->flags & TX_DELTA_IN_HISTORY) || BRSetContains(wallet->spentOutputs, o)) continue;
+        if (BRSetContains(wallet->invalidTx, &o->hash) || BRSetContains(wallet->pendingTx, &o->hash)) continue;
+        if (delta->tx->outputs[o->n].address[0] == '\0') continue;
+        balance += delta->tx->outputs[o->n].amount;
+        if (delta->tx->blockHeight == TX_UNCONFIRMED) pending += delta->tx->outputs[o->n].amount;
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    if (unconfirmed) *unconfirmed = pending;
+    return balance;
+}
+
 // total amount spent from the wallet (exluding change)
 uint64_t BRWalletTotalSent(BRWallet *wallet)
 {
@@ -558,6 +1431,25 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
     return internalCount + externalCount;
 }
 
+// writes the pubkey hashes of all addresses previously generated with BRWalletUnusedAddrs() to pkh, in the same order
+// as BRWalletAllAddrs()
+// returns the number of pubkey hashes written, or total number available if pkh is NULL
+size_t BRWalletAllPKH(BRWallet *wallet, UInt160 pkh[], size_t pkhCount)
+{
+    size_t internalCount = 0, externalCount = 0;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    internalCount = (! pkh || array_count(wallet->internalChain) < pkhCount) ?
+                    array_count(wallet->internalChain) : pkhCount;
+    if (pkh) memcpy(pkh, wallet->internalChain, internalCount*sizeof(*pkh));
+    externalCount = (! pkh || array_count(wallet->externalChain) < pkhCount - internalCount) ?
+                    array_count(wallet->externalChain) : pkhCount - internalCount;
+    if (pkh) memcpy(&pkh[internalCount], wallet->externalChain, externalCount*sizeof(*pkh));
+    pthread_mutex_unlock(&wallet->lock);
+    return internalCount + externalCount;
+}
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
 {
@@ -573,6 +1465,36 @@ int BRWalletContainsAddress(BRWallet *wallet, const char *addr)
     return r;
 }
 
+// true if pkh is the pubkey hash of an address previously generated by BRWalletUnusedAddrs() (even if it's now used)
+int BRWalletContainsPKH(BRWallet *wallet, UInt160 pkh)
+{
+    int r = 0;
+    
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    r = BRSetContains(wallet->allPKH, &pkh);
+    pthread_mutex_unlock(&wallet->lock);
+    return r;
+}
+
+// true if script is a scriptPubKey that pays to an address previously generated by BRWalletUnusedAddrs()
+int BRWalletContainsScript(BRWallet *wallet, const uint8_t *script, size_t scriptLen)
+{
+    const uint8_t *pkh = BRScriptPKH(script, scriptLen);
+    int r = 0;
+    
+    assert(wallet != NULL);
+    assert(script != NULL || scriptLen == 0);
+    
+    if (pkh) {
+        pthread_mutex_lock(&wallet->lock);
+        r = BRSetContains(wallet->allPKH, pkh);
+        pthread_mutex_unlock(&wallet->lock);
+    }
+    
+    return r;
+}
+
 // true if the address was previously used as an output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr)
 {
@@ -769,13 +1691,18 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
+                _BRWalletTxAdded(wallet, tx);
+                _BRWalletAddToHistory(wallet, _BRWalletTxDelta(wallet, tx));
                 _BRWalletUpdateBalance(wallet);
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
                    // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
-                if (tx->blockHeight == TX_UNCONFIRMED) BRSetAdd(wallet->allTx, tx);
+                if (tx->blockHeight == TX_UNCONFIRMED) {
+                    BRSetAdd(wallet->allTx, tx);
+                    _BRWalletTxAdded(wallet, tx);
+                }
+                
                 r = 0;
                 // BUG: XXX memory leak if tx is not added to wallet->allTx, and we can't just free it
             }
@@ -799,9 +1726,11 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
 // removes a tx from the wallet, along with any tx that depend on its outputs
 void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
 {
-    BRTransaction *tx, *t;
-    UInt256 *hashes = NULL;
-    int notifyUser = 0, recommendRescan = 0;
+    BRTransaction *tx, *t, **removed = NULL;
+    BRTxChildren *node;
+    BRTxDelta *delta;
+    size_t i, j;
+    int notifyUser, recommendRescan;
 
     assert(wallet != NULL);
     assert(! UInt256IsZero(txHash));
@@ -809,56 +1738,47 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
     tx = BRSetGet(wallet->allTx, &txHash);
 
     if (tx) {
-        array_new(hashes, 0);
-
-        for (size_t i = array_count(wallet->transactions); i > 0; i--) { // find depedent transactions
-            t = wallet->transactions[i - 1];
-            if (t->blockHeight < tx->blockHeight) break;
-            if (BRTransactionEq(tx, t)) continue;
-            
-            for (size_t j = 0; j < t->inCount; j++) {
-                if (! UInt256Eq(t->inputs[j].txHash, txHash)) continue;
-                array_add(hashes, t->txHash);
-                break;
-            }
-        }
-        
-        if (array_count(hashes) > 0) {
-            pthread_mutex_unlock(&wallet->lock);
-            
-            for (size_t i = array_count(hashes); i > 0; i--) {
-                BRWalletRemoveTransaction(wallet, hashes[i - 1]);
+        array_new(removed, 1);
+        array_add(removed, tx);
+        _BRWalletRemoveFromHistory(wallet, BRSetGet(wallet->txDeltas, tx));
+
+        // walk the spend graph from tx to find its dependent wallet transactions, parents before their children, and
+        // remove each from the history as it's found, so one reached by two paths is only added once
+        for (i = 0; i < array_count(removed); i++) {
+            node = BRSetGet(wallet->txChildren, removed[i]);
+
+            for (j = 0; node && j < array_count(node->children); j++) {
+                delta = BRSetGet(wallet->txDeltas, node->children[j]);
+                if (! delta || ! (delta->flags & TX_DELTA_IN_HISTORY)) continue;
+                _BRWalletRemoveFromHistory(wallet, delta);
+                array_add(removed, node->children[j]);
             }
-            
-            BRWalletRemoveTransaction(wallet, txHash);
         }
-        else {
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
-                array_rm(wallet->transactions, i - 1);
-                break;
-            }
-            
-            _BRWalletUpdateBalance(wallet);
-            pthread_mutex_unlock(&wallet->lock);
-            
+
+        _BRWalletUpdateBalance(wallet);
+        pthread_mutex_unlock(&wallet->lock);
+        if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
+
+        for (i = array_count(removed); i > 0; i--) { // notify children before their parents
+            tx = removed[i - 1];
+            notifyUser = recommendRescan = 0;
+
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
             if (BRWalletAmountSentByTx(wallet, tx) > 0 && BRWalletTransactionIsValid(wallet, tx)) {
                 recommendRescan = notifyUser = 1;
-                
-                for (size_t i = 0; i < tx->inCount; i++) { // only recommend a rescan if all inputs are confirmed
-                    t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
+
+                for (j = 0; j < tx->inCount; j++) { // only recommend a rescan if all inputs are confirmed
+                    t = BRWalletTransactionForHash(wallet, tx->inputs[j].txHash);
                     if (t && t->blockHeight != TX_UNCONFIRMED) continue;
                     recommendRescan = 0;
                     break;
                 }
             }
 
-            if (wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, wallet->balance);
-            if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, txHash, notifyUser, recommendRescan);
+            if (wallet->txDeleted) wallet->txDeleted(wallet->callbackInfo, tx->txHash, notifyUser, recommendRescan);
         }
-        
-        array_free(hashes);
+
+        array_free(removed);
     }
     else pthread_mutex_unlock(&wallet->lock);
 }
@@ -879,7 +1799,6 @@ BRTransaction *BRWalletTransactionForHash(BRWallet *wallet, UInt256 txHash)
 // true if no previous wallet transaction spends any of the given transaction's inputs, and no inputs are invalid
 int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
     int r = 1;
 
     assert(wallet != NULL);
@@ -888,22 +1807,10 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
     // TODO: XXX attempted double spends should cause conflicted tx to remain unverified until they're confirmed
     // TODO: XXX conflicted tx with the same wallet outputs should be presented as the same tx to the user
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be invalid
+    if (tx) {
         pthread_mutex_lock(&wallet->lock);
-
-        if (! BRSetContains(wallet->allTx, tx)) {
-            for (size_t i = 0; r && i < tx->inCount; i++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[i])) r = 0;
-            }
-        }
-        else if (BRSetContains(wallet->invalidTx, tx)) r = 0;
-
+        r = _BRWalletTxIsValid(wallet, tx);
         pthread_mutex_unlock(&wallet->lock);
-
-        for (size_t i = 0; r && i < tx->inCount; i++) {
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsValid(wallet, t)) r = 0;
-        }
     }
     
     return r;
@@ -912,35 +1819,15 @@ int BRWalletTransactionIsValid(BRWallet *wallet, const BRTransaction *tx)
 // true if tx cannot be immediately spent (i.e. if it or an input tx can be replaced-by-fee)
 int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    time_t now = time(NULL);
-    uint32_t blockHeight;
-    int r = 0;
+    int r = 0, timeLocked = 0;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
-    pthread_mutex_lock(&wallet->lock);
-    blockHeight = wallet->blockHeight;
-    pthread_mutex_unlock(&wallet->lock);
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be postdated
-        if (BRTransactionVSize(tx) > TX_MAX_SIZE) r = 1; // check transaction size is under TX_MAX_SIZE
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) {
-            if (tx->inputs[i].sequence < UINT32_MAX - 1) r = 1; // check for replace-by-fee
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                tx->lockTime > blockHeight + 1) r = 1; // future lockTime
-            if (tx->inputs[i].sequence < UINT32_MAX && tx->lockTime > now) r = 1; // future lockTime
-        }
-        
-        for (size_t i = 0; ! r && i < tx->outCount; i++) { // check that no outputs are dust
-            if (tx->outputs[i].amount < TX_MIN_OUTPUT_AMOUNT) r = 1;
-        }
-        
-        for (size_t i = 0; ! r && i < tx->inCount; i++) { // check if any inputs are known to be pending
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && BRWalletTransactionIsPending(wallet, t)) r = 1;
-        }
+    if (tx) {
+        pthread_mutex_lock(&wallet->lock);
+        r = _BRWalletTxIsPending(wallet, tx, time(NULL), &timeLocked);
+        pthread_mutex_unlock(&wallet->lock);
     }
     
     return r;
@@ -949,85 +1836,136 @@ int BRWalletTransactionIsPending(BRWallet *wallet, const BRTransaction *tx)
 // true if tx is considered 0-conf safe (valid and not pending, timestamp is greater than 0, and no unverified inputs)
 int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx)
 {
-    BRTransaction *t;
-    int r = 1;
+    int r = 1, timeLocked = 0;
 
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
 
-    if (tx && tx->blockHeight == TX_UNCONFIRMED) { // only unconfirmed transactions can be unverified
-        if (tx->timestamp == 0 || ! BRWalletTransactionIsValid(wallet, tx) ||
-            BRWalletTransactionIsPending(wallet, tx)) r = 0;
-            
-        for (size_t i = 0; r && i < tx->inCount; i++) { // check if any inputs are known to be unverified
-            t = BRWalletTransactionForHash(wallet, tx->inputs[i].txHash);
-            if (t && ! BRWalletTransactionIsVerified(wallet, t)) r = 0;
-        }
+    if (tx) {
+        pthread_mutex_lock(&wallet->lock);
+        r = _BRWalletTxIsVerified(wallet, tx, time(NULL), &timeLocked);
+        pthread_mutex_unlock(&wallet->lock);
     }
     
     return r;
 }
 
-// set the block heights and timestamps for the given transactions
-// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
-void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
-                                uint32_t timestamp)
+// non-threadsafe part of BRWalletUpdateTransactions(), writes the hashes of the wallet transactions that changed to
+// hashes, sets needsUpdate if the balance needs to be recalculated, and returns the number of hashes written
+static size_t _BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount,
+                                          uint32_t blockHeight, uint32_t timestamp, UInt256 hashes[], int *needsUpdate)
 {
     BRTransaction *tx;
-    UInt256 hashes[txCount];
-    int needsUpdate = 0;
-    size_t i, j, k;
+    size_t i, j;
     
-    assert(wallet != NULL);
-    assert(txHashes != NULL || txCount == 0);
-    pthread_mutex_lock(&wallet->lock);
-    if (blockHeight > wallet->blockHeight) wallet->blockHeight = blockHeight;
+    if (blockHeight > wallet->blockHeight) {
+        wallet->blockHeight = blockHeight;
+        wallet->statusEpoch++; // lockTimes may have passed
+    }
     
     for (i = 0, j = 0; txHashes && i < txCount; i++) {
         tx = BRSetGet(wallet->allTx, &txHashes[i]);
         if (! tx || (tx->blockHeight == blockHeight && tx->timestamp == timestamp)) continue;
         tx->timestamp = timestamp;
         tx->blockHeight = blockHeight;
+        _BRWalletInvalidateTxStatus(wallet, tx->txHash);
         
         if (_BRWalletContainsTx(wallet, tx)) {
-            for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
-                if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
-                array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
-                break;
-            }
-            
+            _BRWalletUpdateTxOrder(wallet, _BRWalletTxDelta(wallet, tx)); // move tx to keep the history sorted
             hashes[j++] = txHashes[i];
-            if (BRSetContains(wallet->pendingTx, tx) || BRSetContains(wallet->invalidTx, tx)) needsUpdate = 1;
+            if (BRSetContains(wallet->pendingTx, tx) || BRSetContains(wallet->invalidTx, tx)) *needsUpdate = 1;
         }
         else if (blockHeight != TX_UNCONFIRMED) { // remove and free confirmed non-wallet tx
             BRSetRemove(wallet->allTx, tx);
+            _BRWalletTxRemoved(wallet, tx);
             BRTransactionFree(tx);
         }
     }
+
+    return j;
+}
+
+// set the block heights and timestamps for the given transactions
+// use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
+void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                uint32_t timestamp)
+{
+    UInt256 hashes[txCount];
+    int needsUpdate = 0;
+    size_t count;
     
+    assert(wallet != NULL);
+    assert(txHashes != NULL || txCount == 0);
+    pthread_mutex_lock(&wallet->lock);
+    count = _BRWalletUpdateTransactions(wallet, txHashes, txCount, blockHeight, timestamp, hashes, &needsUpdate);
+    if (needsUpdate) _BRWalletUpdateBalance(wallet);
+    pthread_mutex_unlock(&wallet->lock);
+    if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, blockHeight, timestamp);
+}
+
+// same as calling BRWalletUpdateTransactions() for each of the given confirmations in order, but takes the wallet lock
+// once, recalculates the balance at most once, and makes callbacks only after all of them are applied: one
+// txUpdated() for each confirmation that changed any transaction, and one balanceChanged() if the balance changed
+void BRWalletConfirmTransactions(BRWallet *wallet, const BRTxConfirmation confirmations[], size_t count)
+{
+    UInt256 *hashes;
+    size_t i, total = 0, *updated = malloc(count*sizeof(*updated) + 1);
+    uint64_t balance, prevBalance;
+    int needsUpdate = 0;
+
+    assert(wallet != NULL);
+    assert(confirmations != NULL || count == 0);
+    assert(updated != NULL);
+    for (i = 0; i < count; i++) total += confirmations[i].txCount;
+    hashes = malloc(total*sizeof(*hashes) + 1);
+    assert(hashes != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    prevBalance = wallet->balance;
+
+    for (i = 0, total = 0; i < count; i++) {
+        assert(confirmations[i].txHashes != NULL || confirmations[i].txCount == 0);
+        updated[i] = _BRWalletUpdateTransactions(wallet, confirmations[i].txHashes, confirmations[i].txCount,
+                                                 confirmations[i].blockHeight, confirmations[i].timestamp,
+                                                 &hashes[total], &needsUpdate);
+        total += updated[i];
+    }
+
     if (needsUpdate) _BRWalletUpdateBalance(wallet);
+    balance = wallet->balance;
     pthread_mutex_unlock(&wallet->lock);
-    if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
+    if (balance != prevBalance && wallet->balanceChanged) wallet->balanceChanged(wallet->callbackInfo, balance);
+
+    for (i = 0, total = 0; wallet->txUpdated && i < count; total += updated[i], i++) {
+        if (updated[i] == 0) continue;
+        wallet->txUpdated(wallet->callbackInfo, &hashes[total], updated[i], confirmations[i].blockHeight,
+                          confirmations[i].timestamp);
+    }
+
+    free(updated);
+    free(hashes);
 }
 
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
 {
-    size_t i, j, count;
+    size_t i, total, count;
     
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
     wallet->blockHeight = blockHeight;
-    count = i = array_count(wallet->transactions);
-    while (i > 0 && wallet->transactions[i - 1]->blockHeight > blockHeight) i--;
-    count -= i;
+    wallet->statusEpoch++;
+    total = _BRTxTreeSize(wallet->history);
+    count = (blockHeight < UINT32_MAX) ? total - _BRTxTreeCountBelow(wallet->history, blockHeight + 1) : 0;
 
+    BRTransaction *txs[count];
     UInt256 hashes[count];
 
-    for (j = 0; j < count; j++) {
-        wallet->transactions[i + j]->blockHeight = TX_UNCONFIRMED;
-        hashes[j] = wallet->transactions[i + j]->txHash;
+    if (count > 0) _BRTxTreeGet(wallet->history, total - count, txs, count);
+
+    for (i = 0; i < count; i++) {
+        txs[i]->blockHeight = TX_UNCONFIRMED;
+        hashes[i] = txs[i]->txHash;
+        _BRWalletUpdateTxOrder(wallet, _BRWalletTxDelta(wallet, txs[i])); // move tx to keep the history sorted
     }
     
     if (count > 0) _BRWalletUpdateBalance(wallet);
@@ -1039,18 +1977,11 @@ void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
 uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
 {
     uint64_t amount = 0;
-    const uint8_t *pkh;
     
     assert(wallet != NULL);
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
-    
-    // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
-    for (size_t i = 0; tx && i < tx->outCount; i++) {
-        pkh = BRScriptPKH(tx->outputs[i].script, tx->outputs[i].scriptLen);
-        if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += tx->outputs[i].amount;
-    }
-    
+    if (tx) amount = _BRWalletGetTxDelta(wallet, tx).received;
     pthread_mutex_unlock(&wallet->lock);
     return amount;
 }
@@ -1063,18 +1994,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx)
     assert(wallet != NULL);
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->inCount; i++) {
-        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
-        uint32_t n = tx->inputs[i].index;
-        const uint8_t *pkh;
-
-        if (t && n < t->outCount) {
-            pkh = BRScriptPKH(t->outputs[n].script, t->outputs[n].scriptLen);
-            if (pkh && BRSetContains(wallet->allPKH, pkh)) amount += t->outputs[n].amount;
-        }
-    }
-    
+    if (tx) amount = _BRWalletGetTxDelta(wallet, tx).sent;
     pthread_mutex_unlock(&wallet->lock);
     return amount;
 }
@@ -1087,42 +2007,22 @@ uint64_t BRWalletFeeForTx(BRWallet *wallet, const BRTransaction *tx)
     assert(wallet != NULL);
     assert(tx != NULL);
     pthread_mutex_lock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->inCount && amount != UINT64_MAX; i++) {
-        BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
-        uint32_t n = tx->inputs[i].index;
-        
-        if (t && n < t->outCount) {
-            amount += t->outputs[n].amount;
-        }
-        else amount = UINT64_MAX;
-    }
-    
+    if (tx) amount = _BRWalletGetTxDelta(wallet, tx).fee;
     pthread_mutex_unlock(&wallet->lock);
-    
-    for (size_t i = 0; tx && i < tx->outCount && amount != UINT64_MAX; i++) {
-        amount -= tx->outputs[i].amount;
-    }
-    
     return amount;
 }
 
 // historical wallet balance after the given transaction, or current balance if transaction is not registered in wallet
 uint64_t BRWalletBalanceAfterTx(BRWallet *wallet, const BRTransaction *tx)
 {
+    BRTxDelta *delta;
     uint64_t balance;
     
     assert(wallet != NULL);
     assert(tx != NULL && BRTransactionIsSigned(tx));
     pthread_mutex_lock(&wallet->lock);
-    balance = wallet->balance;
-    
-    for (size_t i = array_count(wallet->transactions); tx && i > 0; i--) {
-        if (! BRTransactionEq(tx, wallet->transactions[i - 1])) continue;
-        balance = wallet->balanceHist[i - 1];
-        break;
-    }
-
+    delta = (tx) ? BRSetGet(wallet->txDeltas, tx) : NULL;
+    balance = (delta && (delta->flags & TX_DELTA_IN_HISTORY)) ? delta->balance : wallet->balance;
     pthread_mutex_unlock(&wallet->lock);
     return balance;
 }
@@ -1211,6 +2111,23 @@ static void _setApplyFreeTx(void *info, void *tx)
     BRTransactionFree(tx);
 }
 
+static void _setApplyFree(void *info, void *item)
+{
+    free(item);
+}
+
+static void _setApplyFreeTxChildren(void *info, void *node)
+{
+    array_free(((BRTxChildren *)node)->children);
+    free(node);
+}
+
+static void _setApplyFreeAddrOutputs(void *info, void *node)
+{
+    array_free(((BRAddrOutputs *)node)->outputs);
+    free(node);
+}
+
 // frees memory allocated for wallet, and calls BRTransactionFree() for all registered transactions
 void BRWalletFree(BRWallet *wallet)
 {
@@ -1223,10 +2140,14 @@ void BRWalletFree(BRWallet *wallet)
     BRSetApply(wallet->allTx, NULL, _setApplyFreeTx);
     BRSetFree(wallet->allTx);
     BRSetFree(wallet->spentOutputs);
+    BRSetApply(wallet->txDeltas, NULL, _setApplyFree);
+    BRSetFree(wallet->txDeltas);
+    BRSetApply(wallet->txChildren, NULL, _setApplyFreeTxChildren);
+    BRSetFree(wallet->txChildren);
+    BRSetApply(wallet->addrOutputs, NULL, _setApplyFreeAddrOutputs);
+    BRSetFree(wallet->addrOutputs);
     array_free(wallet->internalChain);
     array_free(wallet->externalChain);
-    array_free(wallet->balanceHist);
-    array_free(wallet->transactions);
     array_free(wallet->utxos);
     pthread_mutex_unlock(&wallet->lock);
     pthread_mutex_destroy(&wallet->lock);
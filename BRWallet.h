@@ -84,6 +84,10 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, uint32_t internal);
 
+// same as BRWalletUnusedAddrs(), but writes the pubkey hashes of the unused addresses to pkh instead of encoding them
+// returns the number of pubkey hashes written to pkh
+size_t BRWalletUnusedPKH(BRWallet *wallet, UInt160 pkh[], uint32_t gapLimit, uint32_t internal);
+
 // returns the first unused external address (bech32 pay-to-witness-pubkey-hash)
 BRAddress BRWalletReceiveAddress(BRWallet *wallet);
 
@@ -94,9 +98,20 @@ BRAddress BRWalletLegacyAddress(BRWallet *wallet);
 // returns the number addresses written, or total number available if addrs is NULL
 size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount);
 
+// writes the pubkey hashes of all addresses previously generated with BRWalletUnusedAddrs() to pkh, in the same order
+// as BRWalletAllAddrs()
+// returns the number of pubkey hashes written, or total number available if pkh is NULL
+size_t BRWalletAllPKH(BRWallet *wallet, UInt160 pkh[], size_t pkhCount);
+
 // true if the address was previously generated by BRWalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr);
 
+// true if pkh is the pubkey hash of an address previously generated by BRWalletUnusedAddrs() (even if it's now used)
+int BRWalletContainsPKH(BRWallet *wallet, UInt160 pkh);
+
+// true if script is a scriptPubKey that pays to an address previously generated by BRWalletUnusedAddrs()
+int BRWalletContainsScript(BRWallet *wallet, const uint8_t *script, size_t scriptLen);
+
 // true if the address was previously used as an input or output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr);
 
@@ -109,6 +124,49 @@ size_t BRWalletTransactions(BRWallet *wallet, BRTransaction *transactions[], siz
 size_t BRWalletTxUnconfirmedBefore(BRWallet *wallet, BRTransaction *transactions[], size_t txCount,
                                    uint32_t blockHeight);
 
+#define WALLET_HISTORY_SENT     0x01 // transactions that take more out of the wallet than they pay back to it
+#define WALLET_HISTORY_RECEIVED 0x02 // transactions that pay the wallet more than they take out of it
+#define WALLET_HISTORY_PENDING  0x04 // transactions for which BRWalletTransactionIsPending() is true
+
+// selects the transactions BRWalletHistory() pages through
+typedef struct {
+    uint32_t fromHeight, toHeight; // inclusive block height range, unconfirmed transactions are at TX_UNCONFIRMED
+    uint32_t fromTime, toTime; // inclusive timestamp range
+    uint32_t kinds; // 0 for every transaction, or the WALLET_HISTORY_* flags of the kinds of transactions to include
+    int newestFirst;
+} BRHistoryQuery;
+
+#define WALLET_HISTORY_ALL ((const BRHistoryQuery) { 0, UINT32_MAX, 0, UINT32_MAX, 0, 0 })
+
+// a position between two transactions in the history, it stays valid as transactions are added, removed or confirmed
+typedef struct {
+    uint32_t blockHeight, depth, seq;
+    size_t chainIndex;
+    int isSet; // false for the start of the history, in the order of the query it's used with
+} BRHistoryCursor;
+
+#define WALLET_HISTORY_START ((const BRHistoryCursor) { 0, 0, 0, 0, 0 })
+
+// returns a cursor just before the transaction at index in the history, counting from the oldest transaction, or from
+// the newest if newestFirst is true
+BRHistoryCursor BRWalletHistoryCursor(BRWallet *wallet, size_t index, int newestFirst);
+
+// writes the transactions that match query and follow cursor, in the order of the query, to the transactions array,
+// and moves cursor past them, use WALLET_HISTORY_START for the first page
+// takes O(log n) plus the size of the page, subtrees with no matching kinds or timestamps are skipped
+// returns the number of transactions written
+size_t BRWalletHistory(BRWallet *wallet, const BRHistoryQuery *query, BRHistoryCursor *cursor,
+                       BRTransaction *transactions[], size_t txCount);
+
+// writes the wallet transactions that pay to addr or spend an output to it, sorted by date, oldest first, to the given
+// transactions array, looking only at the transactions that touch addr
+// returns the number of transactions written, or total number available if transactions is NULL
+size_t BRWalletAddressTransactions(BRWallet *wallet, const char *addr, BRTransaction *transactions[], size_t txCount);
+
+// total of the unspent outputs to addr if it's a wallet address, not including transactions known to be invalid or
+// that are pending, and sets unconfirmed (if not NULL) to the part of it from unconfirmed transactions
+uint64_t BRWalletAddressBalance(BRWallet *wallet, const char *addr, uint64_t *unconfirmed);
+
 // current wallet balance, not including transactions known to be invalid
 uint64_t BRWalletBalance(BRWallet *wallet);
 
@@ -163,6 +221,18 @@ int BRWalletTransactionIsVerified(BRWallet *wallet, const BRTransaction *tx);
 // use height TX_UNCONFIRMED and timestamp 0 to indicate a tx should remain marked as unverified (not 0-conf safe)
 void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
                                 uint32_t timestamp);
+
+// a set of transactions with the same block height and timestamp, for BRWalletConfirmTransactions()
+typedef struct {
+    const UInt256 *txHashes;
+    size_t txCount;
+    uint32_t blockHeight, timestamp;
+} BRTxConfirmation;
+
+// same as calling BRWalletUpdateTransactions() for each of the given confirmations in order, but takes the wallet lock
+// once, recalculates the balance at most once, and makes callbacks only after all of them are applied: one
+// txUpdated() for each confirmation that changed any transaction, and one balanceChanged() if the balance changed
+void BRWalletConfirmTransactions(BRWallet *wallet, const BRTxConfirmation confirmations[], size_t count);
     
 // marks all transactions confirmed after blockHeight as unconfirmed (useful for chain re-orgs)
 void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight);
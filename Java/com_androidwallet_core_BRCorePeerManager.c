@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <malloc.h>
+#include <android/log.h>
 #include <arpa/inet.h>
 #include <BRChainParams.h>
 #include "BRPeerManager.h"
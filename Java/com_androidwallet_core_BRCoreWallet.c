@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <malloc.h>
+#include <android/log.h>
 #include <assert.h>
 #include <BRBIP39Mnemonic.h>
 #include "BRWallet.h"
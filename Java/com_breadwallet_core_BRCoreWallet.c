@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <malloc.h>
+#include <android/log.h>
 #include <assert.h>
 #include <BRBIP39Mnemonic.h>
 #include "BRWallet.h"
@@ -243,6 +244,47 @@ Java_com_breadwallet_core_BRCoreWallet_jniGetTransactions
     return transactionArray;
 }
 
+/*
+ * Class:     com_breadwallet_core_BRCoreWallet
+ * Method:    jniGetTransactionsPage
+ * Signature: (JIZ)[Lcom/breadwallet/core/BRCoreTransaction;
+ */
+JNIEXPORT jobjectArray JNICALL
+Java_com_breadwallet_core_BRCoreWallet_jniGetTransactionsPage
+        (JNIEnv *env, jobject thisObject, jlong offset, jint count, jboolean newestFirst) {
+    BRWallet  *wallet  = (BRWallet  *) getJNIReference (env, thisObject);
+
+    if (count <= 0 || offset < 0)
+        return (*env)->NewObjectArray (env, 0, transactionClass, 0);
+
+    BRHistoryQuery query = WALLET_HISTORY_ALL;
+    query.newestFirst = JNI_TRUE == newestFirst;
+
+    // Only the page is copied, not the whole history
+    BRHistoryCursor cursor = BRWalletHistoryCursor (wallet, (size_t) offset, query.newestFirst);
+    BRTransaction **transactions = (BRTransaction **) calloc ((size_t) count, sizeof (BRTransaction *));
+    if (NULL == transactions)
+        return (*env)->NewObjectArray (env, 0, transactionClass, 0);
+
+    size_t transactionCount = BRWalletHistory (wallet, &query, &cursor, transactions, (size_t) count);
+
+    jobjectArray transactionArray = (*env)->NewObjectArray (env, transactionCount, transactionClass, 0);
+
+    for (int index = 0; index < transactionCount; index++) {
+        jobject transactionObject =
+                (*env)->NewObject (env, transactionClass, transactionConstructor,
+                                   (jlong) JNI_COPY_TRANSACTION(transactions[index]));
+        assert (!(*env)->IsSameObject (env, transactionObject, NULL));
+
+        (*env)->SetObjectArrayElement (env, transactionArray, index, transactionObject);
+        (*env)->DeleteLocalRef (env, transactionObject);
+    }
+
+    if (NULL != transactions) free (transactions);
+
+    return transactionArray;
+}
+
 /*
  * Class:     com_breadwallet_core_BRCoreWallet
  * Method:    getTransactionsConfirmedBefore
@@ -71,6 +71,14 @@ JNIEXPORT jboolean JNICALL Java_com_breadwallet_core_BRCoreWallet_addressIsUsed
 JNIEXPORT jobjectArray JNICALL Java_com_breadwallet_core_BRCoreWallet_jniGetTransactions
   (JNIEnv *, jobject);
 
+/*
+ * Class:     com_breadwallet_core_BRCoreWallet
+ * Method:    jniGetTransactionsPage
+ * Signature: (JIZ)[Lcom/breadwallet/core/BRCoreTransaction;
+ */
+JNIEXPORT jobjectArray JNICALL Java_com_breadwallet_core_BRCoreWallet_jniGetTransactionsPage
+  (JNIEnv *, jobject, jlong, jint, jboolean);
+
 /*
  * Class:     com_breadwallet_core_BRCoreWallet
  * Method:    getTransactionsConfirmedBefore
@@ -128,6 +128,21 @@ public class BRCoreWallet extends BRCoreJniReference
      */
     private native BRCoreTransaction[] jniGetTransactions ();
 
+    /**
+     * Return up to `count` transactions, starting `offset` transactions from the oldest (or the
+     * newest if `newestFirst`), without copying the rest of the wallet history.
+     */
+    public BRCoreTransaction[] getTransactionsPage (long offset, int count, boolean newestFirst) {
+        BRCoreTransaction[] transactions = jniGetTransactionsPage(offset, count, newestFirst);
+
+        for (BRCoreTransaction transaction : transactions)
+            transaction.isRegistered = !BRCoreTransaction.JNI_COPIES_TRANSACTIONS;
+
+        return transactions;
+    }
+
+    private native BRCoreTransaction[] jniGetTransactionsPage (long offset, int count, boolean newestFirst);
+
     public native BRCoreTransaction[] getTransactionsConfirmedBefore (long blockHeight);
 
     public native long getBalance ();
@@ -38,9 +38,40 @@
 #define BCASH_PUBKEY_ADDRESS 28
 #define BCASH_SCRIPT_ADDRESS 40
 
-#define polymod(x) ((((x) & 0x07ffffffff) << 5) ^ (-(((x) >> 35) & 1) & 0x98f2bc8e61) ^\
-    (-(((x) >> 36) & 1) & 0x79b76d99e2) ^ (-(((x) >> 37) & 1) & 0xf33e5fb3c4) ^\
-    (-(((x) >> 38) & 1) & 0xae2eabe2a8) ^ (-(((x) >> 39) & 1) & 0x1e4f43e470))
+// generator terms for each value of the top 5 bits of the checksum, so a step costs one table lookup
+static const uint64_t _BRBCashAddrGen[32] = {
+    0x0000000000, 0x98f2bc8e61, 0x79b76d99e2, 0xe145d11783, 0xf33e5fb3c4, 0x6bcce33da5, 0x8a89322a26, 0x127b8ea447,
+    0xae2eabe2a8, 0x36dc176cc9, 0xd799c67b4a, 0x4f6b7af52b, 0x5d10f4516c, 0xc5e248df0d, 0x24a799c88e, 0xbc552546ef,
+    0x1e4f43e470, 0x86bdff6a11, 0x67f82e7d92, 0xff0a92f3f3, 0xed711c57b4, 0x7583a0d9d5, 0x94c671ce56, 0x0c34cd4037,
+    0xb061e806d8, 0x28935488b9, 0xc9d6859f3a, 0x512439115b, 0x435fb7b51c, 0xdbad0b3b7d, 0x3ae8da2cfe, 0xa21a66a29f
+};
+
+// bech32 digit values of upper and lower case characters, or -1 if invalid
+static const int8_t _BRBCashAddrDigits[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    15, -1, 10, 17, 21, 20, 26, 30,  7,  5, -1, -1, -1, -1, -1, -1,
+    -1, 29, -1, 24, 13, 25,  9,  8, 23, -1, 18, 22, 31, 27, 19, -1,
+     1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1,
+    -1, 29, -1, 24, 13, 25,  9,  8, 23, -1, 18, 22, 31, 27, 19, -1,
+     1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1
+};
+
+#define polymod(x) ((((x) & 0x07ffffffff) << 5) ^ _BRBCashAddrGen[(x) >> 35])
+
+// returns the checksum state after the prefix hrp of length hrpLen and its separator, the common lowercase network
+// prefixes are precomputed
+static uint64_t _BRBCashAddrHRPChecksum(const char *hrp, size_t hrpLen)
+{
+    uint64_t chk = 1;
+    
+    if (hrpLen == 11 && memcmp(hrp, "bitcoincash", hrpLen) == 0) return 0xf669cd6d15;
+    if (hrpLen == 7 && memcmp(hrp, "bchtest", hrpLen) == 0) return 0x8823fe40e1;
+    if (hrpLen == 6 && memcmp(hrp, "bchreg", hrpLen) == 0) return 0x08868914e0;
+    for (size_t i = 0; i < hrpLen; i++) chk = polymod(chk) ^ (hrp[i] & 0x1f);
+    return polymod(chk);
+}
 
 // returns the number of bytes written to data21 (maximum of 21)
 static size_t _BRBCashAddrDecode(char *hrp12, uint8_t *data21, const char *addr)
@@ -61,23 +92,12 @@ static size_t _BRBCashAddrDecode(char *hrp12, uint8_t *data21, const char *addr)
     
     while (sep > 0 && addr[sep] != ':') sep--;
     if (sep > 11 || sep + 34 + 8 > addrLen || (upper && lower)) return 0;
-    for (i = 0; i < sep; i++) chk = polymod(chk) ^ (addr[i] & 0x1f);
-    chk = polymod(chk);
+    chk = _BRBCashAddrHRPChecksum(addr, sep);
     memset(buf, 0, sizeof(buf));
     
     for (i = sep + 1, j = 0; i < addrLen; i++, j++) {
-        switch (tolower(addr[i])) {
-            case 'q': c = 0;  break; case 'p': c = 1;  break; case 'z': c = 2;  break; case 'r': c = 3;  break;
-            case 'y': c = 4;  break; case '9': c = 5;  break; case 'x': c = 6;  break; case '8': c = 7;  break;
-            case 'g': c = 8;  break; case 'f': c = 9;  break; case '2': c = 10; break; case 't': c = 11; break;
-            case 'v': c = 12; break; case 'd': c = 13; break; case 'w': c = 14; break; case '0': c = 15; break;
-            case 's': c = 16; break; case '3': c = 17; break; case 'j': c = 18; break; case 'n': c = 19; break;
-            case '5': c = 20; break; case '4': c = 21; break; case 'k': c = 22; break; case 'h': c = 23; break;
-            case 'c': c = 24; break; case 'e': c = 25; break; case '6': c = 26; break; case 'm': c = 27; break;
-            case 'u': c = 28; break; case 'a': c = 29; break; case '7': c = 30; break; case 'l': c = 31; break;
-            default: return 0; // invalid bech32 digit
-        }
-        
+        if (_BRBCashAddrDigits[(uint8_t)addr[i]] < 0) return 0; // invalid bech32 digit
+        c = _BRBCashAddrDigits[(uint8_t)addr[i]];
         chk = polymod(chk) ^ c;
         if (i + 8 >= addrLen) continue;
         x = (j % 8)*5 - ((j % 8)*5/8)*8;
@@ -109,11 +129,10 @@ static size_t _BRBCashAddrEncode(char *addr55, const char *hrp, const uint8_t da
     
     for (i = 0; hrp && hrp[i]; i++) {
         if (i > 12 || hrp[i] < 33 || hrp[i] > 126 || isupper(hrp[i])) return 0;
-        chk = polymod(chk) ^ (hrp[i] & 0x1f);
         addr[i] = hrp[i];
     }
     
-    chk = polymod(chk);
+    chk = _BRBCashAddrHRPChecksum(hrp, i);
     addr[i++] = ':';
     if (i < 1 || data == NULL || dataLen != 21) return 0;
     
@@ -198,3 +217,44 @@ size_t BRBCashAddrEncode(char *bCashAddr55, const char *bitcoinAddr)
     return _BRBCashAddrEncode(bCashAddr55, hrp, data, 21);
 }
 
+// converts count addresses stored bCashAddrLen bytes apart in bCashAddrs, writing each bitcoin address to bitcoinAddrs
+// at intervals of bitcoinAddrLen bytes (e.g. sizeof(BRAddress) for arrays of addresses, which must be at least 36)
+// an address that fails to convert is written as an empty string
+// returns the number of addresses successfully converted
+size_t BRBCashAddrDecodeBatch(char *bitcoinAddrs, size_t bitcoinAddrLen, const char *bCashAddrs, size_t bCashAddrLen,
+                              size_t count)
+{
+    size_t i, n = 0;
+    
+    assert(bitcoinAddrs != NULL || count == 0);
+    assert(bitcoinAddrLen >= 36 || count == 0);
+    assert(bCashAddrs != NULL || count == 0);
+    
+    for (i = 0; i < count && bitcoinAddrLen >= 36; i++) {
+        if (BRBCashAddrDecode(&bitcoinAddrs[i*bitcoinAddrLen], &bCashAddrs[i*bCashAddrLen]) > 0) n++;
+        else bitcoinAddrs[i*bitcoinAddrLen] = '\0';
+    }
+    
+    return n;
+}
+
+// converts count bitcoin addresses stored bitcoinAddrLen bytes apart in bitcoinAddrs, writing each b-cash address to
+// bCashAddrs at intervals of bCashAddrLen bytes (e.g. sizeof(BRAddress) for arrays of addresses, which must be at
+// least 55), an address that fails to convert is written as an empty string
+// returns the number of addresses successfully converted
+size_t BRBCashAddrEncodeBatch(char *bCashAddrs, size_t bCashAddrLen, const char *bitcoinAddrs, size_t bitcoinAddrLen,
+                              size_t count)
+{
+    size_t i, n = 0;
+    
+    assert(bCashAddrs != NULL || count == 0);
+    assert(bCashAddrLen >= 55 || count == 0);
+    assert(bitcoinAddrs != NULL || count == 0);
+    
+    for (i = 0; i < count && bCashAddrLen >= 55; i++) {
+        if (BRBCashAddrEncode(&bCashAddrs[i*bCashAddrLen], &bitcoinAddrs[i*bitcoinAddrLen]) > 0) n++;
+        else bCashAddrs[i*bCashAddrLen] = '\0';
+    }
+    
+    return n;
+}
@@ -41,6 +41,20 @@ size_t BRBCashAddrDecode(char *bitcoinAddr36, const char *bCashAddr);
 // returns the number of bytes written to bCashAddr55 (maximum of 55)
 size_t BRBCashAddrEncode(char *bCashAddr55, const char *bitcoinAddr);
 
+// converts count addresses stored bCashAddrLen bytes apart in bCashAddrs, writing each bitcoin address to bitcoinAddrs
+// at intervals of bitcoinAddrLen bytes (e.g. sizeof(BRAddress) for arrays of addresses, which must be at least 36)
+// an address that fails to convert is written as an empty string
+// returns the number of addresses successfully converted
+size_t BRBCashAddrDecodeBatch(char *bitcoinAddrs, size_t bitcoinAddrLen, const char *bCashAddrs, size_t bCashAddrLen,
+                              size_t count);
+
+// converts count bitcoin addresses stored bitcoinAddrLen bytes apart in bitcoinAddrs, writing each b-cash address to
+// bCashAddrs at intervals of bCashAddrLen bytes (e.g. sizeof(BRAddress) for arrays of addresses, which must be at
+// least 55), an address that fails to convert is written as an empty string
+// returns the number of addresses successfully converted
+size_t BRBCashAddrEncodeBatch(char *bCashAddrs, size_t bCashAddrLen, const char *bitcoinAddrs, size_t bitcoinAddrLen,
+                              size_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,1284 @@
+//
+//  bench.c
+//
+//  Copyright (c) 2018 breadwallet LLC
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "BRCrypto.h"
+#include "BRKey.h"
+#include "BRBIP32Sequence.h"
+#include "BRBase58.h"
+#include "BRBech32.h"
+#include "BRAddress.h"
+#include "BRTransaction.h"
+#include "BRMerkleBlock.h"
+#include "BRBloomFilter.h"
+#include "BRSet.h"
+#include "BRWallet.h"
+#include "BRPeerManager.h"
+#include "BRReplayPeer.h"
+#include "BRLog.h"
+#include "BRInt.h"
+#if BENCH_ETHEREUM
+#include "BRRlpCoder.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+
+// each benchmark is run untimed for BENCH_WARMUP_NS while the number of iterations per sample is doubled until a
+// sample takes at least BENCH_SAMPLE_NS, then reps samples are timed and the per-op time of each sample is reported as
+// min, median, p90, p99 and max, one JSON object per line on stdout, e.g.
+// {"name":"sha256_1k","iterations":1302528,"min_ns":2810.1,"p50_ns":2822.4,...,"ops_per_sec":354307,"mb_per_sec":362.8}
+// wallet macro-benchmarks run against deterministic synthetic wallets, timing a single run per sample, and also report
+// the number of items (transactions or blocks) each run processes and the resulting items_per_sec
+// the sync benchmark runs a BRPeerManager against a BRReplayPeer on the loopback interface, and also reports the traffic
+// of each run, it needs a library built with BITCOIN_REGTEST defined so the synthetic chain is accepted
+
+#define BENCH_WARMUP_NS    50000000ULL
+#define BENCH_SAMPLE_NS    2000000ULL
+#define BENCH_DEFAULT_REPS 21
+#define BENCH_MAX_REPS     1000
+#define BENCH_ONCE_REPS    5
+
+static const char *_benchFilter = NULL;
+static unsigned _benchReps = BENCH_DEFAULT_REPS;
+static int _benchCount = 0;
+static volatile uint64_t _benchSink = 0; // results are folded in here so calls can't be optimized away
+
+static uint64_t _BRBenchNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int _BRBenchCmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+// sorts count samples of ns per op and writes all but the closing brace of a result line to stdout, returns the median
+static double _BRBenchPrint(const char *name, size_t iterations, double samples[], size_t count)
+{
+    double p50;
+
+    qsort(samples, count, sizeof(*samples), _BRBenchCmp);
+    p50 = samples[(count - 1)/2];
+    printf("{\"name\":\"%s\",\"iterations\":%zu,\"min_ns\":%.1f,\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,"
+           "\"max_ns\":%.1f,\"ops_per_sec\":%.0f", name, iterations, samples[0], p50, samples[(count*90 + 99)/100 - 1],
+           samples[(count*99 + 99)/100 - 1], samples[count - 1], (p50 > 0) ? 1e9/p50 : 0);
+    return p50;
+}
+
+typedef struct {
+    uint8_t data[16*1024 + 16];
+    size_t dataLen;
+} BRBenchBuf;
+
+// runs func(info, n), which must perform n operations, and writes a result line to stdout
+// opBytes is the number of input bytes processed per operation, or 0 if throughput in bytes isn't meaningful
+static void _BRBench(const char *name, size_t opBytes, void (*func)(void *info, size_t n), void *info)
+{
+    double samples[BENCH_MAX_REPS], p50;
+    uint64_t start, t = 0;
+    size_t i, n = 1;
+
+    if (_benchFilter && ! strstr(name, _benchFilter)) return;
+    _benchCount++;
+    start = _BRBenchNow();
+
+    do {
+        t = _BRBenchNow();
+        func(info, n);
+        t = _BRBenchNow() - t;
+        if (t < BENCH_SAMPLE_NS && n < (1 << 30)) n *= 2;
+    } while (_BRBenchNow() - start < BENCH_WARMUP_NS || t < BENCH_SAMPLE_NS/2);
+
+    for (i = 0; i < _benchReps; i++) {
+        t = _BRBenchNow();
+        func(info, n);
+        samples[i] = (double)(_BRBenchNow() - t)/n;
+    }
+
+    p50 = _BRBenchPrint(name, n*_benchReps, samples, _benchReps);
+    if (opBytes > 0) printf(",\"mb_per_sec\":%.1f", (p50 > 0) ? opBytes*1e9/p50/(1024*1024) : 0);
+    printf("}\n");
+    fflush(stdout);
+}
+
+// runs run(info) once per sample, with setup(info) before it and teardown(info) after it outside of the timed region,
+// and writes a result line to stdout, for operations too slow or that change too much state to be repeated in a loop
+// items is the number of transactions, blocks, etc. processed by each run, and is reported as items_per_sec
+static void _BRBenchOnce(const char *name, size_t items, void (*setup)(void *info), void (*run)(void *info),
+                         void (*teardown)(void *info), void *info)
+{
+    double samples[BENCH_MAX_REPS], p50;
+    size_t i, reps = (_benchReps < BENCH_ONCE_REPS) ? _benchReps : BENCH_ONCE_REPS;
+    uint64_t t;
+
+    if (_benchFilter && ! strstr(name, _benchFilter)) return;
+    _benchCount++;
+
+    for (i = 0; i < reps; i++) {
+        if (setup) setup(info);
+        t = _BRBenchNow();
+        run(info);
+        samples[i] = (double)(_BRBenchNow() - t);
+        if (teardown) teardown(info);
+    }
+
+    p50 = _BRBenchPrint(name, reps, samples, reps);
+    printf(",\"items\":%zu,\"items_per_sec\":%.0f}\n", items, (p50 > 0) ? items*1e9/p50 : 0);
+    fflush(stdout);
+}
+
+// runs a benchmark over the first dataLen bytes of a BRBenchBuf, named with the data size appended to prefix
+static void _BRBenchSized(const char *prefix, void (*func)(void *info, size_t n), BRBenchBuf *buf)
+{
+    char name[64];
+
+    if (buf->dataLen < 1024) snprintf(name, sizeof(name), "%s_%zu", prefix, buf->dataLen);
+    else snprintf(name, sizeof(name), "%s_%zuk", prefix, buf->dataLen/1024);
+    _BRBench(name, buf->dataLen, func, buf);
+}
+
+#define BENCH_HASH(_name, _md, _hash)\
+static void _name(void *info, size_t n)\
+{\
+    BRBenchBuf *b = info;\
+    uint8_t md[_md] = { 0 };\
+    \
+    for (size_t i = 0; i < n; i++) _hash(md, b->data, b->dataLen), b->data[0] ^= md[0];\
+    _benchSink += md[0];\
+}
+
+BENCH_HASH(_BRBenchSHA1, 20, BRSHA1)
+BENCH_HASH(_BRBenchSHA256, 32, BRSHA256)
+BENCH_HASH(_BRBenchSHA256_2, 32, BRSHA256_2)
+BENCH_HASH(_BRBenchSHA512, 64, BRSHA512)
+BENCH_HASH(_BRBenchRMD160, 20, BRRMD160)
+BENCH_HASH(_BRBenchHash160, 20, BRHash160)
+BENCH_HASH(_BRBenchSHA3_256, 32, BRSHA3_256)
+BENCH_HASH(_BRBenchKeccak256, 32, BRKeccak256)
+BENCH_HASH(_BRBenchMD5, 16, BRMD5)
+
+static void _BRBenchMurmur3(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint32_t h = 0;
+
+    for (size_t i = 0; i < n; i++) h += BRMurmur3_32(b->data, b->dataLen, h);
+    _benchSink += h;
+}
+
+static void _BRBenchSip64(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint64_t h = 0;
+
+    for (size_t i = 0; i < n; i++) h += BRSip64(&b->data[b->dataLen], b->data, b->dataLen);
+    _benchSink += h;
+}
+
+static void _BRBenchHMACSHA256(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint8_t mac[32] = { 0 };
+
+    for (size_t i = 0; i < n; i++) BRHMAC(mac, BRSHA256, 32, mac, sizeof(mac), b->data, b->dataLen);
+    _benchSink += mac[0];
+}
+
+static void _BRBenchHMACSHA512(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint8_t mac[64] = { 0 };
+
+    for (size_t i = 0; i < n; i++) BRHMAC(mac, BRSHA512, 64, mac, 32, b->data, b->dataLen);
+    _benchSink += mac[0];
+}
+
+static void _BRBenchPoly1305(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint8_t mac[16] = { 0 }, key[32] = { 1 };
+
+    for (size_t i = 0; i < n; i++) BRPoly1305(mac, key, b->data, b->dataLen), key[0] ^= mac[0];
+    _benchSink += mac[0];
+}
+
+static void _BRBenchChacha20Poly1305(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    uint8_t key[32] = { 1 }, nonce[12] = { 0 }, out[b->dataLen + 16];
+
+    for (size_t i = 0; i < n; i++) {
+        BRChacha20Poly1305AEADEncrypt(out, sizeof(out), key, nonce, b->data, b->dataLen, NULL, 0);
+        nonce[0]++;
+    }
+
+    _benchSink += out[0];
+}
+
+static void _BRBenchPBKDF2(void *info, size_t n)
+{
+    uint8_t dk[64];
+
+    // the BIP39 seed derivation parameters
+    for (size_t i = 0; i < n; i++) BRPBKDF2(dk, sizeof(dk), BRSHA512, 64, "password", 8, "mnemonic", 8, 2048);
+    _benchSink += dk[0];
+}
+
+static void _BRBenchScrypt(void *info, size_t n)
+{
+    uint8_t dk[64];
+
+    // the BIP38 key derivation cost parameters, but with p = 1 instead of 8
+    for (size_t i = 0; i < n; i++) BRScrypt(dk, sizeof(dk), "password", 8, "salt", 4, 16384, 8, 1);
+    _benchSink += dk[0];
+}
+
+typedef struct {
+    BRKey key;
+    UInt256 md;
+    uint8_t sig[72];
+    size_t sigLen;
+    BRMasterPubKey mpk;
+    UInt512 seed;
+} BRBenchKey;
+
+static void _BRBenchKeySign(void *info, size_t n)
+{
+    BRBenchKey *k = info;
+    uint8_t sig[72];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRKeySign(&k->key, sig, sizeof(sig), k->md), k->md.u32[0]++;
+    _benchSink += len;
+}
+
+static void _BRBenchKeyVerify(void *info, size_t n)
+{
+    BRBenchKey *k = info;
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) r += BRKeyVerify(&k->key, k->md, k->sig, k->sigLen);
+    _benchSink += r;
+}
+
+static void _BRBenchKeyPubKey(void *info, size_t n)
+{
+    BRBenchKey *k = info;
+    uint8_t pubKey[65];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        BRKey key = k->key;
+
+        memset(key.pubKey, 0, sizeof(key.pubKey)); // the public key is cached once computed
+        len += BRKeyPubKey(&key, pubKey, sizeof(pubKey));
+    }
+
+    _benchSink += len;
+}
+
+static void _BRBenchBIP32PubKey(void *info, size_t n)
+{
+    BRBenchKey *k = info;
+    uint8_t pubKey[33];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBIP32PubKey(pubKey, sizeof(pubKey), k->mpk, 0, (uint32_t)i);
+    _benchSink += len;
+}
+
+static void _BRBenchBIP32PrivKey(void *info, size_t n)
+{
+    BRBenchKey *k = info;
+    BRKey key;
+
+    for (size_t i = 0; i < n; i++) BRBIP32PrivKey(&key, &k->seed, sizeof(k->seed), 0, (uint32_t)i);
+    _benchSink += key.secret.u8[0];
+}
+
+typedef struct {
+    uint8_t payload[25], program[22];
+    char base58[36], bech32[91];
+} BRBenchAddr;
+
+static void _BRBenchBase58Encode(void *info, size_t n)
+{
+    BRBenchAddr *a = info;
+    char s[36];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBase58Encode(s, sizeof(s), a->payload, sizeof(a->payload));
+    _benchSink += len;
+}
+
+static void _BRBenchBase58Decode(void *info, size_t n)
+{
+    BRBenchAddr *a = info;
+    uint8_t data[25];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBase58Decode(data, sizeof(data), a->base58);
+    _benchSink += len;
+}
+
+static void _BRBenchBase58CheckDecode(void *info, size_t n)
+{
+    BRBenchAddr *a = info;
+    uint8_t data[21];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBase58CheckDecode(data, sizeof(data), a->base58);
+    _benchSink += len;
+}
+
+static void _BRBenchBech32Encode(void *info, size_t n)
+{
+    BRBenchAddr *a = info;
+    char s[91];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBech32Encode(s, "bc", a->program);
+    _benchSink += len;
+}
+
+static void _BRBenchBech32Decode(void *info, size_t n)
+{
+    BRBenchAddr *a = info;
+    uint8_t data[42];
+    char hrp[84];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRBech32Decode(hrp, data, a->bech32);
+    _benchSink += len;
+}
+
+typedef struct {
+    BRTransaction *tx;
+    BRKey key;
+    uint8_t buf[4096];
+    size_t bufLen;
+} BRBenchTx;
+
+static void _BRBenchTxParse(void *info, size_t n)
+{
+    BRBenchTx *t = info;
+
+    for (size_t i = 0; i < n; i++) {
+        BRTransaction *tx = BRTransactionParse(t->buf, t->bufLen);
+
+        _benchSink += tx->inCount;
+        BRTransactionFree(tx);
+    }
+}
+
+static void _BRBenchTxSerialize(void *info, size_t n)
+{
+    BRBenchTx *t = info;
+    uint8_t buf[4096];
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; i++) len += BRTransactionSerialize(t->tx, buf, sizeof(buf));
+    _benchSink += len;
+}
+
+static void _BRBenchTxSign(void *info, size_t n)
+{
+    BRBenchTx *t = info;
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) r += BRTransactionSign(t->tx, 0, &t->key, 1);
+    _benchSink += r;
+}
+
+typedef struct {
+    uint8_t buf[1024];
+    size_t bufLen;
+    BRMerkleBlock *block;
+} BRBenchBlock;
+
+static void _BRBenchMerkleBlockParse(void *info, size_t n)
+{
+    BRBenchBlock *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        BRMerkleBlock *block = BRMerkleBlockParse(b->buf, b->bufLen);
+
+        _benchSink += block->nonce;
+        BRMerkleBlockFree(block);
+    }
+}
+
+static void _BRBenchMerkleBlockIsValid(void *info, size_t n)
+{
+    BRBenchBlock *b = info;
+    uint32_t now = (uint32_t)time(NULL);
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) r += BRMerkleBlockIsValid(b->block, now);
+    _benchSink += r;
+}
+
+typedef struct {
+    BRBloomFilter *filter;
+    UInt160 *elems;
+    size_t elemCount;
+} BRBenchBloom;
+
+static void _BRBenchBloomInsert(void *info, size_t n)
+{
+    BRBenchBloom *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        BRBloomFilterInsertData(b->filter, b->elems[i % b->elemCount].u8, sizeof(UInt160));
+    }
+
+    _benchSink += b->filter->elemCount;
+}
+
+static void _BRBenchBloomContains(void *info, size_t n)
+{
+    BRBenchBloom *b = info;
+    int r = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        r += BRBloomFilterContainsData(b->filter, b->elems[i % b->elemCount].u8, sizeof(UInt160));
+    }
+
+    _benchSink += r;
+}
+
+typedef struct {
+    BRSet *set;
+    UInt256 *items;
+    size_t itemCount;
+} BRBenchSet;
+
+static size_t _BRBenchUInt256Hash(const void *item)
+{
+    return (size_t)((const UInt256 *)item)->u32[0];
+}
+
+static int _BRBenchUInt256Eq(const void *a, const void *b)
+{
+    return UInt256Eq(*(const UInt256 *)a, *(const UInt256 *)b);
+}
+
+// adds then removes every item, so the set is empty again after each pass
+static void _BRBenchSetAddRemove(void *info, size_t n)
+{
+    BRBenchSet *s = info;
+    size_t i, j;
+
+    for (i = 0; i < n; i += s->itemCount) {
+        for (j = 0; j < s->itemCount && i + j < n; j++) BRSetAdd(s->set, &s->items[j]);
+        for (j = 0; j < s->itemCount && i + j < n; j++) BRSetRemove(s->set, &s->items[j]);
+    }
+
+    _benchSink += BRSetCount(s->set);
+}
+
+static void _BRBenchSetGet(void *info, size_t n)
+{
+    BRBenchSet *s = info;
+    size_t r = 0;
+
+    for (size_t i = 0; i < n; i++) r += (BRSetGet(s->set, &s->items[i % s->itemCount]) != NULL);
+    _benchSink += r;
+}
+
+// shape of a synthetic wallet history
+typedef struct {
+    size_t txCount;     // number of wallet transactions
+    size_t utxoCount;   // number of unspent outputs to leave once every transaction is registered (approximate)
+    uint32_t depth;     // number of blocks the confirmed transactions are spread over
+    double unconfirmed; // fraction of transactions, the most recent ones, left unconfirmed
+} BRBenchWalletConfig;
+
+static BRBenchWalletConfig _benchWallet = { 0, 0, 0, 0 }; // when txCount is 0, a small and a large wallet are used
+
+typedef struct {
+    BRBenchWalletConfig cfg;
+    UInt512 seed;
+    BRMasterPubKey mpk;
+    BRTransaction **txs; // generated history, each transaction after the ones it spends from
+    BRTransaction **copies; // copies of txs handed to the wallet under test, which takes ownership of them
+    UInt256 *unconfirmed;
+    size_t unconfirmedCount;
+    BRWallet *wallet;
+    BRTransaction *tx;
+    uint8_t script[25];
+} BRBenchWallet;
+
+typedef struct {
+    UInt256 hash;
+    uint32_t n;
+    uint64_t amount;
+} BRBenchUTXO;
+
+#define BENCH_WALLET_HEIGHT    500000
+#define BENCH_WALLET_TIMESTAMP 1510000000
+#define BENCH_WALLET_BLOCK_TXS 10
+
+// deterministic xorshift prng, so the same config always generates the same wallet
+static uint32_t _BRBenchRand(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void _BRBenchP2PKH(uint8_t script[25], UInt160 pkh)
+{
+    script[0] = OP_DUP, script[1] = OP_HASH160, script[2] = sizeof(pkh);
+    UInt160Set(&script[3], pkh);
+    script[23] = OP_EQUALVERIFY, script[24] = OP_CHECKSIG;
+}
+
+static UInt160 _BRBenchChainPKH(BRMasterPubKey mpk, uint32_t chain, uint32_t index)
+{
+    uint8_t pubKey[33];
+    BRKey key;
+
+    BRKeySetPubKey(&key, pubKey, BRBIP32PubKey(pubKey, sizeof(pubKey), mpk, chain, index));
+    return BRKeyHash160(&key);
+}
+
+// generates w->cfg.txCount transactions for w->mpk: receives from outside the wallet to successive external addresses,
+// and payments from 1-3 randomly chosen wallet outputs to an outside address with change to successive internal
+// addresses, mixed so that about w->cfg.utxoCount outputs are left unspent
+// inputs carry placeholder signatures, which the wallet accepts but which can't be verified
+static void _BRBenchWalletGenerate(BRBenchWallet *w)
+{
+    BRBenchUTXO *pool, in;
+    size_t i, j, k, len, poolCount = 0, utxoCount = w->cfg.utxoCount, txCount = w->cfg.txCount,
+           confirmed = txCount - (size_t)(txCount*w->cfg.unconfirmed);
+    uint32_t height, r = 0x9e3779b9, external = 0, internal = 0;
+    uint8_t sig[107], wit[1] = { 0 }, script[25], buf[1024];
+    uint64_t amount, fee;
+    BRTransaction *tx;
+    UInt256 hash;
+    int receive;
+
+    if (utxoCount > txCount) utxoCount = txCount;
+    pool = malloc((utxoCount + 3)*sizeof(*pool));
+    w->txs = calloc(txCount, sizeof(*w->txs));
+    w->copies = calloc(txCount, sizeof(*w->copies));
+    w->unconfirmed = calloc(txCount, sizeof(*w->unconfirmed));
+    assert(pool != NULL && w->txs != NULL && w->copies != NULL && w->unconfirmed != NULL);
+    w->unconfirmedCount = 0;
+    sig[0] = 71, sig[72] = 33, sig[73] = 0x02; // a signature push followed by a compressed pubKey push
+    for (i = 1; i < sizeof(sig); i++) if (i != 72 && i != 73) sig[i] = (uint8_t)(i*0x9e3779b1 >> 24);
+
+    for (i = 0; i < txCount; i++) {
+        tx = BRTransactionNew();
+        receive = (poolCount == 0 ||
+                   (poolCount < utxoCount && (txCount - i <= utxoCount - poolCount || (_BRBenchRand(&r) & 1))));
+
+        if (receive) {
+            BRSHA256(&hash, &i, sizeof(i)); // a payment from outside the wallet
+            BRTransactionAddInput(tx, hash, _BRBenchRand(&r) % 4, 0, NULL, 0, sig, sizeof(sig), wit, 0, TXIN_SEQUENCE);
+            _BRBenchP2PKH(script, _BRBenchChainPKH(w->mpk, SEQUENCE_EXTERNAL_CHAIN, external++));
+            BRTransactionAddOutput(tx, 1000000 + _BRBenchRand(&r) % 100000000, script, sizeof(script));
+        }
+        else { // consolidate outputs while there are more than utxoCount
+            k = (poolCount > utxoCount) ? 2 + _BRBenchRand(&r) % 2 : 1;
+            if (k > poolCount) k = poolCount;
+
+            for (j = 0, amount = 0; j < k; j++) {
+                len = _BRBenchRand(&r) % poolCount;
+                in = pool[len];
+                pool[len] = pool[--poolCount];
+                BRTransactionAddInput(tx, in.hash, in.n, in.amount, NULL, 0, sig, sizeof(sig), wit, 0, TXIN_SEQUENCE);
+                amount += in.amount;
+            }
+
+            fee = 1000*(k + 1);
+            BRSHA256(&hash, &i, sizeof(i));
+            _BRBenchP2PKH(script, UInt160Get(&hash)); // an outside address
+            BRTransactionAddOutput(tx, amount/16 + _BRBenchRand(&r) % (amount/8), script, sizeof(script));
+
+            if (amount - tx->outputs[0].amount > fee + TX_MIN_OUTPUT_AMOUNT) {
+                _BRBenchP2PKH(script, _BRBenchChainPKH(w->mpk, SEQUENCE_INTERNAL_CHAIN, internal++));
+                BRTransactionAddOutput(tx, amount - tx->outputs[0].amount - fee, script, sizeof(script));
+            }
+        }
+
+        // round trip through serialization to set the hashes and get the layout of a transaction loaded from storage
+        len = BRTransactionSerialize(tx, buf, sizeof(buf));
+        BRTransactionFree(tx);
+        tx = BRTransactionParse(buf, len);
+        assert(tx != NULL);
+
+        if (i < confirmed) {
+            height = (uint32_t)(i*w->cfg.depth/confirmed);
+            tx->blockHeight = BENCH_WALLET_HEIGHT + height;
+            tx->timestamp = BENCH_WALLET_TIMESTAMP + height*600;
+        }
+        else {
+            tx->blockHeight = TX_UNCONFIRMED;
+            tx->timestamp = BENCH_WALLET_TIMESTAMP + w->cfg.depth*600;
+            w->unconfirmed[w->unconfirmedCount++] = tx->txHash;
+        }
+
+        if (receive || tx->outCount > 1) { // the last output pays the wallet, unless a payment had no change
+            pool[poolCount++] = (BRBenchUTXO) { tx->txHash, (uint32_t)(tx->outCount - 1),
+                                                tx->outputs[tx->outCount - 1].amount };
+        }
+
+        w->txs[i] = tx;
+    }
+
+    free(pool);
+}
+
+static void _BRBenchWalletCopyTxs(void *info)
+{
+    BRBenchWallet *w = info;
+
+    for (size_t i = 0; i < w->cfg.txCount; i++) w->copies[i] = BRTransactionCopy(w->txs[i]);
+}
+
+static void _BRBenchWalletLoad(void *info)
+{
+    BRBenchWallet *w = info;
+
+    _BRBenchWalletCopyTxs(w);
+    w->wallet = BRWalletNew(w->copies, w->cfg.txCount, w->mpk, 0);
+    assert(w->wallet != NULL);
+}
+
+static void _BRBenchWalletEmpty(void *info)
+{
+    BRBenchWallet *w = info;
+
+    _BRBenchWalletCopyTxs(w);
+    w->wallet = BRWalletNew(NULL, 0, w->mpk, 0);
+}
+
+static void _BRBenchWalletFree(void *info)
+{
+    BRBenchWallet *w = info;
+
+    if (w->wallet) BRWalletFree(w->wallet);
+    w->wallet = NULL;
+}
+
+static void _BRBenchWalletNew(void *info)
+{
+    BRBenchWallet *w = info;
+
+    w->wallet = BRWalletNew(w->copies, w->cfg.txCount, w->mpk, 0);
+}
+
+static void _BRBenchWalletRegister(void *info)
+{
+    BRBenchWallet *w = info;
+
+    for (size_t i = 0; i < w->cfg.txCount; i++) {
+        if (! BRWalletRegisterTransaction(w->wallet, w->copies[i])) BRTransactionFree(w->copies[i]);
+    }
+}
+
+// confirms the unconfirmed transactions BENCH_WALLET_BLOCK_TXS at a time, one block after another
+static void _BRBenchWalletUpdate(void *info)
+{
+    BRBenchWallet *w = info;
+    uint32_t height = BENCH_WALLET_HEIGHT + w->cfg.depth + 1;
+
+    for (size_t i = 0; i < w->unconfirmedCount; i += BENCH_WALLET_BLOCK_TXS, height++) {
+        size_t count = (w->unconfirmedCount - i < BENCH_WALLET_BLOCK_TXS) ? w->unconfirmedCount - i :
+                       BENCH_WALLET_BLOCK_TXS;
+
+        BRWalletUpdateTransactions(w->wallet, &w->unconfirmed[i], count, height,
+                                   BENCH_WALLET_TIMESTAMP + (height - BENCH_WALLET_HEIGHT)*600);
+    }
+}
+
+static void _BRBenchWalletCreateTx(void *info, size_t n)
+{
+    BRBenchWallet *w = info;
+    BRTxOutput o = { "", BRWalletBalance(w->wallet)/4, w->script, sizeof(w->script) };
+
+    for (size_t i = 0; i < n; i++) {
+        BRTransaction *tx = BRWalletCreateTxForOutputs(w->wallet, &o, 1);
+
+        _benchSink += (tx) ? tx->inCount : 0;
+        if (tx) BRTransactionFree(tx);
+    }
+}
+
+static void _BRBenchWalletSignTx(void *info, size_t n)
+{
+    BRBenchWallet *w = info;
+
+    for (size_t i = 0; i < n; i++) {
+        BRTransaction *tx = BRTransactionCopy(w->tx);
+
+        _benchSink += BRWalletSignTransaction(w->wallet, tx, &w->seed, sizeof(w->seed));
+        BRTransactionFree(tx);
+    }
+}
+
+#define BENCH_SYNC_TIMEOUT 600        // seconds to wait for a sync to finish
+#define BENCH_SYNC_MAGIC   0xdab5bffa // regtest network magic number
+#define BENCH_SYNC_SAVE_US 2000       // simulated storage latency of each saveBlocks and savePeers call
+
+typedef struct {
+    BRBenchWallet *w;
+    BRReplayPeer *peer;
+    uint16_t port;
+    size_t blockCount; // blocks downloaded by each sync, as headers or merkleblocks
+    uint32_t earliestKeyTime;
+    uint64_t balance; // wallet balance expected once synced
+    BRWallet *wallet;
+    BRPeerManager *manager;
+    BRPeerManagerMetrics metrics; // manager metrics at the end of the last run
+    int profileLocks; // record lock contention per call site during the run
+    BRPeerManagerLockSite topSite; // most contended lock call site of the last profiled run
+    size_t saves, savedBlocks; // saveBlocks and savePeers calls, and blocks saved, during the run
+    BRBlockCache *blockCache; // if set, each run is a rescan after an untimed sync that fills the cache
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done, error;
+} BRBenchSync;
+
+// a transaction from outside the wallet, for padding blocks
+static BRTransaction *_BRBenchSyncNoiseTx(uint32_t *r)
+{
+    BRTransaction *tx = BRTransactionNew();
+    uint8_t sig[107], script[25], buf[512];
+    UInt256 hash;
+    size_t len;
+
+    for (len = 0; len < sizeof(sig); len++) sig[len] = (uint8_t)_BRBenchRand(r);
+    sig[0] = 71, sig[72] = 33, sig[73] = 0x02;
+    for (len = 0; len < sizeof(hash); len++) hash.u8[len] = (uint8_t)_BRBenchRand(r);
+    BRTransactionAddInput(tx, hash, _BRBenchRand(r) % 4, 0, NULL, 0, sig, sizeof(sig), NULL, 0, TXIN_SEQUENCE);
+    _BRBenchP2PKH(script, UInt160Get(&hash));
+    BRTransactionAddOutput(tx, 1000000 + _BRBenchRand(r) % 100000000, script, sizeof(script));
+    len = BRTransactionSerialize(tx, buf, sizeof(buf));
+    BRTransactionFree(tx);
+    return BRTransactionParse(buf, len);
+}
+
+// builds the replay peer's chain for w's history: a base block, then cfg.depth blocks more than a week older than the
+// wallet's first transaction that are downloaded as headers, then a block for each height the confirmed transactions
+// span, each padded with 1 to BENCH_WALLET_BLOCK_TXS transactions from outside the wallet, and the unconfirmed
+// transactions in its mempool (at least one, since the client waits out a timeout when nothing in the mempool matches)
+// returns false if the blocks couldn't be mined because the library wasn't built for regtest
+static int _BRBenchSyncChain(BRBenchSync *s)
+{
+    BRBenchWallet *w = s->w;
+    size_t i, j = 0, count, txCount = w->cfg.txCount, confirmed = txCount - (w->unconfirmedCount > 0 ? 0 : 1);
+    BRTransaction **txs = calloc(txCount + BENCH_WALLET_BLOCK_TXS, sizeof(*txs));
+    uint32_t h, r = 0x6a09e667, t = BENCH_WALLET_TIMESTAMP - 8*24*60*60 - (w->cfg.depth + 1)*600;
+    int ok = 1;
+
+    assert(txs != NULL);
+    s->earliestKeyTime = BENCH_WALLET_TIMESTAMP;
+    for (h = 0; ok && h <= w->cfg.depth; h++) ok = (BRReplayPeerMineBlock(s->peer, NULL, 0, t + h*600) != NULL);
+
+    for (h = 0; ok && h < w->cfg.depth; h++) {
+        count = 1 + _BRBenchRand(&r) % BENCH_WALLET_BLOCK_TXS;
+        for (i = 0; i < count; i++) txs[i] = _BRBenchSyncNoiseTx(&r);
+
+        while (j < confirmed && w->txs[j]->blockHeight == BENCH_WALLET_HEIGHT + h) {
+            txs[count++] = BRTransactionCopy(w->txs[j++]);
+        }
+
+        ok = (BRReplayPeerMineBlock(s->peer, txs, count, BENCH_WALLET_TIMESTAMP + h*600) != NULL);
+        if (! ok) while (count > 0) BRTransactionFree(txs[--count]);
+    }
+
+    while (ok && j < txCount) BRReplayPeerAddMempoolTx(s->peer, BRTransactionCopy(w->txs[j++]));
+    s->blockCount = BRReplayPeerLastHeight(s->peer);
+    free(txs);
+    return ok;
+}
+
+static void _BRBenchSyncStopped(void *info, int error)
+{
+    BRBenchSync *s = info;
+
+    pthread_mutex_lock(&s->lock);
+    s->done = 1;
+    s->error = error;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void _BRBenchSyncSaveBlocks(void *info, int replace, BRMerkleBlock *blocks[], size_t blocksCount)
+{
+    BRBenchSync *s = info;
+    struct timespec ts = { 0, BENCH_SYNC_SAVE_US*1000 };
+
+    nanosleep(&ts, NULL);
+    __atomic_add_fetch(&s->saves, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->savedBlocks, blocksCount, __ATOMIC_RELAXED);
+}
+
+static void _BRBenchSyncSavePeers(void *info, int replace, const BRPeer peers[], size_t peersCount)
+{
+    BRBenchSync *s = info;
+    struct timespec ts = { 0, BENCH_SYNC_SAVE_US*1000 };
+
+    nanosleep(&ts, NULL);
+    __atomic_add_fetch(&s->saves, 1, __ATOMIC_RELAXED);
+}
+
+static int _BRBenchSyncNetworkIsReachable(void *info)
+{
+    return 1;
+}
+
+// connects the peer manager, or rescans if it's already connected, and waits for the sync to stop
+static void _BRBenchSyncWait(BRBenchSync *s, int rescan)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += BENCH_SYNC_TIMEOUT;
+    s->done = 0;
+    if (rescan) BRPeerManagerRescan(s->manager);
+    else BRPeerManagerConnect(s->manager);
+    pthread_mutex_lock(&s->lock);
+    while (! s->done && pthread_cond_timedwait(&s->cond, &s->lock, &deadline) == 0);
+    if (! s->done) s->error = ETIMEDOUT;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void _BRBenchSyncSetup(void *info)
+{
+    BRBenchSync *s = info;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+
+    s->wallet = BRWalletNew(NULL, 0, s->w->mpk, 0);
+    s->manager = BRPeerManagerNew(BRReplayPeerChainParams(s->peer), s->wallet, s->earliestKeyTime, NULL, 0, NULL, 0);
+    BRPeerManagerSetCallbacks(s->manager, s, NULL, _BRBenchSyncStopped, NULL, _BRBenchSyncSaveBlocks,
+                              _BRBenchSyncSavePeers, _BRBenchSyncNetworkIsReachable, NULL);
+    BRPeerManagerSetFixedPeer(s->manager, localHost, s->port);
+    s->error = 0;
+
+    if (s->blockCache) {
+        BRPeerManagerSetBlockCache(s->manager, s->blockCache);
+        _BRBenchSyncWait(s, 0);
+    }
+
+    BRPeerManagerSetLockProfiling(s->manager, s->profileLocks);
+    s->saves = s->savedBlocks = 0;
+    BRReplayPeerResetStats(s->peer);
+}
+
+static void _BRBenchSyncRun(void *info)
+{
+    BRBenchSync *s = info;
+
+    _BRBenchSyncWait(s, (s->blockCache != NULL));
+}
+
+static void _BRBenchSyncTeardown(void *info)
+{
+    BRBenchSync *s = info;
+    int error;
+
+    pthread_mutex_lock(&s->lock);
+    error = s->error; // disconnecting stops the sync again, with the error the replay peer's connection closed with
+    pthread_mutex_unlock(&s->lock);
+    BRPeerManagerDisconnect(s->manager);
+    s->metrics = BRPeerManagerGetMetrics(s->manager);
+    if (s->profileLocks) BRPeerManagerLockProfile(s->manager, &s->topSite, 1);
+
+    if (error != 0 || BRWalletBalance(s->wallet) != s->balance) {
+        fprintf(stderr, "sync ended with error %d at height %"PRIu32", wallet balance %"PRIu64", expected %"PRIu64"\n",
+                error, BRPeerManagerLastBlockHeight(s->manager), BRWalletBalance(s->wallet), s->balance);
+    }
+
+    BRPeerManagerFree(s->manager);
+    BRWalletFree(s->wallet);
+    s->manager = NULL;
+    s->wallet = NULL;
+}
+
+// syncs an empty wallet for w->mpk from a replay peer serving w's history, and writes a result line to stdout that
+// also gives the number of blocks synced, the bytes and messages the replay peer received and sent, how long each peer
+// manager lock was held, and the saves made through callbacks that simulate a slow store, for the last run, which also
+// profiles lock contention and reports the most contended site
+// if rescan is true, each run instead times a rescan of a synced wallet with a block cache filled by the sync, and the
+// result also gives the number of blocks it replayed from the cache
+static void _BRBenchSync(const char *name, BRBenchWallet *w, int rescan)
+{
+    double samples[BENCH_MAX_REPS], p50;
+    size_t i, reps = (_benchReps < BENCH_ONCE_REPS) ? _benchReps : BENCH_ONCE_REPS;
+    char path[] = "/tmp/BRBenchBlockCacheXXXXXX";
+    BRBenchSync s;
+    BRReplayPeerStats stats;
+    uint64_t t;
+    int fd = -1;
+
+    if (_benchFilter && ! strstr(name, _benchFilter)) return;
+    memset(&s, 0, sizeof(s));
+    s.w = w;
+    s.peer = BRReplayPeerNew(BENCH_SYNC_MAGIC);
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    if (rescan && (fd = mkstemp(path)) >= 0) close(fd);
+    if (fd >= 0) s.blockCache = BRBlockCacheOpen(path);
+
+    if (rescan && ! s.blockCache) perror(name);
+    else if (! _BRBenchSyncChain(&s)) {
+        fprintf(stderr, "%s skipped: synthetic blocks need a library built with BITCOIN_REGTEST\n", name);
+    }
+    else if ((s.port = BRReplayPeerListen(s.peer)) == 0) perror(name);
+    else {
+        _benchCount++;
+        _BRBenchWalletLoad(w);
+        s.balance = BRWalletBalance(w->wallet);
+        _BRBenchWalletFree(w);
+
+        for (i = 0; i < reps; i++) {
+            s.profileLocks = (i + 1 == reps); // keep profiling overhead out of all but the last sample
+            _BRBenchSyncSetup(&s);
+            t = _BRBenchNow();
+            _BRBenchSyncRun(&s);
+            samples[i] = (double)(_BRBenchNow() - t);
+            stats = BRReplayPeerGetStats(s.peer);
+            _BRBenchSyncTeardown(&s);
+        }
+
+        p50 = _BRBenchPrint(name, reps, samples, reps);
+        printf(",\"items\":%zu,\"items_per_sec\":%.0f,\"bytes_in\":%"PRIu64",\"bytes_out\":%"PRIu64",\"msgs_in\":%zu,"
+               "\"msgs_out\":%zu,\"locks\":%"PRIu64",\"lock_held_ms\":%.1f,\"lock_p99_us\":%.0f,"
+               "\"lock_max_us\":%"PRIu64",\"peer_locks\":%"PRIu64",\"peer_lock_held_ms\":%.1f,\"tx_locks\":%"PRIu64","
+               "\"tx_lock_held_ms\":%.1f,\"top_wait_site\":\"%s:%s:%d\",\"top_wait_us\":%"PRIu64",\"saves\":%zu,"
+               "\"saved_blocks\":%zu,\"replayed_blocks\":%"PRIu64"}\n",
+               s.blockCount, (p50 > 0) ? s.blockCount*1e9/p50 : 0, stats.bytesIn, stats.bytesOut, stats.messagesIn,
+               stats.messagesOut, s.metrics.lockTime.count, s.metrics.lockTime.totalUsec/1000.0,
+               BRPeerHistogramPercentile(&s.metrics.lockTime, 99)*1000000, s.metrics.lockTime.maxUsec,
+               s.metrics.peerLockTime.count, s.metrics.peerLockTime.totalUsec/1000.0, s.metrics.txLockTime.count,
+               s.metrics.txLockTime.totalUsec/1000.0, (s.topSite.lock) ? s.topSite.lock : "",
+               (s.topSite.function) ? s.topSite.function : "", s.topSite.line, s.topSite.waitUsec, s.saves,
+               s.savedBlocks, s.metrics.replayedBlocks);
+        fflush(stdout);
+    }
+
+    if (s.blockCache) BRBlockCacheClose(s.blockCache);
+    if (fd >= 0) unlink(path);
+    BRReplayPeerFree(s.peer);
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+}
+
+// generates a synthetic wallet with the shape given by cfg and runs the wallet benchmarks against it, naming each with
+// the transaction count appended to prefix
+static void _BRBenchWallet(const char *prefix, BRBenchWalletConfig cfg, const UInt512 *seed)
+{
+    const char *ops[] = { "new", "free", "register", "update_blocks", "create_tx", "sign_tx", "sync", "rescan" };
+    BRBenchWallet w;
+    char name[64];
+    size_t i;
+
+#define BENCH_WALLET_NAME(_name) (snprintf(name, sizeof(name), "%s_%s_%zutx", prefix, _name, cfg.txCount), name)
+    for (i = 0; _benchFilter && i < sizeof(ops)/sizeof(*ops); i++) {
+        if (strstr(BENCH_WALLET_NAME(ops[i]), _benchFilter)) break;
+    }
+
+    if (i == sizeof(ops)/sizeof(*ops) || cfg.txCount == 0) return; // don't generate a wallet nothing will use
+    memset(&w, 0, sizeof(w));
+    w.cfg = cfg;
+    w.seed = *seed;
+    w.mpk = BRBIP32MasterPubKey(&w.seed, sizeof(w.seed));
+    _BRBenchP2PKH(w.script, UInt160Get(&w.seed)); // an outside address
+    _BRBenchWalletGenerate(&w);
+    _BRBenchOnce(BENCH_WALLET_NAME("new"), cfg.txCount, _BRBenchWalletCopyTxs, _BRBenchWalletNew, _BRBenchWalletFree,
+                 &w);
+    _BRBenchOnce(BENCH_WALLET_NAME("free"), cfg.txCount, _BRBenchWalletLoad, _BRBenchWalletFree, NULL, &w);
+    _BRBenchOnce(BENCH_WALLET_NAME("register"), cfg.txCount, _BRBenchWalletEmpty, _BRBenchWalletRegister,
+                 _BRBenchWalletFree, &w);
+
+    if (w.unconfirmedCount > 0) {
+        _BRBenchOnce(BENCH_WALLET_NAME("update_blocks"), (w.unconfirmedCount + BENCH_WALLET_BLOCK_TXS - 1)/
+                     BENCH_WALLET_BLOCK_TXS, _BRBenchWalletLoad, _BRBenchWalletUpdate, _BRBenchWalletFree, &w);
+    }
+
+    BRTxOutput o = { "", 0, w.script, sizeof(w.script) };
+
+    _BRBenchWalletLoad(&w);
+    o.amount = BRWalletBalance(w.wallet)/4;
+    w.tx = BRWalletCreateTxForOutputs(w.wallet, &o, 1);
+    _BRBench(BENCH_WALLET_NAME("create_tx"), 0, _BRBenchWalletCreateTx, &w);
+    if (w.tx) _BRBench(BENCH_WALLET_NAME("sign_tx"), 0, _BRBenchWalletSignTx, &w);
+    if (w.tx) BRTransactionFree(w.tx);
+    _BRBenchWalletFree(&w);
+    _BRBenchSync(BENCH_WALLET_NAME("sync"), &w, 0);
+    _BRBenchSync(BENCH_WALLET_NAME("rescan"), &w, 1);
+#undef BENCH_WALLET_NAME
+
+    for (i = 0; i < cfg.txCount; i++) BRTransactionFree(w.txs[i]);
+    free(w.txs);
+    free(w.copies);
+    free(w.unconfirmed);
+}
+
+#if BENCH_ETHEREUM
+static void _BRBenchRlpEncode(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+
+    for (size_t i = 0; i < n; i++) {
+        BRRlpCoder coder = rlpCoderCreate();
+        BRRlpItem item = rlpEncodeList(coder, 6, rlpEncodeItemUInt64(coder, i, 0),
+                                       rlpEncodeItemUInt64(coder, 20000000000, 0), rlpEncodeItemUInt64(coder, 21000, 0),
+                                       rlpEncodeItemBytes(coder, b->data, 20),
+                                       rlpEncodeItemUInt256(coder, UInt256Get(b->data), 0),
+                                       rlpEncodeItemBytes(coder, b->data, 68)); // an erc20 transfer call
+        BRRlpData data;
+
+        rlpDataExtract(coder, item, &data.bytes, &data.bytesCount);
+        _benchSink += data.bytesCount;
+        rlpDataRelease(data);
+        rlpCoderRelease(coder);
+    }
+}
+
+static void _BRBenchRlpDecode(void *info, size_t n)
+{
+    BRBenchBuf *b = info;
+    BRRlpData data = { b->dataLen, b->data };
+
+    for (size_t i = 0; i < n; i++) {
+        BRRlpCoder coder = rlpCoderCreate();
+        size_t count = 0;
+        const BRRlpItem *items = rlpDecodeList(coder, rlpGetItem(coder, data), &count);
+
+        _benchSink += rlpDecodeItemUInt64(coder, items[0], 0) + rlpDecodeItemUInt64(coder, items[2], 0);
+        rlpCoderRelease(coder);
+    }
+}
+#endif
+
+// runs every benchmark whose name contains filter (or all of them if filter is NULL), taking reps samples of each, or
+// a default number of samples if reps is 0
+// returns the number of benchmarks run
+int BRRunBenchmarks(const char *filter, unsigned reps)
+{
+    static BRBenchBuf buf;
+    BRBenchKey key;
+    BRBenchAddr addr;
+    BRBenchTx tx;
+    BRBenchBlock block;
+    BRBenchBloom bloom;
+    BRBenchSet set;
+    UInt512 seed;
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    size_t i, sizes[] = { 32, 1024, 16*1024 };
+
+    _benchFilter = filter;
+    _benchCount = 0;
+    _benchReps = (reps == 0) ? BENCH_DEFAULT_REPS : (reps > BENCH_MAX_REPS) ? BENCH_MAX_REPS : reps;
+    for (i = 0; i < sizeof(buf.data); i++) buf.data[i] = (uint8_t)(i*0x9e3779b1 >> 24);
+
+    for (i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        buf.dataLen = sizes[i]; // for sipHash, the 16 bytes following the data are the key
+        _BRBenchSized("sha1", _BRBenchSHA1, &buf);
+        _BRBenchSized("sha256", _BRBenchSHA256, &buf);
+        _BRBenchSized("sha256_2", _BRBenchSHA256_2, &buf);
+        _BRBenchSized("sha512", _BRBenchSHA512, &buf);
+        _BRBenchSized("rmd160", _BRBenchRMD160, &buf);
+        _BRBenchSized("hash160", _BRBenchHash160, &buf);
+        _BRBenchSized("sha3_256", _BRBenchSHA3_256, &buf);
+        _BRBenchSized("keccak256", _BRBenchKeccak256, &buf);
+        _BRBenchSized("md5", _BRBenchMD5, &buf);
+        _BRBenchSized("murmur3_32", _BRBenchMurmur3, &buf);
+        _BRBenchSized("sip64", _BRBenchSip64, &buf);
+        _BRBenchSized("hmac_sha256", _BRBenchHMACSHA256, &buf);
+        _BRBenchSized("hmac_sha512", _BRBenchHMACSHA512, &buf);
+        _BRBenchSized("poly1305", _BRBenchPoly1305, &buf);
+        _BRBenchSized("chacha20poly1305", _BRBenchChacha20Poly1305, &buf);
+    }
+
+    _BRBench("pbkdf2_sha512_2048", 0, _BRBenchPBKDF2, NULL);
+    _BRBench("scrypt_16384_8_1", 0, _BRBenchScrypt, NULL);
+
+    BRKeySetSecret(&key.key, &secret, 1);
+    BRSHA256(&key.md, buf.data, 32);
+    key.sigLen = BRKeySign(&key.key, key.sig, sizeof(key.sig), key.md);
+    BRSHA512(&key.seed, buf.data, 32);
+    key.mpk = BRBIP32MasterPubKey(&key.seed, sizeof(key.seed));
+    _BRBench("key_sign", 0, _BRBenchKeySign, &key);
+    _BRBench("key_verify", 0, _BRBenchKeyVerify, &key);
+    _BRBench("key_pubkey", 0, _BRBenchKeyPubKey, &key);
+    _BRBench("bip32_pubkey", 0, _BRBenchBIP32PubKey, &key);
+    _BRBench("bip32_privkey", 0, _BRBenchBIP32PrivKey, &key);
+
+    addr.payload[0] = 0; // an address payload with its checksum
+    BRHash160(&addr.payload[1], buf.data, 33);
+    BRSHA256_2(&addr.payload[21], addr.payload, 21);
+    BRBase58Encode(addr.base58, sizeof(addr.base58), addr.payload, sizeof(addr.payload));
+    addr.program[0] = OP_0, addr.program[1] = 20;
+    memcpy(&addr.program[2], &addr.payload[1], 20);
+    BRBech32Encode(addr.bech32, "bc", addr.program);
+    _BRBench("base58_encode_25", 25, _BRBenchBase58Encode, &addr);
+    _BRBench("base58_decode_25", 25, _BRBenchBase58Decode, &addr);
+    _BRBench("base58check_decode_25", 25, _BRBenchBase58CheckDecode, &addr);
+    _BRBench("bech32_encode_p2wpkh", 22, _BRBenchBech32Encode, &addr);
+    _BRBench("bech32_decode_p2wpkh", 22, _BRBenchBech32Decode, &addr);
+
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.base58)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.base58);
+    char keyAddr[75];
+
+    BRKeyAddress(&key.key, keyAddr, sizeof(keyAddr));
+
+    uint8_t inScript[BRAddressScriptPubKey(NULL, 0, keyAddr)];
+    size_t inScriptLen = BRAddressScriptPubKey(inScript, sizeof(inScript), keyAddr);
+
+    tx.key = key.key;
+    tx.tx = BRTransactionNew(); // a typical two input, two output payment
+    BRTransactionAddInput(tx.tx, key.md, 0, 100000, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddInput(tx.tx, key.md, 1, 100000, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx.tx, 150000, script, scriptLen);
+    BRTransactionAddOutput(tx.tx, 40000, inScript, inScriptLen);
+    BRTransactionSign(tx.tx, 0, &tx.key, 1);
+    tx.bufLen = BRTransactionSerialize(tx.tx, tx.buf, sizeof(tx.buf));
+    _BRBench("tx_parse", tx.bufLen, _BRBenchTxParse, &tx);
+    _BRBench("tx_serialize", tx.bufLen, _BRBenchTxSerialize, &tx);
+    _BRBench("tx_sign_2in", 0, _BRBenchTxSign, &tx);
+    BRTransactionFree(tx.tx);
+
+    const char blockHex[] = // block 10001 filtered to include only transactions 0, 1, 2, and 6
+    "\x01\x00\x00\x00\x06\xe5\x33\xfd\x1a\xda\x86\x39\x1f\x3f\x6c\x34\x32\x04\xb0\xd2\x78\xd4\xaa\xec\x1c"
+    "\x0b\x20\xaa\x27\xba\x03\x00\x00\x00\x00\x00\x6a\xbb\xb3\xeb\x3d\x73\x3a\x9f\xe1\x89\x67\xfd\x7d\x4c\x11\x7e\x4c"
+    "\xcb\xba\xc5\xbe\xc4\xd9\x10\xd9\x00\xb3\xae\x07\x93\xe7\x7f\x54\x24\x1b\x4d\x4c\x86\x04\x1b\x40\x89\xcc\x9b\x0c"
+    "\x00\x00\x00\x08\x4c\x30\xb6\x3c\xfc\xdc\x2d\x35\xe3\x32\x94\x21\xb9\x80\x5e\xf0\xc6\x56\x5d\x35\x38\x1c\xa8\x57"
+    "\x76\x2e\xa0\xb3\xa5\xa1\x28\xbb\xca\x50\x65\xff\x96\x17\xcb\xcb\xa4\x5e\xb2\x37\x26\xdf\x64\x98\xa9\xb9\xca\xfe"
+    "\xd4\xf5\x4c\xba\xb9\xd2\x27\xb0\x03\x5d\xde\xfb\xbb\x15\xac\x1d\x57\xd0\x18\x2a\xae\xe6\x1c\x74\x74\x3a\x9c\x4f"
+    "\x78\x58\x95\xe5\x63\x90\x9b\xaf\xec\x45\xc9\xa2\xb0\xff\x31\x81\xd7\x77\x06\xbe\x8b\x1d\xcc\x91\x11\x2e\xad\xa8"
+    "\x6d\x42\x4e\x2d\x0a\x89\x07\xc3\x48\x8b\x6e\x44\xfd\xa5\xa7\x4a\x25\xcb\xc7\xd6\xbb\x4f\xa0\x42\x45\xf4\xac\x8a"
+    "\x1a\x57\x1d\x55\x37\xea\xc2\x4a\xdc\xa1\x45\x4d\x65\xed\xa4\x46\x05\x54\x79\xaf\x6c\x6d\x4d\xd3\xc9\xab\x65\x84"
+    "\x48\xc1\x0b\x69\x21\xb7\xa4\xce\x30\x21\xeb\x22\xed\x6b\xb6\xa7\xfd\xe1\xe5\xbc\xc4\xb1\xdb\x66\x15\xc6\xab\xc5"
+    "\xca\x04\x21\x27\xbf\xaf\x9f\x44\xeb\xce\x29\xcb\x29\xc6\xdf\x9d\x05\xb4\x7f\x35\xb2\xed\xff\x4f\x00\x64\xb5\x78"
+    "\xab\x74\x1f\xa7\x82\x76\x22\x26\x51\x20\x9f\xe1\xa2\xc4\xc0\xfa\x1c\x58\x51\x0a\xec\x8b\x09\x0d\xd1\xeb\x1f\x82"
+    "\xf9\xd2\x61\xb8\x27\x3b\x52\x5b\x02\xff\x1a";
+
+    block.bufLen = sizeof(blockHex) - 1;
+    memcpy(block.buf, blockHex, block.bufLen);
+    block.block = BRMerkleBlockParse(block.buf, block.bufLen);
+    _BRBench("merkleblock_parse", block.bufLen, _BRBenchMerkleBlockParse, &block);
+    _BRBench("merkleblock_isvalid", 0, _BRBenchMerkleBlockIsValid, &block);
+    BRMerkleBlockFree(block.block);
+
+    bloom.elemCount = 10000;
+    bloom.elems = malloc(bloom.elemCount*sizeof(*bloom.elems));
+    bloom.filter = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, bloom.elemCount, 0, BLOOM_UPDATE_ALL);
+    for (i = 0; i < bloom.elemCount; i++) BRHash160(&bloom.elems[i], &i, sizeof(i));
+    _BRBench("bloom_insert_20", 20, _BRBenchBloomInsert, &bloom);
+    _BRBench("bloom_contains_20", 20, _BRBenchBloomContains, &bloom);
+    BRBloomFilterFree(bloom.filter);
+    free(bloom.elems);
+
+    set.itemCount = 10000;
+    set.items = malloc(set.itemCount*sizeof(*set.items));
+    set.set = BRSetNew(_BRBenchUInt256Hash, _BRBenchUInt256Eq, set.itemCount);
+    for (i = 0; i < set.itemCount; i++) BRSHA256(&set.items[i], &i, sizeof(i));
+    _BRBench("set_add_remove_10k", 0, _BRBenchSetAddRemove, &set);
+    for (i = 0; i < set.itemCount; i++) BRSetAdd(set.set, &set.items[i]);
+    _BRBench("set_get_10k", 0, _BRBenchSetGet, &set);
+    BRSetFree(set.set);
+    free(set.items);
+
+    BRSHA512(&seed, buf.data, 64);
+
+    if (_benchWallet.txCount > 0) _BRBenchWallet("wallet", _benchWallet, &seed);
+    else {
+        _BRBenchWallet("wallet", (BRBenchWalletConfig) { 1000, 100, 1000, 0.01 }, &seed);
+        _BRBenchWallet("wallet", (BRBenchWalletConfig) { 10000, 1000, 20000, 0.01 }, &seed);
+    }
+
+#if BENCH_ETHEREUM
+    _BRBench("rlp_encode_tx", 0, _BRBenchRlpEncode, &buf);
+
+    BRRlpCoder coder = rlpCoderCreate();
+    BRRlpItem item = rlpEncodeList(coder, 6, rlpEncodeItemUInt64(coder, 1, 0),
+                                   rlpEncodeItemUInt64(coder, 20000000000, 0), rlpEncodeItemUInt64(coder, 21000, 0),
+                                   rlpEncodeItemBytes(coder, buf.data, 20),
+                                   rlpEncodeItemUInt256(coder, UInt256Get(buf.data), 0),
+                                   rlpEncodeItemBytes(coder, buf.data, 68));
+    BRRlpData data;
+
+    rlpDataExtract(coder, item, &data.bytes, &data.bytesCount);
+    memcpy(buf.data, data.bytes, data.bytesCount);
+    buf.dataLen = data.bytesCount;
+    rlpDataRelease(data);
+    rlpCoderRelease(coder);
+    _BRBench("rlp_decode_tx", buf.dataLen, _BRBenchRlpDecode, &buf);
+#endif
+
+    return _benchCount;
+}
+
+#ifndef BITCOIN_BENCH_NO_MAIN
+// library log messages go to stderr, keeping stdout to result lines
+static void _BRBenchLogSink(void *info, BRLogLevel level, double timestamp, const char *message)
+{
+    fprintf(stderr, "%s\n", message);
+}
+
+// usage: bench [-v] [-r reps] [-w txCount[,utxoCount[,depth[,unconfirmedFraction]]]] [filter]
+// library warnings and errors are logged to stderr, or with -v, all library log messages
+int main(int argc, const char *argv[])
+{
+    const char *filter = NULL;
+    unsigned reps = 0;
+    char *s;
+
+    BRLogSetSink(NULL, _BRBenchLogSink);
+    BRLogSetLevel(BRLogLevelWarning);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) BRLogSetLevel(BRLogLevelDebug);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) reps = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            _benchWallet.txCount = strtoul(argv[++i], &s, 10);
+            _benchWallet.utxoCount = (*s == ',') ? strtoul(s + 1, &s, 10) : _benchWallet.txCount/10;
+            _benchWallet.depth = (*s == ',') ? (uint32_t)strtoul(s + 1, &s, 10) : (uint32_t)_benchWallet.txCount;
+            _benchWallet.unconfirmed = (*s == ',') ? strtod(s + 1, &s) : 0.01;
+        }
+        else filter = argv[i];
+    }
+
+    return (BRRunBenchmarks(filter, reps) > 0) ? 0 : 1;
+}
+#endif
@@ -25,6 +25,9 @@
 #include "BRCrypto.h"
 #include "BRBloomFilter.h"
 #include "BRMerkleBlock.h"
+#include "BRBlockFilter.h"
+#include "BRHeaderStore.h"
+#include "BRBlockCache.h"
 #include "BRWallet.h"
 #include "BRKey.h"
 #include "BRBIP38Key.h"
@@ -32,10 +35,13 @@
 #include "BRAddress.h"
 #include "BRBase58.h"
 #include "BRBech32.h"
+#include "bcash/BRBCashAddr.h"
 #include "BRBIP39Mnemonic.h"
 #include "BRBIP39WordsEn.h"
+#include "BRLog.h"
 #include "BRPeer.h"
 #include "BRPeerManager.h"
+#include "BRReplayPeer.h"
 #include "BRChainParams.h"
 #include "BRPaymentProtocol.h"
 #include "BRInt.h"
@@ -49,7 +55,9 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #define SKIP_BIP38 1
 
@@ -319,6 +327,30 @@ int BRBase58Tests()
     if (l5 != 21 || memcmp(s, b5, l5) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBase58CheckDecode() test 5\n", __func__);
 
+    if (strcmp(s3, "1111111111111111111114oLvT2") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBase58CheckEncode() test 3\n", __func__);
+    
+    uint8_t d[100], b6[100];
+    char s6[sizeof(d)*138/100 + 2];
+    
+    for (size_t i = 0; i < sizeof(d); i++) d[i] = (i % 7 == 0) ? 0 : (uint8_t)(i*0x9e3779b1 >> 24);
+    
+    for (size_t i = 0; i <= sizeof(d); i++) { // round trip every length, with and without leading zeroes
+        if (BRBase58Encode(s6, sizeof(s6), d, i) > 0 && BRBase58Decode(b6, sizeof(b6), s6) == i &&
+            memcmp(d, b6, i) == 0 && BRBase58Encode(s6, sizeof(s6), &d[1], i - (i > 0)) > 0 &&
+            BRBase58Decode(b6, sizeof(b6), s6) == i - (i > 0) && memcmp(&d[1], b6, i - (i > 0)) == 0) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBase58Encode() round trip test %zu\n", __func__, i);
+    }
+    
+    BRAddress addrs[3];
+    
+    memcpy(d, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 21);
+    memcpy(&d[21], "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\1", 21);
+    memcpy(&d[42], "\5\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 21);
+    if (BRBase58CheckEncodeBatch(addrs[0].s, sizeof(*addrs), d, 21, 3) != 3 || strcmp(addrs[0].s, s3) != 0 ||
+        strcmp(addrs[1].s, s4) != 0 || strcmp(addrs[2].s, s5) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBase58CheckEncodeBatch() test\n", __func__);
+
     return r;
 }
 
@@ -352,10 +384,55 @@ int BRBech32Tests()
     if (l == 0 || strcmp(addr, "bc1zw508d6qejxtdg4y5r3zarvaryvg6kdaj"))
         r = 0, fprintf(stderr, "\n***FAILED*** %s: BRBech32Encode() test 3", __func__);
 
+    uint8_t progs[3][42], d[3][42];
+    BRAddress addrs[3];
+
+    memcpy(progs[0], "\x00\x14\x75\x1e\x76\xe8\x19\x91\x96\xd4\x54\x94\x1c\x45\xd1\xb3\xa3\x23\xf1\x43\x3b\xd6", 22);
+    memcpy(progs[1], b, 20);
+    memcpy(progs[2], "\x51\x01\x00", 3); // program too short
+    if (BRBech32EncodeBatch(addrs[0].s, sizeof(*addrs), "bc", progs[0], sizeof(*progs), 3) != 2 ||
+        strcmp(addrs[0].s, "bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4") != 0 ||
+        strcmp(addrs[1].s, "bc1zw508d6qejxtdg4y5r3zarvaryvg6kdaj") != 0 || addrs[2].s[0] != '\0')
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRBech32EncodeBatch() test", __func__);
+
+    strcpy(addrs[2].s, "tb1qw508d6qejxtdg4y5r3zarvary0c5xw7kxpjzsx"); // different hrp
+    if (BRBech32DecodeBatch(d[0], sizeof(*d), "bc", addrs[0].s, sizeof(*addrs), 3) != 2 ||
+        memcmp(d[0], progs[0], 22) != 0 || memcmp(d[1], progs[1], 18) != 0 || d[2][1] != 0)
+        r = 0, fprintf(stderr, "\n***FAILED*** %s: BRBech32DecodeBatch() test", __func__);
+
     if (! r) fprintf(stderr, "\n                                    ");
     return r;
 }
 
+int BRBCashAddrTests()
+{
+    int r = 1;
+    BRAddress addrs[2], bchAddrs[2];
+    char addr[55];
+    
+    if (BRBCashAddrEncode(addr, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggu") == 0 ||
+        strcmp(addr, "bitcoincash:qpm2qsznhks23z7629mms6s4cwef74vcwvy22gdx6a") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBCashAddrEncode() test\n", __func__);
+    
+    if (BRBCashAddrDecode(addr, "BITCOINCASH:QPM2QSZNHKS23Z7629MMS6S4CWEF74VCWVY22GDX6A") == 0 ||
+        strcmp(addr, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggu") != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBCashAddrDecode() test\n", __func__);
+    
+    strcpy(addrs[0].s, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggu");
+    strcpy(addrs[1].s, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggv"); // bad checksum
+    if (BRBCashAddrEncodeBatch(bchAddrs[0].s, sizeof(*bchAddrs), addrs[0].s, sizeof(*addrs), 2) != 1 ||
+        strcmp(bchAddrs[0].s, "bitcoincash:qpm2qsznhks23z7629mms6s4cwef74vcwvy22gdx6a") != 0 ||
+        bchAddrs[1].s[0] != '\0')
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBCashAddrEncodeBatch() test\n", __func__);
+    
+    strcpy(bchAddrs[1].s, "qpm2qsznhks23z7629mms6s4cwef74vcwvy22gdx6a"); // no prefix
+    if (BRBCashAddrDecodeBatch(addrs[0].s, sizeof(*addrs), bchAddrs[0].s, sizeof(*bchAddrs), 2) != 2 ||
+        strcmp(addrs[0].s, "1BpEi6DfDAUFd7GtittLSdBeYJvcoaVggu") != 0 || strcmp(addrs[1].s, addrs[0].s) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBCashAddrDecodeBatch() test\n", __func__);
+    
+    return r;
+}
+
 int BRHashTests()
 {
     // test sha1
@@ -594,6 +671,17 @@ int BRHashTests()
     
     if (BRMurmur3_32("\x00", 1, 0) != 0x514e28b7)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMurmur3_32() test 4\n", __func__);
+
+    uint32_t seeds[11], mds[11];
+    size_t i;
+    
+    for (i = 0; i < 11; i++) seeds[i] = (uint32_t)i*0xfba4c795 + 0x5082edee;
+    BRMurmur3_32Multi(mds, seeds, 11, "\x21\x43\x65\x87\xFF\xFF\xFF", 7);
+    
+    for (i = 0; i < 11; i++) {
+        if (mds[i] == BRMurmur3_32("\x21\x43\x65\x87\xFF\xFF\xFF", 7, seeds[i])) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMurmur3_32Multi() test %zu\n", __func__, i);
+    }
     
     // test sipHash-64
 
@@ -2080,6 +2168,55 @@ static void walletTxDeleted(void *info, UInt256 txHash, int notifyUser, int reco
 // TODO: test tx ordering for multiple tx with same block height
 // TODO: port all applicable tests from bitcoinj and bitcoincore
 
+typedef struct {
+    size_t balanceChanges, updates;
+    uint64_t balance;
+    UInt256 hashes[4];
+    size_t hashCounts[4];
+    uint32_t heights[4], timestamps[4];
+} BRTestConfirm;
+
+static void _testConfirmBalanceChanged(void *info, uint64_t balance)
+{
+    BRTestConfirm *t = info;
+
+    t->balanceChanges++;
+    t->balance = balance;
+}
+
+static void _testConfirmTxUpdated(void *info, const UInt256 txHashes[], size_t txCount, uint32_t blockHeight,
+                                  uint32_t timestamp)
+{
+    BRTestConfirm *t = info;
+    size_t n = 0;
+
+    for (size_t i = 0; i < t->updates && i < 4; i++) n += t->hashCounts[i];
+
+    if (t->updates < 4) {
+        for (size_t i = 0; i < txCount && n + i < 4; i++) t->hashes[n + i] = txHashes[i];
+        t->hashCounts[t->updates] = txCount;
+        t->heights[t->updates] = blockHeight;
+        t->timestamps[t->updates] = timestamp;
+    }
+
+    t->updates++;
+}
+
+typedef struct {
+    BRWallet *wallet;
+    BRTransaction *tx;
+    int verified, pending;
+} BRTestTxStatus;
+
+static void *_testTxStatus(void *arg)
+{
+    BRTestTxStatus *t = arg;
+
+    t->verified = BRWalletTransactionIsVerified(t->wallet, t->tx);
+    t->pending = BRWalletTransactionIsPending(t->wallet, t->tx);
+    return NULL;
+}
+
 int BRWalletTests()
 {
     int r = 1;
@@ -2164,6 +2301,24 @@ int BRWalletTests()
 
     if (BRWalletAllAddrs(w, NULL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 1)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllAddrs() test\n", __func__);
+
+    if (BRWalletAllPKH(w, NULL, 0) != BRWalletAllAddrs(w, NULL, 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllPKH() test\n", __func__);
+
+    UInt160 pkh[SEQUENCE_GAP_LIMIT_EXTERNAL], recvPKH = UINT160_ZERO;
+    BRAddress addrs[SEQUENCE_GAP_LIMIT_EXTERNAL];
+
+    BRAddressHash160(&recvPKH, recvAddr.s);
+    if (! BRWalletContainsPKH(w, recvPKH) || BRWalletContainsPKH(w, UINT160_ZERO))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsPKH() test\n", __func__);
+
+    if (! BRWalletContainsScript(w, outScript, outScriptLen) || BRWalletContainsScript(w, inScript, inScriptLen))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsScript() test\n", __func__);
+
+    if (BRWalletUnusedPKH(w, pkh, SEQUENCE_GAP_LIMIT_EXTERNAL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL ||
+        BRWalletUnusedAddrs(w, addrs, SEQUENCE_GAP_LIMIT_EXTERNAL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL ||
+        ! BRAddressHash160(&recvPKH, addrs[0].s) || ! UInt160Eq(recvPKH, pkh[0]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUnusedPKH() test\n", __func__);
     
     UInt256 hash = tx->txHash;
 
@@ -2229,7 +2384,297 @@ int BRWalletTests()
 
     BRTransactionFree(tx);
     BRWalletFree(w);
-    
+
+    BRTransaction *parent = BRTransactionNew(), *child = BRTransactionNew();
+
+    w = BRWalletNew(NULL, 0, mpk, 0);
+    BRTransactionAddInput(parent, inHash, 2, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(parent, SATOSHIS - 1000, inScript, inScriptLen);
+    BRTransactionSign(parent, 0, &k, 1);
+    BRTransactionAddInput(child, parent->txHash, 0, SATOSHIS - 1000, inScript, inScriptLen, NULL, 0, NULL, 0,
+                          TXIN_SEQUENCE);
+    BRTransactionAddOutput(child, SATOSHIS - 3000, outScript, outScriptLen);
+    BRTransactionSign(child, 0, &k, 1);
+    BRWalletRegisterTransaction(w, child); // register before the non-wallet tx its input spends
+    if (BRWalletFeeForTx(w, child) != UINT64_MAX || BRWalletAmountReceivedFromTx(w, child) != SATOSHIS - 3000 ||
+        BRWalletBalanceAfterTx(w, child) != SATOSHIS - 3000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTx() test 1\n", __func__);
+
+    if (BRWalletRegisterTransaction(w, parent) || BRWalletFeeForTx(w, child) != 2000 ||
+        BRWalletAmountSentByTx(w, child) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTx() test 2\n", __func__);
+
+    BRWalletUpdateTransactions(w, &child->inputs[0].txHash, 1, 1000, 1); // confirmed non-wallet tx is freed
+    if (BRWalletFeeForTx(w, child) != UINT64_MAX || BRWalletBalanceAfterTx(w, child) != SATOSHIS - 3000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletFeeForTx() test 3\n", __func__);
+
+    if (BRWalletTransactionIsVerified(w, child))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 2\n", __func__);
+
+    BRWalletUpdateTransactions(w, &child->txHash, 1, TX_UNCONFIRMED, 1);
+    if (! BRWalletTransactionIsVerified(w, child))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 3\n", __func__);
+
+    BRTransaction *grandchild = BRTransactionNew();
+
+    tx = BRTransactionNew();
+    BRTransactionAddInput(tx, child->txHash, 0, SATOSHIS - 3000, outScript, outScriptLen, NULL, 0, NULL, 0,
+                          TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS - 5000, outScript, outScriptLen);
+    BRWalletSignTransaction(w, tx, &seed, sizeof(seed));
+    BRTransactionAddInput(grandchild, tx->txHash, 0, SATOSHIS - 5000, outScript, outScriptLen, NULL, 0, NULL, 0,
+                          TXIN_SEQUENCE);
+    BRTransactionAddOutput(grandchild, SATOSHIS - 7000, outScript, outScriptLen);
+    BRWalletSignTransaction(w, grandchild, &seed, sizeof(seed));
+    BRWalletRegisterTransaction(w, grandchild); // registered before the tx its input spends
+    BRWalletRegisterTransaction(w, tx);
+    if (BRWalletTransactions(w, NULL, 0) != 3 || BRWalletFeeForTx(w, grandchild) != 2000 ||
+        BRWalletBalanceAfterTx(w, grandchild) != SATOSHIS - 7000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRegisterTransaction() test 6\n", __func__);
+
+    BRTransaction *history[3];
+
+    BRWalletUpdateTransactions(w, &child->txHash, 1, 2000, 1);
+    if (BRWalletTransactions(w, history, 3) != 3 || history[0] != child || history[1] != tx ||
+        history[2] != grandchild || BRWalletTxUnconfirmedBefore(w, history, 3, 2001) != 2 || history[0] != tx)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 4\n", __func__);
+
+    BRHistoryQuery query = WALLET_HISTORY_ALL;
+    BRHistoryCursor cursor = WALLET_HISTORY_START;
+
+    if (BRWalletHistory(w, &query, &cursor, history, 2) != 2 || history[0] != child || history[1] != tx ||
+        BRWalletHistory(w, &query, &cursor, history, 2) != 1 || history[0] != grandchild ||
+        BRWalletHistory(w, &query, &cursor, history, 2) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletHistory() test 1\n", __func__);
+
+    query.newestFirst = 1, cursor = BRWalletHistoryCursor(w, 1, 1);
+    if (BRWalletHistory(w, &query, &cursor, history, 3) != 2 || history[0] != tx || history[1] != child)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletHistory() test 2\n", __func__);
+
+    query = WALLET_HISTORY_ALL, query.fromHeight = query.toHeight = 2000, cursor = WALLET_HISTORY_START;
+    if (BRWalletHistory(w, &query, &cursor, history, 3) != 1 || history[0] != child)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletHistory() test 3\n", __func__);
+
+    query = WALLET_HISTORY_ALL, query.kinds = WALLET_HISTORY_SENT, cursor = WALLET_HISTORY_START;
+    if (BRWalletHistory(w, &query, &cursor, history, 3) != 2 || history[0] != tx || history[1] != grandchild ||
+        (cursor = BRWalletHistoryCursor(w, 2, 0), BRWalletHistory(w, &query, &cursor, history, 3)) != 1 ||
+        history[0] != grandchild)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletHistory() test 4\n", __func__);
+
+    query.kinds = WALLET_HISTORY_RECEIVED, query.fromTime = 1, cursor = WALLET_HISTORY_START;
+    if (BRWalletHistory(w, &query, &cursor, history, 3) != 1 || history[0] != child)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletHistory() test 5\n", __func__);
+
+    uint64_t unconfirmed = 0;
+
+    if (BRWalletAddressTransactions(w, recvAddr.s, NULL, 0) != 3 ||
+        BRWalletAddressTransactions(w, recvAddr.s, history, 2) != 2 || history[0] != child || history[1] != tx ||
+        BRWalletAddressTransactions(w, addr.s, NULL, 0) != 0) // the confirmed non-wallet parent was freed
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAddressTransactions() test 1\n", __func__);
+
+    if (BRWalletAddressBalance(w, recvAddr.s, &unconfirmed) != SATOSHIS - 7000 || unconfirmed != SATOSHIS - 7000 ||
+        BRWalletAddressBalance(w, addr.s, NULL) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAddressBalance() test 1\n", __func__);
+
+    BRTxConfirmation confirmations[] = { { &tx->txHash, 1, 2001, 2 }, { &inHash, 1, 2001, 2 },
+                                         { &grandchild->txHash, 1, 2002, 3 } };
+
+    BRWalletConfirmTransactions(w, confirmations, sizeof(confirmations)/sizeof(*confirmations));
+    if (tx->blockHeight != 2001 || grandchild->blockHeight != 2002 || grandchild->timestamp != 3 ||
+        BRWalletTransactions(w, history, 3) != 3 || history[1] != tx || history[2] != grandchild ||
+        BRWalletTxUnconfirmedBefore(w, history, 3, 2002) != 1 || history[0] != grandchild ||
+        BRWalletBalance(w) != SATOSHIS - 7000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 1\n", __func__);
+
+    BRWalletRemoveTransaction(w, child->txHash); // removes the whole spend tree with a single rebalance
+    if (BRWalletTransactions(w, NULL, 0) != 0 || BRWalletBalance(w) != 0 ||
+        BRWalletBalanceAfterTx(w, grandchild) != 0 || BRWalletAddressTransactions(w, recvAddr.s, NULL, 0) != 0 ||
+        BRWalletAddressBalance(w, recvAddr.s, NULL) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test 2\n", __func__);
+
+    BRWalletFree(w);
+
+    // a lattice of pairs of transactions, each spending one output of both transactions in the pair before it, has
+    // exponentially many spend graph paths from its root, registered last pair first so each is registered out of order
+    BRTransaction *lattice[1 + 2*30];
+    UInt256 latticeHashes[sizeof(lattice)/sizeof(*lattice)];
+    size_t n = sizeof(lattice)/sizeof(*lattice);
+
+    w = BRWalletNew(NULL, 0, mpk, 0);
+    lattice[0] = BRTransactionNew();
+    BRTransactionAddInput(lattice[0], inHash, 3, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(lattice[0], 100000, outScript, outScriptLen);
+    BRTransactionAddOutput(lattice[0], 100000, outScript, outScriptLen);
+    BRTransactionSign(lattice[0], 0, &k, 1);
+
+    for (size_t i = 1; i < n; i++) {
+        uint32_t m = (i - 1) & 1; // which output of the previous pair to spend
+
+        lattice[i] = BRTransactionNew();
+
+        for (size_t j = (i < 3) ? 0 : i - 2 - m; j < ((i < 3) ? 1 : i - m); j++) {
+            BRTransactionAddInput(lattice[i], lattice[j]->txHash, m, 100000, outScript, outScriptLen, NULL, 0, NULL, 0,
+                                  TXIN_SEQUENCE);
+        }
+
+        BRTransactionAddOutput(lattice[i], 100000, outScript, outScriptLen);
+        BRTransactionAddOutput(lattice[i], 100000, outScript, outScriptLen);
+        BRWalletSignTransaction(w, lattice[i], &seed, sizeof(seed));
+    }
+
+    for (size_t i = n; i > 0; i--) {
+        BRWalletRegisterTransaction(w, lattice[i - 1]);
+        latticeHashes[i - 1] = lattice[i - 1]->txHash;
+    }
+
+    BRWalletUpdateTransactions(w, latticeHashes, n, TX_UNCONFIRMED, 1);
+    if (BRWalletTransactions(w, NULL, 0) != n || ! BRWalletTransactionIsVerified(w, lattice[n - 1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 4\n", __func__);
+
+    BRWalletUpdateTransactions(w, latticeHashes, 1, 1000, 1); // invalidates the memoized status of the whole lattice
+    if (! BRWalletTransactionIsVerified(w, lattice[n - 1]) || BRWalletTransactionIsPending(w, lattice[n - 1]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 5\n", __func__);
+
+    BRTransaction *sorted[sizeof(lattice)/sizeof(*lattice)];
+
+    // confirming the root leaves each unconfirmed pair after the pair it spends, whatever the order they arrived in
+    if (BRWalletTransactions(w, sorted, n) != n || sorted[0] != lattice[0]) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 5\n", __func__);
+    }
+    else {
+        for (size_t i = 1; i < n; i++) {
+            if (sorted[i] == lattice[i] || sorted[i] == lattice[((i - 1) ^ 1) + 1]) continue;
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactions() test 5\n", __func__);
+            break;
+        }
+    }
+
+    BRWalletFree(w);
+
+    // a tx paying an address past the gap limit is sorted by that address's chain index once it's generated
+    BRWallet *gen = BRWalletNew(NULL, 0, mpk, 0);
+    BRAddress ahead[50];
+    BRTransaction *far = BRTransactionNew(), *near = BRTransactionNew();
+
+    BRWalletUnusedAddrs(gen, ahead, 50, 0);
+    w = BRWalletNew(NULL, 0, mpk, 0);
+    BRTransactionAddInput(far, inHash, 4, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddInput(near, inHash, 5, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+
+    for (size_t i = 0; i < 3; i++) { // far pays external addresses 0 and 45, near pays address 5
+        uint8_t script[BRAddressScriptPubKey(NULL, 0, ahead[(i == 2) ? 5 : i*45].s)];
+        size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), ahead[(i == 2) ? 5 : i*45].s);
+
+        BRTransactionAddOutput((i < 2) ? far : near, 10000, script, scriptLen);
+    }
+
+    BRTransactionSign(far, 0, &k, 1);
+    BRTransactionSign(near, 0, &k, 1);
+    BRWalletRegisterTransaction(w, far);
+    BRWalletRegisterTransaction(w, near);
+    if (BRWalletTransactions(w, history, 2) != 2 || history[0] != far || history[1] != near ||
+        BRWalletAmountReceivedFromTx(w, far) != 10000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUnusedAddrs() history test 1\n", __func__);
+
+    BRWalletUnusedAddrs(w, NULL, 50, 0);
+    if (BRWalletTransactions(w, history, 2) != 2 || history[0] != near || history[1] != far ||
+        BRWalletAmountReceivedFromTx(w, far) != 20000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUnusedAddrs() history test 2\n", __func__);
+
+    query = WALLET_HISTORY_ALL, cursor = WALLET_HISTORY_START;
+    if (BRWalletHistory(w, &query, &cursor, history, 3) != 2 || history[0] != near || history[1] != far)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUnusedAddrs() history test 3\n", __func__);
+
+    BRWalletFree(w);
+    BRWalletFree(gen);
+
+    // the status of a tx at the end of a long chain of unconfirmed transactions is found without recursing down the
+    // chain, so it works on a thread with a small stack
+    BRTransaction *chain[5000];
+    BRTestTxStatus status = { NULL, NULL, 0, 1 };
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    for (size_t i = 0; i < sizeof(chain)/sizeof(*chain); i++) {
+        chain[i] = BRTransactionNew();
+        BRTransactionAddInput(chain[i], (i == 0) ? inHash : chain[i - 1]->txHash, (i == 0) ? 6 : 0, SATOSHIS,
+                              inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(chain[i], SATOSHIS, inScript, inScriptLen);
+        BRTransactionAddOutput(chain[i], 10000, outScript, outScriptLen);
+        chain[i]->timestamp = 1;
+        BRTransactionSign(chain[i], 0, &k, 1);
+    }
+
+    status.wallet = w = BRWalletNew(chain, sizeof(chain)/sizeof(*chain), mpk, 0);
+    status.tx = chain[sizeof(chain)/sizeof(*chain) - 1];
+
+    if (! w || pthread_attr_init(&attr) != 0 || pthread_attr_setstacksize(&attr, 64*1024) != 0 ||
+        pthread_create(&thread, &attr, _testTxStatus, &status) != 0) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 6\n", __func__);
+    }
+    else {
+        pthread_join(thread, NULL);
+        if (! status.verified || status.pending)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsVerified() test 6\n", __func__);
+    }
+
+    pthread_attr_destroy(&attr);
+    if (w) BRWalletFree(w);
+
+    // several confirmation groups in one call, one of them only an unknown hash and another with an unknown hash among
+    // wallet transactions, make one balanceChanged() and one txUpdated() for each group that changed something
+    BRTransaction *rbf = BRTransactionNew(), *locked = BRTransactionNew(), *spendable = BRTransactionNew();
+    UInt256 unknownHash = uint256("00000000000000000000000000000000000000000000000000000000000000ff"),
+            groupHashes[4];
+    BRTestConfirm confirm;
+
+    memset(&confirm, 0, sizeof(confirm));
+    w = BRWalletNew(NULL, 0, mpk, 0);
+    BRTransactionAddInput(rbf, inHash, 7, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE - 2);
+    BRTransactionAddOutput(rbf, 10000, outScript, outScriptLen);
+    BRTransactionAddInput(locked, inHash, 8, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE - 1);
+    BRTransactionAddOutput(locked, 20000, outScript, outScriptLen);
+    locked->lockTime = (uint32_t)time(NULL) + 24*60*60;
+    BRTransactionAddInput(spendable, inHash, 9, SATOSHIS, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(spendable, 30000, outScript, outScriptLen);
+    BRTransactionSign(rbf, 0, &k, 1);
+    BRTransactionSign(locked, 0, &k, 1);
+    BRTransactionSign(spendable, 0, &k, 1);
+    BRWalletRegisterTransaction(w, rbf);
+    BRWalletRegisterTransaction(w, locked);
+    BRWalletRegisterTransaction(w, spendable);
+    BRWalletSetCallbacks(w, &confirm, _testConfirmBalanceChanged, NULL, _testConfirmTxUpdated, NULL);
+    if (BRWalletBalance(w) != 30000) // the pending transactions don't count yet
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 2\n", __func__);
+
+    groupHashes[0] = rbf->txHash, groupHashes[1] = unknownHash;
+    groupHashes[2] = locked->txHash, groupHashes[3] = spendable->txHash;
+
+    BRTxConfirmation groups[] = { { &groupHashes[0], 1, 3000, 30 }, { &groupHashes[1], 1, 3001, 31 },
+                                  { &groupHashes[1], 3, 3002, 32 } };
+
+    BRWalletConfirmTransactions(w, groups, sizeof(groups)/sizeof(*groups));
+    if (confirm.balanceChanges != 1 || confirm.balance != 60000 || BRWalletBalance(w) != 60000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 3\n", __func__);
+
+    if (confirm.updates != 2 || confirm.hashCounts[0] != 1 || ! UInt256Eq(confirm.hashes[0], rbf->txHash) ||
+        confirm.heights[0] != 3000 || confirm.timestamps[0] != 30 || confirm.hashCounts[1] != 2 ||
+        ! UInt256Eq(confirm.hashes[1], locked->txHash) || ! UInt256Eq(confirm.hashes[2], spendable->txHash) ||
+        confirm.heights[1] != 3002 || confirm.timestamps[1] != 32)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 4\n", __func__);
+
+    if (rbf->blockHeight != 3000 || rbf->timestamp != 30 || locked->blockHeight != 3002 || locked->timestamp != 32 ||
+        spendable->blockHeight != 3002 || spendable->timestamp != 32 || BRWalletTransactions(w, history, 3) != 3 ||
+        history[0] != rbf || BRWalletTransactionForHash(w, unknownHash) != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 5\n", __func__);
+
+    memset(&confirm, 0, sizeof(confirm));
+    BRWalletConfirmTransactions(w, groups, sizeof(groups)/sizeof(*groups)); // nothing left to change
+    if (confirm.balanceChanges != 0 || confirm.updates != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletConfirmTransactions() test 6\n", __func__);
+
+    BRWalletFree(w);
+
     amt = BRBitcoinAmount(50000, 50000);
     if (amt != SATOSHIS) r = 0, fprintf(stderr, "***FAILED*** %s: BRBitcoinAmount() test 1\n", __func__);
 
@@ -2316,6 +2761,39 @@ int BRBloomFilterTests()
     if (len2 != sizeof(d2) - 1 || memcmp(buf2, d2, len2) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterSerialize() test 2\n", __func__);
     
+    BRBloomFilterFree(f);
+    f = BRBloomFilterNew(0.01, 3, 0, BLOOM_UPDATE_ALL);
+
+    uint8_t elems[60];
+
+    memcpy(elems, data1, 20), memcpy(&elems[20], data3, 20), memcpy(&elems[40], data1, 20);
+    if (BRBloomFilterInsertElements(f, elems, 20, 3) != 2 || f->elemCount != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterInsertElements() test 1\n", __func__);
+
+    BRBloomFilterInsertData(f, (uint8_t *)data4, sizeof(data4) - 1);
+    len1 = BRBloomFilterSerialize(f, buf1, sizeof(buf1));
+    
+    if (len1 != sizeof(d1) - 1 || memcmp(buf1, d1, len1) != 0) // same filter as inserting one at a time
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterInsertElements() test 2\n", __func__);
+    
+    BRBloomFilterFree(f);
+    f = BRBloomFilterNew(0.001, 1000, 0, BLOOM_UPDATE_ALL);
+
+    double fpRate[3];
+    UInt256 elem = UINT256_ZERO;
+
+    for (uint32_t i = 0; i < 2000; i++) {
+        if (i == 500 || i == 1000) fpRate[i/1000] = BRBloomFilterFalsePositiveRate(f);
+        elem.u32[0] = i;
+        BRBloomFilterInsertData(f, elem.u8, sizeof(elem));
+    }
+
+    fpRate[2] = BRBloomFilterFalsePositiveRate(f);
+
+    // the rate the filter was sized for is reached at the element count it was sized for, and exceeded past it
+    if (fpRate[0] >= 0.001 || fpRate[1] < 0.0005 || fpRate[1] > 0.002 || fpRate[2] < 0.01)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBloomFilterFalsePositiveRate() test\n", __func__);
+
     BRBloomFilterFree(f);
     return r;
 }
@@ -2337,6 +2815,26 @@ static int BRMerkleBlockEqual (const BRMerkleBlock *block1, const BRMerkleBlock
            && block1->height == block2->height;
 }
 
+typedef struct {
+    BRHeaderParser *parser;
+    const uint8_t *buf;
+    size_t validCount;
+} BRTestParse;
+
+static void *_testParseHeaders(void *arg)
+{
+    BRTestParse *p = arg;
+    BRMerkleBlock *headers = calloc(1000, sizeof(*headers));
+
+    for (int i = 0; i < 20; i++) {
+        p->validCount = BRMerkleBlockParseHeaders(headers, 1000, p->buf, 81, (uint32_t)time(NULL), p->parser);
+        if (p->validCount != 600) break;
+    }
+
+    free(headers);
+    return NULL;
+}
+
 int BRMerkleBlockTests()
 {
     int r = 1;
@@ -2355,7 +2853,7 @@ int BRMerkleBlockTests()
     "\xab\x74\x1f\xa7\x82\x76\x22\x26\x51\x20\x9f\xe1\xa2\xc4\xc0\xfa\x1c\x58\x51\x0a\xec\x8b\x09\x0d\xd1\xeb\x1f\x82"
     "\xf9\xd2\x61\xb8\x27\x3b\x52\x5b\x02\xff\x1a";
     uint8_t block2[sizeof(block) - 1];
-    BRMerkleBlock *b;
+    BRMerkleBlock *b, *c;
     
     b = BRMerkleBlockParse((uint8_t *)block, sizeof(block) - 1);
     
@@ -2370,6 +2868,55 @@ int BRMerkleBlockTests()
         memcmp(block, block2, sizeof(block2)) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockSerialize() test\n", __func__);
     
+    BRMerkleBlock h;
+    
+    if (! BRMerkleBlockParseHeader(&h, (uint8_t *)block, 80) || ! UInt256Eq(h.blockHash, b->blockHash) ||
+        ! UInt256Eq(h.merkleRoot, b->merkleRoot) || h.nonce != b->nonce || h.hashes != NULL || h.totalTx != 0 ||
+        ! BRMerkleBlockIsValid(&h, (uint32_t)time(NULL)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeader() test\n", __func__);
+    
+    uint8_t *headersBuf = calloc(1000, 81);
+    BRMerkleBlock *headers = calloc(1000, sizeof(*headers));
+    
+    for (int i = 0; i < 1000; i++) memcpy(&headersBuf[i*81], block, 80);
+    
+    BRHeaderParser *parser = BRHeaderParserNew(4);
+    
+    if (BRMerkleBlockParseHeaders(headers, 1000, headersBuf, 81, (uint32_t)time(NULL), parser) != 1000 ||
+        ! UInt256Eq(headers[999].blockHash, b->blockHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test 1\n", __func__);
+    
+    headersBuf[600*81 + 76] ^= 0xff; // break the proof-of-work of header 600
+    
+    if (BRMerkleBlockParseHeaders(headers, 1000, headersBuf, 81, (uint32_t)time(NULL), parser) != 600)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test 2\n", __func__);
+    
+    // the same pool serves later calls, and without one, or below the batch size threshold, headers are parsed inline
+    if (BRMerkleBlockParseHeaders(headers, 1000, headersBuf, 81, (uint32_t)time(NULL), parser) != 600 ||
+        BRMerkleBlockParseHeaders(headers, 1000, headersBuf, 81, (uint32_t)time(NULL), NULL) != 600 ||
+        BRMerkleBlockParseHeaders(headers, 400, headersBuf, 81, (uint32_t)time(NULL), parser) != 400)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test 3\n", __func__);
+    
+    BRTestParse parses[3];
+    pthread_t threads[3];
+    int started[3];
+    
+    for (int i = 0; i < 3; i++) { // any number of threads can share the pool
+        parses[i] = (BRTestParse) { parser, headersBuf, 0 };
+        started[i] = (pthread_create(&threads[i], NULL, _testParseHeaders, &parses[i]) == 0);
+    }
+    
+    for (int i = 0; i < 3; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        
+        if (! started[i] || parses[i].validCount != 600)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseHeaders() test 4\n", __func__);
+    }
+    
+    BRHeaderParserFree(parser);
+    free(headers);
+    free(headersBuf);
+    
     if (! BRMerkleBlockContainsTxHash(b, uint256("4c30b63cfcdc2d35e3329421b9805ef0c6565d35381ca857762ea0b3a5a128bb")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockContainsTxHash() test\n", __func__);
     
@@ -2392,13 +2939,39 @@ int BRMerkleBlockTests()
     if (! UInt256Eq(txHashes[3], uint256("c9ab658448c10b6921b7a4ce3021eb22ed6bb6a7fde1e5bcc4b1db6615c6abc5")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockTxHashes() test 4\n", __func__);
     
+    UInt256 allHashes[7];
+    int matches[7] = { 1, 0, 0, 0, 0, 0, 1 }, none[7] = { 0 };
+    
+    for (int i = 0; i < 7; i++) BRSHA256(&allHashes[i], &i, sizeof(i));
+    c = BRMerkleBlockNew();
+    BRMerkleBlockSetPartialTree(c, allHashes, none, 7);
+    
+    if (c->totalTx != 7 || c->hashesCount != 1 || BRMerkleBlockTxHashes(c, NULL, 0) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockSetPartialTree() test 1\n", __func__);
+    
+    // keep the proof-of-work of block 10001, but commit to the seven hashes above
+    c->blockHash = b->blockHash, c->target = b->target, c->timestamp = b->timestamp, c->merkleRoot = c->hashes[0];
+    BRMerkleBlockSetPartialTree(c, allHashes, matches, 7);
+    
+    if (! BRMerkleBlockIsValid(c, (uint32_t)time(NULL)) || BRMerkleBlockTxHashes(c, txHashes, 4) != 2 ||
+        ! UInt256Eq(txHashes[0], allHashes[0]) || ! UInt256Eq(txHashes[1], allHashes[6]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockSetPartialTree() test 2\n", __func__);
+    
+    allHashes[3].u8[0] ^= 1;
+    BRMerkleBlockSetPartialTree(c, allHashes, matches, 7);
+    
+    if (BRMerkleBlockIsValid(c, (uint32_t)time(NULL)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockSetPartialTree() test 3\n", __func__);
+    
+    BRMerkleBlockFree(c);
+    
     // TODO: test a block with an odd number of tree rows both at the tx level and merkle node level
 
     // TODO: XXX test BRMerkleBlockVerifyDifficulty()
     
     // TODO: test (CVE-2012-2459) vulnerability
 
-    BRMerkleBlock *c = BRMerkleBlockCopy(b);
+    c = BRMerkleBlockCopy(b);
 
     if (!BRMerkleBlockEqual(b, c))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockEqual() test 1\n", __func__);
@@ -2414,6 +2987,302 @@ int BRMerkleBlockTests()
     return r;
 }
 
+int BRBlockFilterTests()
+{
+    int r = 1;
+    const uint8_t script[] = // testnet genesis block coinbase output script, BIP158 test vector
+    "\x41\x04\x67\x8a\xfd\xb0\xfe\x55\x48\x27\x19\x67\xf1\xa6\x71\x30\xb7\x10\x5c\xd6\xa8\x28\xe0\x39\x09"
+    "\xa6\x79\x62\xe0\xea\x1f\x61\xde\xb6\x49\xf6\xbc\x3f\x4c\xef\x38\xc4\xf3\x55\x04\xe5\x1e\xc1\x12\xde"
+    "\x5c\x38\x4d\xf7\xba\x0b\x8d\x57\x8a\x4c\x70\x2b\x6b\xf1\x1d\x5f\xac";
+    const uint8_t *scripts[100];
+    size_t scriptLens[100];
+    uint8_t data[100][25], filter[1000];
+    UInt256 blockHash = UInt256Reverse(uint256("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"));
+    size_t len;
+    
+    scripts[0] = script;
+    scriptLens[0] = sizeof(script) - 1;
+    len = BRBlockFilterBuild(filter, sizeof(filter), blockHash, scripts, scriptLens, 1);
+    
+    if (len != 4 || memcmp(filter, "\x01\x9d\xfc\xa8", 4) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterBuild() test 1\n", __func__);
+    
+    if (! UInt256Eq(BRBlockFilterHeader(BRBlockFilterHash(filter, len), UINT256_ZERO),
+                    UInt256Reverse(uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterHeader() test\n", __func__);
+    
+    if (! BRBlockFilterMatchAny(filter, len, blockHash, scripts, scriptLens, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterMatchAny() test 1\n", __func__);
+    
+    for (int i = 0; i < 100; i++) { // pay-to-pubkey-hash scripts
+        memcpy(data[i], "\x76\xa9\x14", 3);
+        memset(&data[i][3], i, 20);
+        memcpy(&data[i][23], "\x88\xac", 2);
+        scripts[i] = data[i];
+        scriptLens[i] = sizeof(data[i]);
+    }
+    
+    len = BRBlockFilterBuild(filter, sizeof(filter), blockHash, scripts, scriptLens, 50);
+    
+    if (len != BRBlockFilterBuild(NULL, 0, blockHash, scripts, scriptLens, 50) || len < 1 + 50*20/8)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterBuild() test 2\n", __func__);
+    
+    for (int i = 0; i < 50; i++) {
+        if (! BRBlockFilterMatchAny(filter, len, blockHash, &scripts[i], &scriptLens[i], 1))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterMatchAny() test 2\n", __func__);
+    }
+    
+    if (BRBlockFilterMatchAny(filter, len, blockHash, &scripts[50], &scriptLens[50], 50))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterMatchAny() test 3\n", __func__);
+    
+    if (! BRBlockFilterMatchAny(filter, len, blockHash, &scripts[49], &scriptLens[49], 51))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterMatchAny() test 4\n", __func__);
+    
+    if (BRBlockFilterMatchAny(filter, len, UINT256_ZERO, scripts, scriptLens, 1)) // filters are keyed by block hash
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockFilterMatchAny() test 5\n", __func__);
+    
+    return r;
+}
+
+int BRHeaderStoreTests()
+{
+    int r = 1, fd;
+    char path[] = "/tmp/BRHeaderStoreTestsXXXXXX";
+    size_t i, count = 5000; // enough headers to grow the initial mapping
+    BRMerkleBlock *blocks = calloc(count, sizeof(*blocks)), b = BR_MERKLE_BLOCK_NONE;
+    uint8_t buf[80];
+    UInt256 work;
+    BRHeaderStore *store;
+    
+    for (i = 0; i < count; i++) {
+        blocks[i] = BR_MERKLE_BLOCK_NONE;
+        blocks[i].version = 1;
+        if (i > 0) blocks[i].prevBlock = blocks[i - 1].blockHash;
+        blocks[i].timestamp = 1231006505 + (uint32_t)i*600;
+        blocks[i].target = 0x1d00ffff;
+        blocks[i].nonce = (uint32_t)i;
+        blocks[i].height = 100 + (uint32_t)i;
+        BRMerkleBlockSerialize(&blocks[i], buf, sizeof(buf));
+        BRSHA256_2(&blocks[i].blockHash, buf, sizeof(buf));
+    }
+    
+    fd = mkstemp(path);
+    if (fd >= 0) close(fd);
+    store = (fd >= 0) ? BRHeaderStoreOpen(path) : NULL;
+    
+    if (! store) {
+        fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 0\n", __func__);
+        free(blocks);
+        return 0;
+    }
+    
+    if (BRHeaderStoreCount(store) != 0 || BRHeaderStoreLastHeight(store) != BLOCK_UNKNOWN_HEIGHT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 1\n", __func__);
+    
+    for (i = 0; i < count; i++) {
+        if (! BRHeaderStoreAppend(store, &blocks[i])) break;
+    }
+    
+    if (i != count || BRHeaderStoreCount(store) != count || BRHeaderStoreFirstHeight(store) != 100 ||
+        BRHeaderStoreLastHeight(store) != 100 + count - 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 1\n", __func__);
+    
+    if (BRHeaderStoreAppend(store, &blocks[3])) // must follow the last stored header
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 2\n", __func__);
+    
+    if (! BRHeaderStoreHeaderAtHeight(store, 105, &b) || ! UInt256Eq(b.blockHash, blocks[5].blockHash) ||
+        ! UInt256Eq(b.prevBlock, blocks[4].blockHash) || b.nonce != 5 || b.height != 105 || b.target != 0x1d00ffff)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreHeaderAtHeight() test 1\n", __func__);
+    
+    if (BRHeaderStoreHeaderAtHeight(store, 99, &b) || BRHeaderStoreHeaderAtHeight(store, 100 + count, &b))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreHeaderAtHeight() test 2\n", __func__);
+    
+    if (BRHeaderStoreHeightForHash(store, blocks[7].blockHash) != 107 ||
+        BRHeaderStoreHeightForHash(store, blocks[count - 1].blockHash) != 100 + count - 1 ||
+        BRHeaderStoreHeightForHash(store, UINT256_ZERO) != BLOCK_UNKNOWN_HEIGHT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreHeightForHash() test\n", __func__);
+    
+    work = BRHeaderStoreChainWork(store, 109); // difficulty 1 work is 0x100010001 per block
+    
+    if (UInt64GetLE(work.u8) != 10*0x100010001ULL || UInt64GetLE(&work.u8[8]) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreChainWork() test\n", __func__);
+    
+    if (! BRHeaderStoreTruncate(store, 108) || BRHeaderStoreLastHeight(store) != 107 ||
+        BRHeaderStoreHeightForHash(store, blocks[9].blockHash) != BLOCK_UNKNOWN_HEIGHT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreTruncate() test 1\n", __func__);
+    
+    if (! BRHeaderStoreAppend(store, &blocks[8]) || BRHeaderStoreLastHeight(store) != 108)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreAppend() test 3\n", __func__);
+    
+    BRHeaderStoreClose(store);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd >= 0 && write(fd, buf, sizeof(buf)) != sizeof(buf)) r = 0; // simulate a record torn by a crash
+    if (fd >= 0) close(fd);
+    store = BRHeaderStoreOpen(path);
+    
+    if (! store || BRHeaderStoreCount(store) != 9 || BRHeaderStoreLastHeight(store) != 108 ||
+        BRHeaderStoreHeightForHash(store, blocks[8].blockHash) != 108)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreOpen() test 2\n", __func__);
+    
+    if (store && (! BRHeaderStoreTruncate(store, 0) || BRHeaderStoreCount(store) != 0 ||
+                  BRHeaderStoreFirstHeight(store) != BLOCK_UNKNOWN_HEIGHT))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRHeaderStoreTruncate() test 2\n", __func__);
+    
+    if (store) BRHeaderStoreClose(store);
+    unlink(path);
+    free(blocks);
+    return r;
+}
+
+int BRBlockCacheTests()
+{
+    int r = 1, fd;
+    char path[] = "/tmp/BRBlockCacheTestsXXXXXX";
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001"),
+            inHash = uint256("0000000000000000000000000000000000000000000000000000000000000001"), hashes[2];
+    UInt160 e[3] = { UINT160_ZERO, UINT160_ZERO, UINT160_ZERO };
+    int matches[2] = { 1, 0 };
+    size_t i, txCount;
+    uint32_t filterId, filterId2;
+    uint8_t buf[80];
+    BRMerkleBlock *blocks[4], *b;
+    BRTransaction *tx = BRTransactionNew(), *txs[2];
+    BRBlockCache *cache;
+    BRKey k;
+    BRAddress address;
+
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyLegacyAddr(&k, address.s, sizeof(address));
+
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, address.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), address.s);
+
+    BRTransactionAddInput(tx, inHash, 0, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, 100000000, script, scriptLen);
+    BRTransactionSign(tx, 0, &k, 1);
+    hashes[0] = tx->txHash;
+    hashes[1] = inHash;
+    e[0].u8[0] = 1, e[1].u8[0] = 2, e[2].u8[0] = 3;
+
+    for (i = 0; i < 4; i++) {
+        blocks[i] = BRMerkleBlockNew();
+        blocks[i]->version = 1;
+        if (i > 0) blocks[i]->prevBlock = blocks[i - 1]->blockHash;
+        blocks[i]->timestamp = 1231006505 + (uint32_t)i*600;
+        blocks[i]->target = 0x1d00ffff;
+        blocks[i]->nonce = (uint32_t)i;
+        blocks[i]->height = 100 + (uint32_t)i;
+        BRMerkleBlockSerialize(blocks[i], buf, sizeof(buf));
+        BRSHA256_2(&blocks[i]->blockHash, buf, sizeof(buf));
+        if (i == 3) BRMerkleBlockSetPartialTree(blocks[i], hashes, matches, 2); // last block matched a tx
+    }
+
+    fd = mkstemp(path);
+    if (fd >= 0) close(fd);
+    cache = (fd >= 0) ? BRBlockCacheOpen(path) : NULL;
+
+    if (! cache) {
+        fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 0\n", __func__);
+        for (i = 0; i < 4; i++) BRMerkleBlockFree(blocks[i]);
+        BRTransactionFree(tx);
+        return 0;
+    }
+
+    if (BRBlockCacheCount(cache) != 0 || BRBlockCacheBlockAtHeight(cache, 100, NULL, NULL) != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 1\n", __func__);
+
+    BRBlockCacheSetFilter(cache, &e[1], 1);
+    BRBlockCacheSetFilter(cache, e, 2); // replaces the filter no block was added with
+    for (i = 0; i < 3; i++) if (! BRBlockCacheAdd(cache, blocks[i], NULL, 0)) break;
+    BRBlockCacheAddFilterElements(cache, &e[2], 1);
+    if (i == 3 && ! BRBlockCacheAdd(cache, blocks[3], &tx, 1)) i = 0;
+    if (i == 3 && ! BRBlockCacheAdd(cache, blocks[1], NULL, 0)) i = 0; // replace a cached block
+
+    if (i != 3 || BRBlockCacheCount(cache) != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheAdd() test\n", __func__);
+
+    b = BRBlockCacheBlockAtHeight(cache, 100, &filterId, &txCount);
+
+    if (! b || ! UInt256Eq(b->blockHash, blocks[0]->blockHash) || b->height != 100 || b->totalTx != 0 ||
+        txCount != 0 || filterId == 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheBlockAtHeight() test 1\n", __func__);
+
+    if (b) BRMerkleBlockFree(b);
+    b = BRBlockCacheBlockAtHeight(cache, 103, &filterId2, &txCount);
+
+    if (! b || ! UInt256Eq(b->blockHash, blocks[3]->blockHash) || b->totalTx != 2 || txCount != 1 ||
+        filterId2 == filterId || BRMerkleBlockTxHashes(b, NULL, 0) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheBlockAtHeight() test 2\n", __func__);
+
+    if (b) BRMerkleBlockFree(b);
+
+    if (BRBlockCacheBlockAtHeight(cache, 99, NULL, NULL) || BRBlockCacheBlockAtHeight(cache, 104, NULL, NULL))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheBlockAtHeight() test 3\n", __func__);
+
+    if (BRBlockCacheTransactions(cache, 103, txs, 2) != 1 || ! UInt256Eq(txs[0]->txHash, tx->txHash) ||
+        txs[0]->outCount != 1 || txs[0]->outputs[0].amount != 100000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheTransactions() test\n", __func__);
+    else BRTransactionFree(txs[0]);
+
+    if (! BRBlockCacheFilterCovers(cache, filterId, e, 2) || BRBlockCacheFilterCovers(cache, filterId, e, 3) ||
+        ! BRBlockCacheFilterCovers(cache, filterId2, e, 3) || BRBlockCacheFilterCovers(cache, 0, e, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheFilterCovers() test\n", __func__);
+
+    BRBlockCacheClose(cache);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if (fd >= 0 && write(fd, "B\x10\0\0\0", 5) != 5) r = 0; // simulate a record torn by a crash
+    if (fd >= 0) close(fd);
+    cache = BRBlockCacheOpen(path);
+    b = (cache) ? BRBlockCacheBlockAtHeight(cache, 103, &filterId, &txCount) : NULL;
+
+    if (! cache || BRBlockCacheCount(cache) != 4 || ! b || ! UInt256Eq(b->blockHash, blocks[3]->blockHash) ||
+        txCount != 1 || ! BRBlockCacheFilterCovers(cache, filterId, e, 3))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 2\n", __func__);
+
+    if (b) BRMerkleBlockFree(b);
+
+    BRTransaction *bigTx = BRTransactionNew();
+    off_t fileLen = 0;
+
+    BRTransactionAddInput(bigTx, inHash, 0, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    for (i = 0; i < 10000; i++) BRTransactionAddOutput(bigTx, 1000, script, scriptLen);
+    
+    // replace a block until most of the cache is taken up by dead records, so it's compacted when reopened
+    for (i = 0; cache && i < 16; i++) if (! BRBlockCacheAdd(cache, blocks[1], &bigTx, 1)) r = 0;
+    if (cache && ! BRBlockCacheAdd(cache, blocks[1], NULL, 0)) r = 0;
+    if (cache) BRBlockCacheClose(cache);
+    cache = BRBlockCacheOpen(path);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) fileLen = lseek(fd, 0, SEEK_END), close(fd);
+    b = (cache) ? BRBlockCacheBlockAtHeight(cache, 103, &filterId, &txCount) : NULL;
+
+    if (! cache || fileLen <= 0 || fileLen > 4096 || BRBlockCacheCount(cache) != 4 || ! b ||
+        ! UInt256Eq(b->blockHash, blocks[3]->blockHash) || txCount != 1 ||
+        ! BRBlockCacheFilterCovers(cache, filterId, e, 3) || BRBlockCacheTransactions(cache, 101, txs, 2) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 3\n", __func__);
+
+    if (b) BRMerkleBlockFree(b);
+    b = (cache) ? BRBlockCacheBlockAtHeight(cache, 100, &filterId, &txCount) : NULL;
+
+    if (! b || ! UInt256Eq(b->blockHash, blocks[0]->blockHash) || ! BRBlockCacheFilterCovers(cache, filterId, e, 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 4\n", __func__);
+
+    if (b) BRMerkleBlockFree(b);
+    if (cache && ! BRBlockCacheAdd(cache, blocks[2], NULL, 0)) r = 0; // appends after the compacted records
+    if (cache) BRBlockCacheClose(cache);
+    cache = BRBlockCacheOpen(path);
+    
+    if (! cache || BRBlockCacheCount(cache) != 4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBlockCacheOpen() test 5\n", __func__);
+    
+    if (cache) BRBlockCacheClose(cache);
+    unlink(path);
+    for (i = 0; i < 4; i++) BRMerkleBlockFree(blocks[i]);
+    BRTransactionFree(bigTx);
+    BRTransactionFree(tx);
+    return r;
+}
+
 int BRPaymentProtocolTests()
 {
     int r = 1;
@@ -2851,6 +3720,202 @@ int BRPaymentProtocolEncryptionTests()
 }
 
 void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t len, const char *type);
+void BRPeerAddKnownTxTest(BRPeer *peer, const UInt256 txHashes[], size_t txCount);
+int BRPeerKnowsTxTest(BRPeer *peer, UInt256 txHash);
+
+static void _logTestSink(void *info, BRLogLevel level, double timestamp, const char *message)
+{
+    char *buf = info;
+    
+    if (strlen(buf) + strlen(message) + 2 < 1024) strcat(strcat(buf, message), "|");
+}
+
+int BRLogTests()
+{
+    int r = 1;
+    char buf[1024] = "", str[300];
+    BRLogLevel level = BRLogGetLevel();
+    
+    BRLogSetSink(buf, _logTestSink);
+    BRLogSetLevel(BRLogLevelInfo);
+    br_log(BRLogLevelDebug, "debug %d", 1);
+    strcpy(str, "copied");
+    br_log(BRLogLevelInfo, "%s %d %"PRIu64" %zu %x %c %5.2f|%-4s|%*d|%.*s|%hhd 100%%", str, -1, UINT64_MAX,
+           (size_t)7, 255u, 'z', 3.14159, "ab", 3, 5, 2, "xyz", 257);
+    strcpy(str, "changed"); // string arguments are copied when logged
+    memset(str, 'a', sizeof(str) - 1);
+    str[sizeof(str) - 1] = '\0';
+    br_log(BRLogLevelWarning, "long %s", str);
+    BRLogFlush();
+    
+    if (strncmp(buf, "copied -1 18446744073709551615 7 ff z  3.14|ab  |  5|xy|1 100%|long aaa", 70) != 0 ||
+        strcmp(&buf[strlen(buf) - 5], "a...|") != 0 || strstr(buf, "debug") != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: br_log() test\n", __func__);
+    
+    if (BRLogLevelEnabled(BRLogLevelDebug) || ! BRLogLevelEnabled(BRLogLevelError))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRLogLevelEnabled() test\n", __func__);
+    
+    BRLogSetSink(NULL, NULL);
+    BRLogSetLevel(level);
+    return r;
+}
+
+#define TEST_PEER_TIMEOUT 10 // seconds to wait for a peer on the loopback interface
+
+// state shared with the callbacks of a peer connected to a BRReplayPeer
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int connected, pongs, exited;
+} BRTestPeer;
+
+static void _testPeerConnected(void *info)
+{
+    BRTestPeer *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    t->connected = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void _testPeerPong(void *info, int success)
+{
+    BRTestPeer *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    if (success) t->pongs++;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void _testPeerThreadCleanup(void *info)
+{
+    BRTestPeer *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    t->exited = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// waits until *flag is at least value, returns false on timeout
+static int _testPeerWait(BRTestPeer *t, const int *flag, int value)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TEST_PEER_TIMEOUT;
+    pthread_mutex_lock(&t->lock);
+    while (*flag < value && pthread_cond_timedwait(&t->cond, &t->lock, &deadline) == 0);
+    value = (*flag >= value);
+    pthread_mutex_unlock(&t->lock);
+    return value;
+}
+
+// sends a ping and waits for the pong, after which the replay peer has handled everything sent before the ping
+static int _testPeerPing(BRTestPeer *t, BRPeer *peer)
+{
+    int pongs = t->pongs;
+
+    BRPeerSendPing(peer, t, _testPeerPong);
+    return _testPeerWait(t, &t->pongs, pongs + 1);
+}
+
+// connects a new peer to the replay peer, and returns true once it has finished the handshake
+static int _testPeerConnect(BRTestPeer *t, BRPeer **peer, BRReplayPeer *replay)
+{
+    BRPeer *p = *peer = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+
+    p->address = ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } });
+    p->port = BRReplayPeerListen(replay);
+    BRPeerSetCallbacks(p, t, _testPeerConnected, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+                       _testPeerThreadCleanup);
+    if (p->port != 0) BRPeerConnect(p);
+    return (p->port != 0 && _testPeerWait(t, &t->connected, 1) && _testPeerPing(t, p));
+}
+
+static void _testPeerFree(BRTestPeer *t, BRPeer *peer)
+{
+    BRPeerDisconnect(peer);
+    if (peer->port != 0) _testPeerWait(t, &t->exited, 1); // the peer thread must exit before the peer is freed
+    BRPeerFree(peer);
+}
+
+// BRPeerSendInv() announces only the tx hashes not among the most recent known to the peer
+static int _BRPeerSendInvTests(void)
+{
+    int r = 1;
+    BRReplayPeer *replay = BRReplayPeerNew(BR_CHAIN_PARAMS.magicNumber);
+    BRPeer *p;
+    BRTestPeer t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+    UInt256 hashes[4] = { UINT256_ZERO, UINT256_ZERO, UINT256_ZERO, UINT256_ZERO };
+    BRReplayPeerStats before, after;
+
+    for (size_t i = 0; i < 4; i++) hashes[i].u32[0] = (uint32_t)i + 1;
+
+    if (! _testPeerConnect(&t, &p, replay)) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerConnect() test\n", __func__);
+    }
+    else {
+        before = BRReplayPeerGetStats(replay);
+        BRPeerSendInv(p, hashes, 3);
+        BRPeerSendInv(p, &hashes[1], 3); // only hashes[3] is new
+        BRPeerSendInv(p, hashes, 4); // nothing new, so no inv is sent
+        _testPeerPing(&t, p);
+        after = BRReplayPeerGetStats(replay);
+
+        // two inv messages with 3 and 1 entries of 36 bytes, then a ping with an 8 byte nonce
+        if (after.messagesIn - before.messagesIn != 3 ||
+            after.bytesIn - before.bytesIn != (24 + 1 + 3*36) + (24 + 1 + 36) + (24 + 8))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendInv() test\n", __func__);
+    }
+
+    _testPeerFree(&t, p);
+    BRReplayPeerFree(replay);
+    return r;
+}
+
+// BRPeerSendFilteradd() sends elements up to the BIP37 limit of 520 bytes, and drops longer ones instead of getting
+// the peer banned for misbehaving
+static int _BRPeerSendFilteraddTests(void)
+{
+    int r = 1;
+    BRReplayPeer *replay = BRReplayPeerNew(BR_CHAIN_PARAMS.magicNumber);
+    BRBloomFilter *filter = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, 10, 0, BLOOM_UPDATE_ALL);
+    uint8_t data[521], buf[BRBloomFilterSerialize(filter, NULL, 0)];
+    size_t len = BRBloomFilterSerialize(filter, buf, sizeof(buf));
+    BRPeer *p;
+    BRTestPeer t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0 };
+    BRReplayPeerStats before, after;
+
+    memset(data, 0xa5, sizeof(data));
+
+    if (! _testPeerConnect(&t, &p, replay)) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerConnect() test\n", __func__);
+    }
+    else {
+        BRPeerSendFilterload(p, buf, len);
+        _testPeerPing(&t, p);
+        before = BRReplayPeerGetStats(replay);
+        BRPeerSendFilteradd(p, data, 520);
+        BRPeerSendFilteradd(p, data, 521); // too long, not sent
+        BRPeerSendFilteradd(p, data, 1);
+        _testPeerPing(&t, p);
+        after = BRReplayPeerGetStats(replay);
+
+        // filteradd messages with 520 bytes after a 3 byte length, and 1 byte after a 1 byte length, then a ping
+        if (after.messagesIn - before.messagesIn != 3 ||
+            after.bytesIn - before.bytesIn != (24 + 3 + 520) + (24 + 1 + 1) + (24 + 8) ||
+            BRPeerConnectStatus(p) != BRPeerStatusConnected)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendFilteradd() test\n", __func__);
+    }
+
+    _testPeerFree(&t, p);
+    BRReplayPeerFree(replay);
+    BRBloomFilterFree(filter);
+    return r;
+}
 
 int BRPeerTests()
 {
@@ -2858,7 +3923,874 @@ int BRPeerTests()
     BRPeer *p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
     const char msg[] = "my message";
     
+    BRPeerHistogram h;
+    BRPeerMetrics m;
+    
     BRPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+
+    memset(&h, 0, sizeof(h));
+    BRPeerHistogramAdd(&h, 0.0000005);
+    BRPeerHistogramAdd(&h, 0.000003);
+    BRPeerHistogramAdd(&h, 0.002);
+    BRPeerHistogramAdd(&h, 100.0);
+    
+    if (h.count != 4 || h.buckets[0] != 1 || h.buckets[2] != 1 || h.buckets[11] != 1 ||
+        h.buckets[PEER_HISTOGRAM_BUCKETS - 1] != 1 || h.maxUsec != 100000000 || h.totalUsec != 100002003)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerHistogramAdd() test\n", __func__);
+    
+    if (BRPeerHistogramPercentile(&h, 50) != 0.000004 || BRPeerHistogramPercentile(&h, 75) != 0.002048 ||
+        BRPeerHistogramPercentile(&h, 100) != 100.0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerHistogramPercentile() test\n", __func__);
+    
+    if (strcmp(BRPeerMsgTypeName(BRPeerMsgMerkleblock), MSG_MERKLEBLOCK) != 0 ||
+        strcmp(BRPeerMsgTypeName(BRPeerMsgCfheaders), MSG_CFHEADERS) != 0 ||
+        BRPeerMsgTypeName(BRPeerMsgTypeCount) != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerMsgTypeName() test\n", __func__);
+    
+    BRPeerAddFalsePositives(p, 2);
+    m = BRPeerGetMetrics(p);
+    
+    if (m.falsePositives != 2 || m.connectedTime != 0 || m.messagesIn[BRPeerMsgInv] != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerGetMetrics() test\n", __func__);
+    
+    // known tx hashes: the last 1000 are kept exactly in a ring, and older ones in two rolling filter generations of
+    // 10000, the older of which is cleared when the current one fills
+    UInt256 *known = calloc(20001, sizeof(*known));
+    
+    for (uint32_t i = 0; i < 20001; i++) known[i].u32[0] = i + 1;
+    BRPeerAddKnownTxTest(p, known, 1000);
+    
+    if (BRPeerKnowsTxTest(p, known[0]) != 2 || BRPeerKnowsTxTest(p, known[999]) != 2 ||
+        BRPeerKnowsTxTest(p, known[1000]) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: known tx test 1\n", __func__);
+    
+    BRPeerAddKnownTxTest(p, &known[1000], 1); // evicts known[0] from the ring
+    
+    if (BRPeerKnowsTxTest(p, known[0]) != 1 || BRPeerKnowsTxTest(p, known[1]) != 2 ||
+        BRPeerKnowsTxTest(p, known[1000]) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: known tx test 2\n", __func__);
+    
+    BRPeerAddKnownTxTest(p, &known[1001], 10000 - 1001); // fills the current generation
+    BRPeerAddKnownTxTest(p, &known[10000], 1); // starts a new one, known[0] is still in the older generation
+    
+    if (BRPeerKnowsTxTest(p, known[0]) != 1 || BRPeerKnowsTxTest(p, known[10000]) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: known tx test 3\n", __func__);
+    
+    BRPeerAddKnownTxTest(p, &known[10001], 10000 - 1); // fills the new generation
+    
+    if (BRPeerKnowsTxTest(p, known[0]) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: known tx test 4\n", __func__);
+    
+    BRPeerAddKnownTxTest(p, &known[20000], 1); // clears the generation holding known[0] and reuses it
+    
+    if (BRPeerKnowsTxTest(p, known[0]) != 0 || BRPeerKnowsTxTest(p, known[10000]) != 1 ||
+        BRPeerKnowsTxTest(p, known[20000]) != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: known tx test 5\n", __func__);
+    
+    free(known);
+    BRPeerFree(p);
+    if (! _BRPeerSendInvTests()) r = 0;
+    if (! _BRPeerSendFilteraddTests()) r = 0;
+    return r;
+}
+
+void BRPeerManagerQueueSaveBlocksTest(BRPeerManager *manager, int replace, BRMerkleBlock *blocks[], size_t blocksCount);
+void BRPeerManagerQueueSavePeersTest(BRPeerManager *manager, int replace, const BRPeer peers[], size_t peersCount);
+void BRPeerManagerSyncStoppedTest(BRPeerManager *manager, int error);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int hold, delay; // hold save calls until cleared, or sleep in each one
+    int count, finished, stoppedAt; // save calls started and returned, and calls returned when syncStopped was called
+    char kind[16]; // 'b' for saveBlocks, 'p' for savePeers
+    int replace[16];
+    size_t len[16];
+    uint32_t first[16]; // height of the first block, or port of the first peer
+    uint64_t lastTimestamp; // timestamp of the last peer in the last savePeers call
+} BRTestSave;
+
+static void _testSaveCall(BRTestSave *t, char kind, int replace, size_t len, uint32_t first)
+{
+    struct timespec ts = { 0, 100000000 };
+
+    pthread_mutex_lock(&t->lock);
+
+    if (t->count < 16) {
+        t->kind[t->count] = kind, t->replace[t->count] = replace, t->len[t->count] = len;
+        t->first[t->count] = first;
+    }
+
+    t->count++;
+    pthread_cond_broadcast(&t->cond);
+    while (t->hold) pthread_cond_wait(&t->cond, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+    if (t->delay) nanosleep(&ts, NULL);
+    pthread_mutex_lock(&t->lock);
+    t->finished++;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void _testSaveBlocks(void *info, int replace, BRMerkleBlock *blocks[], size_t blocksCount)
+{
+    _testSaveCall(info, 'b', replace, blocksCount, (blocksCount > 0) ? blocks[0]->height : 0);
+}
+
+static void _testSavePeers(void *info, int replace, const BRPeer peers[], size_t peersCount)
+{
+    BRTestSave *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    if (peersCount > 0) t->lastTimestamp = peers[peersCount - 1].timestamp;
+    pthread_mutex_unlock(&t->lock);
+    _testSaveCall(info, 'p', replace, peersCount, (peersCount > 0) ? peers[0].port : 0);
+}
+
+static void _testSaveSyncStopped(void *info, int error)
+{
+    BRTestSave *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    t->stoppedAt = t->finished;
+    pthread_mutex_unlock(&t->lock);
+}
+
+// waits until count save calls have started, returns false on timeout
+static int _testSaveWait(BRTestSave *t, int count)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TEST_PEER_TIMEOUT;
+    pthread_mutex_lock(&t->lock);
+    while (t->count < count && pthread_cond_timedwait(&t->cond, &t->lock, &deadline) == 0);
+    count = (t->count >= count);
+    pthread_mutex_unlock(&t->lock);
+    return count;
+}
+
+static void _testSaveRelease(BRTestSave *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->hold = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int _testSaveMatches(BRTestSave *t, int i, char kind, int replace, size_t len, uint32_t first)
+{
+    return (t->kind[i] == kind && t->replace[i] == replace && t->len[i] == len && t->first[i] == first);
+}
+
+// saves queued while a save call is running are merged, in order, into the next call of each kind, with each peer
+// listed once, a replacing save drops the ones still waiting, and syncStopped and BRPeerManagerDisconnect() wait for
+// every queued save
+static int _BRPeerManagerSaveQueueTests(BRWallet *w)
+{
+    int r = 1;
+    BRPeerManager *manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, w, BIP39_CREATION_TIME, NULL, 0, NULL, 0);
+    BRTestSave t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 1, 0, 0, 0, -1 };
+    BRMerkleBlock *b[4];
+    BRPeer p[2] = { BR_PEER_NONE, BR_PEER_NONE };
+
+    for (size_t i = 0; i < 4; i++) b[i] = BRMerkleBlockNew(), b[i]->height = (uint32_t)i + 1;
+    p[0].port = 1, p[1].port = 2;
+    BRPeerManagerSetCallbacks(manager, &t, NULL, _testSaveSyncStopped, NULL, _testSaveBlocks, _testSavePeers, NULL,
+                              NULL);
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[0], 1);
+
+    if (! _testSaveWait(&t, 1)) { // the save thread now holds the first call
+        r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 1\n", __func__);
+        _testSaveRelease(&t);
+    }
+
+    BRPeerManagerQueueSavePeersTest(manager, 0, &p[0], 1);
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[1], 2);
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[3], 1);
+    BRPeerManagerQueueSavePeersTest(manager, 0, &p[1], 1);
+    _testSaveRelease(&t);
+    BRPeerManagerSyncStoppedTest(manager, 0);
+
+    if (t.count != 3 || t.stoppedAt != 3 || ! _testSaveMatches(&t, 0, 'b', 0, 1, 1) ||
+        ! _testSaveMatches(&t, 1, 'b', 0, 3, 2) || ! _testSaveMatches(&t, 2, 'p', 0, 2, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 2\n", __func__);
+
+    t.hold = 1;
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[0], 1);
+    if (! _testSaveWait(&t, 4)) r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 3\n", __func__);
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[1], 2);
+    BRPeerManagerQueueSaveBlocksTest(manager, 1, &b[3], 1); // drops b[1] and b[2]
+    BRPeerManagerQueueSavePeersTest(manager, 0, &p[0], 1);
+    BRPeerManagerQueueSavePeersTest(manager, 1, &p[1], 1); // drops p[0]
+    _testSaveRelease(&t);
+    BRPeerManagerSyncStoppedTest(manager, 0);
+
+    if (t.count != 6 || t.stoppedAt != 6 || ! _testSaveMatches(&t, 4, 'b', 1, 1, 4) ||
+        ! _testSaveMatches(&t, 5, 'p', 1, 1, 2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 4\n", __func__);
+
+    t.hold = 1;
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, &b[0], 1);
+    if (! _testSaveWait(&t, 7)) r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 5\n", __func__);
+
+    for (size_t i = 0; i < 6; i++) { // a burst of peer saves, each peer is saved once, at its latest timestamp
+        p[i % 2].timestamp = (uint64_t)i + 1;
+        BRPeerManagerQueueSavePeersTest(manager, 0, &p[i % 2], 1);
+    }
+
+    _testSaveRelease(&t);
+    BRPeerManagerSyncStoppedTest(manager, 0);
+
+    if (t.count != 8 || t.stoppedAt != 8 || ! _testSaveMatches(&t, 7, 'p', 0, 2, 1) || t.lastTimestamp != 6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 6\n", __func__);
+
+    t.delay = 1;
+    BRPeerManagerQueueSaveBlocksTest(manager, 0, b, 4);
+    BRPeerManagerQueueSavePeersTest(manager, 1, p, 2);
+    BRPeerManagerDisconnect(manager);
+
+    if (t.finished != 10 || ! _testSaveMatches(&t, 8, 'b', 0, 4, 1) || ! _testSaveMatches(&t, 9, 'p', 1, 2, 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: save queue test 7\n", __func__);
+
+    BRPeerManagerFree(manager);
+    for (size_t i = 0; i < 4; i++) BRMerkleBlockFree(b[i]);
+    return r;
+}
+
+void BRPeerManagerSetDownloadTimeoutTest(BRPeerManager *manager, int seconds);
+int BRPeerManagerDownloadTimerRunningTest(BRPeerManager *manager);
+
+#define TEST_DOWNLOAD_BLOCKS  1800 // enough for several getblocks batches, short of a difficulty transition
+#define TEST_DOWNLOAD_PEERS   3
+#define TEST_DOWNLOAD_STALL   10 // seconds helper peers stall, much longer than the download window timeout
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done, error;
+} BRTestSync;
+
+static void _testSyncStopped(void *info, int error)
+{
+    BRTestSync *t = info;
+
+    pthread_mutex_lock(&t->lock);
+    t->done = 1;
+    t->error = error;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// a transaction paying 1 btc to script, with a placeholder input unique to n
+static BRTransaction *_testSyncTx(uint32_t n, const uint8_t *script, size_t scriptLen)
+{
+    BRTransaction *tx = BRTransactionNew();
+    uint8_t sig[107], buf[512];
+    UInt256 hash = UINT256_ZERO;
+    size_t len;
+
+    memset(sig, 0, sizeof(sig));
+    sig[0] = 71, sig[72] = 33, sig[73] = 0x02; // pushes of a signature and a compressed pubkey
+    hash.u32[0] = n;
+    BRTransactionAddInput(tx, hash, 0, 0, NULL, 0, sig, sizeof(sig), NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, SATOSHIS, script, scriptLen);
+    len = BRTransactionSerialize(tx, buf, sizeof(buf));
+    BRTransactionFree(tx);
+    return BRTransactionParse(buf, len);
+}
+
+// syncs a chain from several replay peers serving the same blocks, so it's split into download windows, while the
+// helper peers stall on their next window for longer than the download window timeout: the sync must finish before
+// the stall ends, with the stalled windows reassigned by the download timer, and the blocks downloaded out of order
+// connected in order, confirming the wallet's transactions at the heights they were mined at
+static int _BRPeerManagerDownloadTests(BRWallet *w)
+{
+    int r = 1, mined = 1;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRAddress addr = BRWalletReceiveAddress(w);
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)], noise[25] = { 0x76, 0xa9, 20 };
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+    const uint32_t walletHeights[] = { 150, 750, 1350, 1750 };
+    UInt256 walletTxHashes[4];
+    BRReplayPeer *replay[TEST_DOWNLOAD_PEERS];
+    BRPeer peers[TEST_DOWNLOAD_PEERS];
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager = NULL;
+    BRTransaction *txs[TEST_DOWNLOAD_PEERS][2];
+    BRReplayPeerStats stats;
+    uint32_t h, now = (uint32_t)time(NULL), start = now - (TEST_DOWNLOAD_BLOCKS + 1)*600;
+    size_t i, k, stalls = 0;
+    struct timespec deadline, ts = { 0, 1000000 };
+    const char *name;
+    time_t begin;
+
+    noise[23] = 0x88, noise[24] = 0xac;
+
+    for (i = 0; i < TEST_DOWNLOAD_PEERS; i++) {
+        replay[i] = BRReplayPeerNew(0xdab5bffa);
+        mined = mined && (BRReplayPeerMineBlock(replay[i], NULL, 0, start) != NULL);
+    }
+
+    for (h = 1, k = 0; mined && h <= TEST_DOWNLOAD_BLOCKS; h++) {
+        UInt32SetLE(&noise[3], h);
+        for (i = 0; mined && i < TEST_DOWNLOAD_PEERS; i++) { // every replay peer mines the same block
+            txs[i][0] = _testSyncTx(h, noise, sizeof(noise));
+            txs[i][1] = (k < 4 && h == walletHeights[k]) ? _testSyncTx(h | 0x80000000, script, scriptLen) : NULL;
+            if (txs[i][1]) walletTxHashes[k] = txs[i][1]->txHash;
+            mined = (BRReplayPeerMineBlock(replay[i], txs[i], (txs[i][1]) ? 2 : 1, start + h*600) != NULL);
+        }
+
+        if (k < 4 && h == walletHeights[k]) k++;
+    }
+
+    for (i = 0; i < TEST_DOWNLOAD_PEERS && mined; i++) { // a pending payment answers the mempool request at the end
+        BRReplayPeerAddMempoolTx(replay[i], _testSyncTx(UINT32_MAX, script, scriptLen));
+        peers[i] = ((const BRPeer) { localHost, BRReplayPeerListen(replay[i]), SERVICES_NODE_NETWORK, now, 0 });
+        if (peers[i].port == 0) mined = 0;
+    }
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (mined) {
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[0]), w, start, NULL, 0, peers, TEST_DOWNLOAD_PEERS);
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetDownloadTimeoutTest(manager, 1);
+        begin = time(NULL);
+        BRPeerManagerConnect(manager);
+        name = BRPeerManagerDownloadPeerName(manager);
+
+        for (i = 0; i < TEST_PEER_TIMEOUT*1000 && name[0] == '\0'; i++) { // wait for the download peer to be picked
+            nanosleep(&ts, NULL);
+            name = BRPeerManagerDownloadPeerName(manager);
+        }
+
+        for (i = 0; name[0] != '\0' && i < TEST_DOWNLOAD_PEERS; i++) { // stall the helpers
+            if (strtoul(strrchr(name, ':') + 1, NULL, 10) == peers[i].port) continue;
+            BRReplayPeerStall(replay[i], TEST_DOWNLOAD_STALL);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TEST_DOWNLOAD_STALL + TEST_PEER_TIMEOUT;
+        pthread_mutex_lock(&t.lock);
+        while (! t.done && pthread_cond_timedwait(&t.cond, &t.lock, &deadline) == 0);
+        pthread_mutex_unlock(&t.lock);
+
+        if (! t.done || t.error != 0 || time(NULL) - begin >= TEST_DOWNLOAD_STALL)
+            r = 0, fprintf(stderr, "***FAILED*** %s: stalled download window test\n", __func__);
+
+        // the timer thread that reassigned the stalled windows was stopped and joined when the sync finished
+        if (BRPeerManagerDownloadTimerRunningTest(manager))
+            r = 0, fprintf(stderr, "***FAILED*** %s: download timer stop test\n", __func__);
+
+        for (i = 0; i < TEST_DOWNLOAD_PEERS; i++) {
+            stats = BRReplayPeerGetStats(replay[i]);
+            stalls += stats.stalls;
+        }
+
+        if (name[0] == '\0' || stalls == 0) // a helper must have been given a window
+            r = 0, fprintf(stderr, "***FAILED*** %s: download window assignment test\n", __func__);
+
+        if (BRPeerManagerLastBlockHeight(manager) != TEST_DOWNLOAD_BLOCKS)
+            r = 0, fprintf(stderr, "***FAILED*** %s: download in order test 1\n", __func__);
+
+        for (k = 0; k < 4; k++) {
+            const BRTransaction *tx = BRWalletTransactionForHash(w, walletTxHashes[k]);
+
+            if (! tx || tx->blockHeight != walletHeights[k])
+                r = 0, fprintf(stderr, "***FAILED*** %s: download in order test 2\n", __func__);
+        }
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    for (i = 0; i < TEST_DOWNLOAD_PEERS; i++) BRReplayPeerFree(replay[i]);
+    return r;
+}
+
+#define TEST_FILTERADD_BLOCKS 150 // blocks paying the wallet twice each, enough to outgrow the filter's capacity
+
+// syncs a chain that pays a fresh wallet address after another, so new addresses keep being added to the loaded bloom
+// filter with filteradd until it reaches the capacity it was sized for, and is then rebuilt and reloaded, while blocks
+// that arrive with filteradds pending are dropped and requested again, so every payment is still found
+static int _BRPeerManagerFilteraddTests(BRMasterPubKey mpk)
+{
+    int r = 1, mined;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRWallet *w = BRWalletNew(NULL, 0, mpk, 0), *gen = BRWalletNew(NULL, 0, mpk, 0);
+    BRAddress addrs[2*TEST_FILTERADD_BLOCKS + 1];
+    uint8_t script[2*TEST_FILTERADD_BLOCKS + 1][25];
+    size_t scriptLen[2*TEST_FILTERADD_BLOCKS + 1], i;
+    BRReplayPeer *replay = BRReplayPeerNew(0xdab5bffa);
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager;
+    BRPeerManagerMetrics metrics;
+    BRTransaction *txs[2];
+    uint32_t h, start = (uint32_t)time(NULL) - (TEST_FILTERADD_BLOCKS + 1)*600;
+    uint16_t port;
+    struct timespec deadline;
+
+    BRWalletUnusedAddrs(gen, addrs, 2*TEST_FILTERADD_BLOCKS + 1, 0); // the wallet's first receive addresses, in order
+
+    for (i = 0; i < 2*TEST_FILTERADD_BLOCKS + 1; i++) {
+        scriptLen[i] = BRAddressScriptPubKey(script[i], sizeof(script[i]), addrs[i].s);
+    }
+
+    mined = (BRReplayPeerMineBlock(replay, NULL, 0, start) != NULL);
+
+    for (h = 1; mined && h <= TEST_FILTERADD_BLOCKS; h++) {
+        txs[0] = _testSyncTx(2*h, script[2*h - 2], scriptLen[2*h - 2]);
+        txs[1] = _testSyncTx(2*h + 1, script[2*h - 1], scriptLen[2*h - 1]);
+        mined = (BRReplayPeerMineBlock(replay, txs, 2, start + h*600) != NULL);
+    }
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (mined && (port = BRReplayPeerListen(replay)) != 0) {
+        BRReplayPeerAddMempoolTx(replay, _testSyncTx(UINT32_MAX, script[2*TEST_FILTERADD_BLOCKS],
+                                                     scriptLen[2*TEST_FILTERADD_BLOCKS]));
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay), w, start, NULL, 0, NULL, 0);
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetFixedPeer(manager, localHost, port);
+        BRPeerManagerConnect(manager);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TEST_PEER_TIMEOUT*3;
+        pthread_mutex_lock(&t.lock);
+        while (! t.done && pthread_cond_timedwait(&t.cond, &t.lock, &deadline) == 0);
+        pthread_mutex_unlock(&t.lock);
+        metrics = BRPeerManagerGetMetrics(manager);
+
+        if (! t.done || t.error != 0 || BRPeerManagerLastBlockHeight(manager) != TEST_FILTERADD_BLOCKS ||
+            BRWalletBalance(w) != (2*TEST_FILTERADD_BLOCKS + 1)*SATOSHIS)
+            r = 0, fprintf(stderr, "***FAILED*** %s: filteradd sync test\n", __func__);
+
+        // each filter has room for 100 elements past those it was built with, new addresses were sent with filteradd
+        // until that room ran out, and then the filter was rebuilt instead
+        if (metrics.filterAdds == 0 || metrics.filterRebuilds < 2 ||
+            metrics.filterAdds > 100*(metrics.filterRebuilds - 1))
+            r = 0, fprintf(stderr, "***FAILED*** %s: filter capacity test\n", __func__);
+
+        // blocks received with filteradds pending were dropped, and downloaded again
+        if (BRReplayPeerGetStats(replay).merkleblocks <= TEST_FILTERADD_BLOCKS)
+            r = 0, fprintf(stderr, "***FAILED*** %s: pending filteradd test\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    BRReplayPeerFree(replay);
+    BRWalletFree(gen);
+    BRWalletFree(w);
+    return r;
+}
+
+// waits up to the given number of seconds for the sync to stop, and returns true if it finished without an error
+static int _testSyncWait(BRTestSync *t, int seconds)
+{
+    struct timespec deadline;
+    int r;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_mutex_lock(&t->lock);
+    while (! t->done && pthread_cond_timedwait(&t->cond, &t->lock, &deadline) == 0);
+    r = (t->done && t->error == 0);
+    pthread_mutex_unlock(&t->lock);
+    return r;
+}
+
+#define TEST_CF_FORK_HEIGHT 30 // the compact filter reorg test's chains fork after this height
+
+// syncs a chain with compact filters from one replay peer, and then from another whose chain forks off it and is
+// longer: the second sync must replace the main chain after the fork point, leaving the wallet transaction that's only
+// in the first chain unconfirmed, and confirming the one that's only in the second chain
+static int _BRPeerManagerCFReorgTests(BRMasterPubKey mpk)
+{
+    int r = 1, mined;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRWallet *w = BRWalletNew(NULL, 0, mpk, 0);
+    BRAddress addr = BRWalletReceiveAddress(w);
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)], noise[25] = { 0x76, 0xa9, 20 };
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+    BRReplayPeer *replay[] = { BRReplayPeerNew(0xdab5bffa), BRReplayPeerNew(0xdab5bffa) };
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager;
+    const BRTransaction *tx[3];
+    BRTransaction *txs[2];
+    UInt256 txHashes[3];
+    uint32_t h, start = (uint32_t)time(NULL) - 100*600,
+             heights[] = { 10, TEST_CF_FORK_HEIGHT + 5, TEST_CF_FORK_HEIGHT + 8 },
+             tips[] = { TEST_CF_FORK_HEIGHT + 10, TEST_CF_FORK_HEIGHT + 15 };
+    uint16_t ports[2];
+    size_t i;
+
+    noise[23] = 0x88, noise[24] = 0xac;
+    mined = (BRReplayPeerMineBlock(replay[0], NULL, 0, start) && BRReplayPeerMineBlock(replay[1], NULL, 0, start));
+
+    // both chains pay the wallet at heights[0], then the first one at heights[1], and the second one at heights[2]
+    for (i = 0; mined && i < 2; i++) {
+        for (h = 1; mined && h <= tips[i]; h++) {
+            UInt32SetLE(&noise[3], (h > TEST_CF_FORK_HEIGHT) ? h | (uint32_t)i << 16 : h);
+            txs[0] = _testSyncTx(h, noise, sizeof(noise));
+            txs[1] = (h == heights[0] || h == heights[i + 1]) ? _testSyncTx(h | 0x80000000, script, scriptLen) : NULL;
+            if (txs[1]) txHashes[(h == heights[0]) ? 0 : i + 1] = txs[1]->txHash;
+            mined = (BRReplayPeerMineBlock(replay[i], txs, (txs[1]) ? 2 : 1,
+                                           start + h*600 + ((h > TEST_CF_FORK_HEIGHT) ? i : 0)) != NULL);
+        }
+    }
+
+    for (i = 0; mined && i < 2; i++) {
+        if ((ports[i] = BRReplayPeerListen(replay[i])) == 0) mined = 0;
+    }
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (mined) {
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[0]), w, start, NULL, 0, NULL, 0);
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetCompactFilters(manager, 1);
+        BRPeerManagerSetFixedPeer(manager, localHost, ports[0]);
+        BRPeerManagerConnect(manager);
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3)) r = 0;
+        for (i = 0; i < 3; i++) tx[i] = BRWalletTransactionForHash(w, txHashes[i]);
+
+        if (! r || BRPeerManagerLastBlockHeight(manager) != tips[0] || ! tx[0] || tx[0]->blockHeight != heights[0] ||
+            ! tx[1] || tx[1]->blockHeight != heights[1] || tx[2])
+            r = 0, fprintf(stderr, "***FAILED*** %s: compact filter sync test\n", __func__);
+
+        BRPeerManagerSetFixedPeer(manager, localHost, ports[1]);
+        pthread_mutex_lock(&t.lock);
+        t.done = t.error = 0;
+        pthread_mutex_unlock(&t.lock);
+        BRPeerManagerConnect(manager);
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3)) r = 0;
+        for (i = 0; i < 3; i++) tx[i] = BRWalletTransactionForHash(w, txHashes[i]);
+
+        if (! r || BRPeerManagerLastBlockHeight(manager) != tips[1] || ! tx[0] || tx[0]->blockHeight != heights[0] ||
+            ! tx[1] || tx[1]->blockHeight != TX_UNCONFIRMED || ! tx[2] || tx[2]->blockHeight != heights[2])
+            r = 0, fprintf(stderr, "***FAILED*** %s: compact filter reorg test\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    BRReplayPeerFree(replay[1]);
+    BRReplayPeerFree(replay[0]);
+    BRWalletFree(w);
+    return r;
+}
+
+#define TEST_CF_BLOCKS 300
+#define TEST_CF_PEERS  5 // enough that the peer list doesn't drop below the connect count, which would look up seeds
+
+// syncs a chain with compact filters from several replay peers, one of which hides the wallet's transactions with
+// filters that leave out their scripts, and claims an extra block to be selected as download peer: its filter hashes
+// must be found to disagree with those of the other peers before any of its filters are used, and after it's banned
+// the chain must be synced from an honest peer, finding every wallet transaction
+static int _BRPeerManagerCFCheckTests(BRMasterPubKey mpk)
+{
+    int r = 1, mined = 1;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRWallet *w = BRWalletNew(NULL, 0, mpk, 0);
+    BRAddress addr = BRWalletReceiveAddress(w);
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)], noise[25] = { 0x76, 0xa9, 20 };
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
+    const uint32_t walletHeights[] = { 50, 150, 250 };
+    UInt256 walletTxHashes[3];
+    BRReplayPeer *replay[TEST_CF_PEERS];
+    BRPeer peers[TEST_CF_PEERS];
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager;
+    const BRTransaction *tx;
+    BRTransaction *txs[2];
+    uint32_t h, now = (uint32_t)time(NULL), start = now - (TEST_CF_BLOCKS + 1)*600;
+    size_t i, k;
+
+    noise[23] = 0x88, noise[24] = 0xac;
+
+    for (i = 0; i < TEST_CF_PEERS; i++) {
+        replay[i] = BRReplayPeerNew(0xdab5bffa);
+        mined = mined && (BRReplayPeerMineBlock(replay[i], NULL, 0, start) != NULL);
+    }
+
+    for (h = 1, k = 0; mined && h <= TEST_CF_BLOCKS; h++) {
+        UInt32SetLE(&noise[3], h);
+
+        for (i = 0; mined && i < TEST_CF_PEERS; i++) { // every replay peer mines the same block
+            txs[0] = _testSyncTx(h, noise, sizeof(noise));
+            txs[1] = (k < 3 && h == walletHeights[k]) ? _testSyncTx(h | 0x80000000, script, scriptLen) : NULL;
+            if (txs[1]) walletTxHashes[k] = txs[1]->txHash;
+            mined = (BRReplayPeerMineBlock(replay[i], txs, (txs[1]) ? 2 : 1, start + h*600) != NULL);
+        }
+
+        if (k < 3 && h == walletHeights[k]) k++;
+    }
+
+    BRReplayPeerHideTransactions(replay[0], walletHeights[0]);
+
+    // the manager connects to the three peers with the most recent timestamps first, the honest peers with older
+    // timestamps are left to take over as download peer once the dishonest one is banned
+    for (i = 0; mined && i < TEST_CF_PEERS; i++) {
+        peers[i] = ((const BRPeer) { localHost, BRReplayPeerListen(replay[i]), SERVICES_NODE_NETWORK,
+                                     (i < 3) ? now : now - 1, 0 });
+        if (peers[i].port == 0) mined = 0;
+    }
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (mined) {
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[0]), w, start, NULL, 0, peers, TEST_CF_PEERS);
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetCompactFilters(manager, 1);
+        BRPeerManagerConnect(manager);
+
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3) || BRPeerManagerLastBlockHeight(manager) != TEST_CF_BLOCKS)
+            r = 0, fprintf(stderr, "***FAILED*** %s: compact filter sync test\n", __func__);
+
+        for (k = 0; k < 3; k++) {
+            tx = BRWalletTransactionForHash(w, walletTxHashes[k]);
+
+            if (! tx || tx->blockHeight != walletHeights[k])
+                r = 0, fprintf(stderr, "***FAILED*** %s: hidden transaction test\n", __func__);
+        }
+
+        if (BRReplayPeerGetStats(replay[0]).connections == 0 || BRPeerManagerGetMetrics(manager).misbehavingPeers == 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: filter header cross-check test\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    for (i = 0; i < TEST_CF_PEERS; i++) BRReplayPeerFree(replay[i]);
+    BRWalletFree(w);
+    return r;
+}
+
+#define TEST_STORE_SAVED 1500 // blocks the header store test's first manager is created with
+#define TEST_STORE_FIRST 1800 // height of the first sync, before the difficulty transition at 2016
+#define TEST_STORE_LAST  2100 // height of the second sync, past the difficulty transition
+
+// syncs a chain with a new, empty header store, starting from saved blocks that end partway through a difficulty
+// interval, and then restarts from the header store alone and syncs past the next difficulty transition: the store
+// must have been started at the last transition, or the retarget can't be verified after the restart
+static int _BRPeerManagerHeaderStoreTests(BRMasterPubKey mpk)
+{
+    int r = 1, mined = 1, fd;
+    char path[] = "/tmp/BRPeerManagerHeaderStoreTestsXXXXXX";
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRWallet *w = BRWalletNew(NULL, 0, mpk, 0);
+    uint8_t noise[25] = { 0x76, 0xa9, 20 };
+    BRReplayPeer *replay[] = { BRReplayPeerNew(0xdab5bffa), BRReplayPeerNew(0xdab5bffa) };
+    BRMerkleBlock *saved[TEST_STORE_SAVED + 1];
+    const BRMerkleBlock *b;
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager;
+    BRHeaderStore *store;
+    BRTransaction *tx;
+    uint32_t h, start = (uint32_t)time(NULL) - (TEST_STORE_LAST + 1)*600,
+             tips[] = { TEST_STORE_FIRST, TEST_STORE_LAST };
+    uint16_t ports[2];
+    size_t i, savedCount = 0;
+
+    noise[23] = 0x88, noise[24] = 0xac;
+
+    for (h = 0; mined && h <= TEST_STORE_LAST; h++) {
+        UInt32SetLE(&noise[3], h);
+
+        for (i = 0; mined && i < 2; i++) { // both replay peers mine the same chain, the first one stops sooner
+            if (h > tips[i]) continue;
+            tx = (h > 0) ? _testSyncTx(h, noise, sizeof(noise)) : NULL;
+            b = BRReplayPeerMineBlock(replay[i], (tx) ? &tx : NULL, (tx) ? 1 : 0, start + h*600);
+            if (b && i == 0 && h <= TEST_STORE_SAVED) saved[savedCount++] = BRMerkleBlockCopy(b);
+            mined = (b != NULL);
+        }
+    }
+
+    for (i = 0; mined && i < 2; i++) {
+        if ((ports[i] = BRReplayPeerListen(replay[i])) == 0) mined = 0;
+    }
+
+    fd = mkstemp(path);
+    if (fd >= 0) close(fd);
+    store = (fd >= 0) ? BRHeaderStoreOpen(path) : NULL;
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (mined && store) {
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[0]), w, start, saved, savedCount, NULL, 0);
+        savedCount = 0; // the manager owns the saved blocks now
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetHeaderStore(manager, store);
+        BRPeerManagerSetFixedPeer(manager, localHost, ports[0]);
+        BRPeerManagerConnect(manager);
+
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3) || BRPeerManagerLastBlockHeight(manager) != TEST_STORE_FIRST)
+            r = 0, fprintf(stderr, "***FAILED*** %s: header store sync test 1\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+
+        // the store starts at the difficulty transition at height 0, or right after the checkpoint there
+        if (BRHeaderStoreFirstHeight(store) > 1 || BRHeaderStoreLastHeight(store) != TEST_STORE_FIRST)
+            r = 0, fprintf(stderr, "***FAILED*** %s: header store difficulty transition test\n", __func__);
+
+        // restart without any saved blocks, the chain is loaded from the header store
+        t.done = t.error = 0;
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[1]), w, start, NULL, 0, NULL, 0);
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetHeaderStore(manager, store);
+
+        if (BRPeerManagerLastBlockHeight(manager) != TEST_STORE_FIRST)
+            r = 0, fprintf(stderr, "***FAILED*** %s: header store restart test\n", __func__);
+
+        BRPeerManagerSetFixedPeer(manager, localHost, ports[1]);
+        BRPeerManagerConnect(manager);
+
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3) || BRPeerManagerLastBlockHeight(manager) != TEST_STORE_LAST ||
+            BRHeaderStoreLastHeight(store) != TEST_STORE_LAST)
+            r = 0, fprintf(stderr, "***FAILED*** %s: header store sync test 2\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    if (store) BRHeaderStoreClose(store);
+    if (fd >= 0) unlink(path);
+    for (i = 0; i < savedCount; i++) BRMerkleBlockFree(saved[i]);
+    BRReplayPeerFree(replay[1]);
+    BRReplayPeerFree(replay[0]);
+    BRWalletFree(w);
+    return r;
+}
+
+#define TEST_HEADERS_BLOCKS 2100 // past a difficulty transition
+#define TEST_HEADERS_FORK   1950 // the headers test's saved chain forks off the peer's after this height
+#define TEST_HEADERS_SAVED  1990 // height of the saved chain
+#define TEST_HEADERS_RECENT 50   // blocks at the tip that are less than a week older than the wallet
+
+// starts from saved blocks that fork off the peer's chain, and syncs the peer's chain, with all but the last blocks
+// more than a week older than the wallet, so they're requested as headers: the headers that fork off the main chain
+// take the per-block path, and once the fork is the longer chain, the main chain is reorganized onto it, and the rest
+// of the headers are verified and connected in batches, across a difficulty transition, before the last blocks are
+// downloaded as merkleblocks
+static int _BRPeerManagerHeadersTests(BRMasterPubKey mpk)
+{
+    int r = 1, mined = 1;
+    UInt128 localHost = { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 } };
+    BRWallet *w = BRWalletNew(NULL, 0, mpk, 0);
+    uint8_t noise[25] = { 0x76, 0xa9, 20 };
+    BRReplayPeer *replay[] = { BRReplayPeerNew(0xdab5bffa), BRReplayPeerNew(0xdab5bffa) }; // saved chain, peer chain
+    BRMerkleBlock *saved[TEST_HEADERS_SAVED + 1];
+    const BRMerkleBlock *b;
+    BRTestSync t = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    BRPeerManager *manager;
+    BRReplayPeerStats stats;
+    BRTransaction *tx;
+    uint32_t h, start = (uint32_t)time(NULL) - (TEST_HEADERS_BLOCKS + 1)*600,
+             earliestKeyTime = start + (TEST_HEADERS_BLOCKS - TEST_HEADERS_RECENT)*600 + 7*24*60*60,
+             tips[] = { TEST_HEADERS_SAVED, TEST_HEADERS_BLOCKS };
+    uint16_t port = 0;
+    size_t i, savedCount = 0;
+
+    noise[23] = 0x88, noise[24] = 0xac;
+
+    for (h = 0; mined && h <= TEST_HEADERS_BLOCKS; h++) {
+        for (i = 0; mined && i < 2; i++) { // the chains have different blocks after the fork
+            if (h > tips[i]) continue;
+            UInt32SetLE(&noise[3], (h > TEST_HEADERS_FORK) ? h | (uint32_t)i << 16 : h);
+            tx = (h > 0) ? _testSyncTx(h, noise, sizeof(noise)) : NULL;
+            b = BRReplayPeerMineBlock(replay[i], (tx) ? &tx : NULL, (tx) ? 1 : 0,
+                                      start + h*600 + ((h > TEST_HEADERS_FORK) ? (uint32_t)i : 0));
+            if (b && i == 0) saved[savedCount++] = BRMerkleBlockCopy(b);
+            mined = (b != NULL);
+        }
+    }
+
+    if (mined) port = BRReplayPeerListen(replay[1]);
+
+    // synthetic blocks are only accepted by a library built with BITCOIN_REGTEST, otherwise there's nothing to sync
+    if (port != 0) {
+        manager = BRPeerManagerNew(BRReplayPeerChainParams(replay[1]), w, earliestKeyTime, saved, savedCount, NULL, 0);
+        savedCount = 0; // the manager owns the saved blocks now
+        BRPeerManagerSetCallbacks(manager, &t, NULL, _testSyncStopped, NULL, NULL, NULL, NULL, NULL);
+        BRPeerManagerSetFixedPeer(manager, localHost, port);
+
+        if (BRPeerManagerLastBlockHeight(manager) != TEST_HEADERS_SAVED)
+            r = 0, fprintf(stderr, "***FAILED*** %s: saved chain test\n", __func__);
+
+        BRPeerManagerConnect(manager);
+
+        // the peer's chain replaced the saved chain after the fork
+        if (! _testSyncWait(&t, TEST_PEER_TIMEOUT*3) || BRPeerManagerLastBlockHeight(manager) != TEST_HEADERS_BLOCKS ||
+            BRPeerManagerLastBlockTimestamp(manager) != start + TEST_HEADERS_BLOCKS*600 + 1)
+            r = 0, fprintf(stderr, "***FAILED*** %s: headers fork test\n", __func__);
+
+        // only the most recent blocks were downloaded as merkleblocks, the rest came as headers
+        stats = BRReplayPeerGetStats(replay[1]);
+
+        if (stats.merkleblocks == 0 || stats.merkleblocks > 2*TEST_HEADERS_RECENT)
+            r = 0, fprintf(stderr, "***FAILED*** %s: headers batch test\n", __func__);
+
+        BRPeerManagerDisconnect(manager);
+        BRPeerManagerFree(manager);
+    }
+
+    for (i = 0; i < savedCount; i++) BRMerkleBlockFree(saved[i]);
+    BRReplayPeerFree(replay[1]);
+    BRReplayPeerFree(replay[0]);
+    BRWalletFree(w);
+    return r;
+}
+
+int BRPeerManagerTests()
+{
+    int r = 1;
+    UInt512 seed;
+    
+    BRBIP39DeriveKey(&seed, "a random seed", NULL);
+    
+    BRWallet *w = BRWalletNew(NULL, 0, BRBIP32MasterPubKey(&seed, sizeof(seed)), 0);
+    BRPeerManager *manager = BRPeerManagerNew(&BR_CHAIN_PARAMS, w, BIP39_CREATION_TIME, NULL, 0, NULL, 0);
+    BRPeerManagerLockSite sites[8];
+    BRPeerManagerMetrics metrics;
+    size_t count;
+    
+    BRPeerManagerPeerCount(manager); // not profiled
+    
+    if (BRPeerManagerLockProfile(manager, NULL, 0) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerLockProfile() test 1\n", __func__);
+    
+    BRPeerManagerSetLockProfiling(manager, 1);
+    BRPeerManagerPeerCount(manager);
+    BRPeerManagerPeerCount(manager);
+    BRPeerManagerRelayCount(manager, uint256("0000000000000000000000000000000000000000000000000000000000000001"));
+    BRPeerManagerLastBlockHeight(manager);
+    BRPeerManagerSetLockProfiling(manager, 0);
+    BRPeerManagerLastBlockHeight(manager); // not profiled
+    count = BRPeerManagerLockProfile(manager, sites, sizeof(sites)/sizeof(*sites));
+    
+    if (count != 3 || BRPeerManagerLockProfile(manager, NULL, 0) != 3 ||
+        BRPeerManagerLockProfile(manager, sites, 1) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerLockProfile() test 2\n", __func__);
+    
+    for (size_t i = 0; i < count; i++) {
+        if ((strcmp(sites[i].lock, "peers") == 0 && (sites[i].count != 2 ||
+             strcmp(sites[i].function, "BRPeerManagerPeerCount") != 0)) ||
+            (strcmp(sites[i].lock, "tx") == 0 && sites[i].count != 1) ||
+            (strcmp(sites[i].lock, "chain") == 0 && sites[i].count != 1) ||
+            (i > 0 && sites[i].waitUsec > sites[i - 1].waitUsec) || sites[i].maxHoldUsec > sites[i].holdUsec)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerLockProfile() test 3\n", __func__);
+    }
+    
+    metrics = BRPeerManagerGetMetrics(manager);
+    
+    if (metrics.peerLockTime.count != 3 || metrics.txLockTime.count < 1 || metrics.lockTime.count < 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerGetMetrics() test\n", __func__);
+    
+    BRPeerManagerFree(manager);
+    if (! _BRPeerManagerSaveQueueTests(w)) r = 0;
+    if (! _BRPeerManagerDownloadTests(w)) r = 0;
+    if (! _BRPeerManagerFilteraddTests(BRBIP32MasterPubKey(&seed, sizeof(seed)))) r = 0;
+    if (! _BRPeerManagerCFReorgTests(BRBIP32MasterPubKey(&seed, sizeof(seed)))) r = 0;
+    if (! _BRPeerManagerCFCheckTests(BRBIP32MasterPubKey(&seed, sizeof(seed)))) r = 0;
+    if (! _BRPeerManagerHeaderStoreTests(BRBIP32MasterPubKey(&seed, sizeof(seed)))) r = 0;
+    if (! _BRPeerManagerHeadersTests(BRBIP32MasterPubKey(&seed, sizeof(seed)))) r = 0;
+    BRWalletFree(w);
     return r;
 }
 
@@ -2876,6 +4808,8 @@ int BRRunTests()
     printf("%s\n", (BRBase58Tests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBech32Tests...                    ");
     printf("%s\n", (BRBech32Tests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRBCashAddrTests...                 ");
+    printf("%s\n", (BRBCashAddrTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRHashTests...                      ");
     printf("%s\n", (BRHashTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMacTests...                       ");
@@ -2912,10 +4846,22 @@ int BRRunTests()
     printf("%s\n", (BRBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMerkleBlockTests...               ");
     printf("%s\n", (BRMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRBlockFilterTests...               ");
+    printf("%s\n", (BRBlockFilterTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRHeaderStoreTests...               ");
+    printf("%s\n", (BRHeaderStoreTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRBlockCacheTests...                ");
+    printf("%s\n", (BRBlockCacheTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolTests...           ");
     printf("%s\n", (BRPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolEncryptionTests... ");
     printf("%s\n", (BRPaymentProtocolEncryptionTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRLogTests...                       ");
+    printf("%s\n", (BRLogTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerTests...                      ");
+    printf("%s\n", (BRPeerTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerTests...               ");
+    printf("%s\n", (BRPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("\n");
     
     if (fail > 0) printf("%d TEST FUNCTION(S) ***FAILED***\n", fail);